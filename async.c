@@ -0,0 +1,119 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - work is kept on a queue under one lock, each thread takes the oldest
+ *     work and runs it without the lock
+ *   - stopping runs the work still queued before the threads exit
+ */
+
+#include "async.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+
+// a queued piece of work
+typedef struct async_work_t {
+    async_fn_t fn;                  // the function to run
+    void* arg;                      // its argument
+    struct async_work_t* next;      // the work queued after it
+} async_work_t;
+
+// the queue of work, oldest first
+static async_work_t* g_Async_Head = 0;
+static async_work_t* g_Async_Tail = 0;
+
+// the pool's threads and if the pool is stopping
+static pthread_t g_Async_Threads[ASYNC_MAX_THREADS];
+static int g_Async_Count = 0;
+static int g_Async_Stop = 0;
+
+// guards the queue and the stop flag, the condition is signaled when work is
+// queued or the pool stops
+static pthread_mutex_t g_Async_Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_Async_Cond = PTHREAD_COND_INITIALIZER;
+
+// runs queued work until the pool stops and the queue is empty
+static void* async_thread(void* arg) {
+    pthread_mutex_lock(&g_Async_Lock);
+    for (;;) {
+        // wait for work
+        while (g_Async_Head == 0 && !g_Async_Stop) {
+            pthread_cond_wait(&g_Async_Cond, &g_Async_Lock);
+        }
+        if (g_Async_Head == 0) {
+            break;
+        }
+
+        // take the oldest work and run it without the lock
+        async_work_t* work = g_Async_Head;
+        g_Async_Head = work->next;
+        if (g_Async_Head == 0) {
+            g_Async_Tail = 0;
+        }
+        pthread_mutex_unlock(&g_Async_Lock);
+        work->fn(work->arg);
+        free(work);
+        pthread_mutex_lock(&g_Async_Lock);
+    }
+    pthread_mutex_unlock(&g_Async_Lock);
+    return 0;
+}
+
+// starts the pool with the given number of threads, the default if null
+int async_init(const char* threads) {
+    int count = (threads != 0) ? atoi(threads) : ASYNC_DEFAULT_THREADS;
+    if (count < 0 || count > ASYNC_MAX_THREADS) {
+        return -EINVAL;
+    }
+
+    g_Async_Stop = 0;
+    for (g_Async_Count = 0; g_Async_Count < count; g_Async_Count++) {
+        if (pthread_create(&g_Async_Threads[g_Async_Count], 0, async_thread, 0) != 0) {
+            break;
+        }
+    }
+    return 0;
+}
+
+// runs fn with arg on a pool thread, or on this thread if the pool has none
+void async_run(async_fn_t fn, void* arg) {
+    if (g_Async_Count == 0) {
+        fn(arg);
+        return;
+    }
+
+    async_work_t* work = malloc(sizeof(async_work_t));
+    assert(work != 0);
+    work->fn = fn;
+    work->arg = arg;
+    work->next = 0;
+
+    pthread_mutex_lock(&g_Async_Lock);
+    if (g_Async_Tail != 0) {
+        g_Async_Tail->next = work;
+    }
+    else {
+        g_Async_Head = work;
+    }
+    g_Async_Tail = work;
+    pthread_cond_signal(&g_Async_Cond);
+    pthread_mutex_unlock(&g_Async_Lock);
+}
+
+// runs the work still queued and stops the pool's threads
+void async_stop() {
+    pthread_mutex_lock(&g_Async_Lock);
+    g_Async_Stop = 1;
+    pthread_cond_broadcast(&g_Async_Cond);
+    pthread_mutex_unlock(&g_Async_Lock);
+
+    for (int i = 0; i < g_Async_Count; i++) {
+        pthread_join(g_Async_Threads[i], 0);
+    }
+    g_Async_Count = 0;
+}
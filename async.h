@@ -0,0 +1,30 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - a pool of threads that run work handed to them in order, an operation
+ *     that waits (an fsync waiting for its commit) is run here so it does not
+ *     hold one of fuse's threads, the work replies to fuse itself
+ *   - NUFS_ASYNC_THREADS in the environment sets the number of threads, with
+ *     0 every work runs on the thread that hands it over
+ */
+
+#ifndef ASYNC_H
+#define ASYNC_H
+
+// the threads started when NUFS_ASYNC_THREADS is not set
+#define ASYNC_DEFAULT_THREADS 4
+
+// the most threads the pool can have
+#define ASYNC_MAX_THREADS 64
+
+// work run by a pool thread
+typedef void (*async_fn_t)(void* arg);
+
+int async_init(const char* threads);
+void async_run(async_fn_t fn, void* arg);
+void async_stop();
+
+#endif
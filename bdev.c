@@ -0,0 +1,874 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - the cache is an array of frames found by block through a chained hash
+ *     table, the frames are allocated a chunk of cache_blocks at a time so the
+ *     cache can grow past its size without moving a frame
+ *   - a miss takes a free frame, a new frame while the cache is not full, or
+ *     the next clean and unpinned frame the clock hand finds that was not
+ *     used since the hand last passed it
+ *   - a frame is loaded without the cache lock, other threads that want the
+ *     block wait for it on the cache's condition
+ *   - once the cache is over its size, a frame is dropped as soon as it is
+ *     clean and unpinned and its memory is given back
+ *   - each thread keeps the frames it pinned so bdev_unpin_all can drop them
+ *     all when it is done with every block
+ *   - the uring backend submits its reads and batches of writes to an
+ *     io_uring and a reaper thread completes them, a frame being read stays
+ *     loading until the reaper marks it valid, the first chunk of frames is
+ *     the ring's registered buffer and the image its fixed file
+ */
+
+#define _GNU_SOURCE
+
+#include "bdev.h"
+#include "storage.h"
+#include "uring.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+// the smallest cache size
+#define BDEV_MIN_CACHE 64
+
+// the end of a hash chain or the free list
+#define BDEV_NIL UINT32_MAX
+
+// the frame states
+#define BDEV_FREE 0
+#define BDEV_LOADING 1
+#define BDEV_VALID 2
+
+// the submission entries of the uring backend's ring
+#define BDEV_RING_ENTRIES 256
+
+// the most blocks one bdev_prefetch reads
+#define BDEV_PREFETCH_MAX 64
+
+// the completion that stops the reaper, loads are odd and writes are the
+// address of their bdev_pending_t
+#define BDEV_STOP 0
+
+// a cache frame holding one block
+typedef struct bdev_frame_t {
+    uint64_t block;                 // the image block it holds
+    uint64_t dirty;                 // the last transaction to change it, 0 if clean
+    uint32_t next;                  // the next frame in its chain or the free list
+    uint32_t pins;                  // the number of pins held on it
+    uint8_t state;                  // BDEV_FREE, BDEV_LOADING or BDEV_VALID
+    uint8_t referenced;             // used since the clock hand last passed
+} bdev_frame_t;
+
+// a chunk of frames and their blocks
+typedef struct bdev_chunk_t {
+    bdev_frame_t* frames;           // the frames
+    char* data;                     // a block for each frame
+} bdev_chunk_t;
+
+// writes submitted together and waited for together
+typedef struct bdev_batch_t {
+    uint32_t remaining;             // the writes not completed yet
+    int error;                      // the first error, 0 if none
+} bdev_batch_t;
+
+// a submitted write of a batch
+typedef struct bdev_pending_t {
+    bdev_batch_t* batch;            // its batch
+    uint32_t len;                   // the bytes it writes
+} bdev_pending_t;
+
+// the image file and its backend
+static int g_Bdev_FD = -1;
+static int g_Bdev_Backend = BDEV_MMAP;
+static uint64_t g_Bdev_Image_Blocks = 0;
+
+// the mapping of the mmap backend
+static char* g_Bdev_Base = 0;
+static uint64_t g_Bdev_Size = 0;
+
+// the resident metadata of the cache backends
+static char* g_Bdev_Resident = 0;
+static uint64_t g_Bdev_Resident_Blocks = 0;
+
+// guards every variable below and every frame
+static pthread_mutex_t g_Bdev_Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_Bdev_Cond = PTHREAD_COND_INITIALIZER;
+
+// the cache size and the chunks of frames, each of g_Bdev_Capacity frames
+static uint64_t g_Bdev_Capacity = DEFAULT_CACHE_BLOCKS;
+static bdev_chunk_t* g_Bdev_Chunks = 0;
+static uint32_t g_Bdev_Chunk_Count = 0;
+
+// the hash chains, a power of two
+static uint32_t* g_Bdev_Buckets = 0;
+static uint32_t g_Bdev_Bucket_Mask = 0;
+
+// the frames made, the free list, the clock hand and the frames holding a block
+static uint32_t g_Bdev_Frames = 0;
+static uint32_t g_Bdev_Free = BDEV_NIL;
+static uint32_t g_Bdev_Hand = 0;
+static uint64_t g_Bdev_Used = 0;
+
+// the cache effectiveness
+static uint64_t g_Bdev_Hits = 0;
+static uint64_t g_Bdev_Misses = 0;
+static uint64_t g_Bdev_Evictions = 0;
+
+// the ring of the uring backend, its submission side lock and its reaper
+static uring_t g_Bdev_Ring;
+static pthread_mutex_t g_Bdev_Ring_Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t g_Bdev_Reaper;
+
+// if the image is the ring's fixed file, and the first chunk's data if it is
+// the ring's fixed buffer, kept apart from the chunks which move as they grow
+static int g_Bdev_Fixed_File = 0;
+static char* g_Bdev_Fixed_Buffer = 0;
+
+// the frames the calling thread pinned
+static __thread uint32_t* t_Bdev_Pins = 0;
+static __thread uint32_t t_Bdev_Pin_Count = 0;
+static __thread uint32_t t_Bdev_Pin_Capacity = 0;
+
+// the backend names, by backend
+static const char* c_Bdev_Names[] = {
+    [BDEV_MMAP]   = "mmap",
+    [BDEV_PREAD]  = "pread",
+    [BDEV_DIRECT] = "direct",
+    [BDEV_URING]  = "uring",
+};
+
+
+
+// -------------------------- FRAMES ------------------------------------
+
+// returns the given frame
+static bdev_frame_t* bdev_frame(uint32_t i) {
+    return &g_Bdev_Chunks[i / g_Bdev_Capacity].frames[i % g_Bdev_Capacity];
+}
+
+// returns the block of the given frame
+static char* bdev_data(uint32_t i) {
+    return g_Bdev_Chunks[i / g_Bdev_Capacity].data + (i % g_Bdev_Capacity) * BLOCK_SIZE;
+}
+
+// returns the frame holding the given address, BDEV_NIL if none does
+static uint32_t bdev_index_of(const void* addr) {
+    uint64_t chunk_size = g_Bdev_Capacity * BLOCK_SIZE;
+    for (uint32_t c = 0; c < g_Bdev_Chunk_Count; c++) {
+        const char* data = g_Bdev_Chunks[c].data;
+        if ((const char*)addr >= data && (const char*)addr < data + chunk_size) {
+            return c * g_Bdev_Capacity + (uint32_t)(((const char*)addr - data) / BLOCK_SIZE);
+        }
+    }
+    return BDEV_NIL;
+}
+
+// returns the hash chain of the given block
+static uint32_t* bdev_bucket(uint64_t block) {
+    return &g_Bdev_Buckets[(uint32_t)((block * 0x9E3779B97F4A7C15ULL) >> 32) & g_Bdev_Bucket_Mask];
+}
+
+// returns the frame holding the given block, BDEV_NIL if it is not cached
+static uint32_t bdev_lookup(uint64_t block) {
+    uint32_t i = *bdev_bucket(block);
+    while (i != BDEV_NIL && bdev_frame(i)->block != block) {
+        i = bdev_frame(i)->next;
+    }
+    return i;
+}
+
+// removes the given frame from its hash chain
+static void bdev_unhash(uint32_t i) {
+    uint32_t* link = bdev_bucket(bdev_frame(i)->block);
+    while (*link != i) {
+        link = &bdev_frame(*link)->next;
+    }
+    *link = bdev_frame(i)->next;
+}
+
+// adds a chunk of frames
+static void bdev_chunk_add() {
+    bdev_chunk_t* chunks = realloc(g_Bdev_Chunks, (g_Bdev_Chunk_Count + 1) * sizeof(bdev_chunk_t));
+    assert(chunks != 0);
+    g_Bdev_Chunks = chunks;
+
+    // anonymous memory is page aligned, as O_DIRECT needs
+    bdev_chunk_t* chunk = &g_Bdev_Chunks[g_Bdev_Chunk_Count++];
+    chunk->frames = calloc(g_Bdev_Capacity, sizeof(bdev_frame_t));
+    chunk->data = mmap(0, g_Bdev_Capacity * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(chunk->frames != 0 && chunk->data != MAP_FAILED);
+}
+
+// makes a new frame, adding a chunk if the last one is full
+static uint32_t bdev_frame_new() {
+    if (g_Bdev_Frames == g_Bdev_Chunk_Count * g_Bdev_Capacity) {
+        bdev_chunk_add();
+    }
+    return g_Bdev_Frames++;
+}
+
+// returns a frame to hold a new block, evicting one if the cache is full
+// note: if every frame is pinned or dirty the cache grows when grow is set,
+//       otherwise BDEV_NIL is returned
+static uint32_t bdev_frame_take(int grow) {
+    // a frame given back since the cache was over its size
+    if (g_Bdev_Free != BDEV_NIL) {
+        uint32_t i = g_Bdev_Free;
+        g_Bdev_Free = bdev_frame(i)->next;
+        return i;
+    }
+
+    // the cache is not full yet
+    if (g_Bdev_Used < g_Bdev_Capacity) {
+        return bdev_frame_new();
+    }
+
+    // two turns of the hand clear every reference bit on the way
+    for (uint64_t n = 0; n < 2 * (uint64_t)g_Bdev_Frames; n++) {
+        uint32_t i = g_Bdev_Hand;
+        bdev_frame_t* frame = bdev_frame(i);
+        g_Bdev_Hand = (g_Bdev_Hand + 1) % g_Bdev_Frames;
+
+        if (frame->state != BDEV_VALID || frame->pins > 0 || frame->dirty != 0) {
+            continue;
+        }
+        if (frame->referenced) {
+            frame->referenced = 0;
+            continue;
+        }
+
+        bdev_unhash(i);
+        g_Bdev_Used--;
+        g_Bdev_Evictions++;
+        return i;
+    }
+
+    return grow ? bdev_frame_new() : BDEV_NIL;
+}
+
+// makes the given free frame hold the given block, pinned pins times, the
+// caller reads the block into it
+static void bdev_frame_fill(uint32_t i, uint64_t block, uint32_t pins) {
+    bdev_frame_t* frame = bdev_frame(i);
+    frame->block = block;
+    frame->dirty = 0;
+    frame->pins = pins;
+    frame->referenced = 1;
+    frame->state = BDEV_LOADING;
+    uint32_t* bucket = bdev_bucket(block);
+    frame->next = *bucket;
+    *bucket = i;
+    g_Bdev_Used++;
+}
+
+// gives a frame that is no longer in use back while the cache is over its
+// size, the caller holds the cache lock
+static void bdev_release(uint32_t i) {
+    bdev_frame_t* frame = bdev_frame(i);
+    if (g_Bdev_Used <= g_Bdev_Capacity || frame->state != BDEV_VALID || frame->pins > 0 || frame->dirty != 0) {
+        return;
+    }
+
+    // the registered chunk's pages must stay the ones the ring pinned
+    bdev_unhash(i);
+    if (g_Bdev_Fixed_Buffer == 0 || i >= g_Bdev_Capacity) {
+        madvise(bdev_data(i), BLOCK_SIZE, MADV_DONTNEED);
+    }
+    frame->state = BDEV_FREE;
+    frame->next = g_Bdev_Free;
+    g_Bdev_Free = i;
+    g_Bdev_Used--;
+    g_Bdev_Evictions++;
+}
+
+// records a pin of the given frame by the calling thread
+static void bdev_pin_add(uint32_t i) {
+    if (t_Bdev_Pin_Count == t_Bdev_Pin_Capacity) {
+        t_Bdev_Pin_Capacity = (t_Bdev_Pin_Capacity == 0) ? 64 : t_Bdev_Pin_Capacity * 2;
+        t_Bdev_Pins = realloc(t_Bdev_Pins, t_Bdev_Pin_Capacity * sizeof(uint32_t));
+        assert(t_Bdev_Pins != 0);
+    }
+    t_Bdev_Pins[t_Bdev_Pin_Count++] = i;
+}
+
+// returns 1 if the address is in the mapping or the resident metadata
+static int bdev_is_resident(const void* addr) {
+    if (g_Bdev_Backend == BDEV_MMAP) {
+        return 1;
+    }
+    return (const char*)addr >= g_Bdev_Resident &&
+        (const char*)addr < g_Bdev_Resident + g_Bdev_Resident_Blocks * BLOCK_SIZE;
+}
+
+
+
+// -------------------------- RING --------------------------------------
+
+// queues a read or write of len bytes at the given offset, the caller holds
+// the ring lock, buffers in the registered chunk are read or written fixed
+static void bdev_ring_queue(int write, const void* buf, size_t len, uint64_t offset, uint64_t user_data) {
+    struct io_uring_sqe* sqe;
+    while ((sqe = uring_sqe(&g_Bdev_Ring)) == 0) {
+        int rv = uring_submit(&g_Bdev_Ring);
+        assert(rv >= 0);
+    }
+
+    const char* fixed = g_Bdev_Fixed_Buffer;
+    if (fixed != 0 && (const char*)buf >= fixed && (const char*)buf + len <= fixed + g_Bdev_Capacity * BLOCK_SIZE) {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = 0;
+    }
+    else {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    if (g_Bdev_Fixed_File) {
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+    }
+    else {
+        sqe->fd = g_Bdev_FD;
+    }
+    sqe->off = offset;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->user_data = user_data;
+}
+
+// submits reads of the given blocks into the given loading frames
+static void bdev_ring_load(const uint32_t* frames, const uint64_t* blocks, char* const* data, uint32_t count) {
+    pthread_mutex_lock(&g_Bdev_Ring_Lock);
+    for (uint32_t k = 0; k < count; k++) {
+        bdev_ring_queue(0, data[k], BLOCK_SIZE, blocks[k] * BLOCK_SIZE, ((uint64_t)frames[k] << 1) | 1);
+    }
+    int rv = uring_submit(&g_Bdev_Ring);
+    assert(rv >= 0);
+    pthread_mutex_unlock(&g_Bdev_Ring_Lock);
+}
+
+// completes every submission of the ring until stopped
+static void* bdev_reaper(void* arg) {
+    struct io_uring_cqe cqe;
+
+    while (uring_wait(&g_Bdev_Ring, &cqe) == 0 && cqe.user_data != BDEV_STOP) {
+        pthread_mutex_lock(&g_Bdev_Lock);
+        if (cqe.user_data & 1) {
+            // a load, the block is in its frame
+            // note: a failed read is as fatal as a fault on the mapping
+            assert(cqe.res == BLOCK_SIZE);
+            bdev_frame((uint32_t)(cqe.user_data >> 1))->state = BDEV_VALID;
+            pthread_cond_broadcast(&g_Bdev_Cond);
+        }
+        else {
+            // a write of a batch, the last one wakes its waiter
+            bdev_pending_t* pending = (bdev_pending_t*)(uintptr_t)cqe.user_data;
+            if (cqe.res != (int32_t)pending->len && pending->batch->error == 0) {
+                pending->batch->error = (cqe.res < 0) ? cqe.res : -EIO;
+            }
+            if (--pending->batch->remaining == 0) {
+                pthread_cond_broadcast(&g_Bdev_Cond);
+            }
+        }
+        pthread_mutex_unlock(&g_Bdev_Lock);
+    }
+    return 0;
+}
+
+// starts the ring of the uring backend and its reaper
+static int bdev_ring_open() {
+    int rv = uring_open(&g_Bdev_Ring, BDEV_RING_ENTRIES);
+    if (rv != 0) {
+        return rv;
+    }
+
+    // a fixed file saves a file lookup per submission, it is optional
+    g_Bdev_Fixed_File = (uring_register_file(&g_Bdev_Ring, g_Bdev_FD) == 0);
+    g_Bdev_Fixed_Buffer = 0;
+    if (pthread_create(&g_Bdev_Reaper, 0, bdev_reaper, 0) != 0) {
+        uring_close(&g_Bdev_Ring);
+        return -EAGAIN;
+    }
+    return 0;
+}
+
+// stops the reaper and closes the ring, nothing may be in flight
+static void bdev_ring_close() {
+    pthread_mutex_lock(&g_Bdev_Ring_Lock);
+    struct io_uring_sqe* sqe;
+    while ((sqe = uring_sqe(&g_Bdev_Ring)) == 0) {
+        uring_submit(&g_Bdev_Ring);
+    }
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = BDEV_STOP;
+    uring_submit(&g_Bdev_Ring);
+    pthread_mutex_unlock(&g_Bdev_Ring_Lock);
+
+    pthread_join(g_Bdev_Reaper, 0);
+    uring_close(&g_Bdev_Ring);
+    g_Bdev_Fixed_File = 0;
+    g_Bdev_Fixed_Buffer = 0;
+}
+
+
+
+// -------------------------- BLOCK DEVICE FUNCTIONS --------------------
+
+// returns the backend of the given name, the mmap backend if name is null
+int bdev_backend(const char* name) {
+    if (name == 0) {
+        return BDEV_MMAP;
+    }
+    for (int i = 0; i < sizeof(c_Bdev_Names) / sizeof(c_Bdev_Names[0]); i++) {
+        if (strcmp(name, c_Bdev_Names[i]) == 0) {
+            return i;
+        }
+    }
+    return -EINVAL;
+}
+
+// returns the name of the given backend
+const char* bdev_backend_name(int backend) {
+    return c_Bdev_Names[backend];
+}
+
+// opens the image at the given path with the given backend, cache_blocks is
+// the cache size of the cache backends, 0 for the default
+// note: the uring backend reads and writes with O_DIRECT as well, the page
+//       cache would otherwise absorb its reads
+int bdev_open(const char* path, int backend, uint64_t cache_blocks) {
+    assert(backend >= BDEV_MMAP && backend <= BDEV_URING);
+
+    int direct = (backend == BDEV_DIRECT || backend == BDEV_URING);
+    g_Bdev_FD = open(path, O_RDWR | (direct ? O_DIRECT : 0));
+    if (g_Bdev_FD == -1) {
+        return -errno;
+    }
+
+    g_Bdev_Backend = backend;
+    g_Bdev_Capacity = (cache_blocks == 0) ? DEFAULT_CACHE_BLOCKS : cache_blocks;
+    if (g_Bdev_Capacity < BDEV_MIN_CACHE) {
+        g_Bdev_Capacity = BDEV_MIN_CACHE;
+    }
+
+    // the uring backend's ring is opened with the image
+    int rv = (backend == BDEV_URING) ? bdev_ring_open() : 0;
+    if (rv != 0) {
+        close(g_Bdev_FD);
+        g_Bdev_FD = -1;
+    }
+    return rv;
+}
+
+// closes the image
+void bdev_close() {
+    if (g_Bdev_Backend == BDEV_URING) {
+        bdev_ring_close();
+    }
+
+    int rv = close(g_Bdev_FD);
+    assert(rv == 0);
+    g_Bdev_FD = -1;
+}
+
+// allocates a buffer of whole blocks that bdev_read and bdev_write accept,
+// free it with free
+void* bdev_alloc(size_t len) {
+    void* buf = 0;
+    size_t size = (len == 0) ? BLOCK_SIZE : BLOCKS_FOR(len) * BLOCK_SIZE;
+    return (posix_memalign(&buf, BLOCK_SIZE, size) == 0) ? buf : 0;
+}
+
+// reads len bytes of the image at the given offset
+int bdev_read(void* buf, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t rv = pread(g_Bdev_FD, buf, len, offset);
+        if (rv <= 0) {
+            return (rv == 0) ? -EIO : -errno;
+        }
+        buf = (char*)buf + rv;
+        len -= rv;
+        offset += rv;
+    }
+    return 0;
+}
+
+// writes len bytes to the image at the given offset
+int bdev_write(const void* buf, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t rv = pwrite(g_Bdev_FD, buf, len, offset);
+        if (rv < 0) {
+            return -errno;
+        }
+        buf = (const char*)buf + rv;
+        len -= rv;
+        offset += rv;
+    }
+    return 0;
+}
+
+// writes each of the given buffers at its offset, the uring backend submits
+// them all before waiting for any, returns the first error
+int bdev_write_batch(const bdev_io_t* ios, uint32_t count) {
+    int rv = 0;
+    if (g_Bdev_Backend != BDEV_URING) {
+        for (uint32_t k = 0; k < count && rv == 0; k++) {
+            rv = bdev_write(ios[k].buf, ios[k].len, ios[k].offset);
+        }
+        return rv;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    bdev_batch_t batch = { count, 0 };
+    bdev_pending_t* pending = malloc(count * sizeof(bdev_pending_t));
+    assert(pending != 0);
+
+    // submit every write
+    pthread_mutex_lock(&g_Bdev_Ring_Lock);
+    for (uint32_t k = 0; k < count; k++) {
+        pending[k].batch = &batch;
+        pending[k].len = (uint32_t)ios[k].len;
+        bdev_ring_queue(1, ios[k].buf, ios[k].len, ios[k].offset, (uint64_t)(uintptr_t)&pending[k]);
+    }
+    rv = uring_submit(&g_Bdev_Ring);
+    assert(rv >= 0);
+    pthread_mutex_unlock(&g_Bdev_Ring_Lock);
+
+    // the reaper wakes the batch once the last write completes
+    pthread_mutex_lock(&g_Bdev_Lock);
+    while (batch.remaining > 0) {
+        pthread_cond_wait(&g_Bdev_Cond, &g_Bdev_Lock);
+    }
+    pthread_mutex_unlock(&g_Bdev_Lock);
+
+    free(pending);
+    return batch.error;
+}
+
+// waits until every write made so far is on the disk
+int bdev_flush() {
+    return (fdatasync(g_Bdev_FD) == 0) ? 0 : -errno;
+}
+
+// returns the image file for reads made around the block device, -1 for the
+// backends that bypass the page cache, their files only take aligned reads
+int bdev_fd() {
+    return (g_Bdev_Backend == BDEV_MMAP || g_Bdev_Backend == BDEV_PREAD) ? g_Bdev_FD : -1;
+}
+
+// starts writing len bytes of the image at the given offset to the disk,
+// nothing waits for it
+void bdev_writeback(uint64_t offset, size_t len) {
+    if (g_Bdev_Backend == BDEV_MMAP || g_Bdev_Backend == BDEV_PREAD) {
+        sync_file_range(g_Bdev_FD, offset, len, SYNC_FILE_RANGE_WRITE);
+    }
+}
+
+// makes the image's blocks reachable by bdev_get, the first resident_blocks
+// stay in memory for as long as the image is mapped
+// note: only the mmap backend can be shared, its changes reach the image
+//       file without bdev_write
+void bdev_map(uint64_t image_blocks, uint64_t resident_blocks, int shared) {
+    g_Bdev_Image_Blocks = image_blocks;
+
+    // the whole image is mapped
+    if (g_Bdev_Backend == BDEV_MMAP) {
+        g_Bdev_Size = image_blocks * BLOCK_SIZE;
+        g_Bdev_Base = mmap(0, g_Bdev_Size, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, g_Bdev_FD, 0);
+        assert(g_Bdev_Base != MAP_FAILED);
+        return;
+    }
+    assert(!shared);
+
+    // read the metadata
+    g_Bdev_Resident_Blocks = resident_blocks;
+    g_Bdev_Resident = bdev_alloc(resident_blocks * BLOCK_SIZE);
+    assert(g_Bdev_Resident != 0);
+    int rv = bdev_read(g_Bdev_Resident, resident_blocks * BLOCK_SIZE, 0);
+    assert(rv == 0);
+
+    // an empty cache with a chain for every two frames of its size
+    uint32_t buckets = 1;
+    while (buckets < g_Bdev_Capacity * 2 && buckets < (1u << 31)) {
+        buckets <<= 1;
+    }
+    g_Bdev_Buckets = malloc(buckets * sizeof(uint32_t));
+    assert(g_Bdev_Buckets != 0);
+    memset(g_Bdev_Buckets, 0xFF, buckets * sizeof(uint32_t));
+    g_Bdev_Bucket_Mask = buckets - 1;
+    g_Bdev_Frames = 0;
+    g_Bdev_Free = BDEV_NIL;
+    g_Bdev_Hand = 0;
+    g_Bdev_Used = 0;
+    g_Bdev_Hits = 0;
+    g_Bdev_Misses = 0;
+    g_Bdev_Evictions = 0;
+
+    // the first chunk is made now so the ring can read into it fixed, a
+    // ring that cannot pin it reads without
+    if (g_Bdev_Backend == BDEV_URING) {
+        bdev_chunk_add();
+        if (uring_register_buffer(&g_Bdev_Ring, g_Bdev_Chunks[0].data, g_Bdev_Capacity * BLOCK_SIZE) == 0) {
+            g_Bdev_Fixed_Buffer = g_Bdev_Chunks[0].data;
+        }
+    }
+}
+
+// drops every block, nothing may be pinned and nothing dirty is written
+void bdev_unmap() {
+    if (g_Bdev_Backend == BDEV_MMAP) {
+        int rv = munmap(g_Bdev_Base, g_Bdev_Size);
+        assert(rv == 0);
+        g_Bdev_Base = 0;
+        return;
+    }
+
+    if (g_Bdev_Fixed_Buffer != 0) {
+        uring_unregister_buffers(&g_Bdev_Ring);
+        g_Bdev_Fixed_Buffer = 0;
+    }
+    for (uint32_t c = 0; c < g_Bdev_Chunk_Count; c++) {
+        munmap(g_Bdev_Chunks[c].data, g_Bdev_Capacity * BLOCK_SIZE);
+        free(g_Bdev_Chunks[c].frames);
+    }
+    free(g_Bdev_Chunks);
+    free(g_Bdev_Buckets);
+    free(g_Bdev_Resident);
+    g_Bdev_Chunks = 0;
+    g_Bdev_Chunk_Count = 0;
+    g_Bdev_Buckets = 0;
+    g_Bdev_Resident = 0;
+    t_Bdev_Pin_Count = 0;
+}
+
+// returns the given image block, reading it into the cache if needed, the
+// block is pinned by the calling thread until bdev_put or bdev_unpin_all
+// note: if run is not null it is the number of blocks wanted from block on
+//       and is set to the number that follow the block in memory
+void* bdev_get(uint64_t block, uint32_t* run) {
+    assert(block < g_Bdev_Image_Blocks);
+
+    // mapped and resident blocks are always in memory
+    if (g_Bdev_Backend == BDEV_MMAP) {
+        return g_Bdev_Base + block * BLOCK_SIZE;
+    }
+    if (block < g_Bdev_Resident_Blocks) {
+        if (run != 0 && *run > g_Bdev_Resident_Blocks - block) {
+            *run = (uint32_t)(g_Bdev_Resident_Blocks - block);
+        }
+        return g_Bdev_Resident + block * BLOCK_SIZE;
+    }
+
+    // cached blocks are not adjacent
+    if (run != 0) {
+        *run = 1;
+    }
+
+    pthread_mutex_lock(&g_Bdev_Lock);
+    uint32_t i = bdev_lookup(block);
+    bdev_frame_t* frame;
+    if (i != BDEV_NIL) {
+        // a hit waits if another thread is still reading the block
+        g_Bdev_Hits++;
+        frame = bdev_frame(i);
+        frame->pins++;
+        frame->referenced = 1;
+        while (frame->state == BDEV_LOADING) {
+            pthread_cond_wait(&g_Bdev_Cond, &g_Bdev_Lock);
+        }
+    }
+    else {
+        // a miss reads the block into a frame without the lock
+        g_Bdev_Misses++;
+        i = bdev_frame_take(1);
+        bdev_frame_fill(i, block, 1);
+        frame = bdev_frame(i);
+
+        char* data = bdev_data(i);
+        pthread_mutex_unlock(&g_Bdev_Lock);
+        if (g_Bdev_Backend == BDEV_URING) {
+            bdev_ring_load(&i, &block, &data, 1);
+        }
+        else {
+            int rv = bdev_read(data, BLOCK_SIZE, block * BLOCK_SIZE);
+            assert(rv == 0);
+        }
+        pthread_mutex_lock(&g_Bdev_Lock);
+
+        // the reaper marks a ring's load valid
+        if (g_Bdev_Backend != BDEV_URING) {
+            frame->state = BDEV_VALID;
+            pthread_cond_broadcast(&g_Bdev_Cond);
+        }
+        while (frame->state == BDEV_LOADING) {
+            pthread_cond_wait(&g_Bdev_Cond, &g_Bdev_Lock);
+        }
+    }
+    char* data = bdev_data(i);
+    pthread_mutex_unlock(&g_Bdev_Lock);
+
+    bdev_pin_add(i);
+    return data;
+}
+
+// starts reading the given blocks into the cache without waiting for them,
+// blocks already cached are skipped and no frame in use is evicted for them
+// note: only the uring backend reads ahead, the mmap backend asks the kernel
+//       to, the other backends would block so they do nothing
+void bdev_prefetch(uint64_t block, uint32_t count) {
+    uint32_t frames[BDEV_PREFETCH_MAX];
+    uint64_t blocks[BDEV_PREFETCH_MAX];
+    char* data[BDEV_PREFETCH_MAX];
+    uint32_t n = 0;
+
+    if (block + count > g_Bdev_Image_Blocks) {
+        count = (block < g_Bdev_Image_Blocks) ? (uint32_t)(g_Bdev_Image_Blocks - block) : 0;
+    }
+    if (g_Bdev_Backend == BDEV_MMAP) {
+        madvise(g_Bdev_Base + block * BLOCK_SIZE, (uint64_t)count * BLOCK_SIZE, MADV_WILLNEED);
+        return;
+    }
+    if (g_Bdev_Backend != BDEV_URING) {
+        return;
+    }
+
+    // at most a quarter of the cache is read ahead at once
+    if (count > BDEV_PREFETCH_MAX) {
+        count = BDEV_PREFETCH_MAX;
+    }
+    if (count > g_Bdev_Capacity / 4) {
+        count = (uint32_t)(g_Bdev_Capacity / 4);
+    }
+
+    // a loading frame is never evicted, the reaper marks it valid
+    pthread_mutex_lock(&g_Bdev_Lock);
+    for (uint64_t b = block; b < block + count; b++) {
+        if (b < g_Bdev_Resident_Blocks || bdev_lookup(b) != BDEV_NIL) {
+            continue;
+        }
+        uint32_t i = bdev_frame_take(0);
+        if (i == BDEV_NIL) {
+            break;
+        }
+        bdev_frame_fill(i, b, 0);
+        frames[n] = i;
+        blocks[n] = b;
+        data[n++] = bdev_data(i);
+    }
+    pthread_mutex_unlock(&g_Bdev_Lock);
+
+    if (n > 0) {
+        bdev_ring_load(frames, blocks, data, n);
+    }
+}
+
+// drops the calling thread's pin of the block holding the given address
+void bdev_put(void* addr) {
+    if (bdev_is_resident(addr)) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_Bdev_Lock);
+    uint32_t i = bdev_index_of(addr);
+    assert(i != BDEV_NIL && bdev_frame(i)->pins > 0);
+    bdev_frame(i)->pins--;
+    bdev_release(i);
+    pthread_mutex_unlock(&g_Bdev_Lock);
+
+    // forget the latest pin of the frame
+    for (uint32_t p = t_Bdev_Pin_Count; p > 0; p--) {
+        if (t_Bdev_Pins[p - 1] == i) {
+            t_Bdev_Pins[p - 1] = t_Bdev_Pins[--t_Bdev_Pin_Count];
+            break;
+        }
+    }
+}
+
+// returns the image block holding the given address, which must be pinned
+uint64_t bdev_block_of(const void* addr) {
+    if (g_Bdev_Backend == BDEV_MMAP) {
+        return (uint64_t)((const char*)addr - g_Bdev_Base) / BLOCK_SIZE;
+    }
+    if (bdev_is_resident(addr)) {
+        return (uint64_t)((const char*)addr - g_Bdev_Resident) / BLOCK_SIZE;
+    }
+
+    pthread_mutex_lock(&g_Bdev_Lock);
+    uint32_t i = bdev_index_of(addr);
+    assert(i != BDEV_NIL);
+    uint64_t block = bdev_frame(i)->block;
+    pthread_mutex_unlock(&g_Bdev_Lock);
+    return block;
+}
+
+// marks the given block as changed by the transaction of the given sequence,
+// it stays cached until bdev_clean, the block must be pinned
+void bdev_dirty(uint64_t block, uint64_t seq) {
+    if (g_Bdev_Backend == BDEV_MMAP || block < g_Bdev_Resident_Blocks) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_Bdev_Lock);
+    uint32_t i = bdev_lookup(block);
+    assert(i != BDEV_NIL);
+    if (bdev_frame(i)->dirty < seq) {
+        bdev_frame(i)->dirty = seq;
+    }
+    pthread_mutex_unlock(&g_Bdev_Lock);
+}
+
+// marks the given block as written in place by the transaction of the given
+// sequence, unless a later transaction changed it since
+void bdev_clean(uint64_t block, uint64_t seq) {
+    if (g_Bdev_Backend == BDEV_MMAP || block < g_Bdev_Resident_Blocks) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_Bdev_Lock);
+    uint32_t i = bdev_lookup(block);
+    if (i != BDEV_NIL && bdev_frame(i)->dirty != 0 && bdev_frame(i)->dirty <= seq) {
+        bdev_frame(i)->dirty = 0;
+        bdev_release(i);
+    }
+    pthread_mutex_unlock(&g_Bdev_Lock);
+}
+
+// drops every pin held by the calling thread
+void bdev_unpin_all() {
+    if (t_Bdev_Pin_Count == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_Bdev_Lock);
+    for (uint32_t p = 0; p < t_Bdev_Pin_Count; p++) {
+        bdev_frame(t_Bdev_Pins[p])->pins--;
+        bdev_release(t_Bdev_Pins[p]);
+    }
+    pthread_mutex_unlock(&g_Bdev_Lock);
+    t_Bdev_Pin_Count = 0;
+}
+
+// returns the number of blocks a transaction may dirty before it is committed,
+// so dirty blocks leave room in the cache for the blocks being read
+uint64_t bdev_dirty_limit() {
+    return (g_Bdev_Backend == BDEV_MMAP) ? UINT64_MAX : g_Bdev_Capacity / 2;
+}
+
+// gets the hits, misses and evictions of the cache
+void bdev_stats(uint64_t* hits, uint64_t* misses, uint64_t* evictions) {
+    pthread_mutex_lock(&g_Bdev_Lock);
+    *hits = g_Bdev_Hits;
+    *misses = g_Bdev_Misses;
+    *evictions = g_Bdev_Evictions;
+    pthread_mutex_unlock(&g_Bdev_Lock);
+}
@@ -0,0 +1,79 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - the block device under the storage layer, every block of the image is
+ *     reached through it and every write to the image file goes through it
+ *   - the backend is chosen when the image is opened:
+ *      - mmap, the whole image is mapped and the kernel pages it in and out
+ *      - pread, blocks are read into a cache of cache_blocks blocks and only
+ *        written back when the journal writes them
+ *      - direct, the cache of the pread backend with every read and write
+ *        made with O_DIRECT so the kernel's page cache is bypassed
+ *      - uring, the direct backend with cache misses, read ahead and batches
+ *        of writes submitted to an io_uring, see uring.h
+ *   - the metadata regions before the journal (superblock, bitmaps, inode
+ *     table) are always resident, the cache only holds journal and data
+ *     region blocks
+ *   - a cached block is pinned while a thread uses it, a thread's pins are
+ *     dropped by bdev_put or all at once by bdev_unpin_all, which lock.c and
+ *     journal.c call once the thread holds no inode lock and is outside any
+ *     transaction
+ *   - a block changed by a transaction is dirty until that transaction has
+ *     written it in place, only clean and unpinned blocks are evicted, so the
+ *     cache may grow past its size while more blocks than that are in use
+ *   - buffers given to bdev_read and bdev_write must come from bdev_alloc and
+ *     be whole blocks at block offsets, the direct backend requires it
+ *   - the mmap and pread backends share the image file's page cache with
+ *     other readers of it, bdev_fd gives them the file for blocks written in
+ *     place
+ */
+
+#ifndef BDEV_H
+#define BDEV_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// the backends
+#define BDEV_MMAP 0
+#define BDEV_PREAD 1
+#define BDEV_DIRECT 2
+#define BDEV_URING 3
+
+// the cache size of the cache backends when none is given
+#define DEFAULT_CACHE_BLOCKS 4096
+
+// a write of a batch
+typedef struct bdev_io_t {
+    const void* buf;                // from bdev_alloc or bdev_get
+    size_t len;                     // whole blocks
+    uint64_t offset;                // a block offset in the image
+} bdev_io_t;
+
+int bdev_backend(const char* name);
+const char* bdev_backend_name(int backend);
+int bdev_open(const char* path, int backend, uint64_t cache_blocks);
+void bdev_close();
+void* bdev_alloc(size_t len);
+int bdev_read(void* buf, size_t len, uint64_t offset);
+int bdev_write(const void* buf, size_t len, uint64_t offset);
+int bdev_write_batch(const bdev_io_t* ios, uint32_t count);
+int bdev_flush();
+int bdev_fd();
+void bdev_writeback(uint64_t offset, size_t len);
+void bdev_map(uint64_t image_blocks, uint64_t resident_blocks, int shared);
+void bdev_unmap();
+void* bdev_get(uint64_t block, uint32_t* run);
+void bdev_prefetch(uint64_t block, uint32_t count);
+void bdev_put(void* addr);
+uint64_t bdev_block_of(const void* addr);
+void bdev_dirty(uint64_t block, uint64_t seq);
+void bdev_clean(uint64_t block, uint64_t seq);
+void bdev_unpin_all();
+uint64_t bdev_dirty_limit();
+void bdev_stats(uint64_t* hits, uint64_t* misses, uint64_t* evictions);
+
+#endif
@@ -0,0 +1,404 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - times the storage functions in process, without fuse, usage:
+ *       bench [-b data blocks] [-i inodes] [-n ops] [-s seed] image
+ *   - each case makes a new image at the given path first, so the cases do
+ *     not depend on each other, the image is left behind
+ *   - the results are printed to stdout as tab separated lines under a header
+ *     line, one per case: its name, its parameters, the number of operations,
+ *     the operations per second and the latency percentiles in nanoseconds
+ *   - only the timed calls count toward the operations per second, not the
+ *     setup between them
+ *   - everything storage prints itself goes to stderr so stdout only has the
+ *     results
+ *   - the NUFS_* environment settings apply as they do to nufs, see storage.h
+ */
+
+#include "storage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+// the default geometry and number of timed operations of each case
+#define BENCH_BLOCK_COUNT 65536
+#define BENCH_INODE_COUNT 65536
+#define BENCH_JOURNAL_BLOCKS 4096
+#define BENCH_OPS 20000
+
+// the longest path a case makes
+#define BENCH_PATH_MAX 512
+
+// the results, the image and the geometry every case uses
+static FILE*       g_Out = 0;
+static const char* g_Image = 0;
+static bnum_t      g_Blocks = BENCH_BLOCK_COUNT;
+static inum_t      g_Inodes = BENCH_INODE_COUNT;
+static uint32_t    g_Ops = BENCH_OPS;
+
+// the latency of each operation of the running case
+static uint64_t*   g_Lat = 0;
+static uint32_t    g_Lat_Count = 0;
+
+// a buffer for the data of reads and writes
+static char*       g_Buf = 0;
+
+// the largest read or write and the size of the file of the read and write cases
+#define BENCH_IO_MAX (256 * 1024)
+#define BENCH_FILE_BYTES (64 * 1024 * 1024)
+
+// returns the monotonic time in nanoseconds
+static uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// exits on a failed storage call, a case that cannot run measures nothing
+static void check(int rv, const char* what) {
+    if (rv < 0) {
+        fprintf(stderr, "bench: %s -> %s\n", what, strerror(-rv));
+        exit(1);
+    }
+}
+
+// makes a new image and mounts it
+static void mount_new() {
+    check(storage_mkfs(g_Image, g_Blocks, g_Inodes, BENCH_JOURNAL_BLOCKS), "mkfs");
+    storage_init(g_Image);
+}
+
+// starts timing a case
+static void case_begin() {
+    g_Lat_Count = 0;
+}
+
+// times one operation that started at the given time
+static void case_op(uint64_t start) {
+    g_Lat[g_Lat_Count++] = now() - start;
+}
+
+// sorts latencies for the percentiles
+static int lat_compare(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// returns the latency below which the given fraction of the sorted latencies are
+static uint64_t lat_percentile(double fraction) {
+    uint32_t i = (uint32_t)(fraction * g_Lat_Count);
+    return g_Lat[(i < g_Lat_Count) ? i : g_Lat_Count - 1];
+}
+
+// prints the results of the running case with its name and parameters
+static void case_end(const char* name, const char* params) {
+    uint64_t elapsed = 0;
+    for (uint32_t i = 0; i < g_Lat_Count; i++) {
+        elapsed += g_Lat[i];
+    }
+    if (g_Lat_Count == 0 || elapsed == 0) {
+        return;
+    }
+
+    qsort(g_Lat, g_Lat_Count, sizeof(uint64_t), lat_compare);
+    fprintf(g_Out, "%s\t%s\t%u\t%.0f\t%lu\t%lu\t%lu\t%lu\t%lu\n", name, params, g_Lat_Count,
+            g_Lat_Count / (elapsed / 1e9), lat_percentile(0.50), lat_percentile(0.90),
+            lat_percentile(0.99), lat_percentile(0.999), g_Lat[g_Lat_Count - 1]);
+    fflush(g_Out);
+}
+
+// fills the buffer with bytes that neither compress nor deduplicate away
+static void fill_buf(size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        g_Buf[i] = (char)rand();
+    }
+}
+
+// storage_access of a file in a directory of the given number of files at the
+// given depth, every file is looked up in turn
+static void bench_access(int depth, int items) {
+    char path[BENCH_PATH_MAX];
+    char params[64];
+    int len = 0;
+
+    // make the directories down to the given depth, then the files
+    mount_new();
+    for (int d = 0; d < depth; d++) {
+        len += snprintf(path + len, sizeof(path) - len, "/d%d", d);
+        check(storage_mknod(path, S_IFDIR | 0755, &(inum_t){ 0 }), "mknod dir");
+    }
+    for (int i = 0; i < items; i++) {
+        snprintf(path + len, sizeof(path) - len, "/f%d", i);
+        check(storage_mknod(path, S_IFREG | 0644, &(inum_t){ 0 }), "mknod file");
+    }
+
+    case_begin();
+    for (uint32_t op = 0; op < g_Ops; op++) {
+        snprintf(path + len, sizeof(path) - len, "/f%d", rand() % items);
+        uint64_t start = now();
+        check(storage_access(path, &(inum_t){ 0 }), "access");
+        case_op(start);
+    }
+    snprintf(params, sizeof(params), "depth=%d,items=%d", depth, items);
+    case_end("access", params);
+    storage_free();
+}
+
+// storage_mknod then storage_unlink of the given number of files at once in
+// one directory, over and over
+static void bench_churn(int items) {
+    char path[BENCH_PATH_MAX];
+    char params[64];
+    uint32_t rounds = g_Ops / items;
+
+    // fewer operations than items makes one round of fewer items
+    if (rounds == 0) {
+        rounds = 1;
+        items = (int)g_Ops;
+    }
+
+    mount_new();
+    check(storage_mknod("/churn", S_IFDIR | 0755, &(inum_t){ 0 }), "mknod dir");
+
+    // time the mknods and the unlinks as their own cases
+    uint64_t* unlinks = malloc((size_t)rounds * items * sizeof(uint64_t));
+    uint32_t unlink_count = 0;
+    if (unlinks == 0) {
+        check(-ENOMEM, "malloc");
+    }
+    case_begin();
+    for (uint32_t r = 0; r < rounds; r++) {
+        for (int i = 0; i < items; i++) {
+            snprintf(path, sizeof(path), "/churn/f%d", i);
+            uint64_t start = now();
+            check(storage_mknod(path, S_IFREG | 0644, &(inum_t){ 0 }), "mknod");
+            case_op(start);
+        }
+        for (int i = 0; i < items; i++) {
+            snprintf(path, sizeof(path), "/churn/f%d", i);
+            uint64_t start = now();
+            check(storage_unlink(path), "unlink");
+            unlinks[unlink_count++] = now() - start;
+        }
+    }
+    snprintf(params, sizeof(params), "items=%d", items);
+    case_end("mknod", params);
+    memcpy(g_Lat, unlinks, unlink_count * sizeof(uint64_t));
+    g_Lat_Count = unlink_count;
+    case_end("unlink", params);
+    free(unlinks);
+    storage_free();
+}
+
+// storage_write then storage_read of a BENCH_FILE_BYTES file with the given
+// size of each call, in order and then at random aligned offsets
+static void bench_io(size_t size) {
+    char params[64];
+    uint64_t calls = BENCH_FILE_BYTES / size;
+    inum_t inode_i;
+
+    mount_new();
+    check(storage_mknod("/io", S_IFREG | 0644, &inode_i), "mknod");
+    fill_buf(size);
+    snprintf(params, sizeof(params), "size=%zu", size);
+
+    // the first writes grow the file, the random writes rewrite it
+    case_begin();
+    for (uint64_t c = 0; c < calls && g_Lat_Count < g_Ops; c++) {
+        uint64_t start = now();
+        check(storage_write(inode_i, g_Buf, size, (off_t)(c * size)), "write");
+        case_op(start);
+    }
+    case_end("write_seq", params);
+    calls = g_Lat_Count;
+
+    case_begin();
+    for (uint64_t c = 0; c < calls; c++) {
+        uint64_t start = now();
+        check(storage_read(inode_i, g_Buf, size, (off_t)(c * size)), "read");
+        case_op(start);
+    }
+    case_end("read_seq", params);
+
+    case_begin();
+    for (uint32_t op = 0; op < g_Ops; op++) {
+        off_t offset = (off_t)(rand() % calls) * size;
+        uint64_t start = now();
+        check(storage_read(inode_i, g_Buf, size, offset), "read");
+        case_op(start);
+    }
+    case_end("read_rand", params);
+
+    case_begin();
+    for (uint32_t op = 0; op < g_Ops; op++) {
+        off_t offset = (off_t)(rand() % calls) * size;
+        uint64_t start = now();
+        check(storage_write(inode_i, g_Buf, size, offset), "write");
+        case_op(start);
+    }
+    case_end("write_rand", params);
+    storage_free();
+}
+
+// storage_truncate growing a file by the given number of bytes at a time,
+// starting over from 0 once it reaches BENCH_FILE_BYTES
+static void bench_truncate(size_t step) {
+    char params[64];
+    inum_t inode_i;
+    uint64_t size = 0;
+
+    mount_new();
+    check(storage_mknod("/grow", S_IFREG | 0644, &inode_i), "mknod");
+
+    case_begin();
+    for (uint32_t op = 0; op < g_Ops; op++) {
+        size = (size + step <= BENCH_FILE_BYTES) ? size + step : 0;
+        uint64_t start = now();
+        check(storage_truncate((off_t)size, inode_i), "truncate");
+        case_op(start);
+    }
+    snprintf(params, sizeof(params), "step=%zu", step);
+    case_end("truncate_grow", params);
+    storage_free();
+}
+
+// writes of 1 to 16 blocks to new files, which are then unlinked, once the
+// image is the given percent full of files with a tenth of them unlinked so
+// the free space is scattered
+static void bench_alloc(int percent) {
+    char path[BENCH_PATH_MAX];
+    char params[64];
+    uint64_t target = (uint64_t)g_Blocks * percent / 100;
+    uint64_t used = 0;
+    uint32_t files = 0;
+    uint8_t* sizes = malloc(g_Inodes / 2);
+    inum_t inode_i;
+    if (sizes == 0) {
+        check(-ENOMEM, "malloc");
+    }
+
+    mount_new();
+    check(storage_mknod("/fill", S_IFDIR | 0755, &(inum_t){ 0 }), "mknod dir");
+    check(storage_mknod("/new", S_IFDIR | 0755, &(inum_t){ 0 }), "mknod dir");
+    fill_buf(16 * BLOCK_SIZE);
+
+    // fill the image, then punch holes in it and fill them again
+    for (int pass = 0; pass < 2; pass++) {
+        while (used < target && files < g_Inodes / 2) {
+            sizes[files] = 1 + rand() % 16;
+            snprintf(path, sizeof(path), "/fill/f%u", files);
+            check(storage_mknod(path, S_IFREG | 0644, &inode_i), "mknod");
+            check(storage_write(inode_i, g_Buf, sizes[files] * BLOCK_SIZE, 0), "write");
+            used += sizes[files++];
+        }
+        for (uint32_t f = 0; pass == 0 && f < files; f += 10) {
+            snprintf(path, sizeof(path), "/fill/f%u", f);
+            check(storage_unlink(path), "unlink");
+            used -= sizes[f];
+        }
+    }
+    free(sizes);
+
+    case_begin();
+    for (uint32_t op = 0; op < g_Ops; op++) {
+        size_t blocks = 1 + rand() % 16;
+        snprintf(path, sizeof(path), "/new/f%u", op);
+        check(storage_mknod(path, S_IFREG | 0644, &inode_i), "mknod");
+        uint64_t start = now();
+        int rv = storage_write(inode_i, g_Buf, blocks * BLOCK_SIZE, 0);
+        case_op(start);
+        check(rv, "write");
+        check(storage_unlink(path), "unlink");
+    }
+    snprintf(params, sizeof(params), "full=%d%%", percent);
+    case_end("alloc_write", params);
+    storage_free();
+}
+
+// main entry point
+int main(int argc, char *argv[]) {
+    unsigned long block_count = BENCH_BLOCK_COUNT;
+    unsigned long inode_count = BENCH_INODE_COUNT;
+    unsigned long ops = BENCH_OPS;
+    unsigned long seed = 1;
+    int opt;
+
+    // read the options
+    while ((opt = getopt(argc, argv, "b:i:n:s:")) != -1) {
+        switch (opt) {
+            case 'b':
+                block_count = strtoul(optarg, 0, 0);
+                break;
+            case 'i':
+                inode_count = strtoul(optarg, 0, 0);
+                break;
+            case 'n':
+                ops = strtoul(optarg, 0, 0);
+                break;
+            case 's':
+                seed = strtoul(optarg, 0, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-b data blocks] [-i inodes] [-n ops] [-s seed] image\n", argv[0]);
+                return 1;
+        }
+    }
+
+    // the image path is the only argument left, the file cases need room for
+    // their file and the directory cases for their items
+    if (optind != argc - 1 || block_count < 2 * BLOCKS_FOR(BENCH_FILE_BYTES) || block_count > UINT32_MAX ||
+            inode_count < 16384 || inode_count > UINT32_MAX || ops == 0 || ops > UINT32_MAX) {
+        fprintf(stderr, "usage: %s [-b data blocks] [-i inodes] [-n ops] [-s seed] image\n", argv[0]);
+        fprintf(stderr, "  at least %lu data blocks and 16384 inodes\n", (unsigned long)(2 * BLOCKS_FOR(BENCH_FILE_BYTES)));
+        return 1;
+    }
+    g_Image = argv[optind];
+    g_Blocks = (bnum_t)block_count;
+    g_Inodes = (inum_t)inode_count;
+    g_Ops = (uint32_t)ops;
+    srand((unsigned)seed);
+
+    // keep stdout for the results, what storage prints goes to stderr
+    g_Out = fdopen(dup(STDOUT_FILENO), "w");
+    if (g_Out == 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        perror("bench");
+        return 1;
+    }
+    g_Lat = malloc((size_t)g_Ops * sizeof(uint64_t));
+    g_Buf = malloc(BENCH_IO_MAX);
+    if (g_Lat == 0 || g_Buf == 0) {
+        perror("bench");
+        return 1;
+    }
+
+    fprintf(g_Out, "case\tparams\tops\tops_per_sec\tp50_ns\tp90_ns\tp99_ns\tp999_ns\tmax_ns\n");
+    int depths[] = { 1, 4, 16 };
+    int items[] = { 16, 1024, 8192 };
+    for (int d = 0; d < 3; d++) {
+        for (int i = 0; i < 3; i++) {
+            bench_access(depths[d], items[i]);
+        }
+    }
+    bench_churn(16);
+    bench_churn(1024);
+    bench_io(BLOCK_SIZE);
+    bench_io(BENCH_IO_MAX);
+    bench_truncate(BLOCK_SIZE);
+    bench_truncate(BENCH_IO_MAX);
+    bench_alloc(50);
+    bench_alloc(90);
+    bench_alloc(99);
+
+    free(g_Lat);
+    free(g_Buf);
+    fclose(g_Out);
+    return 0;
+}
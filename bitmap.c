@@ -2,99 +2,216 @@
  *  Michael Curley
  *  cs3650
  *  ch03
+ *
+ *  notes:
+ *   - the bits of the last word past the size are set when the bitmap is
+ *     opened so they are never found free
+ *   - the summary is rebuilt from the words on every open, it is never saved
  */
 
 #include "bitmap.h"
 
 #include <errno.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <assert.h>
-#include <stdio.h>
 
-// binary value 0b10000000 used for finding free bits
-const uint8_t c_MSB_8_High = 0x80;
+// constant value for a uint64_t with every bit set
+const uint64_t c_0xFF_64 = ~(uint64_t)0;
 
-// constant value for a uint8_t set to zero
-const uint8_t c_0x00 = 0x00;
-
-// initialize null pointers for the different bitmaps
-static uint8_t* inode_bitmap = 0x00;
-static uint8_t* block_bitmap = 0x00;
-
-// sets the pointers for the different bitmaps
-void bitmap_init_print(uint8_t* inode, uint8_t* block) {
-    inode_bitmap = inode;
-    block_bitmap = block;
+// returns the index of the lowest set bit of a non zero word
+static inline uint64_t bitmap_ctz(uint64_t word) {
+    return (uint64_t)__builtin_ctzll(word);
 }
 
-// prints the given bitmap
-void print_bitmap(const char* title, uint8_t* bitmap, int size){
-    printf("%s", title);
+// updates the summary bit of the given word
+static inline void bitmap_summarize(bitmap_t* bitmap, uint64_t word_i) {
+    uint64_t bit = (uint64_t)1 << (word_i % 64);
+    if (bitmap->words[word_i] == c_0xFF_64) {
+        bitmap->summary[word_i / 64] &= ~bit;
+    }
+    else {
+        bitmap->summary[word_i / 64] |= bit;
+    }
+}
 
-    // print the bitmap type if non-null and it matches the bitmap_init_print
-    // values
-    if (inode_bitmap && bitmap == inode_bitmap) {
-        printf(" inode");
+// returns the first free bit at or after the given bit, size if there is none
+static uint64_t bitmap_next_free(bitmap_t* bitmap, uint64_t bit) {
+    if (bit >= bitmap->size) {
+        return bitmap->size;
     }
-    else if (block_bitmap && bitmap == block_bitmap) {
-        printf(" block");
+
+    // check the rest of the bit's own word first
+    uint64_t word_i = bit / 64;
+    uint64_t free = ~bitmap->words[word_i] & (c_0xFF_64 << (bit % 64));
+    if (free != 0) {
+        return word_i * 64 + bitmap_ctz(free);
     }
-    printf(" bitmap content:\n");
-    for (int i = 0; i < size; i++) {
-        // if the current bit is 0 print 0
-        if ((uint8_t)((c_MSB_8_High >> (i % 8)) & bitmap[i / 8]) == c_0x00) {
-            printf("0");
-        }
-        // print 1
-        else {
-            printf("1");
-        }
 
-        // group bits in sets of 4
-        if ((i + 1) % 4 == 0) {
-            printf(" ");
+    // find the next word with a free bit through the summary, 64 words at a time
+    for (word_i++; word_i < bitmap->word_count; word_i = (word_i | 63) + 1) {
+        uint64_t words = bitmap->summary[word_i / 64] & (c_0xFF_64 << (word_i % 64));
+        if (words != 0) {
+            word_i = (word_i & ~(uint64_t)63) + bitmap_ctz(words);
+            return word_i * 64 + bitmap_ctz(~bitmap->words[word_i]);
         }
+    }
+
+    return bitmap->size;
+}
 
-        // group lines in sets of 64
-        if ((i + 1) % 64 == 0) {
-            printf("\n");
+// returns the number of free bits starting at the given free bit, up to want
+static uint64_t bitmap_run(bitmap_t* bitmap, uint64_t bit, uint64_t want) {
+    uint64_t end = (want < bitmap->size - bit) ? bit + want : bitmap->size;
+    uint64_t i = bit;
+
+    // skip the free bits a word at a time until a used bit is found
+    while (i < end) {
+        uint64_t used = bitmap->words[i / 64] >> (i % 64);
+        if (used != 0) {
+            i += bitmap_ctz(used);
+            break;
         }
+        i += 64 - (i % 64);
     }
-    printf("\n\n");
+
+    return ((i < end) ? i : end) - bit;
 }
 
-// finds the next available bit in the map
-int bitmap_next(uint8_t* bitmap, int size) {
-    // loop over whole map
-    for (int i = 0; i < size; i++) {
-        // if the current bit is 0 return the index
-        if ((uint8_t)((c_MSB_8_High >> (i % 8)) & bitmap[i / 8]) == c_0x00) {
-            return i;
-        }
+// opens the bitmap of the given size at words and builds its summary
+int bitmap_open(bitmap_t* bitmap, void* words, uint64_t size) {
+    bitmap->words = words;
+    bitmap->size = size;
+    bitmap->word_count = (size + 63) / 64;
+    bitmap->cursor = 0;
+    bitmap->free = 0;
+    bitmap->summary = calloc((bitmap->word_count + 63) / 64, sizeof(uint64_t));
+    if (bitmap->summary == 0) {
+        return -ENOMEM;
+    }
+
+    // the bits past the size are always in use
+    if (size % 64 != 0) {
+        bitmap->words[bitmap->word_count - 1] |= c_0xFF_64 << (size % 64);
+    }
+
+    // count the free bits and summarize every word
+    for (uint64_t i = 0; i < bitmap->word_count; i++) {
+        bitmap->free += __builtin_popcountll(~bitmap->words[i]);
+        bitmap_summarize(bitmap, i);
+    }
+
+    return 0;
+}
+
+// frees the summary of the bitmap
+void bitmap_close(bitmap_t* bitmap) {
+    free(bitmap->summary);
+    bitmap->summary = 0;
+    bitmap->words = 0;
+}
+
+// finds the next available bit in the map after the cursor, the bit is not set
+int64_t bitmap_next(bitmap_t* bitmap) {
+    // search from the cursor then wrap around to the start
+    uint64_t bit = bitmap_next_free(bitmap, bitmap->cursor);
+    if (bit == bitmap->size) {
+        bit = bitmap_next_free(bitmap, 0);
     }
-    
+
     // all bits in use, return disk quota reached
-    return -EDQUOT;
+    return (bit == bitmap->size) ? -EDQUOT : (int64_t)bit;
+}
+
+// allocates up to want contiguous bits starting the search at goal, or at the
+// cursor if goal is 0, and wrapping around
+// returns the start of the first run of want bits found, if there is none in
+// the first BITMAP_RUN_PROBES runs the longest of them, len is set to the
+// length allocated
+int64_t bitmap_alloc(bitmap_t* bitmap, uint64_t goal, uint64_t want, uint64_t* len) {
+    uint64_t from = (goal != 0) ? goal : bitmap->cursor;
+    uint64_t best = bitmap->size;
+    uint64_t best_len = 0;
+    uint64_t bit = (from < bitmap->size) ? from : 0;
+    int wrapped = 0;
+
+    // all bits in use, return disk quota reached
+    if (bitmap->free == 0 || want == 0) {
+        return -EDQUOT;
+    }
+
+    // look at one free run at a time until one is long enough
+    for (int probes = 0; probes < BITMAP_RUN_PROBES && best_len < want; probes++) {
+        // find the next free run, wrapping around once
+        bit = bitmap_next_free(bitmap, bit);
+        if (bit == bitmap->size && !wrapped) {
+            wrapped = 1;
+            bit = bitmap_next_free(bitmap, 0);
+        }
+        if (bit == bitmap->size || (wrapped && bit >= from)) {
+            break;
+        }
+
+        // keep the longest run, the next search starts past its used bit
+        uint64_t run = bitmap_run(bitmap, bit, want);
+        if (run > best_len) {
+            best = bit;
+            best_len = run;
+        }
+        bit += run;
+    }
+
+    // mark the run used, the cursor moves past it
+    bitmap_set_range(bitmap, 1, best, best_len);
+    *len = best_len;
+    return (int64_t)best;
+}
+
+// returns the value of the offset of the bitmap
+int bitmap_get(bitmap_t* bitmap, uint64_t offset) {
+    assert(offset < bitmap->size);
+    return (int)((bitmap->words[offset / 64] >> (offset % 64)) & 1);
 }
 
 // sets the offset of the bitmap to the value
-void bitmap_set(uint8_t* bitmap, int val, int offset, int size) {
+void bitmap_set(bitmap_t* bitmap, int val, uint64_t offset) {
+    bitmap_set_range(bitmap, val, offset, 1);
+}
+
+// sets count bits of the bitmap starting at the offset to the value, every bit
+// must currently be the other value
+// note: setting bits to 1 moves the cursor past them so the next search without
+//       a goal continues from there
+void bitmap_set_range(bitmap_t* bitmap, int val, uint64_t offset, uint64_t count) {
 
     // val must be a 1 or a 0
-    assert((val == 0 || val == 1) && offset >= 0 && offset < size);
-    
-    // print the initial bitmap state
-    print_bitmap("pre set", bitmap, size);
+    assert((val == 0 || val == 1) && offset <= bitmap->size && count <= bitmap->size - offset);
 
-    // set bit to 1
     if (val) {
-        bitmap[offset / 8] |= c_MSB_8_High >> (offset % 8);
+        bitmap->cursor = offset + count;
     }
-    // set bit to 0
-    else {
-        bitmap[offset / 8] &= ~(c_MSB_8_High >> (offset % 8));
+
+    // set the bits a word at a time
+    uint64_t end = offset + count;
+    while (offset < end) {
+        uint64_t word_i = offset / 64;
+        uint64_t bits = (end - offset < 64 - offset % 64) ? end - offset : 64 - offset % 64;
+        uint64_t mask = ((bits == 64) ? c_0xFF_64 : (((uint64_t)1 << bits) - 1)) << (offset % 64);
+
+        // set bits to 1
+        if (val) {
+            assert((bitmap->words[word_i] & mask) == 0);
+            bitmap->words[word_i] |= mask;
+            bitmap->free -= bits;
+        }
+        // set bits to 0
+        else {
+            assert((bitmap->words[word_i] & mask) == mask);
+            bitmap->words[word_i] &= ~mask;
+            bitmap->free += bits;
+        }
+
+        bitmap_summarize(bitmap, word_i);
+        offset += bits;
     }
-    
-    // print the updated bitmap state
-    print_bitmap("post set", bitmap, size);
 }
@@ -4,7 +4,12 @@
  *  ch03
  *
  *  notes:
- *   - utility functions to manipulate a data bitmap 
+ *   - utility functions to manipulate a data bitmap
+ *   - the bitmap is an array of 64 bit words in the image, bit i is bit i % 64
+ *     of word i / 64 and a set bit is in use
+ *   - a summary level kept in memory has a bit set for every word with a free
+ *     bit, so searches skip 64 full words at a time
+ *   - allocations continue from a next-fit cursor unless given a goal
  */
 
 #ifndef BITMAP_H
@@ -12,9 +17,27 @@
 
 #include <stdint.h>
 
-void bitmap_init_print(uint8_t* inode, uint8_t* block);
+// the number of free runs a contiguous allocation examines before it settles
+// for the longest run it has seen
+#define BITMAP_RUN_PROBES 32
 
-int bitmap_next(uint8_t* bitmap, int size);
-void bitmap_set(uint8_t* bitmap, int val, int offset, int size);
+// a bitmap and its in memory summary
+typedef struct bitmap_t {
+    uint64_t* words;        // the bitmap words, in the image
+    uint64_t* summary;      // a bit per word, set if the word has a free bit
+    uint64_t size;          // the number of bits
+    uint64_t word_count;    // the number of words
+    uint64_t cursor;        // where the next search without a goal starts
+    uint64_t free;          // the number of free bits
+} bitmap_t;
+
+int bitmap_open(bitmap_t* bitmap, void* words, uint64_t size);
+void bitmap_close(bitmap_t* bitmap);
+
+int64_t bitmap_next(bitmap_t* bitmap);
+int64_t bitmap_alloc(bitmap_t* bitmap, uint64_t goal, uint64_t want, uint64_t* len);
+int bitmap_get(bitmap_t* bitmap, uint64_t offset);
+void bitmap_set(bitmap_t* bitmap, int val, uint64_t offset);
+void bitmap_set_range(bitmap_t* bitmap, int val, uint64_t offset, uint64_t count);
 
 #endif
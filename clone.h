@@ -0,0 +1,40 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - the ioctls that clone a file's data into the open file they are called
+ *     on, for programs using a mounted nufs, see storage_clone
+ *   - the clone shares the source's blocks until either file writes them, so
+ *     it takes the same short time whatever the size and no space at first
+ *   - they work like linux's FICLONE and FICLONERANGE but the source is its
+ *     inode number, st_ino, since a file descriptor of the calling process
+ *     means nothing to nufs, and the kernel handles FICLONE itself before it
+ *     reaches a fuse file system
+ *   - the caller needs read permission on the source as stat reports it, the
+ *     same as if it had opened the source for reading
+ */
+
+#ifndef CLONE_H
+#define CLONE_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// the range of a NUFS_IOC_CLONE_RANGE
+typedef struct nufs_clone_range_t {
+    uint64_t src_ino;           // the st_ino of the source file
+    uint64_t src_offset;        // the first byte of the source cloned
+    uint64_t len;               // the bytes cloned, 0 to the end of the source
+    uint64_t dest_offset;       // where they go in the open file
+} nufs_clone_range_t;
+
+// makes the open file's data a clone of the whole file with the given st_ino
+#define NUFS_IOC_CLONE _IOW('N', 1, uint64_t)
+
+// clones a range of a file into the open file, the offsets and len are
+// multiples of the block size unless the range ends at the end of the source
+#define NUFS_IOC_CLONE_RANGE _IOW('N', 2, nufs_clone_range_t)
+
+#endif
@@ -0,0 +1,498 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - a cluster is loaded into and stored from a buffer of CLUSTER_BYTES, the
+ *     last cluster of a file may span fewer blocks, its bytes past them are
+ *     not used
+ *   - a cluster is always compressed from all of the blocks it spans, the
+ *     bytes past the end of the file are zeros and compress to almost nothing
+ *   - storing a cluster allocates the blocks it needs before it changes any,
+ *     on failure the cluster reads as it did, the blocks it allocated are
+ *     zeros
+ *   - a compressed cluster's blocks are written in place like any file data,
+ *     its new length is committed with the transaction that wrote them
+ *   - writing or truncating thaws the inode first, so a table block a
+ *     snapshot holds is never written, see snapshot_thaw
+ */
+
+#include "cluster.h"
+#include "extent.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "lz.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+
+// returns the number of blocks the given cluster of the inode spans
+static uint32_t cluster_blocks(inum_t inode_i, uint64_t c) {
+    inode_t* inode = get_inode(inode_i);
+    uint64_t first = c * CLUSTER_BLOCKS;
+    assert(first < inode->block_count);
+    return (inode->block_count - first < CLUSTER_BLOCKS) ? (uint32_t)(inode->block_count - first) : CLUSTER_BLOCKS;
+}
+
+// returns the compressed length of the given cluster, 0 if it is kept as it is
+static uint16_t cluster_len(inum_t inode_i, uint64_t c) {
+    inode_t* inode = get_inode(inode_i);
+    if (inode->c_block == 0 || c >= CLUSTER_MAX) {
+        return 0;
+    }
+
+    bnum_t leaf = ((bnum_t*)get_block(inode->c_block))[c / CLUSTER_LEAF_COUNT];
+    if (leaf == 0) {
+        return 0;
+    }
+    return ((uint16_t*)get_block(leaf))[c % CLUSTER_LEAF_COUNT];
+}
+
+// allocates a zeroed table block
+static int cluster_table_alloc(bnum_t* block) {
+    int rv = block_alloc(0, 1, block);
+    if (rv < 0) {
+        return rv;
+    }
+
+    void* data = get_block(*block);
+    memset(data, 0, BLOCK_SIZE);
+    journal_dirty(data, BLOCK_SIZE);
+    return 0;
+}
+
+// sets slot to the table entry of the given cluster, the index and leaf
+// blocks are allocated if the inode does not have them yet
+static int cluster_slot(inum_t inode_i, uint64_t c, uint16_t** slot) {
+    inode_t* inode = get_inode(inode_i);
+    int rv;
+    if (c >= CLUSTER_MAX) {
+        return -EFBIG;
+    }
+
+    if (inode->c_block == 0) {
+        if ((rv = cluster_table_alloc(&inode->c_block)) < 0) {
+            return rv;
+        }
+        journal_dirty_inode(inode_i, 1);
+    }
+
+    bnum_t* index = get_block(inode->c_block);
+    bnum_t* leaf = &index[c / CLUSTER_LEAF_COUNT];
+    if (*leaf == 0) {
+        if ((rv = cluster_table_alloc(leaf)) < 0) {
+            return rv;
+        }
+        journal_dirty(leaf, sizeof(bnum_t));
+    }
+
+    *slot = &((uint16_t*)get_block(*leaf))[c % CLUSTER_LEAF_COUNT];
+    return 0;
+}
+
+// sets the given cluster's table entry to 0, it is kept as it is
+static void cluster_clear(inum_t inode_i, uint64_t c) {
+    uint16_t* slot;
+    if (cluster_len(inode_i, c) != 0 && cluster_slot(inode_i, c, &slot) == 0) {
+        *slot = 0;
+        journal_dirty(slot, sizeof(uint16_t));
+    }
+}
+
+// clears the table entries of the clusters from the given one on, the leaves
+// with none left are freed and the index too if none are left
+static void cluster_trim(inum_t inode_i, uint64_t clusters) {
+    inode_t* inode = get_inode(inode_i);
+    if (inode->c_block == 0) {
+        return;
+    }
+
+    bnum_t* index = get_block(inode->c_block);
+    for (uint64_t l = clusters / CLUSTER_LEAF_COUNT; l < CLUSTER_INDEX_COUNT; l++) {
+        if (index[l] == 0) {
+            continue;
+        }
+
+        // the whole leaf is past the end or only its tail is, the index of a
+        // table that is all freed is left as it is
+        uint64_t first = l * CLUSTER_LEAF_COUNT;
+        if (first >= clusters) {
+            block_free(index[l], 1);
+            if (clusters > 0) {
+                index[l] = 0;
+            }
+        }
+        else {
+            uint16_t* leaf = get_block(index[l]);
+            memset(&leaf[clusters - first], 0, (CLUSTER_LEAF_COUNT - (clusters - first)) * sizeof(uint16_t));
+            journal_dirty(leaf, BLOCK_SIZE);
+        }
+    }
+
+    if (clusters == 0) {
+        block_free(inode->c_block, 1);
+        inode->c_block = 0;
+        journal_dirty_inode(inode_i, 1);
+    }
+    else {
+        journal_dirty(index, BLOCK_SIZE);
+    }
+}
+
+// allocates the holes in count blocks of the inode from the given inode
+// block, on failure the blocks allocated so far are zeroed
+static int cluster_fill(inum_t inode_i, uint32_t first, uint32_t count) {
+    uint8_t fresh[CLUSTER_BLOCKS] = { 0 };
+    int rv = 0;
+    assert(count <= CLUSTER_BLOCKS);
+
+    for (uint32_t i = 0; i < count; ) {
+        uint32_t run;
+        if (extent_map(inode_i, first + i, &run) != EXTENT_HOLE) {
+            i += run;
+            continue;
+        }
+        if (run > count - i) {
+            run = count - i;
+        }
+        if ((rv = extent_alloc(inode_i, first + i, run)) < 0) {
+            break;
+        }
+        memset(&fresh[i], 1, rv);
+        i += rv;
+    }
+
+    // the blocks allocated held other files' data, they read as zeros until
+    // the cluster is stored again
+    if (rv < 0) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (fresh[i]) {
+                void* dst = get_block(extent_map(inode_i, first + i, 0));
+                memset(dst, 0, BLOCK_SIZE);
+                journal_dirty_data(inode_i, dst, BLOCK_SIZE);
+            }
+        }
+        return rv;
+    }
+    return 0;
+}
+
+// copies count blocks of the inode from the given inode block to dst, holes
+// are zeros
+static void cluster_copy_in(inum_t inode_i, uint32_t first, uint32_t count, char* dst) {
+    for (uint32_t i = 0; i < count; ) {
+        uint32_t run;
+        bnum_t block = extent_map(inode_i, first + i, &run);
+        if (run > count - i) {
+            run = count - i;
+        }
+
+        if (block == EXTENT_HOLE) {
+            memset(dst + (size_t)i * BLOCK_SIZE, 0, (size_t)run * BLOCK_SIZE);
+        }
+        else {
+            void* src = get_blocks(block, &run);
+            memcpy(dst + (size_t)i * BLOCK_SIZE, src, (size_t)run * BLOCK_SIZE);
+            put_blocks(src);
+        }
+        i += run;
+    }
+}
+
+// copies src to count blocks of the inode from the given inode block, the
+// blocks are allocated
+static void cluster_copy_out(inum_t inode_i, uint32_t first, uint32_t count, const char* src) {
+    for (uint32_t i = 0; i < count; ) {
+        uint32_t run;
+        bnum_t block = extent_map(inode_i, first + i, &run);
+        assert(block != EXTENT_HOLE);
+        if (run > count - i) {
+            run = count - i;
+        }
+
+        void* dst = get_blocks(block, &run);
+        memcpy(dst, src + (size_t)i * BLOCK_SIZE, (size_t)run * BLOCK_SIZE);
+        journal_dirty_data(inode_i, dst, (size_t)run * BLOCK_SIZE);
+        put_blocks(dst);
+        i += run;
+    }
+}
+
+// loads the given cluster of the inode into buf, decompressing it if it is
+// compressed, returns -EIO if its compressed data is not valid
+static int cluster_load(inum_t inode_i, uint64_t c, char* buf) {
+    uint32_t first = (uint32_t)(c * CLUSTER_BLOCKS);
+    uint32_t count = cluster_blocks(inode_i, c);
+    uint16_t len = cluster_len(inode_i, c);
+
+    // a cluster kept as it is is its blocks
+    if (len == 0) {
+        cluster_copy_in(inode_i, first, count, buf);
+        return 0;
+    }
+
+    // the compressed data is in the cluster's first blocks
+    uint32_t used = BLOCKS_FOR(len);
+    char packed[CLUSTER_BYTES];
+    if (used > count) {
+        return -EIO;
+    }
+    cluster_copy_in(inode_i, first, used, packed);
+
+    // the cluster may span more blocks than when it was stored, the rest is
+    // past the end of the file it had then
+    int rv = lz_decompress(packed, len, buf, (size_t)count * BLOCK_SIZE);
+    if (rv < 0) {
+        return -EIO;
+    }
+    memset(buf + rv, 0, (size_t)count * BLOCK_SIZE - rv);
+    return 0;
+}
+
+// stores buf as the given cluster of the inode, compressed if that saves at
+// least a block, count is the blocks of the cluster the data fills
+static int cluster_store(inum_t inode_i, uint64_t c, const char* buf, uint32_t count) {
+    uint32_t first = (uint32_t)(c * CLUSTER_BLOCKS);
+    size_t bytes = (size_t)count * BLOCK_SIZE;
+    int rv;
+
+    // a cluster of zeros is a hole
+    size_t zeros = 0;
+    while (zeros < bytes && buf[zeros] == 0) {
+        zeros++;
+    }
+    if (zeros == bytes && extent_punch(inode_i, first, count) == 0) {
+        cluster_clear(inode_i, c);
+        journal_dirty_inode(inode_i, 1);
+        return 0;
+    }
+
+    // a compressed cluster keeps its data in its first blocks and frees the
+    // rest, if any step fails the cluster is stored as it is instead
+    char packed[CLUSTER_BYTES];
+    int len = (count > 1 && c < CLUSTER_MAX) ? lz_compress(buf, bytes, packed, bytes - BLOCK_SIZE) : 0;
+    if (len > 0) {
+        uint32_t used = BLOCKS_FOR((uint32_t)len);
+        uint16_t* slot;
+        if (cluster_slot(inode_i, c, &slot) == 0 && cluster_fill(inode_i, first, used) == 0 &&
+                extent_own(inode_i, first, used) == 0 && extent_punch(inode_i, first + used, count - used) == 0) {
+            memset(packed + len, 0, (size_t)used * BLOCK_SIZE - len);
+            cluster_copy_out(inode_i, first, used, packed);
+            *slot = (uint16_t)len;
+            journal_dirty(slot, sizeof(uint16_t));
+            journal_dirty_inode(inode_i, 1);
+            return 0;
+        }
+    }
+
+    // otherwise every block is the cluster's data as it is
+    if ((rv = cluster_fill(inode_i, first, count)) < 0 || (rv = extent_own(inode_i, first, count)) < 0) {
+        return rv;
+    }
+    cluster_copy_out(inode_i, first, count, buf);
+    cluster_clear(inode_i, c);
+    journal_dirty_inode(inode_i, 1);
+    return 0;
+}
+
+// reads len bytes of the inode's data at the given offset, the range is within
+// the inode's size
+int cluster_read(inum_t inode_i, char* data, size_t len, off_t offset) {
+    char* buf = 0;
+    size_t done = 0;
+    int rv = 0;
+
+    while (rv == 0 && done != len) {
+        uint64_t c = (uint64_t)offset / CLUSTER_BYTES;
+        size_t in_cluster = (uint64_t)offset % CLUSTER_BYTES;
+        size_t bytes = (uint64_t)cluster_blocks(inode_i, c) * BLOCK_SIZE;
+        size_t n = (CLUSTER_BYTES - in_cluster < len - done) ? CLUSTER_BYTES - in_cluster : len - done;
+
+        // a whole cluster is loaded straight into the data
+        if (in_cluster == 0 && n == bytes) {
+            rv = cluster_load(inode_i, c, data + done);
+        }
+        else {
+            if (buf == 0) {
+                buf = malloc(CLUSTER_BYTES);
+                assert(buf != 0);
+            }
+            if ((rv = cluster_load(inode_i, c, buf)) == 0) {
+                memcpy(data + done, buf + in_cluster, n);
+            }
+        }
+
+        done += n;
+        offset += n;
+    }
+
+    free(buf);
+    return (rv < 0) ? rv : (int)done;
+}
+
+// writes len bytes to the inode at the given offset with copy, the inode's
+// blocks already reach past the write
+// returns the number of bytes written, fewer if copy stopped short
+int cluster_write(inum_t inode_i, size_t len, off_t offset, storage_copy_t copy, void* arg) {
+    int rv = snapshot_thaw(inode_i);
+    if (rv < 0) {
+        return rv;
+    }
+    char* buf = malloc(CLUSTER_BYTES);
+    size_t done = 0;
+    assert(buf != 0);
+
+    while (done != len) {
+        uint64_t c = (uint64_t)offset / CLUSTER_BYTES;
+        size_t in_cluster = (uint64_t)offset % CLUSTER_BYTES;
+        uint32_t count = cluster_blocks(inode_i, c);
+        size_t bytes = (size_t)count * BLOCK_SIZE;
+        size_t n = (CLUSTER_BYTES - in_cluster < len - done) ? CLUSTER_BYTES - in_cluster : len - done;
+
+        // the old data is only needed if the write does not cover it all
+        int whole = (in_cluster == 0 && n == bytes);
+        if (!whole && (rv = cluster_load(inode_i, c, buf)) < 0) {
+            break;
+        }
+        ssize_t copied = copy(buf + in_cluster, n, arg);
+
+        // a short copy of a whole cluster keeps the old data after it
+        if (whole && copied >= 0 && (size_t)copied != n) {
+            char* part = malloc(copied + 1);
+            assert(part != 0);
+            memcpy(part, buf, copied);
+            if ((rv = cluster_load(inode_i, c, buf)) < 0) {
+                free(part);
+                break;
+            }
+            memcpy(buf, part, copied);
+            free(part);
+        }
+
+        // a failed copy ends the write
+        if (copied <= 0) {
+            rv = (copied < 0) ? (int)copied : -EIO;
+            break;
+        }
+        if ((rv = cluster_store(inode_i, c, buf, count)) < 0) {
+            break;
+        }
+
+        done += copied;
+        offset += copied;
+        if ((size_t)copied != n) {
+            break;
+        }
+    }
+
+    free(buf);
+    return (done > 0 || rv == 0) ? (int)done : rv;
+}
+
+// shrinks the inode to the given size, the bytes of its last cluster past the
+// size are zeroed and the blocks and table entries past it are freed
+int cluster_truncate(inum_t inode_i, uint64_t size) {
+    inode_t* inode = get_inode(inode_i);
+    uint64_t blocks = BLOCKS_FOR(size);
+    uint64_t clusters = (size / CLUSTER_BYTES) + (size % CLUSTER_BYTES == 0 ? 0 : 1);
+    int rv = snapshot_thaw(inode_i);
+    if (rv < 0) {
+        return rv;
+    }
+
+    // the last cluster is stored again with only the blocks it keeps, before
+    // any block is freed so a failure leaves the file as it was
+    if (size % CLUSTER_BYTES != 0) {
+        uint64_t c = size / CLUSTER_BYTES;
+        char* buf = malloc(CLUSTER_BYTES);
+        assert(buf != 0);
+        if ((rv = cluster_load(inode_i, c, buf)) == 0) {
+            memset(buf + size % CLUSTER_BYTES, 0, CLUSTER_BYTES - size % CLUSTER_BYTES);
+            rv = cluster_store(inode_i, c, buf, (uint32_t)(blocks - c * CLUSTER_BLOCKS));
+        }
+        free(buf);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+
+    cluster_trim(inode_i, clusters);
+    if (blocks < inode->block_count) {
+        return extent_shrink(inode_i, (bnum_t)blocks);
+    }
+    return 0;
+}
+
+// frees the inode's cluster table, its blocks are freed with extent_shrink
+// note: nothing is written, so it needs no thaw
+void cluster_free(inum_t inode_i) {
+    cluster_trim(inode_i, 0);
+}
+
+// gives the inode its own copy of each block of its cluster table a snapshot
+// holds, see snapshot_thaw
+// returns 0, or a negative errno and the blocks copied so far are the inode's
+int cluster_thaw(inum_t inode_i) {
+    inode_t* inode = get_inode(inode_i);
+    if (inode->c_block == 0) {
+        return 0;
+    }
+
+    int rv = block_thaw(&inode->c_block);
+    if (rv < 0) {
+        return rv;
+    }
+    if (rv > 0) {
+        journal_dirty_inode(inode_i, 1);
+    }
+    bnum_t* index = get_block(inode->c_block);
+    for (uint64_t l = 0; l < CLUSTER_INDEX_COUNT; l++) {
+        if (index[l] == 0) {
+            continue;
+        }
+        if ((rv = block_thaw(&index[l])) < 0) {
+            return rv;
+        }
+        if (rv > 0) {
+            journal_dirty(&index[l], sizeof(bnum_t));
+        }
+    }
+    return 0;
+}
+
+// gives the inode, which has no cluster table, a copy of the source's, the
+// caller shares the source's data blocks with it, see storage_clone
+// returns 0, or a negative errno and the inode still has no table
+int cluster_clone(inum_t src_i, inum_t inode_i) {
+    inode_t* src = get_inode(src_i);
+    inode_t* inode = get_inode(inode_i);
+    if (src->c_block == 0) {
+        return 0;
+    }
+
+    int rv = cluster_table_alloc(&inode->c_block);
+    if (rv < 0) {
+        return rv;
+    }
+    bnum_t* from = get_block(src->c_block);
+    bnum_t* index = get_block(inode->c_block);
+    for (uint64_t l = 0; l < CLUSTER_INDEX_COUNT; l++) {
+        if (from[l] == 0) {
+            continue;
+        }
+        if ((rv = block_alloc(inode->c_block, 1, &index[l])) < 0) {
+            cluster_free(inode_i);
+            return rv;
+        }
+        void* leaf = get_block(index[l]);
+        memcpy(leaf, get_block(from[l]), BLOCK_SIZE);
+        journal_dirty(leaf, BLOCK_SIZE);
+    }
+    journal_dirty(index, BLOCK_SIZE);
+    journal_dirty_inode(inode_i, 1);
+    return 0;
+}
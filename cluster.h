@@ -0,0 +1,51 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - functions to keep an INODE_COMPRESSED file's data in clusters of
+ *     CLUSTER_BLOCKS blocks, each compressed on its own with the lz codec, see
+ *     lz.h
+ *   - a cluster that compresses into fewer blocks than it spans keeps the
+ *     compressed bytes in its first blocks and the rest are a hole, a cluster
+ *     that does not is kept as it is, a cluster of zeros is all hole
+ *   - the compressed length of each cluster is in the inode's cluster table,
+ *     0 for a cluster kept as it is, the table is c_block, an index block of
+ *     leaf blocks that each hold the lengths of CLUSTER_LEAF_COUNT clusters,
+ *     neither is counted in the inode's block_count or block_used
+ *   - a write loads each cluster it touches, copies the data into it and
+ *     stores it again, so only those clusters are compressed again, a write
+ *     of a whole cluster does not load it
+ *   - the clusters past CLUSTER_MAX are always kept as they are
+ *   - every function is called with the inode's lock held, inside a journal
+ *     transaction if it changes anything
+ */
+
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "storage.h"
+
+// the blocks and bytes of a cluster
+#define CLUSTER_BLOCKS 4
+#define CLUSTER_BYTES (CLUSTER_BLOCKS * BLOCK_SIZE)
+
+// the lengths held by a leaf block and the leaves held by the index block
+#define CLUSTER_LEAF_COUNT (BLOCK_SIZE / sizeof(uint16_t))
+#define CLUSTER_INDEX_COUNT (BLOCK_SIZE / sizeof(bnum_t))
+
+// the number of clusters the table can hold
+#define CLUSTER_MAX ((uint64_t)CLUSTER_INDEX_COUNT * CLUSTER_LEAF_COUNT)
+
+int cluster_read(inum_t inode_i, char* data, size_t len, off_t offset);
+int cluster_write(inum_t inode_i, size_t len, off_t offset, storage_copy_t copy, void* arg);
+int cluster_truncate(inum_t inode_i, uint64_t size);
+void cluster_free(inum_t inode_i);
+int cluster_clone(inum_t src_i, inum_t inode_i);
+int cluster_thaw(inum_t inode_i);
+
+#endif
@@ -0,0 +1,215 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - the cache is direct mapped, an insert replaces whatever entry occupied
+ *     the slot of the new entry
+ *   - every slot is a seqlock, lookups take no lock, they copy the slot and
+ *     retry if its sequence changed while it was copied
+ *   - writers of a slot spin on its sequence, a slot is only held for the copy
+ *     of one entry so no other lock is ever waited for
+ *   - a change to a directory updates the dcache while the directory's write
+ *     lock is held, so a lookup sees either the old or the new item
+ */
+
+#include "dcache.h"
+#include "path.h"
+#include "lock.h"
+
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+// the number of stripes of the hit and miss counters, must be a power of two
+#define DCACHE_STAT_STRIPES 64
+
+// a single cached lookup of an item in a directory
+typedef struct dcache_entry_t {
+    uint32_t seq;                       // odd while the entry is being written
+    uint32_t hash;                      // the hash of the parent and item
+    inum_t parent;                      // the parent directory's inode
+    inum_t inode;                       // the item's inode
+    uint8_t valid;                      // if the entry is in use
+    uint8_t negative;                   // if the item does not exist
+    uint8_t len;                        // the length of the item name
+    char item[DCACHE_NAME_MAX + 1];     // the item name, null terminated
+} dcache_entry_t;
+
+// a stripe of the hit and miss counters, on its own cache line so threads
+// counting on different stripes do not share a line
+typedef struct __attribute__((aligned(64))) dcache_stat_t {
+    uint64_t hits;                      // lookups answered by the cache
+    uint64_t misses;                    // lookups that needed a search
+} dcache_stat_t;
+
+// the cache slots
+static dcache_entry_t g_Dcache[DCACHE_SLOTS];
+
+// the counters and the stripe of each thread
+static dcache_stat_t g_Dcache_Stats[DCACHE_STAT_STRIPES];
+static uint32_t g_Dcache_Stat_Next = 0;
+static __thread int t_Dcache_Stripe = -1;
+
+// hashes the parent inode and the item name together
+static uint32_t dcache_hash(inum_t inode_parent, const char* item, int len) {
+    return hash_item(hash_item(HASH_ITEM_SEED, (const char*)&inode_parent, sizeof(inode_parent)), item, len);
+}
+
+// returns the counters of the calling thread
+static dcache_stat_t* dcache_stat() {
+    if (t_Dcache_Stripe < 0) {
+        t_Dcache_Stripe = __atomic_fetch_add(&g_Dcache_Stat_Next, 1, __ATOMIC_RELAXED) & (DCACHE_STAT_STRIPES - 1);
+    }
+    return &g_Dcache_Stats[t_Dcache_Stripe];
+}
+
+// takes the given slot for writing
+static void dcache_slot_lock(dcache_entry_t* entry) {
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+        if ((seq & 1) == 0 && __atomic_compare_exchange_n(&entry->seq, &seq, seq + 1, 0,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+        cpu_relax();
+    }
+
+    // the odd sequence is visible before any field changes
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// releases a slot taken by dcache_slot_lock
+static void dcache_slot_unlock(dcache_entry_t* entry) {
+    __atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELEASE);
+}
+
+// returns 1 if the entry is the given item
+static int dcache_match(dcache_entry_t* entry, inum_t inode_parent, const char* item, int len, uint32_t hash) {
+    // the entry must match on every field, the hash check rejects most misses
+    // before the name is compared
+    return entry->valid && entry->hash == hash && entry->parent == inode_parent &&
+            entry->len == len && memcmp(entry->item, item, len) == 0;
+}
+
+// fills the slot for the given item
+static void dcache_fill(inum_t inode_parent, const char* item, int len, inum_t inode_i, uint8_t negative) {
+    // names that do not fit are never cached
+    if (len > DCACHE_NAME_MAX) {
+        return;
+    }
+
+    uint32_t hash = dcache_hash(inode_parent, item, len);
+    dcache_entry_t* entry = &g_Dcache[hash & (DCACHE_SLOTS - 1)];
+
+    // overwrite the slot
+    dcache_slot_lock(entry);
+    entry->hash = hash;
+    entry->valid = 1;
+    entry->negative = negative;
+    entry->parent = inode_parent;
+    entry->inode = inode_i;
+    entry->len = (uint8_t)len;
+    memcpy(entry->item, item, len);
+    entry->item[len] = 0;
+    dcache_slot_unlock(entry);
+}
+
+// looks up the item in the given directory without taking any lock
+// returns 0 and sets inode_i if cached, -ENOENT if cached as not existing and
+// DCACHE_MISS if the directory needs to be searched
+int dcache_lookup(inum_t inode_parent, const char* item, int len, inum_t* inode_i) {
+    int rv = DCACHE_MISS;
+
+    // only names that fit can be in the cache
+    if (len <= DCACHE_NAME_MAX) {
+        uint32_t hash = dcache_hash(inode_parent, item, len);
+        dcache_entry_t* entry = &g_Dcache[hash & (DCACHE_SLOTS - 1)];
+        inum_t inode = 0;
+        uint32_t seq;
+
+        // copy the slot until it was not written during the copy
+        do {
+            while ((seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE)) & 1) {
+                cpu_relax();
+            }
+
+            rv = DCACHE_MISS;
+            if (dcache_match(entry, inode_parent, item, len, hash)) {
+                rv = entry->negative ? -ENOENT : 0;
+                inode = entry->inode;
+            }
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq);
+
+        if (rv == 0) {
+            *inode_i = inode;
+        }
+    }
+
+    // count the result on this thread's stripe
+    dcache_stat_t* stat = dcache_stat();
+    if (rv == DCACHE_MISS) {
+        __atomic_fetch_add(&stat->misses, 1, __ATOMIC_RELAXED);
+    }
+    else {
+        __atomic_fetch_add(&stat->hits, 1, __ATOMIC_RELAXED);
+    }
+
+    return rv;
+}
+
+// caches the item as existing in the directory with the given inode
+void dcache_insert(inum_t inode_parent, const char* item, int len, inum_t inode_i) {
+    dcache_fill(inode_parent, item, len, inode_i, 0);
+}
+
+// caches the item as not existing in the directory
+void dcache_insert_negative(inum_t inode_parent, const char* item, int len) {
+    dcache_fill(inode_parent, item, len, 0, 1);
+}
+
+// removes the item from the cache, positive or negative
+void dcache_invalidate(inum_t inode_parent, const char* item, int len) {
+    if (len > DCACHE_NAME_MAX) {
+        return;
+    }
+
+    uint32_t hash = dcache_hash(inode_parent, item, len);
+    dcache_entry_t* entry = &g_Dcache[hash & (DCACHE_SLOTS - 1)];
+    dcache_slot_lock(entry);
+    if (dcache_match(entry, inode_parent, item, len, hash)) {
+        entry->valid = 0;
+    }
+    dcache_slot_unlock(entry);
+}
+
+// removes every entry of the given directory, used when the directory's inode
+// is freed so a reuse of the inode cannot hit the old entries
+void dcache_invalidate_dir(inum_t inode_parent) {
+    dcache_invalidate_dirs(inode_parent, 1);
+}
+
+// invalidates every entry of count directories from the given inode, the
+// directories of a removed snapshot
+void dcache_invalidate_dirs(inum_t first, inum_t count) {
+    for (int i = 0; i < DCACHE_SLOTS; i++) {
+        dcache_slot_lock(&g_Dcache[i]);
+        if (g_Dcache[i].valid && g_Dcache[i].parent >= first && g_Dcache[i].parent - first < count) {
+            g_Dcache[i].valid = 0;
+        }
+        dcache_slot_unlock(&g_Dcache[i]);
+    }
+}
+
+// gets the hit and miss counters of the cache
+void dcache_stats(uint64_t* hits, uint64_t* misses) {
+    *hits = 0;
+    *misses = 0;
+    for (int i = 0; i < DCACHE_STAT_STRIPES; i++) {
+        *hits += __atomic_load_n(&g_Dcache_Stats[i].hits, __ATOMIC_RELAXED);
+        *misses += __atomic_load_n(&g_Dcache_Stats[i].misses, __ATOMIC_RELAXED);
+    }
+}
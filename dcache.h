@@ -0,0 +1,38 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - a hashed cache of path item lookups, keyed by the parent directory's
+ *     inode and the item name, mapping to the item's inode
+ *   - negative entries record items known not to exist in a directory
+ *   - entries must be invalidated by any function that changes a directory's
+ *     contents, see storage.c
+ */
+
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stdint.h>
+
+#include "storage.h"
+
+// the number of slots in the cache, must be a power of two
+#define DCACHE_SLOTS 8192
+
+// the longest item name that will be cached, longer names are always searched
+#define DCACHE_NAME_MAX 48
+
+// return value of dcache_lookup when the item is not in the cache
+#define DCACHE_MISS 1
+
+int dcache_lookup(inum_t inode_parent, const char* item, int len, inum_t* inode_i);
+void dcache_insert(inum_t inode_parent, const char* item, int len, inum_t inode_i);
+void dcache_insert_negative(inum_t inode_parent, const char* item, int len);
+void dcache_invalidate(inum_t inode_parent, const char* item, int len);
+void dcache_invalidate_dir(inum_t inode_parent);
+void dcache_invalidate_dirs(inum_t first, inum_t count);
+void dcache_stats(uint64_t* hits, uint64_t* misses);
+
+#endif
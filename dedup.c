@@ -0,0 +1,113 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - the index is a hash table of chains through arrays indexed by block, a
+ *     block's hash is 0 while it is not in the index, block 0 is the root
+ *     directory's so it never is and ends a chain
+ *   - the table has a power of two of buckets, at least one per block
+ */
+
+#include "dedup.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the chain of each bucket, the next block of each block's chain and the hash
+// of each block in the index
+static bnum_t*   g_Dedup_Buckets = 0;
+static bnum_t*   g_Dedup_Next =    0;
+static uint64_t* g_Dedup_Hashes =  0;
+static uint64_t  g_Dedup_Mask =    0;
+
+// allocates an empty index for an image with the given number of blocks
+void dedup_init(bnum_t block_count) {
+    dedup_free();
+    uint64_t buckets = 1;
+    while (buckets < block_count) {
+        buckets <<= 1;
+    }
+    g_Dedup_Mask = buckets - 1;
+    g_Dedup_Buckets = calloc(buckets, sizeof(bnum_t));
+    assert(g_Dedup_Buckets != 0);
+    g_Dedup_Next = calloc(block_count, sizeof(bnum_t));
+    assert(g_Dedup_Next != 0);
+    g_Dedup_Hashes = calloc(block_count, sizeof(uint64_t));
+    assert(g_Dedup_Hashes != 0);
+}
+
+// frees the index, if there is one
+void dedup_free() {
+    free(g_Dedup_Buckets);
+    g_Dedup_Buckets = 0;
+    free(g_Dedup_Next);
+    g_Dedup_Next = 0;
+    free(g_Dedup_Hashes);
+    g_Dedup_Hashes = 0;
+}
+
+// returns the hash of a block's bytes, never 0
+// note: the 64 bit murmur2 hash, 8 bytes at a time
+uint64_t dedup_hash(const void* data) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    const uint8_t* p = data;
+    uint64_t h = 0x8445d61a4e774912ULL ^ (BLOCK_SIZE * m);
+
+    for (size_t i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t)) {
+        uint64_t k;
+        memcpy(&k, p + i, sizeof(k));
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+
+    return (h != 0) ? h : 1;
+}
+
+// returns a block in the index with the given hash, or 0 if there is none
+bnum_t dedup_find(uint64_t hash) {
+    if (g_Dedup_Buckets == 0) {
+        return 0;
+    }
+    for (bnum_t b = g_Dedup_Buckets[hash & g_Dedup_Mask]; b != 0; b = g_Dedup_Next[b]) {
+        if (g_Dedup_Hashes[b] == hash) {
+            return b;
+        }
+    }
+    return 0;
+}
+
+// adds a block with the given hash of its bytes, replacing the hash it had
+void dedup_add(bnum_t block, uint64_t hash) {
+    if (g_Dedup_Buckets == 0) {
+        return;
+    }
+    assert(block != 0);
+    dedup_remove(block);
+    bnum_t* head = &g_Dedup_Buckets[hash & g_Dedup_Mask];
+    g_Dedup_Hashes[block] = hash;
+    g_Dedup_Next[block] = *head;
+    *head = block;
+}
+
+// removes a block from the index, if it is in it
+void dedup_remove(bnum_t block) {
+    if (g_Dedup_Buckets == 0 || g_Dedup_Hashes[block] == 0) {
+        return;
+    }
+    bnum_t* link = &g_Dedup_Buckets[g_Dedup_Hashes[block] & g_Dedup_Mask];
+    while (*link != block) {
+        link = &g_Dedup_Next[*link];
+    }
+    *link = g_Dedup_Next[block];
+    g_Dedup_Hashes[block] = 0;
+}
@@ -0,0 +1,35 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - an index of data blocks by their contents for deduplicating writes,
+ *     enabled with NUFS_DEDUP set in the environment
+ *   - a block is found by a 64 bit hash of its bytes, its bytes are compared
+ *     before it is shared, see block_share, so a hash collision never shares
+ *     a block
+ *   - the index is only kept in memory and is rebuilt at each mount from the
+ *     whole blocks of every file, see storage_dedup_index, so the mount reads
+ *     all of the files' data, a block leaves the index when it is freed or
+ *     claimed to be written in place
+ *   - every function but dedup_init, dedup_free and dedup_hash is called with
+ *     the allocator lock held, none of them reads a block so the lock never
+ *     waits for the block cache
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+
+#include "storage.h"
+
+void dedup_init(bnum_t block_count);
+void dedup_free();
+uint64_t dedup_hash(const void* data);
+bnum_t dedup_find(uint64_t hash);
+void dedup_add(bnum_t block, uint64_t hash);
+void dedup_remove(bnum_t block);
+
+#endif
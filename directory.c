@@ -0,0 +1,621 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - item hashes are the hash_item hash of the name, the index is searched
+ *     with a binary search so lookups only scan one leaf block
+ *   - when a leaf is full it is split by hash, the upper half of its items
+ *     move to a new block at the end of the directory
+ *   - compaction is incremental, only the block an item was deleted from is
+ *     ever compacted or removed by that delete
+ *   - a removed block is replaced by the directory's last block so the
+ *     directory can always be shrunk with inode_truncate
+ *   - functions return 0 on success or a negative errno, see storage.c
+ *   - no function here takes a lock, the caller holds the directory's read
+ *     lock to find or iterate and its write lock to insert or delete
+ *   - every block written is marked with journal_dirty, the caller is inside a
+ *     journal transaction
+ *   - a directory is thawed before it is changed so a snapshot's directory
+ *     blocks are never written, see snapshot_thaw
+ *   - a snapshot's directory holds the live inode numbers of its items, they
+ *     are moved into the snapshot with snapshot_base when they are returned
+ */
+
+#include "directory.h"
+#include "path.h"
+#include "extent.h"
+#include "journal.h"
+#include "snapshot.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/stat.h>
+
+// an item being moved between blocks by a split or conversion
+typedef struct dir_move_item_t {
+    uint32_t hash;          // the hash of the item name
+    dir_item_t* item;       // the item in the copied blocks
+} dir_move_item_t;
+
+// an item being listed by dir_iterate
+typedef struct dir_pos_item_t {
+    uint64_t pos;           // the position of the item, see dir_item_pos
+    dir_item_t* item;       // the item in its block
+} dir_pos_item_t;
+
+
+
+// -------------------------- BLOCK HELPERS -----------------------------
+
+// returns the data of the given directory block index
+static void* dir_block(inum_t inode_dir, uint32_t block_i) {
+    assert(block_i < get_inode(inode_dir)->block_count);
+    return get_block(extent_map(inode_dir, block_i, 0));
+}
+
+// initializes an empty directory block
+static void dir_block_init(dir_block_t* block) {
+    block->end = 0;
+    block->dead = 0;
+    journal_dirty(block, BLOCK_SIZE);
+}
+
+// returns the item at the given offset in the block
+static dir_item_t* dir_block_item(dir_block_t* block, int offset) {
+    return (dir_item_t*)(block->items + offset);
+}
+
+// finds the item in a block, returns the item or null
+static dir_item_t* dir_block_find(dir_block_t* block, const char* item, int len) {
+    dir_item_t* current;
+
+    // loop over every item in the block
+    for (int offset = 0; offset < block->end; offset += DIR_ITEM_SIZE(current->len)) {
+        // if the current item is the item of interest return it
+        current = dir_block_item(block, offset);
+        if (current->len == len && (current->flags & DIR_ITEM_DELETED) == 0 &&
+                memcmp(current->name, item, len) == 0) {
+            return current;
+        }
+    }
+
+    return 0;
+}
+
+// removes the space of the deleted items in the block by sliding the items
+// after them down
+static void dir_block_compact(dir_block_t* block) {
+    dir_item_t* current;
+    int end = 0;
+    int size;
+
+    // loop over every item, only moving the items that are not deleted
+    for (int offset = 0; offset < block->end; offset += size) {
+        current = dir_block_item(block, offset);
+        size = DIR_ITEM_SIZE(current->len);
+        if ((current->flags & DIR_ITEM_DELETED) == 0) {
+            memmove(block->items + end, current, size);
+            end += size;
+        }
+    }
+
+    block->end = end;
+    block->dead = 0;
+}
+
+// writes an item at the end of the block, the caller ensures it fits
+static void dir_block_write(dir_block_t* block, const char* item, int len, inum_t inode_i, uint8_t type) {
+    dir_item_t* new_item = dir_block_item(block, block->end);
+    new_item->len = len;
+    new_item->flags = 0;
+    new_item->type = type;
+    new_item->inode = inode_i;
+    memcpy(new_item->name, item, len);
+    new_item->name[len] = 0;
+    block->end += DIR_ITEM_SIZE(len);
+    journal_dirty(block, BLOCK_SIZE);
+}
+
+// appends the item to the block if it has space, compacting the block first if
+// that would make space, returns 0 on success
+static int dir_block_append(dir_block_t* block, const char* item, int len, inum_t inode_i, uint8_t type) {
+    int size = DIR_ITEM_SIZE(len);
+
+    // no room at the end, compact if the deleted items would make room
+    if (block->end + size > DIR_BLOCK_SPACE) {
+        if (block->end - block->dead + size > DIR_BLOCK_SPACE) {
+            return -ENOSPC;
+        }
+        dir_block_compact(block);
+    }
+
+    dir_block_write(block, item, len, inode_i, type);
+    return 0;
+}
+
+// flags the item in the block as deleted, returns 1 if the block has no items
+// left
+static int dir_block_delete(dir_block_t* block, dir_item_t* item) {
+    item->flags |= DIR_ITEM_DELETED;
+    block->dead += DIR_ITEM_SIZE(item->len);
+    journal_dirty(block, BLOCK_SIZE);
+
+    // every item is deleted, the block is empty
+    if (block->dead == block->end) {
+        dir_block_init(block);
+        return 1;
+    }
+
+    // compact the block once enough of it is deleted
+    if (block->dead > DIR_BLOCK_COMPACT) {
+        dir_block_compact(block);
+    }
+
+    return 0;
+}
+
+
+
+// -------------------------- INDEX HELPERS -----------------------------
+
+// returns the index slot of the leaf that holds the given hash
+static uint32_t dir_index_slot(dir_index_t* index, uint32_t hash) {
+    uint32_t low = 0;
+    uint32_t high = index->count;
+
+    // binary search for the last entry with a hash less than or equal to the
+    // hash, entry 0 always has hash 0 so there is always one
+    while (high - low > 1) {
+        uint32_t mid = (low + high) / 2;
+        if (index->entries[mid].hash <= hash) {
+            low = mid;
+        }
+        else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+// returns the leaf block that holds the given item hash
+static dir_block_t* dir_leaf(inum_t inode_dir, uint32_t hash, uint32_t* slot) {
+    dir_index_t* index = dir_block(inode_dir, 0);
+    *slot = dir_index_slot(index, hash);
+    return dir_block(inode_dir, index->entries[*slot].block);
+}
+
+// compares moved items by hash for qsort
+static int dir_move_compare(const void* a, const void* b) {
+    uint32_t ha = ((const dir_move_item_t*)a)->hash;
+    uint32_t hb = ((const dir_move_item_t*)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+// collects the items that are not deleted in the copied blocks, sorted by hash
+// returns the number of items collected
+static int dir_collect(char* copy, int block_count, dir_move_item_t* items) {
+    int count = 0;
+    dir_item_t* current;
+
+    // loop over every item of every block
+    for (int i = 0; i < block_count; i++) {
+        dir_block_t* block = (dir_block_t*)(copy + i * BLOCK_SIZE);
+        for (int offset = 0; offset < block->end; offset += DIR_ITEM_SIZE(current->len)) {
+            current = dir_block_item(block, offset);
+            if ((current->flags & DIR_ITEM_DELETED) == 0) {
+                items[count].hash = hash_item(HASH_ITEM_SEED, current->name, current->len);
+                items[count++].item = current;
+            }
+        }
+    }
+
+    qsort(items, count, sizeof(dir_move_item_t), dir_move_compare);
+    return count;
+}
+
+// writes the given sorted items to an empty block
+static void dir_fill(dir_block_t* block, dir_move_item_t* items, int count) {
+    dir_block_init(block);
+    for (int i = 0; i < count; i++) {
+        dir_block_write(block, items[i].item->name, items[i].item->len, items[i].item->inode, items[i].item->type);
+    }
+}
+
+// splits the leaf at the given index slot in two, the upper half of the hashes
+// move to a new leaf block at the end of the directory
+static int dir_split(inum_t inode_dir, uint32_t slot) {
+    inode_t* inode = get_inode(inode_dir);
+    dir_index_t* index = dir_block(inode_dir, 0);
+
+    // the index must have room for another leaf
+    if (index->count >= DIRECTORY_INDEX_MAX) {
+        return -ENOSPC;
+    }
+
+    // copy the leaf and sort its items
+    char* copy = malloc(BLOCK_SIZE);
+    memcpy(copy, dir_block(inode_dir, index->entries[slot].block), BLOCK_SIZE);
+    dir_move_item_t* items = malloc((DIR_BLOCK_SPACE / DIR_ITEM_SIZE(1)) * sizeof(dir_move_item_t));
+    int count = dir_collect(copy, 1, items);
+
+    // split at the middle, moving to the nearest change in hash so that every
+    // item with the same hash stays in the same leaf
+    int split = count / 2;
+    while (split > 0 && split < count && items[split].hash == items[split - 1].hash) {
+        split++;
+    }
+    if (split == count) {
+        split = count / 2;
+        while (split > 0 && items[split].hash == items[split - 1].hash) {
+            split--;
+        }
+    }
+
+    // every item has the same hash, the leaf cannot be split
+    int rv = -ENOSPC;
+    if (split > 0 && split < count) {
+        // grow the directory by one block for the new leaf
+        uint32_t new_leaf = inode->block_count;
+        if ((rv = inode_truncate((off_t)(new_leaf + 1) * BLOCK_SIZE, inode_dir)) == 0) {
+            // the index block may have moved if the blocks switched to the
+            // indirect block, get it again
+            index = dir_block(inode_dir, 0);
+
+            // rewrite both leaves from the sorted items
+            dir_fill(dir_block(inode_dir, index->entries[slot].block), items, split);
+            dir_fill(dir_block(inode_dir, new_leaf), items + split, count - split);
+
+            // add the new leaf to the index after the split leaf
+            memmove(&index->entries[slot + 2], &index->entries[slot + 1],
+                    (index->count - slot - 1) * sizeof(dir_index_entry_t));
+            index->entries[slot + 1].hash = items[split].hash;
+            index->entries[slot + 1].block = new_leaf;
+            index->count++;
+            journal_dirty(index, BLOCK_SIZE);
+        }
+    }
+
+    free(items);
+    free(copy);
+
+    return rv;
+}
+
+// converts a full directory of packed items into the indexed format
+// note: the new layout is planned before any block is written, so on failure
+//       the directory is unchanged
+static int dir_convert(inum_t inode_dir) {
+    inode_t* inode = get_inode(inode_dir);
+    int block_count = inode->block_count;
+
+    // the items of block_count blocks always fit in block_count + 1 leaves, plus
+    // one block for the index
+    int rv = inode_truncate((off_t)(block_count + 2) * BLOCK_SIZE, inode_dir);
+    if (rv != 0) {
+        return rv;
+    }
+
+    // copy the blocks and sort their items
+    char* copy = malloc(block_count * BLOCK_SIZE);
+    for (int i = 0; i < block_count; i++) {
+        memcpy(copy + i * BLOCK_SIZE, dir_block(inode_dir, i), BLOCK_SIZE);
+    }
+    dir_move_item_t* items = malloc(block_count * (DIR_BLOCK_SPACE / DIR_ITEM_SIZE(1)) * sizeof(dir_move_item_t));
+    int count = dir_collect(copy, block_count, items);
+
+    // plan where each leaf starts, a leaf ends at the last change in hash
+    // before it would be full
+    int* starts = malloc((block_count + 2) * sizeof(int));
+    int leaves = 1;
+    int used = 0;
+    starts[0] = 0;
+    for (int i = 0; i < count; i++) {
+        int size = DIR_ITEM_SIZE(items[i].item->len);
+        if (used + size > DIR_BLOCK_SPACE) {
+            // move back to the first item with this hash
+            int start = i;
+            while (start > starts[leaves - 1] && items[start].hash == items[start - 1].hash) {
+                start--;
+            }
+
+            // the whole leaf has one hash or there are no blocks left
+            if (start == starts[leaves - 1] || leaves == block_count + 1) {
+                rv = -ENOSPC;
+                break;
+            }
+
+            // start a new leaf and count the moved items against it
+            starts[leaves++] = start;
+            used = 0;
+            i = start - 1;
+            continue;
+        }
+        used += size;
+    }
+
+    if (rv == 0) {
+        // write every leaf, leaf n is block n + 1
+        for (int n = 0; n < leaves; n++) {
+            int end = (n + 1 < leaves) ? starts[n + 1] : count;
+            dir_fill(dir_block(inode_dir, n + 1), items + starts[n], end - starts[n]);
+        }
+
+        // block 0 becomes the index
+        dir_index_t* index = dir_block(inode_dir, 0);
+        memset(index, 0, BLOCK_SIZE);
+        index->count = leaves;
+        for (int n = 0; n < leaves; n++) {
+            index->entries[n].hash = (n == 0) ? 0 : items[starts[n]].hash;
+            index->entries[n].block = n + 1;
+        }
+        inode->flags |= INODE_INDEXED;
+        journal_dirty(index, BLOCK_SIZE);
+        journal_dirty(inode, sizeof(inode_t));
+    }
+
+    // free the blocks that were not needed, or all new blocks on failure
+    inode_truncate((off_t)((rv == 0) ? leaves + 1 : block_count) * BLOCK_SIZE, inode_dir);
+
+    free(starts);
+    free(items);
+    free(copy);
+
+    return rv;
+}
+
+// removes an empty block from the directory, the last block takes its place
+static int dir_remove_block(inum_t inode_dir, uint32_t block_i) {
+    inode_t* inode = get_inode(inode_dir);
+    uint32_t last = inode->block_count - 1;
+
+    if (inode->flags & INODE_INDEXED) {
+        dir_index_t* index = dir_block(inode_dir, 0);
+
+        // remove the leaf's index entry, its hashes belong to the previous leaf
+        // now or to the first leaf if it was the first
+        for (uint32_t slot = 0; slot < index->count; slot++) {
+            if (index->entries[slot].block == block_i) {
+                memmove(&index->entries[slot], &index->entries[slot + 1],
+                        (index->count - slot - 1) * sizeof(dir_index_entry_t));
+                index->count--;
+                index->entries[0].hash = 0;
+                break;
+            }
+        }
+
+        // point the last block's leaf at its new position
+        for (uint32_t slot = 0; slot < index->count; slot++) {
+            if (index->entries[slot].block == last) {
+                index->entries[slot].block = block_i;
+            }
+        }
+        journal_dirty(index, BLOCK_SIZE);
+    }
+
+    // move the last block into the removed block and shrink the directory
+    if (block_i != last) {
+        memcpy(dir_block(inode_dir, block_i), dir_block(inode_dir, last), BLOCK_SIZE);
+        journal_dirty(dir_block(inode_dir, block_i), BLOCK_SIZE);
+    }
+    return inode_truncate((off_t)last * BLOCK_SIZE, inode_dir);
+}
+
+
+
+// -------------------------- DIRECTORY FUNCTIONS -----------------------
+
+// initializes the data of a new directory, it has one empty block
+int dir_init(inum_t inode_dir) {
+    inode_t* inode = get_inode(inode_dir);
+    inode->flags &= ~INODE_INDEXED;
+    journal_dirty(inode, sizeof(inode_t));
+
+    // all directories have an initial size of BLOCK_SIZE
+    int rv = inode_truncate(BLOCK_SIZE, inode_dir);
+    if (rv == 0) {
+        dir_block_init(dir_block(inode_dir, 0));
+    }
+
+    return rv;
+}
+
+// finds the item of the given length in the directory, sets the block index
+// it was found in
+static dir_item_t* dir_find_item(inum_t inode_dir, const char* item, int len, uint32_t* block_i) {
+    inode_t* inode = get_inode(inode_dir);
+    dir_item_t* found = 0;
+
+    // indexed directories only need the item's leaf searched
+    if (inode->flags & INODE_INDEXED) {
+        uint32_t slot;
+        found = dir_block_find(dir_leaf(inode_dir, hash_item(HASH_ITEM_SEED, item, len), &slot), item, len);
+        *block_i = ((dir_index_t*)dir_block(inode_dir, 0))->entries[slot].block;
+    }
+    // loop over all data blocks
+    else {
+        for (*block_i = 0; *block_i < inode->block_count; (*block_i)++) {
+            if ((found = dir_block_find(dir_block(inode_dir, *block_i), item, len))) {
+                break;
+            }
+        }
+    }
+
+    return found;
+}
+
+// finds the item of the given length in the directory, sets the inode pointer
+// to the item's inode
+int dir_find(inum_t inode_dir, const char* item, int len, inum_t* inode_i) {
+    uint32_t block_i;
+    dir_item_t* found = dir_find_item(inode_dir, item, len, &block_i);
+
+    // no entry
+    if (found == 0) {
+        return -ENOENT;
+    }
+
+    *inode_i = snapshot_base(inode_dir) + found->inode;
+    return 0;
+}
+
+// inserts the item of the given length into the directory with the given inode
+// and its DT_* type
+int dir_insert(inum_t inode_dir, const char* item, int len, inum_t inode_i, uint8_t type) {
+    inode_t* inode = get_inode(inode_dir);
+    int rv = -ENOSPC;
+
+    // the name length must fit in an item
+    if (len > UINT8_MAX) {
+        return -ENAMETOOLONG;
+    }
+    if ((rv = snapshot_thaw(inode_dir)) < 0) {
+        return rv;
+    }
+    rv = -ENOSPC;
+
+    if ((inode->flags & INODE_INDEXED) == 0) {
+        // add the item to the first block with space
+        for (int i = 0; i < inode->block_count && rv != 0; i++) {
+            rv = dir_block_append(dir_block(inode_dir, i), item, len, inode_i, type);
+        }
+
+        // grow the directory by a block while it is small enough
+        if (rv != 0 && inode->block_count < DIRECTORY_INDEX_BLOCKS) {
+            uint32_t new_block = inode->block_count;
+            if ((rv = inode_truncate((off_t)(new_block + 1) * BLOCK_SIZE, inode_dir)) == 0) {
+                dir_block_init(dir_block(inode_dir, new_block));
+                rv = dir_block_append(dir_block(inode_dir, new_block), item, len, inode_i, type);
+            }
+        }
+        // the directory is full, convert it to the indexed format
+        else if (rv != 0) {
+            if ((rv = dir_convert(inode_dir)) == 0) {
+                rv = -ENOSPC;
+            }
+        }
+    }
+
+    // add the item to its leaf, splitting the leaf until there is room
+    if (rv == -ENOSPC && (inode->flags & INODE_INDEXED)) {
+        uint32_t hash = hash_item(HASH_ITEM_SEED, item, len);
+        uint32_t slot;
+        while ((rv = dir_block_append(dir_leaf(inode_dir, hash, &slot), item, len, inode_i, type)) != 0) {
+            if ((rv = dir_split(inode_dir, slot)) != 0) {
+                break;
+            }
+        }
+    }
+
+    // the directory cannot hold any more items
+    if (rv == -ENOSPC) {
+        rv = -EDQUOT;
+    }
+
+    return rv;
+}
+
+// deletes the item of the given length from the directory
+int dir_delete(inum_t inode_dir, const char* item, int len) {
+    int rv = snapshot_thaw(inode_dir);
+    if (rv < 0) {
+        return rv;
+    }
+    uint32_t block_i;
+    dir_item_t* found = dir_find_item(inode_dir, item, len, &block_i);
+
+    // no entry
+    if (found == 0) {
+        return -ENOENT;
+    }
+
+    // flag the item deleted, remove its block if that emptied it and the
+    // directory has another block to hold items
+    inode_t* inode = get_inode(inode_dir);
+    uint32_t min_blocks = (inode->flags & INODE_INDEXED) ? 2 : 1;
+    if (dir_block_delete(dir_block(inode_dir, block_i), found) && inode->block_count > min_blocks) {
+        dir_remove_block(inode_dir, block_i);
+    }
+
+    return 0;
+}
+
+// returns the position of the item of the given length, its hash followed by
+// a second hash of its name, so the position does not change when the item
+// moves to another block or offset
+static uint64_t dir_item_pos(const char* item, int len) {
+    uint32_t hash = hash_item(HASH_ITEM_SEED, item, len);
+    return ((uint64_t)hash << 30) | (hash_item(hash, item, len) >> 2);
+}
+
+// compares listed items by position for qsort
+static int dir_pos_compare(const void* a, const void* b) {
+    uint64_t pa = ((const dir_pos_item_t*)a)->pos;
+    uint64_t pb = ((const dir_pos_item_t*)b)->pos;
+    return (pa > pb) - (pa < pb);
+}
+
+// calls the given function for each item from the given position in count
+// blocks from the given block index, in position order
+// returns the first nonzero value the function returns, or 0
+static int dir_iterate_blocks(inum_t inode_dir, uint32_t block_i, int count, uint64_t pos, dir_iterate_t fn, void* arg) {
+    dir_pos_item_t* items = malloc(count * (DIR_BLOCK_SPACE / DIR_ITEM_SIZE(1)) * sizeof(dir_pos_item_t));
+    assert(items != 0);
+    inum_t base = snapshot_base(inode_dir);
+    dir_item_t* current;
+    int found = 0;
+    int rv = 0;
+
+    // collect the items at or after the position
+    for (int i = 0; i < count; i++) {
+        dir_block_t* block = dir_block(inode_dir, block_i + i);
+        for (int offset = 0; offset < block->end; offset += DIR_ITEM_SIZE(current->len)) {
+            current = dir_block_item(block, offset);
+            uint64_t item_pos = dir_item_pos(current->name, current->len);
+            if ((current->flags & DIR_ITEM_DELETED) == 0 && item_pos >= pos) {
+                items[found].pos = item_pos;
+                items[found++].item = current;
+            }
+        }
+    }
+
+    qsort(items, found, sizeof(dir_pos_item_t), dir_pos_compare);
+    for (int i = 0; i < found && rv == 0; i++) {
+        current = items[i].item;
+        rv = fn(current->name, base + current->inode, current->type, items[i].pos + 1, arg);
+    }
+
+    free(items);
+    return rv;
+}
+
+// calls the given function for each item in the directory from the given
+// position, 0 is the first item, in the order of their positions
+// note: every leaf of an indexed directory holds a range of hashes in index
+//       order, so only the leaves from the position's are read
+int dir_iterate(inum_t inode_dir, uint64_t pos, dir_iterate_t fn, void* arg) {
+    inode_t* inode = get_inode(inode_dir);
+
+    // the snapshots are the items of the snapshot directory
+    if (inode_dir == SNAPSHOT_DIR_INODE) {
+        return snapshot_iterate(pos, fn, arg);
+    }
+
+    // a small directory is listed all at once
+    if ((inode->flags & INODE_INDEXED) == 0) {
+        return dir_iterate_blocks(inode_dir, 0, inode->block_count, pos, fn, arg);
+    }
+
+    // list each leaf from the one holding the position's hash
+    dir_index_t* index = dir_block(inode_dir, 0);
+    int rv = 0;
+    for (uint32_t slot = dir_index_slot(index, (uint32_t)(pos >> 30)); slot < index->count && rv == 0; slot++) {
+        rv = dir_iterate_blocks(inode_dir, index->entries[slot].block, 1, pos, fn, arg);
+    }
+
+    return rv;
+}
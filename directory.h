@@ -0,0 +1,92 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - functions to find, insert and delete items in a directory's data blocks
+ *   - every directory data block starts with a dir_block_t header followed by
+ *     packed dir_item_t items, each item is its inode offset, name length,
+ *     flags, file type and null terminated name, so a directory is listed
+ *     without reading its items' inodes
+ *   - deleting an item only flags it DIR_ITEM_DELETED, the space of deleted
+ *     items is reclaimed when its block is compacted and blocks with no items
+ *     left are removed from the directory
+ *   - small directories use up to DIRECTORY_INDEX_BLOCKS blocks, once a
+ *     directory needs more it is converted to the indexed format and its inode
+ *     is flagged INODE_INDEXED
+ *   - indexed directories use block 0 as an index of item name hashes to leaf
+ *     blocks, each leaf block holds the items with hashes between its index
+ *     entry's hash and the next entry's hash
+ *   - a directory is iterated in the order of its items' positions, a 62 bit
+ *     hash of the name, so a listing can stop and continue later and an item
+ *     moved by a compaction, split or block removal since then is still listed
+ *     once, only two names with the same position may be skipped
+ */
+
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include <stdint.h>
+
+#include "storage.h"
+
+// the number of blocks a directory may use before it is indexed
+#define DIRECTORY_INDEX_BLOCKS 4
+
+// item flag set when the item has been deleted
+#define DIR_ITEM_DELETED 0x01
+
+// a single item in a directory block
+// note: items are packed at any offset in a block so the struct is packed
+typedef struct __attribute__((packed)) dir_item_t {
+    inum_t inode;           // the item's inode
+    uint8_t len;            // the length of the name
+    uint8_t flags;          // DIR_ITEM_* flags
+    uint8_t type;           // the DT_* type of the item's inode
+    char name[];            // the name, null terminated
+} dir_item_t;
+
+// the size of an item with a name of the given length
+#define DIR_ITEM_SIZE(len) (sizeof(dir_item_t) + (len) + 1)
+
+// the header of a directory data block
+typedef struct dir_block_t {
+    uint16_t end;           // the offset of the end of the items
+    uint16_t dead;          // the number of bytes used by deleted items
+    char items[];           // the packed items
+} dir_block_t;
+
+// the space for items in a directory block
+#define DIR_BLOCK_SPACE (BLOCK_SIZE - sizeof(dir_block_t))
+
+// a block is compacted once deleted items use more than this many bytes
+#define DIR_BLOCK_COMPACT (DIR_BLOCK_SPACE / 2)
+
+// a single index entry, the leaf holds all item hashes starting at hash
+typedef struct dir_index_entry_t {
+    uint32_t hash;          // the lowest item hash in the leaf
+    uint32_t block;         // the directory block index of the leaf
+} dir_index_entry_t;
+
+// the index block of an indexed directory
+typedef struct dir_index_t {
+    uint32_t count;                 // the number of leaves
+    uint32_t reserved;              // unused, keeps the entries aligned
+    dir_index_entry_t entries[];    // the leaves, sorted by hash
+} dir_index_t;
+
+// the maximum number of leaves an indexed directory can have
+#define DIRECTORY_INDEX_MAX ((BLOCK_SIZE - sizeof(dir_index_t)) / sizeof(dir_index_entry_t))
+
+// function called for each item by dir_iterate with the position after the
+// item, a non-zero return stops
+typedef int (*dir_iterate_t)(const char* item, inum_t inode_i, uint8_t type, uint64_t next, void* arg);
+
+int dir_init(inum_t inode_dir);
+int dir_find(inum_t inode_dir, const char* item, int len, inum_t* inode_i);
+int dir_insert(inum_t inode_dir, const char* item, int len, inum_t inode_i, uint8_t type);
+int dir_delete(inum_t inode_dir, const char* item, int len);
+int dir_iterate(inum_t inode_dir, uint64_t pos, dir_iterate_t fn, void* arg);
+
+#endif
@@ -0,0 +1,549 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - the extent block is not counted in an inode's block_count or block_used,
+ *     it is freed as soon as the extents fit in the inode again
+ *   - a new extent is merged into the extents next to it when its blocks
+ *     continue theirs on disk
+ *   - growing or shrinking marks the inode and its extent block with
+ *     journal_dirty, the caller is inside a journal transaction
+ *   - a block shared with other owners is only written after extent_own has
+ *     remapped the inode block to a copy, see block_claim
+ *   - every function that changes the extents thaws the inode first, so an
+ *     extent block a snapshot holds is never written, see snapshot_thaw
+ */
+
+#include "extent.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "trace.h"
+
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+
+// returns the extent array of the given inode, in the inode or its extent block
+extent_t* get_extents(inum_t inode_i) {
+    inode_t* inode = get_inode(inode_i);
+    return ((inode->extent_count > INODE_EXTENT_COUNT) ?
+        (extent_t*)get_block(inode->e_block) : inode->extents);
+}
+
+// returns the index of the first extent starting after the given inode block,
+// the extent before it is the only one that can hold the block
+static uint32_t extent_find(extent_t* extents, uint32_t count, uint32_t logical) {
+    // binary search for the first extent starting after the block
+    uint32_t lo = 0;
+    uint32_t hi = count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (extents[mid].logical <= logical) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// returns the data block of the given inode block, if run is not null it is set
+// to the number of contiguous blocks from that block to the end of its extent
+// note: a block in a hole returns EXTENT_HOLE and run is set to the number of
+//       blocks to the end of the hole
+bnum_t extent_map(inum_t inode_i, uint32_t logical, uint32_t* run) {
+    inode_t* inode = get_inode(inode_i);
+    extent_t* extents = get_extents(inode_i);
+    assert(logical < inode->block_count);
+
+    // the block is in the extent before the next one or in the hole after it
+    uint32_t next = extent_find(extents, inode->extent_count, logical);
+    extent_t* extent = (next > 0) ? &extents[next - 1] : 0;
+    if (extent == 0 || logical - extent->logical >= extent->length) {
+        if (run != 0) {
+            *run = ((next < inode->extent_count) ? extents[next].logical : inode->block_count) - logical;
+        }
+        return EXTENT_HOLE;
+    }
+
+    if (run != 0) {
+        *run = extent->length - (logical - extent->logical);
+    }
+    return extent->start + (logical - extent->logical);
+}
+
+// marks the inode and its extent block, if it has one, as changed, a changed
+// mapping is a change fdatasync must commit even when the size is the same
+static void extent_dirty(inum_t inode_i) {
+    inode_t* inode = get_inode(inode_i);
+    journal_dirty_inode(inode_i, 1);
+    if (inode->extent_count > INODE_EXTENT_COUNT) {
+        journal_dirty(get_block(inode->e_block), BLOCK_SIZE);
+    }
+}
+
+// inserts an extent at the given index of the given inode's extents, moving
+// the extents to an extent block if they no longer fit in the inode
+static int extent_insert(inum_t inode_i, uint32_t index, uint32_t logical, bnum_t start, bnum_t length) {
+    inode_t* inode = get_inode(inode_i);
+
+    // the extent block is full too
+    if (inode->extent_count == EXTENT_BLOCK_COUNT) {
+        return -EFBIG;
+    }
+
+    // the inode is full, move its extents to a new extent block
+    if (inode->extent_count == INODE_EXTENT_COUNT) {
+        bnum_t e_block;
+        int rv = block_alloc(start + length, 1, &e_block);
+        if (rv < 0) {
+            return rv;
+        }
+
+        memcpy(get_block(e_block), inode->extents, sizeof(inode->extents));
+        inode->e_block = e_block;
+    }
+
+    // make room for the extent, the count is updated last so the extents are
+    // read from the extent block once it is over the inode's count
+    extent_t* extents = (inode->extent_count >= INODE_EXTENT_COUNT) ?
+        (extent_t*)get_block(inode->e_block) : inode->extents;
+    memmove(&extents[index + 1], &extents[index], (inode->extent_count - index) * sizeof(extent_t));
+    extents[index].logical = logical;
+    extents[index].start = start;
+    extents[index].length = length;
+    inode->extent_count++;
+
+    return 0;
+}
+
+// moves the extents back to the inode if they fit and frees the extent block,
+// extents is where they were before the count last dropped
+static void extent_unblock(inum_t inode_i, extent_t* extents) {
+    inode_t* inode = get_inode(inode_i);
+    if (extents != inode->extents && inode->extent_count <= INODE_EXTENT_COUNT) {
+        memcpy(inode->extents, extents, inode->extent_count * sizeof(extent_t));
+        block_free(inode->e_block, 1);
+        inode->e_block = 0;
+    }
+}
+
+// maps the hole at the given inode block to length data blocks from start,
+// returns 0 or a negative errno if the extents have no room for them
+static int extent_add(inum_t inode_i, uint32_t logical, bnum_t start, bnum_t length) {
+    inode_t* inode = get_inode(inode_i);
+    extent_t* extents = get_extents(inode_i);
+    uint32_t next = extent_find(extents, inode->extent_count, logical);
+    extent_t* before = (next > 0) ? &extents[next - 1] : 0;
+    extent_t* after = (next < inode->extent_count) ? &extents[next] : 0;
+    int rv;
+
+    // continue the extent before, the extent after, both or neither
+    int joins_before = (before != 0 && before->logical + before->length == logical &&
+            before->start + before->length == start);
+    int joins_after = (after != 0 && logical + length == after->logical && start + length == after->start);
+    if (joins_before && joins_after) {
+        before->length += length + after->length;
+        memmove(after, after + 1, (inode->extent_count - next - 1) * sizeof(extent_t));
+        inode->extent_count--;
+        extent_unblock(inode_i, extents);
+    }
+    else if (joins_before) {
+        before->length += length;
+    }
+    else if (joins_after) {
+        after->logical = logical;
+        after->start = start;
+        after->length += length;
+    }
+    else if ((rv = extent_insert(inode_i, next, logical, start, length)) != 0) {
+        return rv;
+    }
+
+    inode->block_used += length;
+    extent_dirty(inode_i);
+    return 0;
+}
+
+// maps new blocks to the hole at the given inode block, at most want blocks and
+// never past the hole, the caller fills them before they are read
+// returns the number of blocks mapped, one run that may be shorter than want
+// if the bitmap has no free run of want blocks where the hole would continue
+// the blocks before it
+int extent_alloc(inum_t inode_i, uint32_t logical, bnum_t want) {
+    int rv = snapshot_thaw(inode_i);
+    if (rv < 0) {
+        return rv;
+    }
+    inode_t* inode = get_inode(inode_i);
+    extent_t* extents = get_extents(inode_i);
+    uint32_t next = extent_find(extents, inode->extent_count, logical);
+    extent_t* before = (next > 0) ? &extents[next - 1] : 0;
+    extent_t* after = (next < inode->extent_count) ? &extents[next] : 0;
+    assert(before == 0 || logical - before->logical >= before->length);
+    assert(after == 0 || after->logical - logical >= want);
+
+    // ask for the blocks where they would be if the extents on either side
+    // had been written contiguously
+    bnum_t goal = 0;
+    if (before != 0) {
+        goal = before->start + (logical - before->logical);
+    }
+    else if (after != 0 && after->start > after->logical - logical) {
+        goal = after->start - (after->logical - logical);
+    }
+
+    bnum_t start;
+    if ((rv = block_alloc(goal, want, &start)) < 0) {
+        return rv;
+    }
+    bnum_t length = (bnum_t)rv;
+    if ((rv = extent_add(inode_i, logical, start, length)) != 0) {
+        block_free(start, length);
+        return rv;
+    }
+    return (int)length;
+}
+
+// maps the hole of count blocks at the given inode block to the data blocks
+// from start, which are shared with their other owners, see block_ref
+// returns 0, or a negative errno and nothing changed
+int extent_share(inum_t inode_i, uint32_t logical, bnum_t start, bnum_t count) {
+    int rv = snapshot_thaw(inode_i);
+    if (rv < 0 || (rv = block_ref(start, count)) < 0) {
+        return rv;
+    }
+    if ((rv = extent_add(inode_i, logical, start, count)) != 0) {
+        block_free(start, count);
+    }
+    return rv;
+}
+
+// grows the given inode to the given number of blocks without mapping any, the
+// new blocks are a hole
+void extent_hole(inum_t inode_i, bnum_t blocks) {
+    inode_t* inode = get_inode(inode_i);
+    assert(blocks >= inode->block_count);
+    inode->block_count = blocks;
+    journal_dirty_inode(inode_i, 1);
+}
+
+// grows the given inode to the given number of blocks, every new block is
+// mapped, on failure the inode is left as it was
+int extent_grow(inum_t inode_i, bnum_t blocks) {
+    inode_t* inode = get_inode(inode_i);
+    bnum_t old_blocks = inode->block_count;
+    int rv = snapshot_thaw(inode_i);
+    if (rv < 0) {
+        return rv;
+    }
+
+    // allocate runs until all blocks are mapped, usually one is enough
+    while (inode->block_count < blocks) {
+        // try to continue right after the last extent
+        extent_t* extents = get_extents(inode_i);
+        extent_t* last = (inode->extent_count > 0) ? &extents[inode->extent_count - 1] : 0;
+        bnum_t goal = (last != 0) ? last->start + last->length : 0;
+
+        bnum_t start;
+        if ((rv = block_alloc(goal, blocks - inode->block_count, &start)) < 0) {
+            break;
+        }
+        bnum_t length = (bnum_t)rv;
+        rv = 0;
+
+        // the run continues the last extent if nothing is between them,
+        // otherwise it is a new extent
+        if (last != 0 && start == goal && last->logical + last->length == inode->block_count) {
+            last->length += length;
+        }
+        else if ((rv = extent_insert(inode_i, inode->extent_count, inode->block_count, start, length)) != 0) {
+            block_free(start, length);
+            break;
+        }
+
+        inode->block_count += length;
+        inode->block_used += length;
+    }
+
+    // on failure free whatever was allocated
+    if (rv != 0) {
+        extent_shrink(inode_i, old_blocks);
+    }
+    extent_dirty(inode_i);
+
+    return rv;
+}
+
+// shrinks the given inode to the given number of blocks and frees the rest
+// returns 0, or a negative errno and nothing changed
+// note: shrinking to no blocks only frees them and writes no extent, so it
+//       needs no thaw and cannot fail
+int extent_shrink(inum_t inode_i, bnum_t blocks) {
+    inode_t* inode = get_inode(inode_i);
+    int rv = (blocks > 0) ? snapshot_thaw(inode_i) : 0;
+    if (rv < 0) {
+        return rv;
+    }
+    extent_t* extents = get_extents(inode_i);
+
+    // free the extents from the end until the last one ends at or before blocks
+    while (inode->extent_count > 0) {
+        extent_t* last = &extents[inode->extent_count - 1];
+
+        // the whole extent is past the new end
+        if (last->logical >= blocks) {
+            block_free(last->start, last->length);
+            inode->block_used -= last->length;
+            inode->extent_count--;
+        }
+        // only the tail of the extent is past the new end
+        else {
+            uint32_t keep = blocks - last->logical;
+            if (keep < last->length) {
+                block_free(last->start + keep, last->length - keep);
+                inode->block_used -= last->length - keep;
+                last->length = keep;
+            }
+            break;
+        }
+    }
+
+    // move the extents back to the inode if they fit
+    extent_unblock(inode_i, extents);
+
+    inode->block_count = blocks;
+    extent_dirty(inode_i);
+    return 0;
+}
+
+// frees count blocks of the given inode from the given inode block, they
+// become a hole, an extent that reaches past both ends of the range is split
+// note: on failure, when a split needs an extent block and none is left, the
+//       blocks before the extent being split are already a hole
+int extent_punch(inum_t inode_i, uint32_t logical, uint32_t count) {
+    int rv = snapshot_thaw(inode_i);
+    if (rv < 0) {
+        return rv;
+    }
+    inode_t* inode = get_inode(inode_i);
+    extent_t* extents = get_extents(inode_i);
+    uint32_t end = logical + count;
+
+    // start at the extent that may hold the first block
+    uint32_t i = extent_find(extents, inode->extent_count, logical);
+    if (i > 0) {
+        i--;
+    }
+    while (i < inode->extent_count && extents[i].logical < end) {
+        extent_t* extent = &extents[i];
+        uint32_t extent_end = extent->logical + extent->length;
+        if (extent_end <= logical) {
+            i++;
+            continue;
+        }
+        uint32_t cut = (extent->logical > logical) ? extent->logical : logical;
+        uint32_t cut_end = (extent_end < end) ? extent_end : end;
+        bnum_t cut_start = extent->start + (cut - extent->logical);
+
+        // the range is in the middle of the extent, the part after it is a
+        // new extent
+        if (cut > extent->logical && cut_end < extent_end) {
+            rv = extent_insert(inode_i, i + 1, cut_end, extent->start + (cut_end - extent->logical),
+                    extent_end - cut_end);
+            if (rv != 0) {
+                break;
+            }
+            extents = get_extents(inode_i);
+            extents[i].length = cut - extents[i].logical;
+            i += 2;
+        }
+        // the range is the tail of the extent
+        else if (cut > extent->logical) {
+            extent->length = cut - extent->logical;
+            i++;
+        }
+        // the range is the head of the extent
+        else if (cut_end < extent_end) {
+            extent->start += cut_end - extent->logical;
+            extent->length = extent_end - cut_end;
+            extent->logical = cut_end;
+            i++;
+        }
+        // the whole extent is in the range
+        else {
+            memmove(extent, extent + 1, (inode->extent_count - i - 1) * sizeof(extent_t));
+            inode->extent_count--;
+        }
+
+        block_free(cut_start, cut_end - cut);
+        inode->block_used -= cut_end - cut;
+    }
+
+    // move the extents back to the inode if they fit
+    extent_unblock(inode_i, extents);
+    extent_dirty(inode_i);
+    return rv;
+}
+
+// removes count extents at the given index of the given inode's extents
+static void extent_remove(inum_t inode_i, uint32_t index, uint32_t count) {
+    inode_t* inode = get_inode(inode_i);
+    extent_t* extents = get_extents(inode_i);
+    memmove(&extents[index], &extents[index + count], (inode->extent_count - index - count) * sizeof(extent_t));
+    inode->extent_count -= count;
+    extent_unblock(inode_i, extents);
+}
+
+// maps the given inode block, which is not a hole, to the given data block
+// instead, merging it into the extents next to it when it continues them
+// returns the data block it was mapped to, or a negative errno if the extents
+// have no room for the split and nothing changed
+// note: the caller frees or keeps the old block, block_used stays the same
+int64_t extent_remap(inum_t inode_i, uint32_t logical, bnum_t start) {
+    int rv = snapshot_thaw(inode_i);
+    if (rv < 0) {
+        return rv;
+    }
+    inode_t* inode = get_inode(inode_i);
+    extent_t* extents = get_extents(inode_i);
+    uint32_t i = extent_find(extents, inode->extent_count, logical) - 1;
+    extent_t* extent = &extents[i];
+    extent_t* before = (i > 0) ? &extents[i - 1] : 0;
+    extent_t* after = (i + 1 < inode->extent_count) ? &extents[i + 1] : 0;
+    assert(logical - extent->logical < extent->length);
+    bnum_t old = extent->start + (logical - extent->logical);
+
+    // the block is the head or tail of its extent and may continue the extent
+    // on that side
+    int head = (logical == extent->logical);
+    int tail = (logical == extent->logical + extent->length - 1);
+    int joins_before = (head && before != 0 && before->logical + before->length == logical &&
+            before->start + before->length == start);
+    int joins_after = (tail && after != 0 && after->logical == logical + 1 && after->start == start + 1);
+
+    if (joins_before && joins_after) {
+        before->length += 1 + after->length;
+        extent_remove(inode_i, i, 2);
+    }
+    else if (joins_before) {
+        before->length++;
+        if (tail) {
+            extent_remove(inode_i, i, 1);
+        }
+        else {
+            extent->logical++;
+            extent->start++;
+            extent->length--;
+        }
+    }
+    else if (joins_after) {
+        after->logical--;
+        after->start = start;
+        after->length++;
+        if (head) {
+            extent_remove(inode_i, i, 1);
+        }
+        else {
+            extent->length--;
+        }
+    }
+    else if (head && tail) {
+        extent->start = start;
+    }
+    // the block is split off its extent into one of its own
+    else if (head) {
+        rv = extent_insert(inode_i, i + 1, logical + 1, old + 1, extent->length - 1);
+        if (rv == 0) {
+            extents = get_extents(inode_i);
+            extents[i].start = start;
+            extents[i].length = 1;
+        }
+    }
+    else if (tail) {
+        rv = extent_insert(inode_i, i + 1, logical, start, 1);
+        if (rv == 0) {
+            extents = get_extents(inode_i);
+            extents[i].length--;
+        }
+    }
+    // or it is in the middle and the rest of the extent is split off too
+    else {
+        uint32_t keep = logical - extent->logical;
+        rv = extent_insert(inode_i, i + 1, logical + 1, old + 1, extent->length - keep - 1);
+        if (rv == 0) {
+            rv = extent_insert(inode_i, i + 1, logical, start, 1);
+            if (rv != 0) {
+                extent_remove(inode_i, i + 1, 1);
+            }
+        }
+        if (rv == 0) {
+            extents = get_extents(inode_i);
+            extents[i].length = keep;
+        }
+    }
+    if (rv != 0) {
+        return rv;
+    }
+
+    extent_dirty(inode_i);
+    return old;
+}
+
+// makes count blocks of the given inode from the given inode block its own so
+// they can be written in place, a shared block is copied to a new block first,
+// holes are left as they are
+// returns 0, or a negative errno if a block could not be copied
+int extent_own(inum_t inode_i, uint32_t logical, uint32_t count) {
+    uint32_t end = logical + count;
+
+    while (logical < end) {
+        uint32_t run;
+        bnum_t block = extent_map(inode_i, logical, &run);
+        if (run > end - logical) {
+            run = end - logical;
+        }
+        if (block == EXTENT_HOLE) {
+            logical += run;
+            continue;
+        }
+
+        // the blocks before the first shared one are already the inode's own
+        bnum_t owned = block_claim(block, run);
+        logical += owned;
+        if (owned == run) {
+            continue;
+        }
+        block += owned;
+
+        // copy the shared block next to the block before it
+        bnum_t goal = (logical > 0) ? extent_map(inode_i, logical - 1, 0) : EXTENT_HOLE;
+        if (goal != EXTENT_HOLE) {
+            goal++;
+        }
+        bnum_t copy;
+        int rv = block_alloc(goal, 1, &copy);
+        if (rv < 0) {
+            return rv;
+        }
+        void* dst = get_block(copy);
+        memcpy(dst, get_block(block), BLOCK_SIZE);
+        journal_dirty_data(inode_i, dst, BLOCK_SIZE);
+
+        // and drop the inode's reference to it
+        int64_t old = extent_remap(inode_i, logical, copy);
+        if (old < 0) {
+            block_free(copy, 1);
+            return (int)old;
+        }
+        block_free(block, 1);
+        TRACE(TRACE_DEBUG, TRACE_COW, 0, inode_i, logical, block, copy);
+        logical++;
+    }
+
+    return 0;
+}
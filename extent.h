@@ -0,0 +1,40 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - functions to map an inode's blocks to data blocks through its extents
+ *   - the extents of an inode are sorted by logical block, the blocks from 0
+ *     to block_count that no extent covers are holes and have no data block,
+ *     up to INODE_EXTENT_COUNT extents are kept in the inode and more are kept
+ *     in its extent block
+ *   - punching a range of an inode frees its blocks and leaves a hole, the
+ *     inode's block_count stays the same
+ *   - growing an inode asks for one run of all the new blocks starting right
+ *     after its last block so sequential data stays contiguous on disk
+ */
+
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <stdint.h>
+
+#include "storage.h"
+
+// the data block extent_map returns for a block in a hole, block 0 is always
+// the root directory's so it is never a file's
+#define EXTENT_HOLE 0
+
+extent_t* get_extents(inum_t inode_i);
+bnum_t extent_map(inum_t inode_i, uint32_t logical, uint32_t* run);
+int extent_alloc(inum_t inode_i, uint32_t logical, bnum_t want);
+int extent_share(inum_t inode_i, uint32_t logical, bnum_t start, bnum_t count);
+void extent_hole(inum_t inode_i, bnum_t blocks);
+int extent_grow(inum_t inode_i, bnum_t blocks);
+int extent_shrink(inum_t inode_i, bnum_t blocks);
+int extent_punch(inum_t inode_i, uint32_t logical, uint32_t count);
+int64_t extent_remap(inum_t inode_i, uint32_t logical, bnum_t start);
+int extent_own(inum_t inode_i, uint32_t logical, uint32_t count);
+
+#endif
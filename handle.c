@@ -0,0 +1,189 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - free handles are kept on a stack so opening and releasing are constant
+ *     time
+ *   - every function but handle_get holds the handle lock, an open handle is
+ *     only ever used by the thread fuse gives its fh to
+ *   - a snapshot's inodes are never freed, so their handles and lookups are
+ *     not counted, see snapshot.h
+ */
+
+#include "handle.h"
+#include "journal.h"
+
+#include <errno.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+// the handle table
+static handle_t g_Handles[HANDLE_COUNT];
+
+// the stack of free handle indices and the number of indices on it
+static uint32_t g_Handle_Free[HANDLE_COUNT];
+static uint32_t g_Handle_Free_Count = 0;
+
+// the number of handles that have been used at least once, handles past this
+// have never been pushed on the free stack
+static uint32_t g_Handle_Used = 0;
+
+// the number of open handles for each inode
+static uint32_t* g_Open_Count = 0;
+
+// the number of lookups the kernel holds on each inode
+static uint64_t* g_Lookup_Count = 0;
+
+// the number of inodes counted, the live tree's
+static inum_t g_Handle_Inodes = 0;
+
+// guards the table, the open and lookup counts and every inode's link count
+static pthread_mutex_t g_Handle_Lock = PTHREAD_MUTEX_INITIALIZER;
+
+// allocates the open and lookup counts for an image with the given number of
+// inodes
+void handle_init(inum_t inode_count) {
+    free(g_Open_Count);
+    g_Open_Count = calloc(inode_count, sizeof(uint32_t));
+    assert(g_Open_Count != 0);
+    free(g_Lookup_Count);
+    g_Lookup_Count = calloc(inode_count, sizeof(uint64_t));
+    assert(g_Lookup_Count != 0);
+    g_Handle_Inodes = inode_count;
+}
+
+// returns 1 if nothing refers to the given inode any more and it must be
+// freed, the caller holds the handle lock
+static int handle_unused(inum_t inode_i) {
+    return (g_Open_Count[inode_i] == 0 && g_Lookup_Count[inode_i] == 0 && get_inode(inode_i)->links == 0);
+}
+
+// opens a handle on the given inode, returns the handle index, -ENOENT if the
+// inode was unlinked or -ENFILE if the table is full
+int handle_open(inum_t inode_i, int flags) {
+    uint32_t fh;
+    int rv;
+
+    pthread_mutex_lock(&g_Handle_Lock);
+
+    // the path was unlinked after it was looked up
+    int counted = (inode_i < g_Handle_Inodes);
+    if (counted && get_inode(inode_i)->links == 0) {
+        rv = -ENOENT;
+    }
+    // reuse a released handle or take the next never used handle
+    else if (g_Handle_Free_Count > 0 || g_Handle_Used < HANDLE_COUNT) {
+        fh = (g_Handle_Free_Count > 0) ? g_Handle_Free[--g_Handle_Free_Count] : g_Handle_Used++;
+
+        // fill the handle and count it against the inode
+        g_Handles[fh].in_use = 1;
+        g_Handles[fh].inode = inode_i;
+        g_Handles[fh].flags = flags;
+        g_Open_Count[inode_i] += counted;
+        rv = (int)fh;
+    }
+    else {
+        rv = -ENFILE;
+    }
+
+    pthread_mutex_unlock(&g_Handle_Lock);
+    return rv;
+}
+
+// gets the open handle at the given index
+handle_t* handle_get(uint64_t fh) {
+    assert(fh < HANDLE_COUNT && g_Handles[fh].in_use);
+    return &g_Handles[fh];
+}
+
+// releases the handle at the given index and sets the inode it was open on
+// returns 1 if the inode has no links, other handles or lookups and must be
+// freed
+int handle_release(uint64_t fh, inum_t* inode_i) {
+    handle_t* handle = handle_get(fh);
+
+    pthread_mutex_lock(&g_Handle_Lock);
+
+    // uncount the handle and push it on the free stack
+    *inode_i = handle->inode;
+    handle->in_use = 0;
+    g_Handle_Free[g_Handle_Free_Count++] = (uint32_t)fh;
+    int rv = 0;
+    if (*inode_i < g_Handle_Inodes) {
+        g_Open_Count[*inode_i]--;
+        rv = handle_unused(*inode_i);
+    }
+
+    pthread_mutex_unlock(&g_Handle_Lock);
+    return rv;
+}
+
+// counts a lookup the kernel now holds on the given inode, returns -ENOENT if
+// the inode was unlinked since its name was found
+int handle_lookup(inum_t inode_i) {
+    if (inode_i >= g_Handle_Inodes) {
+        return 0;
+    }
+    pthread_mutex_lock(&g_Handle_Lock);
+    int rv = (get_inode(inode_i)->links == 0) ? -ENOENT : 0;
+    if (rv == 0) {
+        g_Lookup_Count[inode_i]++;
+    }
+    pthread_mutex_unlock(&g_Handle_Lock);
+    return rv;
+}
+
+// drops nlookup of the lookups on the given inode
+// returns 1 if the inode has no links, handles or lookups and must be freed
+int handle_forget(inum_t inode_i, uint64_t nlookup) {
+    if (inode_i >= g_Handle_Inodes) {
+        return 0;
+    }
+    pthread_mutex_lock(&g_Handle_Lock);
+    assert(g_Lookup_Count[inode_i] >= nlookup);
+    g_Lookup_Count[inode_i] -= nlookup;
+    int rv = handle_unused(inode_i);
+    pthread_mutex_unlock(&g_Handle_Lock);
+    return rv;
+}
+
+// returns the number of open handles on the given inode
+int handle_is_open(inum_t inode_i) {
+    if (inode_i >= g_Handle_Inodes) {
+        return 0;
+    }
+    pthread_mutex_lock(&g_Handle_Lock);
+    int rv = g_Open_Count[inode_i];
+    pthread_mutex_unlock(&g_Handle_Lock);
+    return rv;
+}
+
+// adds a link to the given inode, returns -ENOENT if it has no links left
+int handle_link(inum_t inode_i) {
+    pthread_mutex_lock(&g_Handle_Lock);
+    inode_t* inode = get_inode(inode_i);
+    int rv = (inode->links == 0) ? -ENOENT : 0;
+    if (rv == 0) {
+        inode->links++;
+        journal_dirty_inode(inode_i, 0);
+    }
+    pthread_mutex_unlock(&g_Handle_Lock);
+    return rv;
+}
+
+// removes a link from the given inode
+// returns 1 if the inode has no links, handles or lookups and must be freed
+int handle_unlink(inum_t inode_i) {
+    pthread_mutex_lock(&g_Handle_Lock);
+    inode_t* inode = get_inode(inode_i);
+    assert(inode->links > 0);
+    inode->links--;
+    int rv = handle_unused(inode_i);
+    journal_dirty_inode(inode_i, 0);
+    pthread_mutex_unlock(&g_Handle_Lock);
+    return rv;
+}
@@ -0,0 +1,44 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - table of open files, the index of a handle is stored in the fuse file
+ *     info's fh so reads and writes never resolve the path again
+ *   - tracks the number of open handles of each inode and the number of
+ *     lookups the kernel holds on it, so an unlinked inode is only freed once
+ *     it is no longer open and the kernel has forgotten it
+ *   - link counts are changed here under the same lock as the open counts, so
+ *     exactly one caller sees an inode lose its last link and last handle and
+ *     frees it
+ */
+
+#ifndef HANDLE_H
+#define HANDLE_H
+
+#include <stdint.h>
+
+#include "storage.h"
+
+// the maximum number of files open at once
+#define HANDLE_COUNT 1024
+
+// an open file
+typedef struct handle_t {
+    uint8_t in_use;     // if the handle is currently open
+    inum_t inode;       // the inode the handle was opened on
+    int flags;          // the open flags
+} handle_t;
+
+void handle_init(inum_t inode_count);
+int handle_open(inum_t inode_i, int flags);
+handle_t* handle_get(uint64_t fh);
+int handle_release(uint64_t fh, inum_t* inode_i);
+int handle_is_open(inum_t inode_i);
+int handle_lookup(inum_t inode_i);
+int handle_forget(inum_t inode_i, uint64_t nlookup);
+int handle_link(inum_t inode_i);
+int handle_unlink(inum_t inode_i);
+
+#endif
@@ -0,0 +1,938 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - the running transaction is the set of blocks changed since the last
+ *     commit, a commit waits until no operation is inside it, copies its
+ *     metadata blocks and starts the next transaction before any i/o so
+ *     operations only wait for the copy
+ *   - one commit writes at a time, operations that end while it writes join
+ *     the next transaction and are committed together by one of them
+ *   - a block whose metadata was journaled since the journal was last reset is
+ *     journaled again if it is written as file data, a replay of the old copy
+ *     would otherwise overwrite the data
+ *   - a block freed by a transaction that is not on disk yet is journaled if
+ *     it is written as file data, the image still has it as what it held
+ *     before, an extent or directory block its old inode points to
+ *   - the journal restarts at its first block when a transaction does not fit
+ *     in the rest of it, everything already committed is flushed first and the
+ *     superblock records the sequence the journal now starts at
+ *   - a transaction too large for the whole journal is written in place and
+ *     flushed, it is not atomic, the journal restarts at the next sequence
+ *     first
+ *   - every other transaction writes at least its commit block, even one that
+ *     only wrote data, so the sequences in the journal have no gap
+ *   - each inode records the last transaction that changed it, an fsync only
+ *     commits when the inode's own metadata is not on disk yet, otherwise only
+ *     the inode's data blocks are written and flushed
+ *   - writeback of checkpointed blocks is started as soon as they are written
+ *     so a later flush has little but its own blocks to wait for
+ *   - every block a transaction changes is marked dirty in the block device
+ *     until the commit has written it in place, so a cached block is never
+ *     evicted before then, see bdev.h
+ */
+
+#define _GNU_SOURCE
+
+#include "journal.h"
+#include "bdev.h"
+#include "path.h"
+#include "trace.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+// a block in a set and the inode whose data it holds
+typedef struct journal_slot_t {
+    uint32_t block;                 // the image block, 0 if the slot is empty
+    inum_t inode;                   // the inode of a file data block
+} journal_slot_t;
+
+// a set of image block numbers
+typedef struct journal_set_t {
+    journal_slot_t* slots;          // open addressed slots
+    uint32_t capacity;              // the number of slots, a power of two
+    uint32_t count;                 // the number of blocks in the set
+} journal_set_t;
+
+// the blocks changed by a group of operations, committed together
+typedef struct journal_txn_t {
+    uint64_t seq;                   // the transaction's sequence
+    uint32_t updates;               // operations inside the transaction
+    journal_set_t meta;             // metadata blocks, journaled
+    journal_set_t data;             // file data blocks, written before commit
+    journal_set_t freed;            // blocks freed, never written in place
+                                    // as data before the commit
+} journal_txn_t;
+
+// the last transactions an inode was changed in
+typedef struct journal_inode_t {
+    uint64_t changed;               // any of its fields
+    uint64_t data_changed;          // the fields needed to read its data back
+    uint64_t written;               // its data blocks
+} journal_inode_t;
+
+// the superblock of the open image, resident in the block device
+static superblock_t* g_Journal_Super = 0;
+
+// guards every variable below and the running transaction
+static pthread_mutex_t g_Journal_Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_Journal_Cond = PTHREAD_COND_INITIALIZER;
+
+// the transaction operations join and the one being written, if any
+static journal_txn_t* g_Journal_Running = 0;
+static journal_txn_t* g_Journal_Writing = 0;
+
+// set while a commit copies the running transaction, no operation may begin
+static int g_Journal_Locked = 0;
+
+// set while an operation runs alone, no other operation may begin, see
+// journal_begin_exclusive
+static int g_Journal_Exclusive = 0;
+
+// set while a commit is in progress and the result of the last commit
+static int g_Journal_Committing = 0;
+static int g_Journal_Error = 0;
+
+// the sequence of the last transaction on disk
+static uint64_t g_Journal_Committed = 0;
+
+// the next free journal block
+static uint32_t g_Journal_Head = 0;
+
+// the metadata blocks a transaction may reach before it is committed
+static uint32_t g_Journal_Limit = 0;
+
+// the image blocks journaled since the journal was last reset
+static journal_set_t g_Journal_Logged;
+
+// the transactions each inode was last changed in
+static journal_inode_t* g_Journal_Inodes = 0;
+
+// a bit for each block before the journal, set when its metadata changes and
+// cleared by journal_untouch, see snapshot_create
+static uint64_t* g_Journal_Touched = 0;
+
+// if operations wait for their commit, otherwise the commit thread runs
+static int g_Journal_Sync = 0;
+static int g_Journal_Stop = 0;
+static pthread_t g_Journal_Thread;
+
+// the calling thread's nesting depth, its transaction and if it changed any
+// block in it
+static __thread int t_Journal_Depth = 0;
+static __thread journal_txn_t* t_Journal_Txn = 0;
+static __thread int t_Journal_Dirtied = 0;
+
+// set in the thread of the operation running alone
+static __thread int t_Journal_Exclusive = 0;
+
+
+
+// -------------------------- BLOCK SETS --------------------------------
+
+// returns the slot of the given block, its own slot or the empty slot it
+// would be added to
+static uint32_t journal_set_slot(journal_set_t* set, uint32_t block) {
+    uint32_t mask = set->capacity - 1;
+    uint32_t slot = (block * 0x9E3779B1) & mask;
+    while (set->slots[slot].block != 0 && set->slots[slot].block != block) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// returns 1 if the block is in the set
+static int journal_set_has(journal_set_t* set, uint32_t block) {
+    return set->count > 0 && set->slots[journal_set_slot(set, block)].block == block;
+}
+
+// adds the block to the set as a block of the given inode, the set doubles
+// once it is half full
+static void journal_set_add(journal_set_t* set, uint32_t block, inum_t inode_i) {
+    // block 0 is the superblock, it is never journaled
+    assert(block != 0);
+
+    if ((set->count + 1) * 2 > set->capacity) {
+        journal_set_t grown = { 0, (set->capacity == 0) ? 64 : set->capacity * 2, 0 };
+        grown.slots = calloc(grown.capacity, sizeof(journal_slot_t));
+        assert(grown.slots != 0);
+        for (uint32_t i = 0; i < set->capacity; i++) {
+            if (set->slots[i].block != 0) {
+                grown.slots[journal_set_slot(&grown, set->slots[i].block)] = set->slots[i];
+                grown.count++;
+            }
+        }
+        free(set->slots);
+        *set = grown;
+    }
+
+    // a block freed and used by another inode belongs to the last one
+    uint32_t slot = journal_set_slot(set, block);
+    if (set->slots[slot].block == 0) {
+        set->slots[slot].block = block;
+        set->count++;
+    }
+    set->slots[slot].inode = inode_i;
+}
+
+// empties the set
+static void journal_set_clear(journal_set_t* set) {
+    free(set->slots);
+    memset(set, 0, sizeof(journal_set_t));
+}
+
+// orders block numbers for qsort
+static int journal_block_compare(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+// returns the blocks of the set in order, skipping blocks in the given set
+// if it is not null, count is set to the number returned
+static uint32_t* journal_set_sorted(journal_set_t* set, journal_set_t* skip, uint32_t* count) {
+    uint32_t* blocks = malloc((set->count + 1) * sizeof(uint32_t));
+    assert(blocks != 0);
+
+    *count = 0;
+    for (uint32_t i = 0; i < set->capacity; i++) {
+        uint32_t block = set->slots[i].block;
+        if (block != 0 && (skip == 0 || !journal_set_has(skip, block))) {
+            blocks[(*count)++] = block;
+        }
+    }
+    qsort(blocks, *count, sizeof(uint32_t), journal_block_compare);
+    return blocks;
+}
+
+
+
+// -------------------------- DISK I/O ----------------------------------
+
+// writes the given sorted blocks in place from the copies, or from the block
+// device if copies is null, each run of adjacent blocks is one write and the
+// writes are submitted together
+// note: with writeback set the kernel starts writing each run to the disk
+//       right away, nothing waits for it
+static int journal_write_home(uint32_t* blocks, const char* copies, uint32_t count, int writeback) {
+    bdev_io_t* ios = calloc(count + 1, sizeof(bdev_io_t));
+    uint32_t runs = 0;
+    assert(ios != 0);
+
+    for (uint32_t i = 0, j; i < count; i = j) {
+        j = i + 1;
+        while (j < count && blocks[j] == blocks[i] + (j - i)) {
+            j++;
+        }
+
+        // a run of cached blocks is only adjacent in the copies
+        if (copies != 0) {
+            ios[runs].buf = copies + (uint64_t)i * BLOCK_SIZE;
+        }
+        else {
+            uint32_t run = j - i;
+            ios[runs].buf = bdev_get(blocks[i], &run);
+            j = i + run;
+        }
+        ios[runs].len = (uint64_t)(j - i) * BLOCK_SIZE;
+        ios[runs++].offset = (uint64_t)blocks[i] * BLOCK_SIZE;
+    }
+
+    int rv = bdev_write_batch(ios, runs);
+    for (uint32_t k = 0; k < runs; k++) {
+        if (rv == 0 && writeback) {
+            bdev_writeback(ios[k].offset, ios[k].len);
+        }
+        if (copies == 0) {
+            bdev_put((void*)ios[k].buf);
+        }
+    }
+
+    free(ios);
+    return rv;
+}
+
+// marks the given blocks as written in place by the transaction of the given
+// sequence
+static void journal_clean(uint64_t seq, uint32_t* blocks, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        bdev_clean(blocks[i], seq);
+    }
+}
+
+// returns the checksum of a transaction's block numbers and copies
+static uint32_t journal_checksum(uint32_t checksum, uint32_t block, const char* copy) {
+    checksum = hash_item(checksum, (const char*)&block, sizeof(uint32_t));
+    return hash_item(checksum, copy, BLOCK_SIZE);
+}
+
+// starts the journal over at its first block with the given sequence, every
+// transaction before it is flushed in place so none is replayed again
+// note: super is the whole first block, from bdev_alloc or the block device
+static int journal_reset(superblock_t* super, uint64_t seq) {
+    int rv = bdev_flush();
+    if (rv != 0) {
+        return rv;
+    }
+
+    super->journal_seq = seq;
+    g_Journal_Head = 0;
+    return bdev_write(super, BLOCK_SIZE, 0);
+}
+
+// writes a transaction, the data blocks in place, then the metadata copies to
+// the journal with one flush, then the copies in place
+// note: a transaction with no metadata still writes its commit block, replay
+//       stops at the first missing sequence and would skip every later one
+// note: called by the committing thread without the journal lock
+static int journal_write(uint64_t seq, uint32_t* blocks, char* copies, uint32_t count, uint32_t* data, uint32_t data_count) {
+    uint32_t descriptors = (count + JOURNAL_DESCRIPTOR_COUNT - 1) / JOURNAL_DESCRIPTOR_COUNT;
+    uint32_t needed = count + descriptors + 1;
+
+    // the data the metadata refers to is written first
+    int rv = journal_write_home(data, 0, data_count, 0);
+    if (rv == 0) {
+        journal_clean(seq, data, data_count);
+    }
+    if (rv != 0) {
+        return rv;
+    }
+
+    // too large for the journal, start the journal over after it so no older
+    // transaction is replayed over it and the next one follows it, then write
+    // it in place
+    if (needed > g_Journal_Super->journal_blocks) {
+        if ((rv = journal_reset(g_Journal_Super, seq + 1)) != 0) {
+            return rv;
+        }
+        pthread_mutex_lock(&g_Journal_Lock);
+        journal_set_clear(&g_Journal_Logged);
+        pthread_mutex_unlock(&g_Journal_Lock);
+        rv = journal_write_home(blocks, copies, count, 0);
+        if (rv == 0) {
+            journal_clean(seq, blocks, count);
+        }
+        return (rv == 0) ? bdev_flush() : rv;
+    }
+
+    // start over if the transaction does not fit in the rest of the journal,
+    // no block journaled before can be replayed after that
+    if (g_Journal_Head + needed > g_Journal_Super->journal_blocks) {
+        if ((rv = journal_reset(g_Journal_Super, seq)) != 0) {
+            return rv;
+        }
+        pthread_mutex_lock(&g_Journal_Lock);
+        journal_set_clear(&g_Journal_Logged);
+        pthread_mutex_unlock(&g_Journal_Lock);
+    }
+
+    // lay out the descriptors, each followed by the copies it lists
+    char* log = bdev_alloc((uint64_t)needed * BLOCK_SIZE);
+    assert(log != 0);
+    memset(log, 0, (uint64_t)needed * BLOCK_SIZE);
+    uint32_t checksum = HASH_ITEM_SEED;
+    uint32_t at = 0;
+    for (uint32_t i = 0; i < count; i += JOURNAL_DESCRIPTOR_COUNT) {
+        journal_block_t* descriptor = (journal_block_t*)(log + (uint64_t)at++ * BLOCK_SIZE);
+        descriptor->magic = JOURNAL_MAGIC;
+        descriptor->type = JOURNAL_DESCRIPTOR;
+        descriptor->seq = seq;
+        descriptor->count = (count - i < JOURNAL_DESCRIPTOR_COUNT) ? count - i : JOURNAL_DESCRIPTOR_COUNT;
+        for (uint32_t j = 0; j < descriptor->count; j++) {
+            descriptor->blocks[j] = blocks[i + j];
+            memcpy(log + (uint64_t)at++ * BLOCK_SIZE, copies + (uint64_t)(i + j) * BLOCK_SIZE, BLOCK_SIZE);
+            checksum = journal_checksum(checksum, blocks[i + j], copies + (uint64_t)(i + j) * BLOCK_SIZE);
+        }
+    }
+
+    // the commit block makes the transaction valid
+    journal_block_t* commit = (journal_block_t*)(log + (uint64_t)at * BLOCK_SIZE);
+    commit->magic = JOURNAL_MAGIC;
+    commit->type = JOURNAL_COMMIT;
+    commit->seq = seq;
+    commit->count = count;
+    commit->checksum = checksum;
+
+    // one write and one flush commit the transaction, then it is checkpointed
+    // in place, the next flush or reset makes that durable
+    rv = bdev_write(log, (uint64_t)needed * BLOCK_SIZE,
+            ((uint64_t)g_Journal_Super->journal_start + g_Journal_Head) * BLOCK_SIZE);
+    if (rv == 0) {
+        rv = bdev_flush();
+    }
+    if (rv == 0) {
+        g_Journal_Head += needed;
+        pthread_mutex_lock(&g_Journal_Lock);
+        for (uint32_t i = 0; i < count; i++) {
+            journal_set_add(&g_Journal_Logged, blocks[i], 0);
+        }
+        pthread_mutex_unlock(&g_Journal_Lock);
+        rv = journal_write_home(blocks, copies, count, 1);
+    }
+    if (rv == 0) {
+        journal_clean(seq, blocks, count);
+    }
+
+    free(log);
+    return rv;
+}
+
+
+
+// -------------------------- TRANSACTIONS ------------------------------
+
+// makes a new empty transaction with the given sequence
+static journal_txn_t* journal_txn_new(uint64_t seq) {
+    journal_txn_t* txn = calloc(1, sizeof(journal_txn_t));
+    assert(txn != 0);
+    txn->seq = seq;
+    return txn;
+}
+
+// commits the running transaction, the caller holds the journal lock and no
+// other commit is in progress, the lock is released during the i/o
+static void journal_commit_running() {
+    journal_txn_t* txn = g_Journal_Running;
+    uint32_t count;
+    uint32_t data_count;
+
+    // stop new operations and wait for the ones inside the transaction
+    g_Journal_Committing = 1;
+    g_Journal_Locked = 1;
+    while (txn->updates > 0) {
+        pthread_cond_wait(&g_Journal_Cond, &g_Journal_Lock);
+    }
+
+    // data written over a journaled block is journaled as well
+    for (uint32_t i = 0; i < txn->data.capacity && g_Journal_Logged.count > 0; i++) {
+        uint32_t block = txn->data.slots[i].block;
+        if (block != 0 && journal_set_has(&g_Journal_Logged, block)) {
+            journal_set_add(&txn->meta, block, 0);
+        }
+    }
+
+    // copy the metadata as it is between operations
+    uint32_t* blocks = journal_set_sorted(&txn->meta, 0, &count);
+    uint32_t* data = journal_set_sorted(&txn->data, &txn->meta, &data_count);
+    char* copies = bdev_alloc((uint64_t)count * BLOCK_SIZE);
+    assert(copies != 0);
+    for (uint32_t i = 0; i < count; i++) {
+        char* block = bdev_get(blocks[i], 0);
+        memcpy(copies + (uint64_t)i * BLOCK_SIZE, block, BLOCK_SIZE);
+        bdev_put(block);
+    }
+
+    // later operations join the next transaction while this one is written
+    g_Journal_Running = journal_txn_new(txn->seq + 1);
+    g_Journal_Writing = txn;
+    g_Journal_Locked = 0;
+    pthread_cond_broadcast(&g_Journal_Cond);
+    pthread_mutex_unlock(&g_Journal_Lock);
+
+    int rv = journal_write(txn->seq, blocks, copies, count, data, data_count);
+    TRACE(TRACE_DEBUG, TRACE_COMMIT, rv, txn->seq, count, data_count, 0);
+
+    // the transaction is on disk, wake the operations waiting for it
+    pthread_mutex_lock(&g_Journal_Lock);
+    g_Journal_Committed = txn->seq;
+    g_Journal_Committing = 0;
+    g_Journal_Writing = 0;
+    g_Journal_Error = rv;
+    pthread_cond_broadcast(&g_Journal_Cond);
+
+    free(copies);
+    free(data);
+    free(blocks);
+    journal_set_clear(&txn->meta);
+    journal_set_clear(&txn->data);
+    journal_set_clear(&txn->freed);
+    free(txn);
+}
+
+// waits until the transaction of the given sequence is on disk, committing it
+// if no other thread is, the caller holds the journal lock
+static void journal_wait(uint64_t seq) {
+    while (g_Journal_Committed < seq) {
+        if (!g_Journal_Committing && g_Journal_Running->seq == seq) {
+            journal_commit_running();
+        }
+        else {
+            pthread_cond_wait(&g_Journal_Cond, &g_Journal_Lock);
+        }
+    }
+}
+
+// commits the running transaction every JOURNAL_COMMIT_INTERVAL seconds
+static void* journal_thread(void* arg) {
+    pthread_mutex_lock(&g_Journal_Lock);
+    while (!g_Journal_Stop) {
+        struct timespec at;
+        clock_gettime(CLOCK_REALTIME, &at);
+        at.tv_sec += JOURNAL_COMMIT_INTERVAL;
+
+        // sleep for the interval unless stopped
+        int rv = 0;
+        while (!g_Journal_Stop && rv != ETIMEDOUT) {
+            rv = pthread_cond_timedwait(&g_Journal_Cond, &g_Journal_Lock, &at);
+        }
+
+        // commit whatever changed since the last commit
+        journal_txn_t* txn = g_Journal_Running;
+        if (!g_Journal_Stop && !g_Journal_Committing && (txn->meta.count > 0 || txn->data.count > 0)) {
+            journal_commit_running();
+        }
+    }
+    pthread_mutex_unlock(&g_Journal_Lock);
+    return 0;
+}
+
+// marks the blocks covering len bytes at addr as changed in the calling
+// thread's transaction, as data of the given inode if data is set
+static void journal_mark(void* addr, size_t len, int data, inum_t inode_i) {
+    // nothing is journaled while the image is not mounted
+    if (g_Journal_Super == 0 || len == 0) {
+        return;
+    }
+    assert(t_Journal_Depth > 0 && t_Journal_Txn != 0);
+
+    // the range is within one cached block or adjacent in memory
+    uint64_t first = bdev_block_of(addr);
+    uint64_t last = bdev_block_of((char*)addr + len - 1);
+    t_Journal_Dirtied = 1;
+
+    pthread_mutex_lock(&g_Journal_Lock);
+    for (uint64_t block = first; block <= last; block++) {
+        // a freed block is journaled until its free is on disk, its inode
+        // must then commit to sync it
+        int freed = data && (journal_set_has(&t_Journal_Txn->freed, (uint32_t)block) ||
+                (g_Journal_Writing != 0 && journal_set_has(&g_Journal_Writing->freed, (uint32_t)block)));
+        if (freed) {
+            g_Journal_Inodes[inode_i].changed = t_Journal_Txn->seq;
+            g_Journal_Inodes[inode_i].data_changed = t_Journal_Txn->seq;
+        }
+        journal_set_add((data && !freed) ? &t_Journal_Txn->data : &t_Journal_Txn->meta, (uint32_t)block, inode_i);
+        bdev_dirty(block, t_Journal_Txn->seq);
+        if (block < g_Journal_Super->journal_start) {
+            g_Journal_Touched[block / 64] |= 1ULL << (block % 64);
+        }
+    }
+    if (data) {
+        g_Journal_Inodes[inode_i].written = t_Journal_Txn->seq;
+    }
+    pthread_mutex_unlock(&g_Journal_Lock);
+}
+
+
+
+// -------------------------- JOURNAL FUNCTIONS -------------------------
+
+// applies every committed transaction in the journal of the open image, then
+// starts the journal over, called before the image is mapped
+// note: super is the image's first block, from bdev_alloc
+// returns the number of transactions applied or a negative errno
+int journal_replay(superblock_t* super) {
+    journal_block_t* header = bdev_alloc(BLOCK_SIZE);
+    char* copy = bdev_alloc(BLOCK_SIZE);
+    uint32_t* blocks = malloc(super->journal_blocks * sizeof(uint32_t));
+    uint32_t* where = malloc(super->journal_blocks * sizeof(uint32_t));
+    uint64_t journal = (uint64_t)super->journal_start * BLOCK_SIZE;
+    uint64_t seq = super->journal_seq;
+    uint32_t pos = 0;
+    int replayed = 0;
+    int rv = 0;
+    assert(header != 0 && copy != 0 && blocks != 0 && where != 0);
+
+    // each transaction follows the last one until one is missing or torn
+    while (rv == 0) {
+        uint32_t count = 0;
+        int valid = 0;
+
+        // gather the blocks of every descriptor up to the commit block
+        while (pos < super->journal_blocks &&
+                bdev_read(header, BLOCK_SIZE, journal + (uint64_t)pos * BLOCK_SIZE) == 0 &&
+                header->magic == JOURNAL_MAGIC && header->seq == seq) {
+            pos++;
+            if (header->type == JOURNAL_COMMIT) {
+                valid = (header->count == count);
+                break;
+            }
+            if (header->type != JOURNAL_DESCRIPTOR || header->count > JOURNAL_DESCRIPTOR_COUNT ||
+                    header->count > super->journal_blocks - pos) {
+                break;
+            }
+            for (uint32_t i = 0; i < header->count; i++) {
+                blocks[count] = header->blocks[i];
+                where[count++] = pos++;
+            }
+        }
+        if (!valid) {
+            break;
+        }
+
+        // the copies must match the checksum and be inside the image
+        uint32_t checksum = HASH_ITEM_SEED;
+        for (uint32_t i = 0; i < count && valid; i++) {
+            valid = (blocks[i] != 0 && blocks[i] < super->image_blocks &&
+                    bdev_read(copy, BLOCK_SIZE, journal + (uint64_t)where[i] * BLOCK_SIZE) == 0);
+            checksum = journal_checksum(checksum, blocks[i], copy);
+        }
+        if (!valid || checksum != header->checksum) {
+            break;
+        }
+
+        // write every copy in place
+        for (uint32_t i = 0; i < count && rv == 0; i++) {
+            rv = bdev_read(copy, BLOCK_SIZE, journal + (uint64_t)where[i] * BLOCK_SIZE);
+            if (rv == 0) {
+                rv = bdev_write(copy, BLOCK_SIZE, (uint64_t)blocks[i] * BLOCK_SIZE);
+            }
+        }
+        seq++;
+        replayed++;
+    }
+
+    // the next transaction starts the journal over
+    if (rv == 0) {
+        rv = journal_reset(super, seq);
+    }
+    if (rv == 0) {
+        rv = bdev_flush();
+    }
+
+    free(where);
+    free(blocks);
+    free(copy);
+    free(header);
+    return (rv == 0) ? replayed : rv;
+}
+
+// starts journaling the image mapped by the block device, super is the
+// superblock in the block device
+int journal_open(superblock_t* super) {
+    if (super->journal_blocks < JOURNAL_MIN_BLOCKS) {
+        return -EINVAL;
+    }
+
+    g_Journal_Super = super;
+    g_Journal_Head = 0;
+    g_Journal_Committed = super->journal_seq - 1;
+    g_Journal_Error = 0;
+    g_Journal_Limit = super->journal_blocks / 4;
+    g_Journal_Running = journal_txn_new(super->journal_seq);
+    g_Journal_Inodes = calloc(super->inode_count, sizeof(journal_inode_t));
+    if (g_Journal_Inodes == 0) {
+        return -ENOMEM;
+    }
+
+    // what changed before the mount is not known, so every block has
+    g_Journal_Touched = malloc(BITMAP_BYTES((uint64_t)super->journal_start));
+    if (g_Journal_Touched == 0) {
+        return -ENOMEM;
+    }
+    memset(g_Journal_Touched, 0xFF, BITMAP_BYTES((uint64_t)super->journal_start));
+
+    // operations wait for their commit or the commit thread commits them
+    g_Journal_Sync = (getenv("NUFS_SYNC") != 0);
+    g_Journal_Stop = 0;
+    if (!g_Journal_Sync && pthread_create(&g_Journal_Thread, 0, journal_thread, 0) != 0) {
+        g_Journal_Sync = 1;
+    }
+
+    return 0;
+}
+
+// commits everything and starts the journal over, the image can then be
+// unmapped
+void journal_close() {
+    if (g_Journal_Running == 0) {
+        return;
+    }
+
+    // stop the commit thread
+    pthread_mutex_lock(&g_Journal_Lock);
+    g_Journal_Stop = 1;
+    pthread_cond_broadcast(&g_Journal_Cond);
+    pthread_mutex_unlock(&g_Journal_Lock);
+    if (!g_Journal_Sync) {
+        pthread_join(g_Journal_Thread, 0);
+    }
+
+    // commit the last transaction, everything is in place after the reset
+    pthread_mutex_lock(&g_Journal_Lock);
+    journal_wait(g_Journal_Running->seq);
+    journal_txn_t* txn = g_Journal_Running;
+    if (journal_reset(g_Journal_Super, txn->seq) == 0) {
+        bdev_flush();
+    }
+    g_Journal_Running = 0;
+    g_Journal_Super = 0;
+    journal_set_clear(&g_Journal_Logged);
+    free(g_Journal_Inodes);
+    g_Journal_Inodes = 0;
+    free(g_Journal_Touched);
+    g_Journal_Touched = 0;
+    pthread_mutex_unlock(&g_Journal_Lock);
+
+    free(txn);
+}
+
+// begins an operation in the running transaction, operations may be nested
+// note: the caller must not hold any inode lock
+void journal_begin() {
+    if (t_Journal_Depth++ > 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_Journal_Lock);
+    if (g_Journal_Running != 0) {
+        for (;;) {
+            // wait for a commit to finish copying or an operation running
+            // alone to end
+            if (g_Journal_Locked || (g_Journal_Exclusive && !t_Journal_Exclusive)) {
+                pthread_cond_wait(&g_Journal_Cond, &g_Journal_Lock);
+            }
+            // a large transaction is committed before it grows any more, or
+            // before its dirty blocks fill the block device's cache
+            else if (!g_Journal_Committing && (g_Journal_Running->meta.count > g_Journal_Limit ||
+                    g_Journal_Running->meta.count + g_Journal_Running->data.count > bdev_dirty_limit())) {
+                journal_commit_running();
+            }
+            else {
+                break;
+            }
+        }
+
+        t_Journal_Txn = g_Journal_Running;
+        t_Journal_Txn->updates++;
+        t_Journal_Dirtied = 0;
+    }
+    pthread_mutex_unlock(&g_Journal_Lock);
+}
+
+// ends an operation, with NUFS_SYNC set it returns once the operation is on
+// disk
+void journal_end() {
+    assert(t_Journal_Depth > 0);
+    if (--t_Journal_Depth > 0) {
+        return;
+    }
+
+    // the operation is done with every block it used
+    bdev_unpin_all();
+
+    pthread_mutex_lock(&g_Journal_Lock);
+    journal_txn_t* txn = t_Journal_Txn;
+    if (txn != 0) {
+        uint64_t seq = txn->seq;
+        if (--txn->updates == 0 || (g_Journal_Exclusive && !t_Journal_Exclusive)) {
+            pthread_cond_broadcast(&g_Journal_Cond);
+        }
+
+        // an operation that changed nothing has nothing to wait for
+        if (g_Journal_Sync && t_Journal_Dirtied) {
+            journal_wait(seq);
+        }
+        t_Journal_Txn = 0;
+    }
+
+    // the operations waiting for one that ran alone may begin
+    if (t_Journal_Exclusive) {
+        t_Journal_Exclusive = 0;
+        g_Journal_Exclusive = 0;
+        pthread_cond_broadcast(&g_Journal_Cond);
+    }
+    pthread_mutex_unlock(&g_Journal_Lock);
+}
+
+// begins an operation that runs alone in the running transaction, it waits
+// until every other operation in it has ended and none begins until it ends
+// with journal_end
+// note: the caller must not be inside an operation or hold any inode lock
+void journal_begin_exclusive() {
+    assert(t_Journal_Depth == 0);
+
+    // one operation runs alone at a time
+    pthread_mutex_lock(&g_Journal_Lock);
+    while (g_Journal_Exclusive) {
+        pthread_cond_wait(&g_Journal_Cond, &g_Journal_Lock);
+    }
+    g_Journal_Exclusive = 1;
+    t_Journal_Exclusive = 1;
+    pthread_mutex_unlock(&g_Journal_Lock);
+
+    // no operation begins now, wait for the ones already inside to end, each
+    // wakes it as it ends, see journal_end
+    journal_begin();
+    pthread_mutex_lock(&g_Journal_Lock);
+    while (t_Journal_Txn != 0 && t_Journal_Txn->updates > 1) {
+        pthread_cond_wait(&g_Journal_Cond, &g_Journal_Lock);
+    }
+    pthread_mutex_unlock(&g_Journal_Lock);
+}
+
+// marks the metadata covering len bytes at addr as changed
+void journal_dirty(void* addr, size_t len) {
+    journal_mark(addr, len, 0, 0);
+}
+
+// marks the given inode as changed, with datasync set the change is needed to
+// read its data back (its size, blocks or items) and fdatasync commits it
+void journal_dirty_inode(inum_t inode_i, int datasync) {
+    // a snapshot's inodes never change, see snapshot.h
+    assert(g_Journal_Super == 0 || inode_i < g_Journal_Super->inode_count);
+    journal_mark(get_inode(inode_i), sizeof(inode_t), 0, 0);
+    if (g_Journal_Super == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_Journal_Lock);
+    g_Journal_Inodes[inode_i].changed = t_Journal_Txn->seq;
+    if (datasync) {
+        g_Journal_Inodes[inode_i].data_changed = t_Journal_Txn->seq;
+    }
+    pthread_mutex_unlock(&g_Journal_Lock);
+}
+
+// marks the file data of the given inode covering len bytes at addr as changed
+void journal_dirty_data(inum_t inode_i, void* addr, size_t len) {
+    journal_mark(addr, len, 1, inode_i);
+}
+
+// marks count image blocks from first as freed in the calling thread's
+// transaction, they are not written in place as file data until it commits
+void journal_free(uint64_t first, uint64_t count) {
+    if (g_Journal_Super == 0) {
+        return;
+    }
+    assert(t_Journal_Depth > 0 && t_Journal_Txn != 0);
+
+    pthread_mutex_lock(&g_Journal_Lock);
+    for (uint64_t block = first; block < first + count; block++) {
+        journal_set_add(&t_Journal_Txn->freed, (uint32_t)block, 0);
+    }
+    pthread_mutex_unlock(&g_Journal_Lock);
+}
+
+// returns 1 if the metadata of the given block before the journal changed
+// since it was last untouched or the image was mounted
+int journal_touched(uint64_t block) {
+    if (g_Journal_Super == 0) {
+        return 1;
+    }
+    pthread_mutex_lock(&g_Journal_Lock);
+    int rv = (g_Journal_Touched[block / 64] >> (block % 64)) & 1;
+    pthread_mutex_unlock(&g_Journal_Lock);
+    return rv;
+}
+
+// records that count blocks before the journal from first changed, whether
+// or not a transaction did
+void journal_touch(uint64_t first, uint64_t count) {
+    if (g_Journal_Super == 0) {
+        return;
+    }
+    pthread_mutex_lock(&g_Journal_Lock);
+    for (uint64_t block = first; block < first + count; block++) {
+        g_Journal_Touched[block / 64] |= 1ULL << (block % 64);
+    }
+    pthread_mutex_unlock(&g_Journal_Lock);
+}
+
+// forgets that count blocks before the journal from first changed
+void journal_untouch(uint64_t first, uint64_t count) {
+    if (g_Journal_Super == 0) {
+        return;
+    }
+    pthread_mutex_lock(&g_Journal_Lock);
+    for (uint64_t block = first; block < first + count; block++) {
+        g_Journal_Touched[block / 64] &= ~(1ULL << (block % 64));
+    }
+    pthread_mutex_unlock(&g_Journal_Lock);
+}
+
+// writes the data blocks the given inode changed since the last commit in
+// place and flushes them, the caller holds the inode's lock so they stay its
+// returns 1 if the inode's metadata is not on disk yet and the running
+// transaction must be committed instead, see storage_fsync
+int journal_write_inode(inum_t inode_i, int datasync) {
+    uint32_t* blocks = 0;
+    uint32_t count = 0;
+    int rv = 0;
+
+    if (g_Journal_Super == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&g_Journal_Lock);
+    journal_inode_t* seqs = &g_Journal_Inodes[inode_i];
+    journal_txn_t* txn = g_Journal_Running;
+
+    // the metadata is not committed or the data is in a commit being written
+    uint64_t changed = datasync ? seqs->data_changed : seqs->changed;
+    if (changed > g_Journal_Committed || (seqs->written > g_Journal_Committed && seqs->written < txn->seq)) {
+        rv = 1;
+    }
+    // gather the inode's blocks, a block journaled since the last reset must
+    // be journaled again so it needs the commit too
+    else if (seqs->written == txn->seq) {
+        blocks = malloc((txn->data.count + 1) * sizeof(uint32_t));
+        assert(blocks != 0);
+        for (uint32_t i = 0; i < txn->data.capacity && rv == 0; i++) {
+            if (txn->data.slots[i].block != 0 && txn->data.slots[i].inode == inode_i) {
+                blocks[count++] = txn->data.slots[i].block;
+                rv = journal_set_has(&g_Journal_Logged, txn->data.slots[i].block) ||
+                    journal_set_has(&txn->meta, txn->data.slots[i].block);
+            }
+        }
+    }
+    pthread_mutex_unlock(&g_Journal_Lock);
+
+    // only the inode's own blocks are written and flushed, the commit writes
+    // them again with the rest of the transaction
+    if (rv == 0 && count > 0) {
+        qsort(blocks, count, sizeof(uint32_t), journal_block_compare);
+        rv = journal_write_home(blocks, 0, count, 0);
+        if (rv == 0) {
+            rv = bdev_flush();
+        }
+    }
+
+    free(blocks);
+    return rv;
+}
+
+// returns 1 if every data block of the given inode is written in place, so the
+// image file holds its data, the caller holds the inode's lock
+int journal_data_written(inum_t inode_i) {
+    if (g_Journal_Super == 0) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&g_Journal_Lock);
+    int rv = (g_Journal_Inodes[inode_i].written <= g_Journal_Committed);
+    pthread_mutex_unlock(&g_Journal_Lock);
+    return rv;
+}
+
+// commits the running transaction and waits until it is on disk, returns the
+// error of the last commit
+// note: the caller must not be inside an operation
+int journal_commit() {
+    if (g_Journal_Running == 0) {
+        return 0;
+    }
+    assert(t_Journal_Depth == 0);
+
+    pthread_mutex_lock(&g_Journal_Lock);
+    journal_wait(g_Journal_Running->seq);
+    int rv = g_Journal_Error;
+    pthread_mutex_unlock(&g_Journal_Lock);
+    return rv;
+}
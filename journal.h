@@ -0,0 +1,86 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - changes to the image's blocks only reach the image file when the journal
+ *     writes them, so metadata is always in the journal before it is written
+ *     in place, see bdev.h
+ *   - every change to the image is made inside a transaction, journal_begin and
+ *     journal_end bracket a whole operation and may be nested
+ *   - journal_begin must be called before any inode lock is taken, it waits
+ *     while a commit is taking its copy of the metadata or an operation from
+ *     journal_begin_exclusive runs alone
+ *   - a changed metadata block (bitmap, inode table, extent block, directory
+ *     block) is marked with journal_dirty, a changed file data block with
+ *     journal_dirty_data
+ *   - every operation since the last commit joins the running transaction, a
+ *     commit writes the data blocks in place, the metadata blocks to the
+ *     journal with one flush, then the metadata blocks in place
+ *   - a freed block is marked with journal_free, file data written to it is
+ *     journaled like metadata until the free is committed
+ *   - fsync of an inode commits only if the inode's metadata changed since the
+ *     last commit, otherwise it writes and flushes only the inode's data blocks
+ *   - with NUFS_SYNC set in the environment every operation waits for its
+ *     transaction to commit, operations that wait together share one commit,
+ *     otherwise a commit is made every JOURNAL_COMMIT_INTERVAL seconds
+ *   - the journal remembers which blocks before it changed since they were
+ *     last untouched, so a snapshot only copies those, see snapshot.h
+ *   - the journal region is a ring of blocks, each transaction is descriptor
+ *     blocks each followed by the copies of the blocks they list, then a commit
+ *     block with the checksum of the whole transaction
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "storage.h"
+
+// the fewest journal blocks an image may have
+#define JOURNAL_MIN_BLOCKS 16
+
+// the journal block magic number and block types
+#define JOURNAL_MAGIC 0x4E554A4C
+#define JOURNAL_DESCRIPTOR 1
+#define JOURNAL_COMMIT 2
+
+// the seconds between commits when operations do not wait for theirs
+#define JOURNAL_COMMIT_INTERVAL 5
+
+// the number of block numbers in a descriptor block
+#define JOURNAL_DESCRIPTOR_COUNT ((BLOCK_SIZE - 24) / sizeof(uint32_t))
+
+// a descriptor or commit block
+// note: a descriptor lists the image blocks of the copies that follow it, a
+//       commit's count is the number of copies in the transaction
+typedef struct journal_block_t {
+    uint32_t magic;                             // JOURNAL_MAGIC
+    uint32_t type;                              // JOURNAL_DESCRIPTOR or COMMIT
+    uint64_t seq;                               // the transaction's sequence
+    uint32_t count;                             // the number of blocks
+    uint32_t checksum;                          // the commit's checksum
+    uint32_t blocks[JOURNAL_DESCRIPTOR_COUNT];  // the descriptor's image blocks
+} journal_block_t;
+
+int journal_replay(superblock_t* super);
+int journal_open(superblock_t* super);
+void journal_close();
+void journal_begin();
+void journal_end();
+void journal_begin_exclusive();
+void journal_dirty(void* addr, size_t len);
+void journal_dirty_inode(inum_t inode_i, int datasync);
+void journal_dirty_data(inum_t inode_i, void* addr, size_t len);
+void journal_free(uint64_t first, uint64_t count);
+int journal_write_inode(inum_t inode_i, int datasync);
+int journal_data_written(inum_t inode_i);
+int journal_commit();
+int journal_touched(uint64_t block);
+void journal_touch(uint64_t first, uint64_t count);
+void journal_untouch(uint64_t first, uint64_t count);
+
+#endif
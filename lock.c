@@ -0,0 +1,189 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - the inode locks are allocated once per mount, sized by the superblock's
+ *     inode count
+ *   - each thread counts the inode locks it holds, the blocks it pinned are
+ *     released once it holds none, see bdev.h
+ *   - a snapshot's inodes never change and have no lock of their own, locking
+ *     one read locks the snapshots' lock, which a snapshot's removal holds for
+ *     writing, and counts it so the blocks read from the snapshot stay pinned,
+ *     see snapshot_inode
+ */
+
+#include "lock.h"
+#include "bdev.h"
+
+#include <pthread.h>
+#include <assert.h>
+#include <stdlib.h>
+
+// the lock and sequence of each inode
+static pthread_rwlock_t* g_Inode_Locks = 0;
+static uint32_t* g_Inode_Seqs = 0;
+static inum_t g_Inode_Lock_Count = 0;
+
+// serializes renames so two renames never lock the same directories in
+// opposite orders
+static pthread_mutex_t g_Rename_Lock = PTHREAD_MUTEX_INITIALIZER;
+
+// held for reading by every lock of a snapshot's inode and for writing while a
+// snapshot is removed, so no reader is inside the blocks it frees, a remover
+// holds the turnstile while it waits so new readers cannot starve it
+static pthread_rwlock_t g_Snapshots_Lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t g_Snapshots_Turnstile = PTHREAD_MUTEX_INITIALIZER;
+
+// the number of inode locks the calling thread holds
+static __thread int t_Lock_Depth = 0;
+
+// the number of snapshot inode locks the calling thread holds, only the first
+// passes the turnstile, the rest are granted while a remover waits
+static __thread int t_Snapshots_Depth = 0;
+
+// allocates a lock for each of the given number of inodes
+void lock_init(inum_t inode_count) {
+    // destroy the locks of a previous mount
+    for (inum_t i = 0; i < g_Inode_Lock_Count; i++) {
+        pthread_rwlock_destroy(&g_Inode_Locks[i]);
+    }
+    free(g_Inode_Locks);
+    free(g_Inode_Seqs);
+
+    g_Inode_Locks = malloc(inode_count * sizeof(pthread_rwlock_t));
+    g_Inode_Seqs = calloc(inode_count, sizeof(uint32_t));
+    assert(g_Inode_Locks != 0 && g_Inode_Seqs != 0);
+    g_Inode_Lock_Count = inode_count;
+    for (inum_t i = 0; i < inode_count; i++) {
+        pthread_rwlock_init(&g_Inode_Locks[i], 0);
+    }
+}
+
+// read locks the snapshots' lock for a snapshot's inode
+static void snapshots_read_lock() {
+    if (t_Snapshots_Depth++ == 0) {
+        pthread_mutex_lock(&g_Snapshots_Turnstile);
+        pthread_mutex_unlock(&g_Snapshots_Turnstile);
+    }
+    pthread_rwlock_rdlock(&g_Snapshots_Lock);
+}
+
+// locks the given inode for reading
+void inode_read_lock(inum_t inode_i) {
+    if (inode_i < g_Inode_Lock_Count) {
+        pthread_rwlock_rdlock(&g_Inode_Locks[inode_i]);
+    }
+    else {
+        snapshots_read_lock();
+    }
+    t_Lock_Depth++;
+}
+
+// locks the given inode for writing, its sequence is odd until it is unlocked
+void inode_write_lock(inum_t inode_i) {
+    t_Lock_Depth++;
+    if (inode_i >= g_Inode_Lock_Count) {
+        snapshots_read_lock();
+        return;
+    }
+    pthread_rwlock_wrlock(&g_Inode_Locks[inode_i]);
+    __atomic_store_n(&g_Inode_Seqs[inode_i], g_Inode_Seqs[inode_i] + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// unlocks the given inode, read or write
+// note: the sequence can only be odd while the write lock is held, so an odd
+//       sequence means the caller is the writer
+void inode_unlock(inum_t inode_i) {
+    if (inode_i < g_Inode_Lock_Count) {
+        uint32_t seq = __atomic_load_n(&g_Inode_Seqs[inode_i], __ATOMIC_RELAXED);
+        if (seq & 1) {
+            __atomic_store_n(&g_Inode_Seqs[inode_i], seq + 1, __ATOMIC_RELEASE);
+        }
+        pthread_rwlock_unlock(&g_Inode_Locks[inode_i]);
+    }
+    else {
+        t_Snapshots_Depth--;
+        pthread_rwlock_unlock(&g_Snapshots_Lock);
+    }
+
+    // the blocks read under the lock can be evicted once no lock is held
+    if (--t_Lock_Depth == 0) {
+        bdev_unpin_all();
+    }
+}
+
+// starts a lockless read of the given inode, waits out any writer and returns
+// the sequence to pass to inode_read_retry
+// note: a snapshot's inode is locked like inode_read_lock until
+//       inode_read_retry
+uint32_t inode_read_begin(inum_t inode_i) {
+    if (inode_i >= g_Inode_Lock_Count) {
+        inode_read_lock(inode_i);
+        return 0;
+    }
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&g_Inode_Seqs[inode_i], __ATOMIC_ACQUIRE)) & 1) {
+        cpu_relax();
+    }
+    return seq;
+}
+
+// ends a lockless read of the given inode, returns 1 if it was written during
+// the read and the read must be repeated
+int inode_read_retry(inum_t inode_i, uint32_t seq) {
+    if (inode_i >= g_Inode_Lock_Count) {
+        inode_unlock(inode_i);
+        return 0;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&g_Inode_Seqs[inode_i], __ATOMIC_RELAXED) != seq;
+}
+
+// locks two directory inodes, or the two files of a clone, for writing in inode
+// order, the same inode is only locked once
+void inode_write_lock_pair(inum_t inode_a, inum_t inode_b) {
+    if (inode_a == inode_b) {
+        inode_write_lock(inode_a);
+    }
+    else if (inode_a < inode_b) {
+        inode_write_lock(inode_a);
+        inode_write_lock(inode_b);
+    }
+    else {
+        inode_write_lock(inode_b);
+        inode_write_lock(inode_a);
+    }
+}
+
+// unlocks two inodes locked by inode_write_lock_pair
+void inode_unlock_pair(inum_t inode_a, inum_t inode_b) {
+    inode_unlock(inode_a);
+    if (inode_a != inode_b) {
+        inode_unlock(inode_b);
+    }
+}
+
+// locks every snapshot's inodes for writing, while a snapshot is removed
+void snapshots_write_lock() {
+    pthread_mutex_lock(&g_Snapshots_Turnstile);
+    pthread_rwlock_wrlock(&g_Snapshots_Lock);
+}
+
+// unlocks the snapshots' inodes locked by snapshots_write_lock
+void snapshots_unlock() {
+    pthread_rwlock_unlock(&g_Snapshots_Lock);
+    pthread_mutex_unlock(&g_Snapshots_Turnstile);
+}
+
+// takes the rename lock
+void rename_lock() {
+    pthread_mutex_lock(&g_Rename_Lock);
+}
+
+// releases the rename lock
+void rename_unlock() {
+    pthread_mutex_unlock(&g_Rename_Lock);
+}
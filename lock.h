@@ -0,0 +1,57 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - every inode has a reader/writer lock guarding its data blocks, extents,
+ *     size, mode and times, a directory's lock also guards its items
+ *   - the link count of an inode is guarded by the handle table instead, see
+ *     handle.c
+ *   - locks are always taken in this order, a lock later in the list is never
+ *     held while waiting for one earlier in the list:
+ *      - the rename lock, held for a whole rename
+ *      - directory inode locks, at most two at once and in inode order,
+ *        then the read lock of the directory a rename replaces, see
+ *        storage_rename_at
+ *      - a single file inode lock, or two in inode order for a clone, see
+ *        storage_clone
+ *      - the handle table and allocator locks and the dcache slots, which
+ *        never wait for another lock while held
+ *   - a snapshot's inodes share one lock, see lock.c, its removal takes it for
+ *     writing inside an exclusive transaction while holding no other lock
+ *   - path walks only hold one directory's lock at a time, no lock is held
+ *     between the items of a path
+ *   - every inode also has a sequence that is odd while its write lock is
+ *     held, inode_read_begin and inode_read_retry let a reader copy an inode's
+ *     fields without taking its lock
+ */
+
+#ifndef LOCK_H
+#define LOCK_H
+
+#include "storage.h"
+
+#include <stdint.h>
+
+// tells the cpu the thread is spinning on a lock or sequence
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+void lock_init(inum_t inode_count);
+void inode_read_lock(inum_t inode_i);
+void inode_write_lock(inum_t inode_i);
+void inode_unlock(inum_t inode_i);
+void inode_write_lock_pair(inum_t inode_a, inum_t inode_b);
+void inode_unlock_pair(inum_t inode_a, inum_t inode_b);
+uint32_t inode_read_begin(inum_t inode_i);
+int inode_read_retry(inum_t inode_i, uint32_t seq);
+void snapshots_write_lock();
+void snapshots_unlock();
+void rename_lock();
+void rename_unlock();
+
+#endif
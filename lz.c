@@ -0,0 +1,199 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - the compressed format is described in lz.h
+ *   - both functions only use the buffers they are given and a table on the
+ *     stack, so any thread may call them at once
+ */
+
+#include "lz.h"
+
+#include <string.h>
+#include <stdint.h>
+
+// returns the hash table index of the four bytes at p
+static uint32_t lz_hash(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// writes the extra bytes of a count of 15 or more, returns the end of what was
+// written or null if it does not fit before end
+static uint8_t* lz_put_count(uint8_t* op, uint8_t* end, size_t count) {
+    for (count -= 15; count >= 255; count -= 255) {
+        if (op == end) {
+            return 0;
+        }
+        *op++ = 255;
+    }
+    if (op == end) {
+        return 0;
+    }
+    *op++ = (uint8_t)count;
+    return op;
+}
+
+// reads the extra bytes of a count of 15, returns the end of what was read or
+// null if the data ends first
+static const uint8_t* lz_get_count(const uint8_t* ip, const uint8_t* end, size_t* count) {
+    uint8_t byte;
+    do {
+        if (ip == end) {
+            return 0;
+        }
+        byte = *ip++;
+        *count += byte;
+    } while (byte == 255);
+    return ip;
+}
+
+// writes one sequence of nlit literals and a match of the given distance and
+// length, a length of 0 is the last sequence, returns the end of what was
+// written or null if it does not fit before end
+static uint8_t* lz_put_sequence(uint8_t* op, uint8_t* end, const uint8_t* lit, size_t nlit,
+        size_t distance, size_t length) {
+    if (op == end) {
+        return 0;
+    }
+
+    // the token, then the counts that do not fit in it
+    uint8_t* token = op++;
+    *token = (uint8_t)(((nlit < 15) ? nlit : 15) << 4);
+    if (nlit >= 15 && (op = lz_put_count(op, end, nlit)) == 0) {
+        return 0;
+    }
+    if ((size_t)(end - op) < nlit) {
+        return 0;
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    // the match
+    if (length > 0) {
+        length -= LZ_MIN_MATCH;
+        *token |= (uint8_t)((length < 15) ? length : 15);
+        if (end - op < 2) {
+            return 0;
+        }
+        *op++ = (uint8_t)(distance & 0xFF);
+        *op++ = (uint8_t)(distance >> 8);
+        if (length >= 15 && (op = lz_put_count(op, end, length)) == 0) {
+            return 0;
+        }
+    }
+
+    return op;
+}
+
+// compresses len bytes of src into dst, which holds cap bytes
+// returns the length of the compressed data, or 0 if it does not fit in cap
+int lz_compress(const void* src, size_t len, void* dst, size_t cap) {
+    const uint8_t* base = src;
+    const uint8_t* ip = base;
+    const uint8_t* anchor = base;
+    const uint8_t* end = base + len;
+    uint8_t* op = dst;
+    uint8_t* op_end = op + cap;
+
+    // the last position of each hash, -1 if none
+    int32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0xFF, sizeof(table));
+
+    // find a match at each position until the last literals
+    if (len > LZ_LAST_LITERALS + LZ_MIN_MATCH) {
+        const uint8_t* limit = end - LZ_LAST_LITERALS;
+        while (ip + LZ_MIN_MATCH <= limit) {
+            uint32_t h = lz_hash(ip);
+            int32_t ref = table[h];
+            table[h] = (int32_t)(ip - base);
+            if (ref < 0 || (ip - base) - ref > LZ_MAX_DISTANCE || memcmp(base + ref, ip, LZ_MIN_MATCH) != 0) {
+                ip++;
+                continue;
+            }
+
+            // extend the match as far as it goes
+            const uint8_t* match = base + ref;
+            size_t length = LZ_MIN_MATCH;
+            while (ip + length < limit && match[length] == ip[length]) {
+                length++;
+            }
+
+            op = lz_put_sequence(op, op_end, anchor, ip - anchor, ip - match, length);
+            if (op == 0) {
+                return 0;
+            }
+            ip += length;
+            anchor = ip;
+        }
+    }
+
+    // then the rest as literals
+    op = lz_put_sequence(op, op_end, anchor, end - anchor, 0, 0);
+    if (op == 0) {
+        return 0;
+    }
+    return (int)(op - (uint8_t*)dst);
+}
+
+// decompresses len bytes of src into dst, which holds cap bytes
+// returns the length of the decompressed data, or -1 if src is not valid
+// compressed data or it does not fit in cap
+int lz_decompress(const void* src, size_t len, void* dst, size_t cap) {
+    const uint8_t* ip = src;
+    const uint8_t* end = ip + len;
+    uint8_t* base = dst;
+    uint8_t* op = base;
+    uint8_t* op_end = base + cap;
+
+    while (ip < end) {
+        // the literals
+        uint8_t token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && (ip = lz_get_count(ip, end, &nlit)) == 0) {
+            return -1;
+        }
+        if (nlit > (size_t)(end - ip) || nlit > (size_t)(op_end - op)) {
+            return -1;
+        }
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        // the last sequence has no match
+        if (ip == end) {
+            break;
+        }
+
+        // the match, which may overlap the bytes it makes
+        if (end - ip < 2) {
+            return -1;
+        }
+        size_t distance = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t length = token & 0x0F;
+        if (length == 15 && (ip = lz_get_count(ip, end, &length)) == 0) {
+            return -1;
+        }
+        length += LZ_MIN_MATCH;
+        if (distance == 0 || distance > (size_t)(op - base) || length > (size_t)(op_end - op)) {
+            return -1;
+        }
+
+        const uint8_t* match = op - distance;
+        if (distance >= length) {
+            memcpy(op, match, length);
+            op += length;
+        }
+        else {
+            while (length-- > 0) {
+                *op++ = *match++;
+            }
+        }
+    }
+
+    return (int)(op - base);
+}
@@ -0,0 +1,42 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - a small lz77 codec for compressing file clusters, see cluster.h
+ *   - the compressed data is a list of sequences, each a token byte, the
+ *     literal bytes and a match, the token's high four bits are the number of
+ *     literals and its low four bits the match length less LZ_MIN_MATCH, a
+ *     count of 15 continues in the bytes after it, each adding up to 255
+ *   - a match is the two byte little endian distance back to copy from
+ *     followed by its length's extra bytes, the last sequence is only
+ *     literals and ends the data
+ *   - matches are found greedily through a hash table of the last position
+ *     of each four bytes, so a cluster compresses in a single pass
+ *   - decompressing checks every length and distance against both buffers,
+ *     data that was not made by lz_compress fails instead of overrunning
+ */
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+// the shortest match, shorter repeats are kept as literals
+#define LZ_MIN_MATCH 4
+
+// the number of bits of the match hash table index
+#define LZ_HASH_BITS 12
+
+// the bytes at the end of the data that are always literals, so finding a
+// match never reads past the end
+#define LZ_LAST_LITERALS 5
+
+// the farthest back a match can copy from
+#define LZ_MAX_DISTANCE 65535
+
+int lz_compress(const void* src, size_t len, void* dst, size_t cap);
+int lz_decompress(const void* src, size_t len, void* dst, size_t cap);
+
+#endif
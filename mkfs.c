@@ -0,0 +1,63 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - makes a new nufs image, usage:
+ *       mkfs.nufs [-b data blocks] [-i inodes] [-j journal blocks] image
+ *   - the image file is created if it does not exist and overwritten if it
+ *     does, see storage_mkfs in storage.c
+ */
+
+#include "storage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// main entry point
+int main(int argc, char *argv[]) {
+    // start from the default geometry
+    unsigned long block_count = DEFAULT_BLOCK_COUNT;
+    unsigned long inode_count = DEFAULT_INODE_COUNT;
+    unsigned long journal_blocks = DEFAULT_JOURNAL_BLOCKS;
+    int opt;
+
+    // read the geometry options
+    while ((opt = getopt(argc, argv, "b:i:j:")) != -1) {
+        switch (opt) {
+            case 'b':
+                block_count = strtoul(optarg, 0, 0);
+                break;
+            case 'i':
+                inode_count = strtoul(optarg, 0, 0);
+                break;
+            case 'j':
+                journal_blocks = strtoul(optarg, 0, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-b data blocks] [-i inodes] [-j journal blocks] image\n", argv[0]);
+                return 1;
+        }
+    }
+
+    // the image path is the only argument left
+    if (optind != argc - 1 || block_count == 0 || block_count > UINT32_MAX ||
+            inode_count == 0 || inode_count > UINT32_MAX || journal_blocks > UINT32_MAX) {
+        fprintf(stderr, "usage: %s [-b data blocks] [-i inodes] [-j journal blocks] image\n", argv[0]);
+        return 1;
+    }
+
+    // make the image
+    int rv = storage_mkfs(argv[optind], (bnum_t)block_count, (inum_t)inode_count, (uint32_t)journal_blocks);
+    if (rv != 0) {
+        fprintf(stderr, "mkfs(%s) -> %s\n", argv[optind], strerror(-rv));
+        return 1;
+    }
+
+    printf("mkfs(%s) -> %lu blocks of %d bytes, %lu inodes, %lu journal blocks\n", argv[optind], block_count,
+            BLOCK_SIZE, inode_count, journal_blocks);
+    return 0;
+}
@@ -9,13 +9,38 @@
  *     it was written here to try and reduce complexity and size of storage.c
  *     file
  *   - see storage.h and storage.c for information about directory structure
+ *   - an operation that makes several changes is one journal transaction, see
+ *     journal.h
+ *   - nufs uses fuse's low-level api, every callback is given inode numbers so
+ *     no path is built or walked, the fuse inode number of an inode is its
+ *     offset plus one so the root is FUSE_ROOT_ID
+ *   - every entry replied to the kernel counts a lookup of its inode, an
+ *     unlinked inode is only freed once the kernel forgets all of them, see
+ *     handle.h
+ *   - fsync and fsyncdir wait for the journal on the async pool and reply from
+ *     there, see async.h
+ *   - reads and writes pass fuse buffers, a read of data already written in
+ *     place is pieces of the image file the kernel splices from and a write
+ *     is copied from fuse's buffer (possibly a pipe) straight into the blocks
+ *   - mkdir in the hidden directory SNAPSHOT_DIR of the root makes a snapshot
+ *     of the whole tree with the directory's name and rmdir removes one, a
+ *     snapshot is read-only, see snapshot.h
  *   - based on cs3650 course code
  */
 
 #include "storage.h"
 #include "path.h"
+#include "handle.h"
+#include "directory.h"
+#include "trace.h"
+#include "lock.h"
+#include "journal.h"
+#include "async.h"
+#include "clone.h"
+#include "snapshot.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -24,168 +49,363 @@
 #include <dirent.h>
 #include <bsd/string.h>
 #include <assert.h>
+#include <linux/falloc.h>
+#include <fcntl.h>
 
 #define FUSE_USE_VERSION 26
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+
+// the fuse inode number of an inode and the inode of a fuse inode number
+#define NUFS_INO(inode_i) ((fuse_ino_t)(inode_i) + 1)
+#define NUFS_INODE(ino) ((inum_t)((ino) - 1))
+
+// the seconds the kernel may cache entries and attributes
+#define NUFS_TIMEOUT 1.0
+
+// the channel to the kernel, for telling it an inode changed under it
+static struct fuse_chan* g_Chan = 0;
 
 // helper function sets the stats of given stat pointer from the index of the
-// given inode
-void set_stat(uint8_t inode_i, struct stat *st) {
+// given inode, the caller holds the inode's lock
+void fill_stat(inum_t inode_i, struct stat *st) {
     // get the inode
     inode_t* inode = get_inode(inode_i);
 
     // set all possible stats
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = NUFS_INO(inode_i);
     st->st_mode = inode->mode;
     st->st_nlink = inode->links;
     st->st_atime = inode->a_time;
     st->st_mtime = inode->m_time;
-    st->st_size = inode->size;
-    st->st_blocks = inode->block_count;
+    st->st_size = inode->size + storage_delayed(inode_i);
+    st->st_blocks = (blkcnt_t)inode->block_used * (BLOCK_SIZE / 512);
     st->st_blksize = BLOCK_SIZE;
     st->st_uid = getuid();
 }
 
+// helper function sets the stats of given stat pointer from the index of the
+// given inode, the inode is copied without its lock and copied again if it was
+// written during the copy
+void set_stat(inum_t inode_i, struct stat *st) {
+    uint32_t seq;
+    do {
+        seq = inode_read_begin(inode_i);
+        fill_stat(inode_i, st);
+    } while (inode_read_retry(inode_i, seq));
+}
+
+// helper function returns 1 if the inode is a snapshot's or the snapshot
+// directory, which never change
+int is_snapshot(inum_t inode_i) {
+    return inode_i >= get_superblock()->inode_count;
+}
+
+// helper function returns 0 if the caller of the request may read the inode,
+// -EACCES if not, checked against the owner and group stat reports
+int may_read(fuse_req_t req, inum_t inode_i) {
+    const struct fuse_ctx* ctx = fuse_req_ctx(req);
+    struct stat st;
+    set_stat(inode_i, &st);
+    mode_t bit = S_IROTH;
+    if (ctx->uid == 0) {
+        return 0;
+    }
+    if (ctx->uid == st.st_uid) {
+        bit = S_IRUSR;
+    }
+    else if (ctx->gid == st.st_gid) {
+        bit = S_IRGRP;
+    }
+    return (st.st_mode & bit) ? 0 : -EACCES;
+}
+
 // helper function updates the inode's access time
-void update_access_time(uint8_t inode_i, time_t tv_sec) {
+void update_access_time(inum_t inode_i, time_t tv_sec) {
     // update current times for access
     inode_t* inode = get_inode(inode_i);
+    journal_begin();
+    inode_write_lock(inode_i);
     inode->a_time = tv_sec;
-    printf("updating access time\n\n");
+    journal_dirty_inode(inode_i, 0);
+    inode_unlock(inode_i);
+    journal_end();
+    TRACE(TRACE_DEBUG, TRACE_ATIME, 0, inode_i, tv_sec, 0, 0);
 }
 
 // helper function updates the inode's access time
-void update_modified_time(uint8_t inode_i, time_t tv_sec) {
+void update_modified_time(inum_t inode_i, time_t tv_sec) {
     // update current times for access
     inode_t* inode = get_inode(inode_i);
+    journal_begin();
+    inode_write_lock(inode_i);
     inode->m_time = tv_sec;
-    printf("updating modified time\n\n");
+    journal_dirty_inode(inode_i, 0);
+    inode_unlock(inode_i);
+    journal_end();
+    TRACE(TRACE_DEBUG, TRACE_MTIME, 0, inode_i, tv_sec, 0, 0);
 }
 
 // updates last access and last modified times to the same values
-void update_all_time(uint8_t inode_i, time_t tv_sec) {
+void update_all_time(inum_t inode_i, time_t tv_sec) {
     update_access_time(inode_i, tv_sec);
     update_modified_time(inode_i, tv_sec);
 }
 
-// implementation for: man 2 access
-// Checks if a file exists.
-int nufs_access(const char *path, int mask) {
-    int rv = storage_access(path, 0);
-    printf("access(%s, %04o) -> %d\n\n", path, mask, rv);
+// helper function fills the entry of the given inode and counts the kernel's
+// lookup of it, returns -ENOENT if it was unlinked in the meantime
+int fill_entry(inum_t inode_i, struct fuse_entry_param* e) {
+    int rv = handle_lookup(inode_i);
+    if (rv == 0) {
+        memset(e, 0, sizeof(struct fuse_entry_param));
+        e->ino = NUFS_INO(inode_i);
+        e->attr_timeout = NUFS_TIMEOUT;
+        e->entry_timeout = NUFS_TIMEOUT;
+        set_stat(inode_i, &e->attr);
+    }
     return rv;
 }
 
+// helper function replies with the entry of the given inode, or with rv if it
+// is an error
+void reply_entry(fuse_req_t req, int rv, inum_t inode_i) {
+    struct fuse_entry_param e;
+    if (rv == 0) {
+        rv = fill_entry(inode_i, &e);
+    }
+    if (rv != 0) {
+        fuse_reply_err(req, -rv);
+    }
+    // the kernel never counted the lookup if the request was interrupted
+    else if (fuse_reply_entry(req, &e) != 0) {
+        storage_forget(inode_i, 1);
+    }
+}
+
+// helper function replies with the attributes of the given inode, or with rv
+// if it is an error
+void reply_attr(fuse_req_t req, int rv, inum_t inode_i) {
+    struct stat st;
+    if (rv != 0) {
+        fuse_reply_err(req, -rv);
+    }
+    else {
+        set_stat(inode_i, &st);
+        fuse_reply_attr(req, &st, NUFS_TIMEOUT);
+    }
+}
+
+// looks up an item of the parent directory
+void nufs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    inum_t inode_i = 0;
+    int rv = directory_lookup(name, strlen(name), NUFS_INODE(parent), &inode_i);
+    TRACE(TRACE_INFO, TRACE_LOOKUP, rv, NUFS_INODE(parent), TRACE_PATH(name), inode_i, 0);
+    reply_entry(req, rv, inode_i);
+}
+
+// the kernel drops nlookup of its lookups of an inode
+void nufs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    storage_forget(NUFS_INODE(ino), nlookup);
+    TRACE(TRACE_INFO, TRACE_FORGET, 0, NUFS_INODE(ino), nlookup, 0, 0);
+    fuse_reply_none(req);
+}
+
+// the kernel drops its lookups of several inodes at once
+void nufs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    for (size_t i = 0; i < count; i++) {
+        storage_forget(NUFS_INODE(forgets[i].ino), forgets[i].nlookup);
+        TRACE(TRACE_INFO, TRACE_FORGET, 0, NUFS_INODE(forgets[i].ino), forgets[i].nlookup, 0, 0);
+    }
+    fuse_reply_none(req);
+}
+
+// implementation for: man 2 access
+// the kernel has looked the inode up so it exists
+void nufs_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+    TRACE(TRACE_INFO, TRACE_ACCESS, 0, NUFS_INODE(ino), mask, 0, 0);
+    fuse_reply_err(req, 0);
+}
+
 // implementation for: man 2 stat
 // gets an object's attributes (type, permissions, size, etc)
-int nufs_getattr(const char *path, struct stat *st) {
-    uint8_t inode_i;
-    int rv = storage_access(path, &inode_i);
+void nufs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    TRACE(TRACE_INFO, TRACE_GETATTR, 0, NUFS_INODE(ino), 0, 0, 0);
+    reply_attr(req, 0, NUFS_INODE(ino));
+}
 
-    // set the stats on successful acquisition of the path's inode
-    if (rv == 0) {
-        set_stat(inode_i, st);
+// the arguments readdir passes to readdir_item for each directory item
+typedef struct readdir_ctx_t {
+    fuse_req_t req;             // the request replied to
+    char* buf;                  // the reply buffer
+    size_t size;                // the size of the reply buffer
+    size_t used;                // the bytes of it filled
+    int count;                  // the number of items filled
+} readdir_ctx_t;
+
+// helper function adds a single directory item to the reply, its offset is the
+// position after it plus one for "."
+// note: fuse only uses the inode number and mode of these stats, the item's
+//       type is in the directory so its inode is never read
+int readdir_item(const char* item, inum_t inode_i, uint8_t type, uint64_t next, void* arg) {
+    readdir_ctx_t* ctx = arg;
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_ino = NUFS_INO(inode_i);
+    st.st_mode = DTTOIF(type);
+    size_t len = fuse_add_direntry(ctx->req, ctx->buf + ctx->used, ctx->size - ctx->used, item, &st, next + 1);
+    if (len > ctx->size - ctx->used) {
+        return 1;
     }
-    printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n\n", path, rv, st->st_mode, st->st_size);
-    return rv;
+    ctx->used += len;
+    ctx->count++;
+    return 0;
+}
+
+// opens a directory, the handle holds the directory's inode so it is only
+// freed once the last handle is released, like an open file
+void nufs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    int rv = handle_open(NUFS_INODE(ino), fi->flags);
+    TRACE(TRACE_INFO, TRACE_OPENDIR, (rv < 0) ? rv : 0, NUFS_INODE(ino), 0, 0, 0);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+        return;
+    }
+
+    // the kernel never got the handle if the request was interrupted
+    fi->fh = rv;
+    if (fuse_reply_open(req, fi) != 0) {
+        storage_release(fi->fh);
+    }
+}
+
+// releases an open directory
+void nufs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    storage_release(fi->fh);
+    TRACE(TRACE_INFO, TRACE_RELEASEDIR, 0, fi->fh, 0, 0, 0);
+    fuse_reply_err(req, 0);
 }
 
 // implementation for: man 2 readdir
-// lists the contents of a directory
-int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+// lists the contents of a directory from the given offset until size bytes of
+// items are filled, offset 0 starts with "." and any other offset is one past
+// a position in the directory, see dir_iterate
+void nufs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    readdir_ctx_t ctx = { req, malloc(size), size, 0, 0 };
     struct stat st;
-    uint8_t inode_i;
+    int rv = 0;
+    assert(ctx.buf != 0);
 
-    // get the directory's inode
-    int rv = storage_access(path, &inode_i);
-
-    // on success
-    if (rv == 0) {
-        inode_t* inode = get_inode(inode_i);
+    // get the directory's inode from its handle
+    inum_t inode_i = handle_get(fi->fh)->inode;
+    inode_read_lock(inode_i);
+    inode_t* inode = get_inode(inode_i);
 
-        // if the inode is not a directory...
-        if ((mode_t)(inode->mode & S_IFDIR) != S_IFDIR) {
-            rv = -ENOTDIR;
-        }
-        // if the inode does not have search permissions
-        else if ((mode_t)(inode->mode & S_IXUSR) != S_IXUSR) {
-            rv = -EACCES;
-        }
-        // set the stats for the current working directory and its
-        // subdirectories and files
-        else {
-            // set working directory stat
-            set_stat(inode_i, &st);
-            filler(buf, ".", &st, 0);
-
-            // get the data associated with the directory's inode
-            uint8_t* blocks = get_blocks(inode_i);
-            int block_count = get_inode(inode_i)->block_count;
-            void* block;
-            int pathlen;
-
-            // loop over all of the directory's data
-            for (int i = 0; i < block_count; i++) {
-                // get each individual block
-                block = get_block(blocks[i]);
-
-                // set the stats for each path item in the directory
-                while ((pathlen = strlen(block))) {
-                    set_stat(*(uint8_t*)(block + pathlen + 1), &st);
-                    filler(buf, block, &st, 0);
-                    block += pathlen + 2;
-                }
+    // if the inode is not a directory...
+    if ((mode_t)(inode->mode & S_IFDIR) != S_IFDIR) {
+        rv = -ENOTDIR;
+    }
+    // if the inode does not have search permissions
+    else if ((mode_t)(inode->mode & S_IXUSR) != S_IXUSR) {
+        rv = -EACCES;
+    }
+    // fill the items from the offset until the buffer is full
+    else {
+        // set working directory stat first
+        if (offset == 0) {
+            fill_stat(inode_i, &st);
+            ctx.used = fuse_add_direntry(req, ctx.buf, ctx.size, ".", &st, 1);
+            if (ctx.used <= ctx.size) {
+                ctx.count++;
+                offset = 1;
             }
+            else {
+                ctx.used = 0;
+            }
+        }
+
+        // then each path item in the directory
+        if (offset > 0) {
+            dir_iterate(inode_i, (uint64_t)offset - 1, readdir_item, &ctx);
         }
     }
+    inode_unlock(inode_i);
 
-    printf("readdir(%s) -> %d\n\n", path, rv);
-    return rv;
+    TRACE(TRACE_INFO, TRACE_READDIR, rv, fi->fh, offset, ctx.count, 0);
+    if (rv != 0) {
+        fuse_reply_err(req, -rv);
+    }
+    else {
+        fuse_reply_buf(req, ctx.buf, ctx.used);
+    }
+    free(ctx.buf);
 }
 
-// mknod makes a filesystem object like a file or directory
-// called for: man 2 open, man 2 link
-int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
-    uint8_t inode_i;
-    int rv = storage_mknod(path, mode, &inode_i);
+// helper function makes a filesystem object like a file or directory in the
+// parent directory, returns its inode in inode_i
+int make_item(fuse_ino_t parent, const char *name, mode_t mode, inum_t* inode_i) {
+    journal_begin();
+    int rv = storage_mknod_at(NUFS_INODE(parent), name, mode, inode_i);
 
     // on success update times
     if (rv == 0) {
-        update_all_time(inode_i, time(0));
+        update_all_time(*inode_i, time(0));
     }
-    printf("mknod(%s, %04o) -> %d\n\n", path, mode, rv);
+    journal_end();
     return rv;
 }
 
+// mknod makes a filesystem object like a file or directory
+// called for: man 2 mknod
+void nufs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+    inum_t inode_i = 0;
+    int rv = make_item(parent, name, mode, &inode_i);
+    TRACE(TRACE_INFO, TRACE_MKNOD, rv, NUFS_INODE(parent), TRACE_PATH(name), mode, inode_i);
+    reply_entry(req, rv, inode_i);
+}
+
 // most of the following callbacks implement
 // another system call; see section 2 of the manual
-int nufs_mkdir(const char *path, mode_t mode) {
-    int rv = nufs_mknod(path, mode | S_IFDIR, 0);
-    printf("mkdir(%s) -> %d\n\n", path, rv);
-    return rv;
+void nufs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    inum_t inode_i = 0;
+    int rv;
+
+    // a directory made in the snapshot directory is a snapshot
+    if (NUFS_INODE(parent) == SNAPSHOT_DIR_INODE) {
+        rv = storage_snapshot(name, &inode_i);
+    }
+    else {
+        rv = make_item(parent, name, mode | S_IFDIR, &inode_i);
+    }
+    TRACE(TRACE_INFO, TRACE_MKDIR, rv, NUFS_INODE(parent), TRACE_PATH(name), mode, inode_i);
+    reply_entry(req, rv, inode_i);
 }
 
-// unlinks the path to its inode, if the inode has 0 links after its data is
-// completely deleted
-int nufs_unlink(const char *path) {
-    int rv = storage_unlink(path);
-    printf("unlink(%s) -> %d\n\n", path, rv);
-    return rv;
+// unlinks the item from its inode, if the inode has 0 links after its data is
+// completely deleted once it is not open or looked up
+void nufs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    int rv = storage_unlink_at(NUFS_INODE(parent), name);
+    TRACE(TRACE_INFO, TRACE_UNLINK, rv, NUFS_INODE(parent), TRACE_PATH(name), 0, 0);
+    fuse_reply_err(req, -rv);
 }
 
-// links one path inode to another path
-int nufs_link(const char *from, const char *to) {
-    int rv = storage_link(from, to);
-    printf("link(%s => %s) -> %d\n\n", from, to, rv);
-	return rv;
+// links an inode to a new item
+void nufs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+    int rv = storage_link_at(NUFS_INODE(ino), NUFS_INODE(newparent), newname);
+    TRACE(TRACE_INFO, TRACE_LINK, rv, NUFS_INODE(ino), NUFS_INODE(newparent), TRACE_PATH(newname), 0);
+    reply_entry(req, rv, NUFS_INODE(ino));
 }
 
 // removes a directory
-int nufs_rmdir(const char *path) {
-    uint8_t inode_i;
+void nufs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    inum_t inode_i;
+    int rv;
 
-    // access the path's inode
-    int rv = storage_access(path, &inode_i);
-    if (rv == 0) {
+    // a directory removed from the snapshot directory is a snapshot
+    if (NUFS_INODE(parent) == SNAPSHOT_DIR_INODE) {
+        rv = storage_snapshot_remove(name);
+    }
+    // look up the item's inode
+    else if ((rv = directory_lookup(name, strlen(name), NUFS_INODE(parent), &inode_i)) == 0) {
         // check the inode corresponds to a directory
         inode_t* inode = get_inode(inode_i);
         if ((mode_t)(inode->mode & S_IFDIR) != S_IFDIR) {
@@ -194,181 +414,508 @@ int nufs_rmdir(const char *path) {
         // unlink the directory.. directory is removed if refs == 1, if
         // directory is not deleted there exists a bug
         else {
-            rv = nufs_unlink(path);
+            rv = storage_unlink_at(NUFS_INODE(parent), name);
         }
     }
-    printf("rmdir(%s) -> %d\n\n", path, rv);
-    return rv;
+    TRACE(TRACE_INFO, TRACE_RMDIR, rv, NUFS_INODE(parent), TRACE_PATH(name), 0, 0);
+    fuse_reply_err(req, -rv);
 }
 
 // implements: man 2 rename
 // called to move a file within the same filesystem
-int nufs_rename(const char *from, const char *to) {
-    uint8_t inode_i;
-
-    // access the original path's inode
-    int rv = storage_access(from, &inode_i);
-    if (rv == 0) {
-        uint8_t inode_ip;
+void nufs_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+    int rv = storage_rename_at(NUFS_INODE(parent), name, NUFS_INODE(newparent), newname);
+    TRACE(TRACE_INFO, TRACE_RENAME, rv, NUFS_INODE(parent), TRACE_PATH(name), NUFS_INODE(newparent),
+            TRACE_PATH(newname));
+    fuse_reply_err(req, -rv);
+}
 
-        // get the directory inode of the to item
-        char* parent = parent_directory(to);
+// helper function changes the inode's permissions, its type stays the same
+void chmod_inode(inum_t inode_i, mode_t mode) {
+    inode_t* inode = get_inode(inode_i);
+    journal_begin();
+    inode_write_lock(inode_i);
+    inode->mode = (inode->mode & S_IFMT) | (mode & ~S_IFMT);
+    journal_dirty_inode(inode_i, 0);
+    inode_unlock(inode_i);
+    journal_end();
+    TRACE(TRACE_DEBUG, TRACE_CHMOD, 0, inode_i, mode, 0, 0);
+}
 
-        // on successful access of parent inode remove the original path name
-        if ((rv = storage_access(parent, &inode_ip)) == 0) {
+// helper function truncates the given inode if it is a file with write
+// permissions
+int truncate_inode(inum_t inode_i, off_t size) {
+    int rv;
 
-            // on success, add the new item to its parent directory with the old
-            // path's inode as data
-            if ((rv = directory_remove(from)) == 0) {
-                rv = directory_add(to + strlen(parent) + 1, inode_ip, 0, inode_i);
-            }
+    // check the inode corresponds to a directory
+    inode_t* inode = get_inode(inode_i);
+    if ((mode_t)(inode->mode & S_IFDIR) == S_IFDIR) {
+        rv = -EISDIR;
+    }
+    // check the inode has write permissions
+    else if ((mode_t)(inode->mode & S_IWUSR) != S_IWUSR) {
+        rv = -EACCES;
+    }
+    // file can be truncated
+    else {
+        journal_begin();
+        rv = storage_truncate(size, inode_i);
+        if (rv == 0) {
+            update_all_time(inode_i, time(0));
         }
-
-        // free the allocated parent
-        free_parent_directory(parent);
+        journal_end();
     }
 
-    printf("rename(%s => %s) -> %d\n\n", from, to, rv);
+    TRACE(TRACE_DEBUG, TRACE_TRUNCATE, rv, inode_i, size, 0, 0);
     return rv;
 }
 
-// changes the path's inode permissions
-int nufs_chmod(const char *path, mode_t mode) {
-    uint8_t inode_i;
+// changes the attributes of an inode set in to_set, called for: man 2 chmod,
+// man 2 truncate, man 2 ftruncate and man 2 utimensat
+void nufs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    inum_t inode_i = NUFS_INODE(ino);
+    int rv = is_snapshot(inode_i) ? -EROFS : 0;
 
-    // access the path's inode
-    int rv = storage_access(path, &inode_i);
+    // every change is made in one transaction
+    journal_begin();
+    if (rv == 0 && (to_set & FUSE_SET_ATTR_MODE)) {
+        chmod_inode(inode_i, attr->st_mode);
+    }
+    if (rv == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+        rv = truncate_inode(inode_i, attr->st_size);
+    }
+    if (rv == 0 && (to_set & FUSE_SET_ATTR_ATIME)) {
+        update_access_time(inode_i, (to_set & FUSE_SET_ATTR_ATIME_NOW) ? time(0) : attr->st_atime);
+    }
+    if (rv == 0 && (to_set & FUSE_SET_ATTR_MTIME)) {
+        update_modified_time(inode_i, (to_set & FUSE_SET_ATTR_MTIME_NOW) ? time(0) : attr->st_mtime);
+    }
+    journal_end();
+
+    TRACE(TRACE_INFO, TRACE_SETATTR, rv, inode_i, to_set, attr->st_mode, attr->st_size);
+    reply_attr(req, rv, inode_i);
+}
+
+// opens the inode, the handle holds the inode so it is not freed while open
+void nufs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    inum_t inode_i = NUFS_INODE(ino);
+    int snapshot = is_snapshot(inode_i);
+    int rv = (snapshot && (fi->flags & O_ACCMODE) != O_RDONLY) ? -EROFS : handle_open(inode_i, fi->flags);
+    TRACE(TRACE_INFO, TRACE_OPEN, (rv < 0) ? rv : 0, inode_i, fi->flags, 0, 0);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+        return;
+    }
+
+    // the kernel never got the handle if the request was interrupted
+    fi->fh = rv;
+    if (!snapshot) {
+        update_access_time(inode_i, time(0));
+    }
+    if (fuse_reply_open(req, fi) != 0) {
+        storage_release(fi->fh);
+    }
+}
+
+// makes and opens a file
+void nufs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    struct fuse_entry_param e;
+    inum_t inode_i = 0;
+    int rv = make_item(parent, name, mode, &inode_i);
+
+    // on success open a handle and count the lookup, the handle keeps the
+    // inode so neither can fail
     if (rv == 0) {
-        // update the permissions
-        inode_t* inode = get_inode(inode_i);
-        inode->mode = mode;
+        rv = handle_open(inode_i, fi->flags);
+        assert(rv >= 0);
+        fi->fh = rv;
+        rv = fill_entry(inode_i, &e);
+        assert(rv == 0);
+    }
+    TRACE(TRACE_INFO, TRACE_CREATE, rv, NUFS_INODE(parent), TRACE_PATH(name), mode, inode_i);
+
+    if (rv != 0) {
+        fuse_reply_err(req, -rv);
+    }
+    // the kernel got neither if the request was interrupted
+    else if (fuse_reply_create(req, &e, fi) != 0) {
+        storage_forget(inode_i, 1);
+        storage_release(fi->fh);
+    }
+}
+
+// releases an open file, the inode is freed here if it was unlinked while open
+// and the kernel forgot it
+void nufs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    storage_release(fi->fh);
+    TRACE(TRACE_INFO, TRACE_RELEASE, 0, fi->fh, 0, 0, 0);
+    fuse_reply_err(req, 0);
+}
+
+// replies to a read with runs of the image file for fuse to splice from, arg is
+// the request, the inode is locked until fuse has spliced them
+static int nufs_reply_runs(const storage_run_t* runs, uint32_t count, void* arg) {
+    struct fuse_bufvec* bufv = malloc(sizeof(struct fuse_bufvec) + count * sizeof(struct fuse_buf));
+    assert(bufv != 0);
+    *bufv = FUSE_BUFVEC_INIT(0);
+
+    int fd = storage_image_fd();
+    for (uint32_t i = 0; i < count; i++) {
+        bufv->buf[i].size = runs[i].len;
+        bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufv->buf[i].mem = 0;
+        bufv->buf[i].fd = fd;
+        bufv->buf[i].pos = runs[i].pos;
+    }
+    // a read at the end of the file has no runs and replies with no data
+    if (count > 0) {
+        bufv->count = count;
     }
 
-    printf("chmod(%s, %04o) -> %d\n\n", path, mode, rv);
+    int rv = fuse_reply_data((fuse_req_t)arg, bufv, FUSE_BUF_SPLICE_MOVE);
+    free(bufv);
     return rv;
 }
 
-// truncates a file
-int nufs_truncate(const char *path, off_t size) {
-    uint8_t inode_i;
-    int rv = storage_access(path, &inode_i);
-    if (rv == 0) {
-        // check the inode corresponds to a directory
-        inode_t* inode = get_inode(inode_i);
-        if ((mode_t)(inode->mode & S_IFDIR) == S_IFDIR) {
-            rv = -EISDIR;
-        }
-        // check the inode has write permissions
-        else if ((mode_t)(inode->mode & S_IWUSR) != S_IWUSR) {
-            rv = -EACCES;
+// reads data as runs of the image file for fuse to splice from, data not yet
+// written in place is read into memory instead
+void nufs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    inum_t inode_i = handle_get(fi->fh)->inode;
+
+    // a run is at least one block, a read not starting on a block boundary
+    // touches one more
+    uint32_t count = (uint32_t)(size / BLOCK_SIZE) + 2;
+    storage_run_t* runs = malloc(count * sizeof(storage_run_t));
+    assert(runs != 0);
+    int rv = storage_read_runs(inode_i, size, offset, runs, count, nufs_reply_runs, req);
+    int spliced = (rv != -EAGAIN);
+    free(runs);
+
+    // fuse has copied the data once it has replied
+    if (!spliced) {
+        struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(0);
+        bufv.buf[0].mem = malloc(size);
+        assert(bufv.buf[0].mem != 0);
+        rv = storage_read(inode_i, bufv.buf[0].mem, size, offset);
+        if (rv < 0) {
+            fuse_reply_err(req, -rv);
         }
-        // file can be truncated
         else {
-            rv = storage_truncate(size, inode_i);
-            update_all_time(inode_i, time(0));
+            bufv.buf[0].size = rv;
+            fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
         }
+        free(bufv.buf[0].mem);
     }
+    TRACE(TRACE_INFO, TRACE_READ, rv, fi->fh, size, offset, spliced);
+}
 
-    printf("truncate(%s, %ld bytes) -> %d\n\n", path, size, rv);
-    return rv;
+// copies the next len bytes of a write_buf's data into a block, arg is the
+// source vector, which fuse_buf_copy advances
+static ssize_t nufs_copy_buf(void* dst, size_t len, void* arg) {
+    struct fuse_bufvec dst_bufv = FUSE_BUFVEC_INIT(len);
+    dst_bufv.buf[0].mem = dst;
+    return fuse_buf_copy(&dst_bufv, (struct fuse_bufvec*)arg, 0);
 }
 
-// this is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-int nufs_open(const char *path, struct fuse_file_info *fi) {
-    // get access to the path's inode, can only open something that exists
-    uint8_t inode_i;
-    int rv = storage_access(path, &inode_i);
-    if (rv == 0) {
-        update_access_time(inode_i, time(0));
+// helper function replies to a write with the bytes written or the error
+void reply_write(fuse_req_t req, int rv) {
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    }
+    else {
+        fuse_reply_write(req, rv);
     }
-    printf("open(%s) -> %d\n\n", path, rv);
-    return rv;
 }
 
-// Actually read data
-int nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    int rv = storage_read(path, buf, size, offset);
-    printf("read(%s, %ld bytes, @+%ld) -> %d\n\n", path, size, offset, rv);
-    return rv;
+// writes data from fuse's buffers, which may be a pipe spliced from the
+// kernel, without copying it anywhere but the file's blocks
+void nufs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *buf, off_t offset,
+        struct fuse_file_info *fi) {
+    inum_t inode_i = handle_get(fi->fh)->inode;
+    size_t size = fuse_buf_size(buf);
+    journal_begin();
+    int rv = storage_write_from(inode_i, size, offset, nufs_copy_buf, buf);
+
+    // on success update time stamps
+    if (rv >= 0) {
+        update_all_time(inode_i, time(0));
+    }
+    journal_end();
+
+    TRACE(TRACE_INFO, TRACE_WRITE, rv, fi->fh, size, offset, 0);
+    reply_write(req, rv);
 }
 
 // Actually write data
-int nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    uint8_t inode_i;
-    int rv = storage_write(path, buf, size, offset, &inode_i);
+void nufs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset,
+        struct fuse_file_info *fi) {
+    inum_t inode_i = handle_get(fi->fh)->inode;
+    journal_begin();
+    int rv = storage_write(inode_i, buf, size, offset);
 
     // on success update time stamps
     if (rv >= 0) {
         update_all_time(inode_i, time(0));
     }
+    journal_end();
 
-    printf("write(%s, %ld bytes, @+%ld) -> %d\n\n", path, size, offset, rv);
-    return rv;
+    TRACE(TRACE_INFO, TRACE_WRITE, rv, fi->fh, size, offset, 0);
+    reply_write(req, rv);
 }
 
-// Update the timestamps on a file or directory.
-int nufs_utimens(const char* path, const struct timespec ts[2]) {
-    uint8_t inode_i;
-    
-    // get access to the path's inode
-    int rv = storage_access(path, &inode_i);
+// an fsync or fsyncdir waiting on the async pool
+typedef struct fsync_work_t {
+    fuse_req_t req;             // the request replied to
+    uint64_t fh;                // the open handle synced
+    int datasync;               // if only the data is synced
+    int event;                  // TRACE_FSYNC or TRACE_FSYNCDIR
+} fsync_work_t;
+
+// makes an open handle's changes durable and replies, run on the async pool
+// so the fuse thread is not held while the journal commits
+// note: the kernel does not release the handle until this replies
+static void fsync_run(void* arg) {
+    fsync_work_t* work = arg;
+    int rv = storage_fsync(handle_get(work->fh)->inode, work->datasync);
+    TRACE(TRACE_INFO, work->event, rv, work->fh, work->datasync, 0, 0);
+    fuse_reply_err(work->req, -rv);
+    free(work);
+}
+
+// helper function hands an fsync of the open handle to the async pool
+void fsync_async(fuse_req_t req, uint64_t fh, int datasync, int event) {
+    fsync_work_t* work = malloc(sizeof(fsync_work_t));
+    assert(work != 0);
+    work->req = req;
+    work->fh = fh;
+    work->datasync = datasync;
+    work->event = event;
+    async_run(fsync_run, work);
+}
+
+// makes an open file's changes durable, with datasync only its data and what
+// is needed to read it back
+void nufs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    fsync_async(req, fi->fh, datasync, TRACE_FSYNC);
+}
+
+// makes an open directory's items durable
+void nufs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    fsync_async(req, fi->fh, datasync, TRACE_FSYNCDIR);
+}
+
+// called on every close of an open file, closing does not make the file
+// durable but data appended to it is given its blocks, see nufs_fsync
+void nufs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    int rv = storage_flush(handle_get(fi->fh)->inode);
+    TRACE(TRACE_INFO, TRACE_FLUSH, rv, fi->fh, 0, 0, 0);
+    fuse_reply_err(req, -rv);
+}
+
+// implementation for: man 2 fallocate
+// preallocates an open file's blocks, with FALLOC_FL_KEEP_SIZE the file's size
+// stays the same
+void nufs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t len,
+        struct fuse_file_info *fi) {
+    inum_t inode_i = handle_get(fi->fh)->inode;
+    int rv;
+
+    // only preallocation is supported, not punching or zeroing ranges
+    if ((mode & ~FALLOC_FL_KEEP_SIZE) != 0) {
+        rv = -EOPNOTSUPP;
+    }
+    else {
+        journal_begin();
+        rv = storage_fallocate(inode_i, offset, len, (mode & FALLOC_FL_KEEP_SIZE) != 0);
+        if (rv == 0 && (mode & FALLOC_FL_KEEP_SIZE) == 0) {
+            update_modified_time(inode_i, time(0));
+        }
+        journal_end();
+    }
+
+    TRACE(TRACE_INFO, TRACE_FALLOCATE, rv, fi->fh, offset, len, mode);
+    fuse_reply_err(req, -rv);
+}
+
+// tells the kernel the given fuse inode's cached attributes and pages are out
+// of date, run on the async pool
+// note: fuse must not be told from inside an operation on the inode, the
+//       kernel may be waiting on that operation's thread to read a page
+static void inval_run(void* arg) {
+    fuse_ino_t* ino = arg;
+    fuse_lowlevel_notify_inval_inode(g_Chan, *ino, 0, 0);
+    free(ino);
+}
+
+// helper function hands an invalidation of the fuse inode to the async pool
+void inval_async(fuse_ino_t ino) {
+    fuse_ino_t* work = malloc(sizeof(fuse_ino_t));
+    assert(work != 0);
+    *work = ino;
+    async_run(inval_run, work);
+}
+
+// clones another file's data into the open file, see clone.h, the file must
+// be open for writing
+void nufs_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi,
+        unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+    inum_t inode_i = NUFS_INODE(ino);
+    uint64_t src_ino = 0;
+    int rv;
+
+    // the source is given by its fuse inode number
+    if (flags & FUSE_IOCTL_COMPAT) {
+        rv = -ENOSYS;
+    }
+    else if ((cmd == NUFS_IOC_CLONE && in_bufsz != sizeof(uint64_t)) ||
+            (cmd == NUFS_IOC_CLONE_RANGE && in_bufsz != sizeof(nufs_clone_range_t))) {
+        rv = -EINVAL;
+    }
+    else if (cmd != NUFS_IOC_CLONE && cmd != NUFS_IOC_CLONE_RANGE) {
+        rv = -ENOTTY;
+    }
+    else if ((handle_get(fi->fh)->flags & O_ACCMODE) == O_RDONLY) {
+        rv = -EBADF;
+    }
+    else {
+        memcpy(&src_ino, in_buf, sizeof(uint64_t));
+        rv = (src_ino == 0 || src_ino > UINT32_MAX) ? -EINVAL : 0;
+    }
+
+    // the source is never opened, so the caller must be allowed to read it
     if (rv == 0) {
-        // on success, update times
-        update_access_time(inode_i, ts[0].tv_sec);
-        update_modified_time(inode_i, ts[1].tv_sec);
+        rv = may_read(req, NUFS_INODE(src_ino));
     }
 
-    printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n\n",
-           path, ts[0].tv_sec, ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
-	return rv;
+    if (rv == 0) {
+        journal_begin();
+        if (cmd == NUFS_IOC_CLONE) {
+            rv = storage_clone(NUFS_INODE(src_ino), inode_i);
+        }
+        else {
+            const nufs_clone_range_t* range = in_buf;
+            rv = (range->src_offset > INT64_MAX || range->dest_offset > INT64_MAX) ? -EINVAL :
+                storage_clone_range(NUFS_INODE(src_ino), range->src_offset, range->len, inode_i,
+                        range->dest_offset);
+        }
+        if (rv == 0) {
+            update_modified_time(inode_i, time(0));
+        }
+        journal_end();
+    }
+
+    // the kernel's cached size and pages of the file are out of date, it is
+    // told once the ioctl is replied
+    TRACE(TRACE_INFO, TRACE_IOCTL, rv, inode_i, cmd, src_ino, 0);
+    if (rv == 0) {
+        fuse_reply_ioctl(req, 0, 0, 0);
+        inval_async(ino);
+    }
+    else {
+        fuse_reply_err(req, -rv);
+    }
 }
 
-// Extended operations
-int nufs_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi, unsigned int flags, void* data) {
-    // not implemented for challenge
-    int rv = -1;
-    printf("ioctl(%s, %d, ...) -> %d\n\n", path, cmd, rv);
-    return rv;
+// unmounts the file system, the waiting fsyncs finish first and the trace ring
+// is written out last
+void nufs_destroy(void* private_data) {
+    async_stop();
+    storage_free();
+    trace_dump();
 }
 
 // initializes the callbacks for controlling fuse
-void nufs_init_ops(struct fuse_operations* ops) {
-    memset(ops, 0, sizeof(struct fuse_operations));
+void nufs_init_ops(struct fuse_lowlevel_ops* ops) {
+    memset(ops, 0, sizeof(struct fuse_lowlevel_ops));
+    ops->lookup   = nufs_lookup;
+    ops->forget   = nufs_forget;
+    ops->forget_multi = nufs_forget_multi;
     ops->access   = nufs_access;
     ops->getattr  = nufs_getattr;
+    ops->setattr  = nufs_setattr;
+    ops->opendir  = nufs_opendir;
     ops->readdir  = nufs_readdir;
+    ops->releasedir = nufs_releasedir;
+    ops->fsyncdir = nufs_fsyncdir;
     ops->mknod    = nufs_mknod;
     ops->mkdir    = nufs_mkdir;
     ops->link     = nufs_link;
     ops->unlink   = nufs_unlink;
     ops->rmdir    = nufs_rmdir;
     ops->rename   = nufs_rename;
-    ops->chmod    = nufs_chmod;
-    ops->truncate = nufs_truncate;
     ops->open	  = nufs_open;
+    ops->create   = nufs_create;
+    ops->release  = nufs_release;
     ops->read     = nufs_read;
     ops->write    = nufs_write;
-    ops->utimens  = nufs_utimens;
+    ops->write_buf = nufs_write_buf;
+    ops->flush    = nufs_flush;
+    ops->fsync    = nufs_fsync;
+    ops->fallocate = nufs_fallocate;
     ops->ioctl    = nufs_ioctl;
+    ops->destroy  = nufs_destroy;
 };
 
 // the structure to initialize the fuse ops
-struct fuse_operations nufs_ops;
+struct fuse_lowlevel_ops nufs_ops;
 
 // main entry point
 int main(int argc, char *argv[]) {
+    char* mountpoint;
+    int multithreaded;
+    int foreground;
+    int rv = -1;
+
     // check the program was called correctly
     assert(argc > 2 && argc < 6);
 
-    // initialize the storage with the given file
-    storage_init(argv[--argc]);
+    // read the trace settings before anything is traced
+    trace_init();
+
+    // the image's full path, fuse_daemonize changes to the root directory
+    char* image = realpath(argv[--argc], 0);
+    if (image == 0) {
+        perror(argv[argc]);
+        return 1;
+    }
 
     // init the ops
     nufs_init_ops(&nufs_ops);
 
-    // run fuse main
-    return fuse_main(argc, argv, &nufs_ops, NULL);
-}
+    // mount and run the session until it is unmounted, destroying the session
+    // calls nufs_destroy
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1) {
+        struct fuse_chan* ch = fuse_mount(mountpoint, &args);
+        g_Chan = ch;
+        if (ch != 0) {
+            struct fuse_session* se = fuse_lowlevel_new(&args, &nufs_ops, sizeof(nufs_ops), 0);
+            if (se != 0) {
+                if (fuse_set_signal_handlers(se) != -1) {
+                    fuse_session_add_chan(se, ch);
+
+                    // initialize the storage with the given file and the async
+                    // pool once daemonized, the fork only keeps the calling
+                    // thread so their threads must start in the daemon
+                    fuse_daemonize(foreground);
+                    storage_init(image);
+                    if (async_init(getenv("NUFS_ASYNC_THREADS")) == 0) {
+                        rv = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                    }
+                    else {
+                        storage_free();
+                    }
+                    fuse_remove_signal_handlers(se);
+                    fuse_session_remove_chan(ch);
+                }
+                fuse_session_destroy(se);
+            }
+            fuse_unmount(mountpoint, ch);
+        }
+        free(mountpoint);
+    }
+    fuse_opt_free_args(&args);
+    free(image);
 
+    return (rv == 0) ? 0 : 1;
+}
@@ -9,6 +9,21 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <stdint.h>
+
+// fnv-1a prime used for hashing path items
+const uint32_t c_Fnv_Prime = 0x01000193;
+
+// hashes len bytes of the path item, seed is HASH_ITEM_SEED or the hash of a
+// previous item to chain them together
+// note: item does not need to be null terminated
+uint32_t hash_item(uint32_t seed, const char* item, int len) {
+    uint32_t hash = seed;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)item[i]) * c_Fnv_Prime;
+    }
+    return hash;
+}
 
 // frees the delimited path created from delimit_path function
 void free_delimited_path(char* path) {
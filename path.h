@@ -10,6 +10,12 @@
 #ifndef PATH_H
 #define PATH_H
 
+#include <stdint.h>
+
+// the seed for hashing the first item, fnv-1a offset basis
+#define HASH_ITEM_SEED 0x811C9DC5
+
+uint32_t hash_item(uint32_t seed, const char* item, int len);
 void free_delimited_path(char* path);
 void free_parent_directory(char* path);
 char* delimit_path(const char* original_path);
@@ -0,0 +1,455 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - the snapshot table is a resident region of SNAPSHOT_MAX entries, its
+ *     entries are only written by snapshot_create while no other operation
+ *     runs, so it is read without a lock
+ *   - a snapshot's map block lists its map blocks, which list the copies of
+ *     the frozen regions' blocks in order, each holds SNAPSHOT_MAP_COUNT
+ *     entries, so an image with more than SNAPSHOT_MAP_COUNT squared frozen
+ *     blocks cannot take snapshots
+ *   - a map entry may be the same block as the last snapshot's, each frozen
+ *     block only has the one copy it needs, and a map block the last
+ *     snapshot's when none of its blocks changed
+ *   - an inode is thawed at most once per snapshot, g_Thawed remembers the
+ *     snapshot count it was last thawed at
+ *   - removing the last snapshots lowers the snapshot count, the journal no
+ *     longer knows which frozen blocks changed since the last one that remains
+ *     so the next snapshot copies all of them
+ */
+
+#include "snapshot.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+
+#include "bdev.h"
+#include "journal.h"
+#include "extent.h"
+#include "cluster.h"
+#include "path.h"
+#include "trace.h"
+
+// the number of entries in a map block
+#define SNAPSHOT_MAP_COUNT (BLOCK_SIZE / sizeof(bnum_t))
+
+// the snapshot table, the number in use and the most the image can take
+static snapshot_t* g_Snapshots =      0;
+static uint32_t    g_Snapshot_Count = 0;
+static uint32_t    g_Snapshot_Max =   0;
+
+// the number of inodes of the live tree and of each snapshot
+static inum_t      g_Snapshot_Inodes = 0;
+
+// the snapshot count at which each live inode was last thawed
+static uint32_t*   g_Thawed = 0;
+
+// the hidden directory of snapshots, it only exists in memory
+static inode_t     g_Snapshot_Dir;
+
+// the inode of every removed snapshot, empty
+static inode_t     g_Snapshot_Removed;
+
+// returns the first block and the number of blocks of the frozen regions
+static uint32_t snapshot_frozen(uint64_t* first) {
+    superblock_t* super = get_superblock();
+    *first = super->block_bitmap_start;
+    return super->snapshot_start - super->block_bitmap_start;
+}
+
+// loads the snapshot table of the mounted image
+void snapshot_init(inum_t inode_count) {
+    superblock_t* super = get_superblock();
+    uint64_t first;
+    uint32_t frozen = snapshot_frozen(&first);
+
+    g_Snapshots = bdev_get(super->snapshot_start, 0);
+    g_Snapshot_Inodes = inode_count;
+    g_Snapshot_Count = 0;
+    while (g_Snapshot_Count < SNAPSHOT_MAX && g_Snapshots[g_Snapshot_Count].map != 0) {
+        g_Snapshot_Count++;
+    }
+
+    // every snapshot's inode numbers must fit in an inum_t below the snapshot
+    // directory's
+    g_Snapshot_Max = (frozen <= SNAPSHOT_MAP_COUNT * SNAPSHOT_MAP_COUNT) ? SNAPSHOT_MAX : 0;
+    if (g_Snapshot_Max > UINT32_MAX / inode_count - 1) {
+        g_Snapshot_Max = UINT32_MAX / inode_count - 1;
+    }
+
+    free(g_Thawed);
+    g_Thawed = calloc(inode_count, sizeof(uint32_t));
+    assert(g_Thawed != 0);
+
+    memset(&g_Snapshot_Dir, 0, sizeof(g_Snapshot_Dir));
+    g_Snapshot_Dir.mode = S_IFDIR | 0555;
+    g_Snapshot_Dir.links = 2;
+    g_Snapshot_Dir.a_time = g_Snapshot_Dir.m_time = (g_Snapshot_Count > 0) ? g_Snapshots[g_Snapshot_Count - 1].time : time(0);
+}
+
+// returns the number of snapshots, blocks born before the last are frozen
+uint32_t snapshot_count() {
+    return g_Snapshot_Count;
+}
+
+// frees the blocks of a snapshot's maps that are not the last snapshot's, the
+// copies of count frozen blocks from first in the given map
+static void snapshot_free_map(bnum_t map, bnum_t last, uint32_t count) {
+    bnum_t* maps = get_block(map);
+    bnum_t* last_maps = (last != 0) ? get_block(last) : 0;
+    for (uint32_t j = 0; j * SNAPSHOT_MAP_COUNT < count; j++) {
+        if (maps[j] == 0 || (last_maps != 0 && maps[j] == last_maps[j])) {
+            continue;
+        }
+        bnum_t* copies = get_block(maps[j]);
+        bnum_t* last_copies = (last_maps != 0) ? get_block(last_maps[j]) : 0;
+        for (uint32_t k = 0; k < SNAPSHOT_MAP_COUNT && j * SNAPSHOT_MAP_COUNT + k < count; k++) {
+            if (copies[k] != 0 && (last_copies == 0 || copies[k] != last_copies[k])) {
+                block_free(copies[k], 1);
+            }
+        }
+        block_free(maps[j], 1);
+    }
+    block_free(map, 1);
+}
+
+// returns the copy of the frozen block k blocks from the first that the given
+// map block of a snapshot lists
+static void* snapshot_copy_get(bnum_t* maps, uint32_t k) {
+    bnum_t* copies = get_block(maps[k / SNAPSHOT_MAP_COUNT]);
+    void* copy = get_block(copies[k % SNAPSHOT_MAP_COUNT]);
+    put_blocks(copies);
+    return copy;
+}
+
+// fills the given map block with the copies of count frozen blocks from first,
+// the last snapshot's copies where the journal did not change a block
+// returns the number of blocks copied or a negative errno
+static int snapshot_copy(bnum_t map, bnum_t* last, uint64_t first, uint32_t count) {
+    bnum_t* copies = get_block(map);
+    int copied = 0;
+    for (uint32_t k = 0; k < count; k++) {
+        if (last != 0 && !journal_touched(first + k)) {
+            copies[k] = last[k];
+            continue;
+        }
+        bnum_t goal = (k > 0) ? copies[k - 1] + 1 : map + 1;
+        int rv = block_alloc(goal, 1, &copies[k]);
+        if (rv < 0) {
+            return rv;
+        }
+        void* dst = get_block(copies[k]);
+        memcpy(dst, bdev_get(first + k, 0), BLOCK_SIZE);
+        journal_dirty(dst, BLOCK_SIZE);
+        copied++;
+    }
+    journal_dirty(copies, BLOCK_SIZE);
+    return copied;
+}
+
+// returns whether the journal changed any of count frozen blocks from first
+static int snapshot_touched(uint64_t first, uint32_t count) {
+    for (uint32_t k = 0; k < count; k++) {
+        if (journal_touched(first + k)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// makes a snapshot of the whole tree with the name of the given length and
+// sets the inode pointer to its root
+// note: called inside an exclusive transaction, see storage_snapshot
+int snapshot_create(const char* name, int len, inum_t* inode_i) {
+    if (len == 0) {
+        return -EINVAL;
+    }
+    if (len > SNAPSHOT_NAME_MAX) {
+        return -ENAMETOOLONG;
+    }
+    inum_t found;
+    if (snapshot_find(name, len, &found) == 0) {
+        return -EEXIST;
+    }
+    if (g_Snapshot_Max == 0) {
+        return -EOPNOTSUPP;
+    }
+    if (g_Snapshot_Count >= g_Snapshot_Max) {
+        return -ENOSPC;
+    }
+
+    uint64_t first;
+    uint32_t frozen = snapshot_frozen(&first);
+    bnum_t map;
+    int rv = block_alloc(0, 1, &map);
+    if (rv < 0) {
+        return rv;
+    }
+    bnum_t* maps = get_block(map);
+    memset(maps, 0, BLOCK_SIZE);
+    bnum_t last = (g_Snapshot_Count > 0) ? g_Snapshots[g_Snapshot_Count - 1].map : 0;
+    bnum_t* last_maps = (last != 0) ? get_block(last) : 0;
+
+    // copy the frozen blocks the journal changed since the last snapshot, a
+    // map block none of them are in is the last snapshot's
+    uint32_t copied = 0;
+    for (uint32_t j = 0; j * SNAPSHOT_MAP_COUNT < frozen && rv >= 0; j++) {
+        uint64_t from = first + j * SNAPSHOT_MAP_COUNT;
+        uint32_t count = frozen - j * SNAPSHOT_MAP_COUNT;
+        if (count > SNAPSHOT_MAP_COUNT) {
+            count = SNAPSHOT_MAP_COUNT;
+        }
+        if (last_maps != 0 && !snapshot_touched(from, count)) {
+            maps[j] = last_maps[j];
+            continue;
+        }
+        bnum_t goal = (j > 0) ? maps[j - 1] + 1 : map + 1;
+        if ((rv = block_alloc(goal, 1, &maps[j])) < 0) {
+            break;
+        }
+        memset(get_block(maps[j]), 0, BLOCK_SIZE);
+        if ((rv = snapshot_copy(maps[j], (last_maps != 0) ? get_block(last_maps[j]) : 0, from, count)) >= 0) {
+            copied += rv;
+        }
+    }
+    if (rv < 0) {
+        snapshot_free_map(map, last, frozen);
+        return rv;
+    }
+    journal_dirty(maps, BLOCK_SIZE);
+
+    // add the entry, from now on every block born before is frozen
+    snapshot_t* entry = &g_Snapshots[g_Snapshot_Count];
+    memset(entry, 0, sizeof(snapshot_t));
+    memcpy(entry->name, name, len);
+    entry->map = map;
+    entry->time = time(0);
+    journal_dirty(entry, sizeof(snapshot_t));
+    journal_untouch(first, frozen);
+    g_Snapshot_Count++;
+    g_Snapshot_Dir.a_time = g_Snapshot_Dir.m_time = entry->time;
+
+    *inode_i = g_Snapshot_Count * g_Snapshot_Inodes;
+    TRACE(TRACE_INFO, TRACE_SNAPSHOT, 0, hash_item(HASH_ITEM_SEED, name, len), *inode_i, copied, 0);
+    return 0;
+}
+
+// removes the snapshot with the name of the given length from the table and
+// sets the inode pointer to its root, the removed entries at its end are
+// cleared and the blocks born after the last snapshot that remains are the
+// live tree's alone again
+// note: called inside an exclusive transaction with the snapshots' inodes
+//       locked, the caller then frees the blocks no one holds, see
+//       storage_snapshot_remove
+int snapshot_remove(const char* name, int len, inum_t* inode_i) {
+    int rv = snapshot_find(name, len, inode_i);
+    if (rv != 0) {
+        return rv;
+    }
+
+    snapshot_t* entry = &g_Snapshots[*inode_i / g_Snapshot_Inodes - 1];
+    memset(entry->name, 0, sizeof(entry->name));
+    entry->map = SNAPSHOT_REMOVED;
+    journal_dirty(entry, sizeof(snapshot_t));
+
+    uint32_t count = g_Snapshot_Count;
+    while (count > 0 && g_Snapshots[count - 1].map == SNAPSHOT_REMOVED) {
+        count--;
+    }
+    if (count < g_Snapshot_Count) {
+        uint64_t first;
+        uint32_t frozen = snapshot_frozen(&first);
+        block_epoch(count);
+        for (inum_t i = 0; i < g_Snapshot_Inodes; i++) {
+            if (g_Thawed[i] > count) {
+                g_Thawed[i] = count;
+            }
+        }
+        journal_touch(first, frozen);
+
+        // the count drops before the entries are cleared
+        uint32_t old_count = g_Snapshot_Count;
+        g_Snapshot_Count = count;
+        memset(&g_Snapshots[count], 0, (old_count - count) * sizeof(snapshot_t));
+        journal_dirty(&g_Snapshots[count], (old_count - count) * sizeof(snapshot_t));
+    }
+    g_Snapshot_Dir.a_time = g_Snapshot_Dir.m_time = time(0);
+    return 0;
+}
+
+// sets the bit of every block the snapshots hold in used, each one's maps and
+// copies of the frozen regions and the blocks of its inodes
+// note: called with the snapshots' inodes locked
+void snapshot_mark(uint64_t* used) {
+    superblock_t* super = get_superblock();
+    uint64_t first;
+    uint32_t frozen = snapshot_frozen(&first);
+    uint32_t bitmap_k = super->inode_bitmap_start - super->block_bitmap_start;
+    uint32_t table_k = super->inode_table_start - super->block_bitmap_start;
+    uint32_t per_block = BLOCK_SIZE / sizeof(inode_t);
+
+    for (uint32_t s = 0; s < g_Snapshot_Count; s++) {
+        if (g_Snapshots[s].map == SNAPSHOT_REMOVED) {
+            continue;
+        }
+
+        // its map block, map blocks and copies
+        bnum_t* maps = get_block(g_Snapshots[s].map);
+        block_mark(used, g_Snapshots[s].map, 1);
+        for (uint32_t j = 0; j * SNAPSHOT_MAP_COUNT < frozen; j++) {
+            bnum_t* copies = get_block(maps[j]);
+            block_mark(used, maps[j], 1);
+            for (uint32_t k = 0; k < SNAPSHOT_MAP_COUNT && j * SNAPSHOT_MAP_COUNT + k < frozen; k++) {
+                block_mark(used, copies[k], 1);
+            }
+            put_blocks(copies);
+        }
+
+        // and the blocks of every inode its copy of the inode bitmap has in
+        // use, a block of its inode table at a time
+        uint64_t* words = 0;
+        uint32_t words_k = 0;
+        for (inum_t i = 0; i < g_Snapshot_Inodes; i += per_block) {
+            inode_t* inodes = snapshot_copy_get(maps, table_k + i / per_block);
+            for (inum_t n = i; n < i + per_block && n < g_Snapshot_Inodes; n++) {
+                uint32_t k = bitmap_k + (uint32_t)(n / 64 * sizeof(uint64_t) / BLOCK_SIZE);
+                if (words == 0 || k != words_k) {
+                    if (words != 0) {
+                        put_blocks(words);
+                    }
+                    words = snapshot_copy_get(maps, k);
+                    words_k = k;
+                }
+                if ((words[n / 64 % (BLOCK_SIZE / sizeof(uint64_t))] >> (n % 64)) & 1) {
+                    block_mark_inode(used, &inodes[n - i]);
+                }
+            }
+            put_blocks(inodes);
+        }
+        if (words != 0) {
+            put_blocks(words);
+        }
+        put_blocks(maps);
+    }
+}
+
+// sets the inode pointer to the root of the snapshot with the name of the
+// given length
+// returns 0 on success, -ENOENT if there is none
+int snapshot_find(const char* name, int len, inum_t* inode_i) {
+    for (uint32_t s = 0; s < g_Snapshot_Count; s++) {
+        if (g_Snapshots[s].map != SNAPSHOT_REMOVED && strnlen(g_Snapshots[s].name, SNAPSHOT_NAME_MAX + 1) == len &&
+                memcmp(g_Snapshots[s].name, name, len) == 0) {
+            *inode_i = (s + 1) * g_Snapshot_Inodes;
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+// calls the function for each snapshot from the given position, the items of
+// the snapshot directory, the position after snapshot s is s + 1
+// returns the first nonzero value the function returns, or 0
+int snapshot_iterate(uint64_t pos, dir_iterate_t fn, void* arg) {
+    int rv = 0;
+    for (uint64_t s = pos; s < g_Snapshot_Count && rv == 0; s++) {
+        if (g_Snapshots[s].map != SNAPSHOT_REMOVED) {
+            rv = fn(g_Snapshots[s].name, (s + 1) * g_Snapshot_Inodes, DT_DIR, s + 1, arg);
+        }
+    }
+    return rv;
+}
+
+// returns a snapshot's inode, read from the snapshot's copy of the inode table,
+// or the snapshot directory, an inode of a removed snapshot is empty
+// note: like any block, the copy stays pinned until the caller's locks are
+//       released, see lock.h
+inode_t* snapshot_inode(inum_t inode_i) {
+    if (inode_i == SNAPSHOT_DIR_INODE) {
+        return &g_Snapshot_Dir;
+    }
+
+    superblock_t* super = get_superblock();
+    uint32_t s = inode_i / g_Snapshot_Inodes - 1;
+    uint64_t byte = (uint64_t)(inode_i % g_Snapshot_Inodes) * sizeof(inode_t);
+    if (s >= g_Snapshot_Count || g_Snapshots[s].map == SNAPSHOT_REMOVED) {
+        return &g_Snapshot_Removed;
+    }
+
+    bnum_t* maps = get_block(g_Snapshots[s].map);
+    uint32_t k = (super->inode_table_start - super->block_bitmap_start) + byte / BLOCK_SIZE;
+    return (inode_t*)((char*)snapshot_copy_get(maps, k) + byte % BLOCK_SIZE);
+}
+
+// returns the number of the first inode of the snapshot the given inode is in,
+// 0 for a live inode, so the base plus a directory item's inode is the item's
+// inode in the same snapshot
+inum_t snapshot_base(inum_t inode_i) {
+    if (inode_i < g_Snapshot_Inodes || inode_i == SNAPSHOT_DIR_INODE) {
+        return 0;
+    }
+    return (inode_i / g_Snapshot_Inodes) * g_Snapshot_Inodes;
+}
+
+// gives the root directory its own copy of its first block, block 0, which
+// extent_own takes for a hole, see snapshot_thaw
+static int snapshot_thaw_root() {
+    bnum_t copy;
+    int rv = block_alloc(1, 1, &copy);
+    if (rv < 0) {
+        return rv;
+    }
+    void* dst = get_block(copy);
+    memcpy(dst, get_block(0), BLOCK_SIZE);
+    journal_dirty(dst, BLOCK_SIZE);
+
+    // block 0 stays the snapshots', see block_free
+    int64_t old = extent_remap(0, 0, copy);
+    if (old < 0) {
+        block_free(copy, 1);
+        return (int)old;
+    }
+    block_free(0, 1);
+    return 0;
+}
+
+// gives a live inode its own copies of the frozen blocks it writes in place,
+// its extent block, cluster table and directory blocks, before it changes
+// note: called with the inode's write lock held, inside a transaction
+//       its data blocks are copied as they are written, see block_claim
+int snapshot_thaw(inum_t inode_i) {
+    assert(inode_i < g_Snapshot_Inodes);
+    if (g_Snapshot_Count == 0 || g_Thawed[inode_i] == g_Snapshot_Count) {
+        return 0;
+    }
+
+    // set first since extent_own comes back here
+    uint32_t thawed = g_Thawed[inode_i];
+    g_Thawed[inode_i] = g_Snapshot_Count;
+
+    inode_t* inode = get_inode(inode_i);
+    int rv = 0;
+    if (inode->extent_count > INODE_EXTENT_COUNT && (rv = block_thaw(&inode->e_block)) > 0) {
+        journal_dirty_inode(inode_i, 1);
+    }
+    if (rv >= 0 && (inode->flags & INODE_COMPRESSED)) {
+        rv = cluster_thaw(inode_i);
+    }
+    if (rv >= 0 && S_ISDIR(inode->mode)) {
+        rv = extent_own(inode_i, 0, inode->block_count);
+    }
+    if (rv >= 0 && inode_i == 0 && extent_map(0, 0, 0) == 0 && block_frozen(0)) {
+        rv = snapshot_thaw_root();
+    }
+    if (rv < 0) {
+        g_Thawed[inode_i] = thawed;
+        return rv;
+    }
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - a snapshot is a named, read-only copy of the whole tree as it was at one
+ *     moment, the snapshots are the items of the hidden directory SNAPSHOT_DIR
+ *     in the root and making a directory in it makes a snapshot
+ *   - a snapshot keeps its own copy of the block bitmap, the inode bitmap and
+ *     the inode table, the frozen regions, in data blocks listed by its map
+ *     blocks, the blocks its inodes point to are the live tree's blocks
+ *   - each block's birth is the number of snapshots when it was allocated, a
+ *     block born before the last snapshot is frozen, a live file copies a
+ *     frozen block before writing it like a shared block and freeing one only
+ *     drops the live tree's ownership, see block_claim and block_free
+ *   - the extent block, cluster table and directory blocks of an inode are
+ *     copied the first time the inode changes after a snapshot, see
+ *     snapshot_thaw
+ *   - a block of the frozen regions is only copied when the journal changed it
+ *     since the last snapshot, the rest are the last snapshot's copies, so a
+ *     snapshot costs the metadata changed since the last one, not the image
+ *   - a snapshot is made while no other operation runs, see
+ *     journal_begin_exclusive, so it never holds half of an operation
+ *   - the inodes of snapshot s are numbered from (s + 1) * inode_count, a
+ *     snapshot's directory items are inodes of the same snapshot
+ *   - removing a snapshot, rmdir of its directory, frees every block that
+ *     neither the live tree nor another snapshot holds, see
+ *     storage_snapshot_remove, a snapshot taken before another that remains
+ *     keeps its entry as SNAPSHOT_REMOVED so the epochs of the blocks born
+ *     after it stay the same, the entries at the end are cleared
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "storage.h"
+#include "directory.h"
+
+// the name of the hidden directory of snapshots in the root, and its inode
+#define SNAPSHOT_DIR ".snapshots"
+#define SNAPSHOT_DIR_INODE UINT32_MAX
+
+// the most snapshots an image may have and the longest name of one
+#define SNAPSHOT_MAX 256
+#define SNAPSHOT_NAME_MAX 51
+
+// the map of a removed snapshot's entry that a later snapshot still needs
+#define SNAPSHOT_REMOVED UINT32_MAX
+
+// an entry of the snapshot table, the entries in use come first
+typedef struct snapshot_t {
+    char name[SNAPSHOT_NAME_MAX + 1];       // the name, null terminated
+    bnum_t map;                             // the block of map blocks, 0 if unused
+    uint64_t time;                          // when it was made
+} snapshot_t;
+
+void snapshot_init(inum_t inode_count);
+uint32_t snapshot_count();
+int snapshot_create(const char* name, int len, inum_t* inode_i);
+int snapshot_remove(const char* name, int len, inum_t* inode_i);
+void snapshot_mark(uint64_t* used);
+int snapshot_find(const char* name, int len, inum_t* inode_i);
+int snapshot_iterate(uint64_t pos, dir_iterate_t fn, void* arg);
+inode_t* snapshot_inode(inum_t inode_i);
+inum_t snapshot_base(inum_t inode_i);
+int snapshot_thaw(inum_t inode_i);
+
+#endif
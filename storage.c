@@ -6,15 +6,41 @@
  *  notes:
  *   - directories are automatically BLOCK_SIZE on creation
  *   - mode and permissions match sys/stat defs
- *   - directories save data about its contents by path item, followed by null
- *     character, followed by a uint8_t offset to its inode
+ *   - directories save data about its contents by path item, each item holds
+ *     the item name and an inum_t offset to its inode
+ *   - directories grow a block at a time and large directories are indexed by
+ *     item hash, see directory.h for the directory formats
  *   - when navigating a path, the program always searches in root first
  *   - example: search for /dir/file.txt
  *      - search for "dir" in root
- *      - on found, get inode, it is the first uint8_t byte after the null
- *        terminator for the string "dir\0"
+ *      - on found, get inode, it is stored in the item for "dir"
  *      - search in dir's inode blocks for "file.txt"
  *      - on found set inode's offset for calling function
+ *   - every directory search is cached in the dcache (including items that
+ *     were not found), any change to a directory's items must update or
+ *     invalidate the dcache
+ *   - the image is reached through the block device, every change must be
+ *     marked with journal_dirty or journal_dirty_data or it never reaches the
+ *     image file, see journal.h
+ *   - the backend is chosen by NUFS_BACKEND (mmap, pread, direct or uring)
+ *     and the cache size in blocks by NUFS_CACHE, see bdev.h
+ *   - a block from get_block stays in memory until the caller holds no inode
+ *     lock and is outside any transaction, get_blocks and put_blocks bound
+ *     the blocks a large read or write holds at once
+ *   - a read asks the block device for all of its blocks before it copies
+ *     any, and for READAHEAD_BLOCKS more when it starts where the inode's
+ *     last read ended
+ *   - storage_read_runs gives where a file's data is in the image file
+ *     instead of copying it, once the journal has written it in place, and
+ *     they are read before the inode is unlocked so no write, truncate or
+ *     clone can free or reuse their blocks first
+ *   - a new file's data is in its inode until it outgrows INODE_INLINE_BYTES,
+ *     reading it touches nothing but the inode
+ *   - a file grows by a hole, its blocks are only allocated when data is
+ *     written to them, a hole reads as zeros without touching the disk and
+ *     the bytes of a block past the end of its file are always zero
+ *   - a compressed file is read and written a cluster at a time through
+ *     cluster.c, its data is never read from the image file in place
  *   - based on cs3650 course code
  */
 
@@ -23,9 +49,19 @@
 #include "storage.h"
 #include "bitmap.h"
 #include "path.h"
+#include "dcache.h"
+#include "handle.h"
+#include "directory.h"
+#include "extent.h"
+#include "cluster.h"
+#include "dedup.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "lock.h"
+#include "journal.h"
+#include "bdev.h"
 
 #include <string.h>
-#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -35,660 +71,1856 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <dirent.h>
+#include <pthread.h>
 
 // -------------------------- GLOBAL VARIABLES --------------------------
 
-// the disk file's file descriptor
-static int        g_Disk_FD =       -1;
+// data appended to a file before it has blocks
+typedef struct delayed_t {
+    char* data;                     // DELAYED_BYTES of memory, null if unused
+    uint32_t len;                   // the number of bytes waiting
+} delayed_t;
 
-// the base of the disk from mmap
-static void*      g_Disk_Base =      0;
+// the block device backend
+static int        g_Disk_Backend =  BDEV_MMAP;
 
-// the first slot of the data block bitmap
-static uint8_t*   g_Block_Bitmap =   0;
+// the superblock at the base of the disk
+static superblock_t* g_Super =       0;
 
-// the first slot of the inode bitmap
-static uint8_t*   g_Inode_Bitmap =   0;
+// the data block bitmap
+static bitmap_t   g_Block_Bitmap;
+
+// the inode bitmap
+static bitmap_t   g_Inode_Bitmap;
+
+// the reference count of each data block, the owners it has past the first
+static uint16_t*  g_Refcount =       0;
+
+// the number of snapshots when each data block was allocated, see snapshot.h
+static uint32_t*  g_Birth =          0;
+
+// guards both bitmaps, the reference counts, the births and the dedup index
+static pthread_mutex_t g_Alloc_Lock = PTHREAD_MUTEX_INITIALIZER;
 
 // the first slot of the inode structures
 static inode_t*   g_Inode_Base =     0;
 
-// the first slot of the data blocks
-static void*      g_Block_Base =     0;
+// the offset after the last read of each inode
+static uint64_t*  g_Read_Next =      0;
 
+// the data appended to each inode that waits for blocks, guarded by the
+// inode's lock, and if appends wait at all (NUFS_DELALLOC)
+static delayed_t* g_Delayed =        0;
+static int        g_Delalloc =       0;
 
+// if new files are compressed (NUFS_COMPRESS)
+static int        g_Compress =       0;
 
-// -------------------------- CONSTANTS ---------------------------------
+// if written blocks are deduplicated (NUFS_DEDUP)
+static int        g_Dedup =          0;
 
-// the flag used to tell if the 'disk' file was previously initialized
-const uint8_t c_Init_Flag = 0x99;
-
-// the mask to allign a pointer to a 4k BLOCK_SIZE
-const uint64_t c_Block_Mask = 0xFFFFFFFFFFFFF000;
+static void bitmap_dirty(bitmap_t* bitmap, uint64_t offset, uint64_t count);
+static int storage_delayed_flush(inum_t inode_i);
+static void storage_zero(inum_t inode_i, uint64_t offset, uint64_t end);
+static int storage_uninline(inum_t inode_i);
+static int storage_readonly(inum_t inode_i);
 
 
 
 // -------------------------- NUFS SIMILAR FUNCTIONS --------------------
 
-// recursively searches the given delimited path, sets the inode offset pointer
-// to the inode associated with the path
-int search(const char* path, uint8_t* inode_i) {
-    // the path has been fully searched, return success
-    if (strlen(path) == 0) {
+// walks the given path one item at a time from root, sets the inode offset
+// pointer to the inode associated with the path
+// note: each item is resolved through the dcache before the directory data is
+//       searched, so no copy of the path is made
+int storage_access(const char* path, inum_t* inode_i) {
+    // set the search to start in root (0)
+    inum_t path_inode = 0;
+    const char* item = path;
+    int len;
+    int rv = 0;
+
+    // loop until the path has been fully searched or an item is missing
+    while (rv == 0) {
+        // skip the '/' separators before the next item
+        while (*item == '/') {
+            item++;
+        }
+
+        // the path has been fully searched
+        if (*item == 0) {
+            break;
+        }
+
+        // look up the item in the current directory and move past it
+        len = strcspn(item, "/");
+        rv = directory_lookup(item, len, path_inode, &path_inode);
+        item += len;
+    }
+
+    // set the inode pointer if not null
+    if (inode_i != 0) {
+        *inode_i = path_inode;
+    }
+
+    return rv;
+}
+
+// truncates the given inode's size
+int storage_truncate(off_t size, inum_t inode_i) {
+    if (storage_readonly(inode_i) < 0) {
+        return -EROFS;
+    }
+
+    journal_begin();
+    inode_write_lock(inode_i);
+    int rv = storage_delayed_flush(inode_i);
+    if (rv == 0) {
+        rv = inode_truncate(size, inode_i);
+    }
+    inode_unlock(inode_i);
+    journal_end();
+    return rv;
+}
+
+// starts reading count blocks of the inode from the given inode block into
+// the block device without waiting for them, the caller holds the inode's lock
+static void storage_prefetch(inum_t inode_i, uint32_t first, uint32_t count) {
+    inode_t* inode = get_inode(inode_i);
+    if (first >= inode->block_count) {
+        return;
+    }
+    if (count > inode->block_count - first) {
+        count = inode->block_count - first;
+    }
+
+    // one request per contiguous run
+    while (count > 0) {
+        uint32_t run;
+        bnum_t block = extent_map(inode_i, first, &run);
+        if (run > count) {
+            run = count;
+        }
+        if (block != EXTENT_HOLE) {
+            bdev_prefetch((uint64_t)g_Super->data_start + block, run);
+        }
+        first += run;
+        count -= run;
+    }
+}
+
+// reads len bytes of data from the given inode at the given offset
+int storage_read(inum_t inode_i, char* data, size_t len, off_t offset) {
+    // get the inode under its lock, a snapshot's inode can be removed until
+    // it is locked, nothing to read at or past the end of the file
+    int rv = 0;
+    inode_read_lock(inode_i);
+    inode_t* inode = get_inode(inode_i);
+    uint64_t size = inode->size + storage_delayed(inode_i);
+    if (offset < size && len > 0) {
+        // update read len if it will exceed the file size
+        if (offset + len > size) {
+            len = size - offset;
+        }
+
+        // the bytes past the inode's size wait in memory for their blocks
+        size_t in_blocks = 0;
+        if (offset < inode->size) {
+            in_blocks = (offset + len > inode->size) ? inode->size - offset : len;
+        }
+
+        // an inline file's data is all in its inode
+        if ((inode->flags & INODE_INLINE) && in_blocks > 0) {
+            memcpy(data, inode->inline_data + offset, in_blocks);
+            rv = in_blocks;
+            offset += in_blocks;
+        }
+        // a compressed file's data is decompressed a cluster at a time
+        else if ((inode->flags & INODE_COMPRESSED) && in_blocks > 0) {
+            rv = cluster_read(inode_i, data, in_blocks, offset);
+            if (rv < 0) {
+                inode_unlock(inode_i);
+                return rv;
+            }
+            offset += in_blocks;
+        }
+
+        // start every block of the read at once, a sequential reader's next
+        // blocks are started as well and are read while it copies these, a
+        // snapshot's files are never read ahead
+        if (rv != in_blocks) {
+            uint32_t first = (uint32_t)(offset / BLOCK_SIZE);
+            uint32_t count = (uint32_t)((offset + in_blocks - 1) / BLOCK_SIZE) - first + 1;
+            if (inode_i < g_Super->inode_count) {
+                if (__atomic_load_n(&g_Read_Next[inode_i], __ATOMIC_RELAXED) == (uint64_t)offset) {
+                    count += READAHEAD_BLOCKS;
+                }
+                __atomic_store_n(&g_Read_Next[inode_i], offset + in_blocks, __ATOMIC_RELAXED);
+            }
+            storage_prefetch(inode_i, first, count);
+        }
+
+        // copy one contiguous run of blocks at a time, the offset only matters
+        // for the first run
+        while (rv != in_blocks) {
+            uint32_t run;
+            bnum_t block = extent_map(inode_i, (uint32_t)(offset / BLOCK_SIZE), &run);
+            uint64_t in_block = offset % BLOCK_SIZE;
+
+            // a hole is zeros, the run is all of it
+            if (block == EXTENT_HOLE) {
+                size_t bytes_to_zero = (uint64_t)run * BLOCK_SIZE - in_block;
+                if (bytes_to_zero > in_blocks - rv) {
+                    bytes_to_zero = in_blocks - rv;
+                }
+                memset(data + rv, 0, bytes_to_zero);
+                rv += bytes_to_zero;
+                offset += bytes_to_zero;
+                continue;
+            }
+
+            // bytes to read is either the rest of the run or the rest of len
+            void* src = get_blocks(block, &run) + in_block;
+            size_t bytes_to_read = (uint64_t)run * BLOCK_SIZE - in_block;
+            if (bytes_to_read > in_blocks - rv) {
+                bytes_to_read = in_blocks - rv;
+            }
+
+            // copy the data and update the return value
+            memcpy(data + rv, src, bytes_to_read);
+            put_blocks(src);
+            rv += bytes_to_read;
+            offset += bytes_to_read;
+        }
+
+        // then the rest from memory
+        if (rv != len) {
+            memcpy(data + rv, g_Delayed[inode_i].data + (offset - inode->size), len - rv);
+            rv = len;
+        }
+    }
+    inode_unlock(inode_i);
+
+    return rv;
+}
+
+// finds where len bytes of the given inode's data at the given offset are in
+// the image file and passes them to send with arg while the inode is still
+// locked, count is the size of runs, a run never spans two blocks that are not
+// adjacent in the image
+// returns the number of bytes sent or send's error, or -EAGAIN if the image
+// file does not hold the data, then it must be read with storage_read, as a
+// snapshot's file always is since the journal does not know when its blocks
+// were written
+int storage_read_runs(inum_t inode_i, size_t len, off_t offset, storage_run_t* runs, uint32_t count,
+        storage_send_t send, void* arg) {
+    // get the inode, nothing to read at or past the end of the file
+    uint32_t used = 0;
+    int rv = 0;
+    inode_read_lock(inode_i);
+    inode_t* inode = get_inode(inode_i);
+    if (storage_image_fd() < 0 || inode_i >= g_Super->inode_count || (inode->flags & (INODE_INLINE | INODE_COMPRESSED)) ||
+            g_Delayed[inode_i].len > 0 || !journal_data_written(inode_i)) {
+        rv = -EAGAIN;
+    }
+    else if (offset < inode->size && len > 0) {
+        // update read len if it will exceed the file size
+        if (offset + len > inode->size) {
+            len = inode->size - offset;
+        }
+
+        // one run per contiguous run of blocks, the offset only matters for
+        // the first run, a hole is not in the image file and must be read
+        // into memory
+        while (rv != len && used < count) {
+            uint32_t run;
+            bnum_t block = extent_map(inode_i, (uint32_t)(offset / BLOCK_SIZE), &run);
+            uint64_t in_block = offset % BLOCK_SIZE;
+            if (block == EXTENT_HOLE) {
+                rv = -EAGAIN;
+                break;
+            }
+
+            // bytes in the run is either the rest of the run or the rest of len
+            size_t bytes_to_read = (uint64_t)run * BLOCK_SIZE - in_block;
+            if (bytes_to_read > len - rv) {
+                bytes_to_read = len - rv;
+            }
+
+            runs[used].pos = ((uint64_t)g_Super->data_start + block) * BLOCK_SIZE + in_block;
+            runs[used++].len = bytes_to_read;
+            rv += bytes_to_read;
+            offset += bytes_to_read;
+        }
+    }
+
+    // the blocks stay the inode's until it is unlocked
+    if (rv >= 0) {
+        int sent = send(runs, used, arg);
+        if (sent < 0) {
+            rv = sent;
+        }
+    }
+    inode_unlock(inode_i);
+
+    return rv;
+}
+
+// copies from the data given to storage_write, arg points to the next byte
+static ssize_t storage_copy_data(void* dst, size_t len, void* arg) {
+    const char** data = (const char**)arg;
+    memcpy(dst, *data, len);
+    *data += len;
+    return len;
+}
+
+// writes len bytes of data to the data for the given inode at the given offset
+int storage_write(inum_t inode_i, const char* data, size_t len, off_t offset) {
+    return storage_write_from(inode_i, len, offset, storage_copy_data, &data);
+}
+
+// zeros the bytes of the inode's blocks from the given offset to the end
+// offset, holes are already zeros, the caller holds the inode's write lock
+// inside a transaction
+static void storage_zero(inum_t inode_i, uint64_t offset, uint64_t end) {
+    while (offset < end) {
+        uint32_t run;
+        bnum_t block = extent_map(inode_i, (uint32_t)(offset / BLOCK_SIZE), &run);
+        uint64_t in_block = offset % BLOCK_SIZE;
+        size_t bytes = (uint64_t)run * BLOCK_SIZE - in_block;
+        if (bytes > end - offset) {
+            bytes = end - offset;
+        }
+
+        if (block != EXTENT_HOLE) {
+            char* dst = (char*)get_blocks(block, &run) + in_block;
+            if (bytes > (uint64_t)run * BLOCK_SIZE - in_block) {
+                bytes = (uint64_t)run * BLOCK_SIZE - in_block;
+            }
+            memset(dst, 0, bytes);
+            journal_dirty_data(inode_i, dst, bytes);
+            put_blocks(dst);
+        }
+        offset += bytes;
+    }
+}
+
+// adds the whole blocks of every file to the dedup index when the image is
+// mounted, the first block found with some bytes is the one others share
+// returns the number of blocks added
+// note: every file's data is read once, a block past a file's last whole block
+//       is left out like storage_dedup leaves it out
+static uint64_t storage_dedup_index() {
+    uint64_t added = 0;
+    for (inum_t i = 0; i < g_Super->inode_count; i++) {
+        inode_t* inode = get_inode(i);
+        if (!bitmap_get(&g_Inode_Bitmap, i) || !S_ISREG(inode->mode) ||
+                (inode->flags & (INODE_INLINE | INODE_COMPRESSED))) {
+            continue;
+        }
+
+        uint64_t whole = inode->size / BLOCK_SIZE;
+        extent_t* extents = inode->extents;
+        if (inode->extent_count > INODE_EXTENT_COUNT) {
+            extents = get_block(inode->e_block);
+        }
+        for (uint32_t e = 0; e < inode->extent_count; e++) {
+            // one contiguous run of blocks at a time
+            uint32_t k = 0;
+            while (k < extents[e].length && extents[e].logical + k < whole) {
+                uint32_t run = extents[e].length - k;
+                char* data = get_blocks(extents[e].start + k, &run);
+                for (uint32_t j = 0; j < run && extents[e].logical + k + j < whole; j++) {
+                    uint64_t hash = dedup_hash(data + (uint64_t)j * BLOCK_SIZE);
+                    pthread_mutex_lock(&g_Alloc_Lock);
+                    if (dedup_find(hash) == 0) {
+                        dedup_add(extents[e].start + k + j, hash);
+                        added++;
+                    }
+                    pthread_mutex_unlock(&g_Alloc_Lock);
+                }
+                put_blocks(data);
+                k += run;
+            }
+        }
+        if (extents != inode->extents) {
+            put_blocks(extents);
+        }
+    }
+    return added;
+}
+
+// shares each block the bytes from offset to end cover whole with a block
+// holding the same bytes, if the dedup index has one, the block is added to the
+// index if not, the caller holds the inode's write lock inside a transaction
+// note: a block the range only partly covers, like a file's tail, is left
+//       alone so growing a file does not copy its last block again and again
+static void storage_dedup(inum_t inode_i, uint64_t offset, uint64_t end) {
+    uint32_t last = (uint32_t)(end / BLOCK_SIZE);
+    for (uint32_t logical = (uint32_t)BLOCKS_FOR(offset); logical < last; logical++) {
+        bnum_t block = extent_map(inode_i, logical, 0);
+        if (block == EXTENT_HOLE) {
+            continue;
+        }
+        bnum_t shared = block_share(block, dedup_hash(get_block(block)));
+        if (shared == 0) {
+            continue;
+        }
+
+        // the inode's own block is freed for the shared one, or the reference
+        // taken on the shared block is dropped if the extents have no room
+        if (extent_remap(inode_i, logical, shared) < 0) {
+            block_free(shared, 1);
+            continue;
+        }
+        block_free(block, 1);
+        TRACE(TRACE_DEBUG, TRACE_DEDUP, 0, inode_i, logical, block, shared);
+    }
+}
+
+// allocates the holes holding len bytes of the inode at the given offset, the
+// inode's blocks already reach past them, a new block's bytes outside the range
+// are zeroed and with zero set so are the ones in it
+// note: on failure the blocks allocated so far stay, they are zeros
+static int storage_fill(inum_t inode_i, uint64_t offset, uint64_t len, int zero) {
+    uint64_t end = offset + len;
+    uint32_t logical = (uint32_t)(offset / BLOCK_SIZE);
+    uint32_t last = (uint32_t)((end - 1) / BLOCK_SIZE);
+
+    while (logical <= last) {
+        // skip the blocks that are already allocated
+        uint32_t run;
+        if (extent_map(inode_i, logical, &run) != EXTENT_HOLE) {
+            logical += run;
+            continue;
+        }
+        if (run > last - logical + 1) {
+            run = last - logical + 1;
+        }
+
+        // allocate the hole, the blocks only the range writes are not zeroed
+        int rv = extent_alloc(inode_i, logical, run);
+        if (rv < 0) {
+            return rv;
+        }
+        uint64_t first_byte = (uint64_t)logical * BLOCK_SIZE;
+        uint64_t end_byte = (uint64_t)(logical + rv) * BLOCK_SIZE;
+        if (zero) {
+            storage_zero(inode_i, first_byte, end_byte);
+        }
+        else {
+            if (first_byte < offset) {
+                storage_zero(inode_i, first_byte, offset);
+            }
+            if (end_byte > end) {
+                storage_zero(inode_i, (end > first_byte) ? end : first_byte, end_byte);
+            }
+        }
+        logical += rv;
+    }
+
+    return 0;
+}
+
+// writes len bytes to an inline inode's data at the given offset with copy, the
+// write ends within INODE_INLINE_BYTES, the caller holds the inode's write lock
+// inside a transaction
+static int storage_write_inline(inum_t inode_i, size_t len, off_t offset, storage_copy_t copy, void* arg) {
+    inode_t* inode = get_inode(inode_i);
+    ssize_t copied = copy(inode->inline_data + offset, len, arg);
+
+    // the file now reaches the last byte written, what a short copy left
+    // unwritten past it must stay zeros
+    if (copied > 0 && offset + copied > inode->size) {
+        inode->size = offset + copied;
+    }
+    if (offset + len > inode->size) {
+        memset(inode->inline_data + inode->size, 0, offset + len - inode->size);
+    }
+    journal_dirty_inode(inode_i, 1);
+
+    // a failed copy fails the write
+    if (copied <= 0) {
+        return (copied < 0) ? (int)copied : -EIO;
+    }
+    return (int)copied;
+}
+
+// writes len bytes to the inode's blocks at the given offset with copy, the
+// caller holds the inode's write lock inside a transaction
+static int storage_write_locked(inum_t inode_i, size_t len, off_t offset, storage_copy_t copy, void* arg) {
+    inode_t* inode = get_inode(inode_i);
+    uint64_t start = (uint64_t)offset;
+    uint64_t end = start + len;
+    uint64_t blocks_needed = BLOCKS_FOR(end);
+    int rv = 0;
+
+    // an inline file stays inline while it fits, its data moves to blocks
+    // once it does not
+    if (inode->flags & INODE_INLINE) {
+        if (end <= INODE_INLINE_BYTES) {
+            return storage_write_inline(inode_i, len, offset, copy, arg);
+        }
+        if ((rv = storage_uninline(inode_i)) < 0) {
+            return rv;
+        }
+    }
+
+    // the file cannot have more blocks than a block offset can count
+    if (blocks_needed > UINT32_MAX) {
+        return -EFBIG;
+    }
+
+    // the blocks between the end of the file and the write stay a hole, only
+    // the written blocks are allocated
+    if (blocks_needed > inode->block_count) {
+        TRACE(TRACE_DEBUG, TRACE_GROW, 0, inode_i, end, 0, 0);
+        extent_hole(inode_i, (bnum_t)blocks_needed);
+    }
+
+    // a compressed file stores each cluster it writes again, what a short
+    // copy left unwritten keeps its old data so nothing is zeroed after it
+    if (inode->flags & INODE_COMPRESSED) {
+        rv = cluster_write(inode_i, len, offset, copy, arg);
+        if (rv > 0 && (uint64_t)offset + rv > inode->size) {
+            inode->size = offset + rv;
+            journal_dirty_inode(inode_i, 1);
+        }
+        return rv;
+    }
+    // a shared block is copied before it is written
+    rv = storage_fill(inode_i, offset, len, 0);
+    if (rv == 0) {
+        rv = extent_own(inode_i, (uint32_t)(start / BLOCK_SIZE), (uint32_t)((end - 1) / BLOCK_SIZE - start / BLOCK_SIZE + 1));
+    }
+
+    // copy one contiguous run of blocks at a time, the offset only matters
+    // for the first run
+    while (rv >= 0 && rv != len) {
+        uint32_t run;
+        bnum_t block = extent_map(inode_i, (uint32_t)(offset / BLOCK_SIZE), &run);
+        uint64_t in_block = offset % BLOCK_SIZE;
+
+        // bytes to write is either the rest of the run or the rest of len
+        void* dst = get_blocks(block, &run) + in_block;
+        size_t bytes_to_write = (uint64_t)run * BLOCK_SIZE - in_block;
+        if (bytes_to_write > len - rv) {
+            bytes_to_write = len - rv;
+        }
+
+        // copy the data and update total bytes written, the data is
+        // written before the transaction that maps it commits
+        ssize_t copied = copy(dst, bytes_to_write, arg);
+        if (copied > 0) {
+            journal_dirty_data(inode_i, dst, copied);
+        }
+        put_blocks(dst);
+
+        // a short copy ends the write, a failed first copy fails it
+        if (copied != bytes_to_write) {
+            if (copied > 0) {
+                rv += copied;
+            }
+            else if (rv == 0) {
+                rv = (copied < 0) ? copied : -EIO;
+            }
+            break;
+        }
+        rv += bytes_to_write;
+        offset += bytes_to_write;
+    }
+
+    // the file now reaches the last byte written, what a short copy left
+    // unwritten past it must read as zeros once the file grows over it
+    if (rv > 0 && offset > inode->size) {
+        inode->size = offset;
+        journal_dirty_inode(inode_i, 1);
+    }
+    if (rv >= 0 && (uint64_t)offset < end) {
+        storage_zero(inode_i, (offset > inode->size) ? offset : inode->size, end);
+    }
+    if (rv > 0 && g_Dedup && S_ISREG(inode->mode)) {
+        storage_dedup(inode_i, start, start + rv);
+    }
+
+    return rv;
+}
+
+// moves an inline inode's data to a block, the caller holds the inode's write
+// lock inside a transaction
+// note: on failure the inode is left inline as it was
+static int storage_uninline(inum_t inode_i) {
+    inode_t* inode = get_inode(inode_i);
+    char data[INODE_INLINE_BYTES];
+    uint64_t size = inode->size;
+    memcpy(data, inode->inline_data, sizeof(data));
+
+    // the space of the data is the extents again
+    memset(inode->inline_data, 0, sizeof(data));
+    inode->flags &= ~INODE_INLINE;
+    inode->size = 0;
+    inode->block_count = 0;
+    inode->block_used = 0;
+    inode->extent_count = 0;
+    inode->e_block = 0;
+    journal_dirty_inode(inode_i, 1);
+
+    // write the data back through the blocks
+    int rv = 0;
+    if (size > 0) {
+        const char* src = data;
+        rv = storage_write_locked(inode_i, size, 0, storage_copy_data, &src);
+    }
+    if (rv < 0) {
+        extent_shrink(inode_i, 0);
+        memcpy(inode->inline_data, data, sizeof(data));
+        inode->flags |= INODE_INLINE;
+        inode->size = size;
+        return rv;
+    }
+
+    return 0;
+}
+
+// gives the data waiting in memory for the given inode its blocks, in one run
+// if the bitmap has one, and writes it, the caller holds the inode's write
+// lock inside a transaction
+// note: on failure the data keeps waiting, the error goes to the flush, fsync
+//       or truncate that needed the blocks
+static int storage_delayed_flush(inum_t inode_i) {
+    delayed_t* delayed = &g_Delayed[inode_i];
+    inode_t* inode = get_inode(inode_i);
+    uint32_t len = delayed->len;
+    if (len == 0) {
         return 0;
     }
 
-    // get the inode confirm it is a directory, if it is not there is a bug
-    inode_t* inode = get_inode(*inode_i);
-    assert((mode_t)(inode->mode & S_IFDIR) == S_IFDIR);
+    // the size stays the same, the waiting bytes become the inode's
+    const char* data = delayed->data;
+    __atomic_store_n(&delayed->len, 0, __ATOMIC_RELAXED);
+    int rv = storage_write_locked(inode_i, len, inode->size, storage_copy_data, &data);
+    TRACE(TRACE_DEBUG, TRACE_DELALLOC, rv, inode_i, inode->size, len, 0);
+    if (rv < 0) {
+        __atomic_store_n(&delayed->len, len, __ATOMIC_RELAXED);
+        return rv;
+    }
+
+    free(delayed->data);
+    delayed->data = 0;
+    return 0;
+}
+
+// appends len bytes to the data waiting in memory for the given inode, the
+// caller holds the inode's write lock inside a transaction
+static int storage_delayed_append(inum_t inode_i, size_t len, storage_copy_t copy, void* arg) {
+    delayed_t* delayed = &g_Delayed[inode_i];
+
+    // the waiting data is given its blocks once no more fits
+    if (delayed->len + len > DELAYED_BYTES) {
+        int rv = storage_delayed_flush(inode_i);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+    if (delayed->data == 0) {
+        delayed->data = malloc(DELAYED_BYTES);
+        assert(delayed->data != 0);
+    }
+
+    ssize_t copied = copy(delayed->data + delayed->len, len, arg);
+    if (copied <= 0) {
+        return (copied < 0) ? (int)copied : -EIO;
+    }
+    __atomic_store_n(&delayed->len, delayed->len + (uint32_t)copied, __ATOMIC_RELAXED);
+    return (int)copied;
+}
+
+// writes len bytes to the data for the given inode at the given offset, copy
+// is called to fill the inode's blocks in order straight from the data
+// note: with NUFS_DELALLOC set an append waits in memory instead, anything
+//       else gives the waiting data its blocks first
+// returns the number of bytes written, fewer if copy stopped short
+int storage_write_from(inum_t inode_i, size_t len, off_t offset, storage_copy_t copy, void* arg) {
+    // get the inode, nothing to do for an empty write
+    inode_t* inode = get_inode(inode_i);
+    int rv = storage_readonly(inode_i);
+    if (rv == 0 && len > 0) {
+        journal_begin();
+        inode_write_lock(inode_i);
+
+        if (g_Delalloc && S_ISREG(inode->mode) && len <= DELAYED_BYTES &&
+                offset == inode->size + g_Delayed[inode_i].len) {
+            rv = storage_delayed_append(inode_i, len, copy, arg);
+        }
+        else if ((rv = storage_delayed_flush(inode_i)) == 0) {
+            rv = storage_write_locked(inode_i, len, offset, copy, arg);
+        }
+
+        inode_unlock(inode_i);
+        journal_end();
+    }
+
+    return rv;
+}
+
+// preallocates the blocks holding len bytes of the given inode at the given
+// offset, the holes in the range are allocated and read as zeros, unless
+// keep_size is set the size grows to cover the range
+// note: each hole is asked for as one run so a file written after it is
+//       preallocated stays contiguous on disk
+int storage_fallocate(inum_t inode_i, off_t offset, off_t len, int keep_size) {
+    inode_t* inode = get_inode(inode_i);
+    if (offset < 0 || len <= 0) {
+        return -EINVAL;
+    }
+    if (storage_readonly(inode_i) < 0) {
+        return -EROFS;
+    }
+
+    journal_begin();
+    inode_write_lock(inode_i);
+    uint64_t end = (uint64_t)offset + len;
+    uint64_t blocks_needed = BLOCKS_FOR(end);
+    int rv = 0;
+
+    if (!S_ISREG(inode->mode)) {
+        rv = -ENODEV;
+    }
+    // a compressed cluster only keeps the blocks its data needs
+    else if (inode->flags & INODE_COMPRESSED) {
+        rv = -EOPNOTSUPP;
+    }
+    else if (blocks_needed > UINT32_MAX) {
+        rv = -EFBIG;
+    }
+    else {
+        rv = storage_delayed_flush(inode_i);
+    }
+
+    // the range is given blocks, so an inline file's data moves to them
+    if (rv == 0 && (inode->flags & INODE_INLINE)) {
+        rv = storage_uninline(inode_i);
+    }
+
+    // the new blocks held other files' data so all of them are zeroed
+    if (rv == 0) {
+        if (blocks_needed > inode->block_count) {
+            extent_hole(inode_i, (bnum_t)blocks_needed);
+        }
+        rv = storage_fill(inode_i, offset, len, 1);
+    }
+    if (rv == 0 && !keep_size && end > inode->size) {
+        inode->size = end;
+        journal_dirty_inode(inode_i, 1);
+    }
+
+    inode_unlock(inode_i);
+    journal_end();
+    return rv;
+}
+
+// checks the source of a clone is a regular file in use and the inode is a
+// regular file, then gives both inodes' data waiting in memory its blocks, the
+// caller holds both write locks inside a transaction
+static int storage_clone_check(inum_t src_i, inum_t inode_i) {
+    pthread_mutex_lock(&g_Alloc_Lock);
+    int used = bitmap_get(&g_Inode_Bitmap, src_i);
+    pthread_mutex_unlock(&g_Alloc_Lock);
+    if (!used || !S_ISREG(get_inode(src_i)->mode) || !S_ISREG(get_inode(inode_i)->mode)) {
+        return -EINVAL;
+    }
+
+    int rv = storage_delayed_flush(src_i);
+    if (rv == 0) {
+        rv = storage_delayed_flush(inode_i);
+    }
+    return rv;
+}
+
+// gives the inode, which has no blocks, the source's size, data and extents,
+// every data block becomes shared by both
+// returns 0, or a negative errno and the inode still has no blocks
+static int storage_clone_blocks(inum_t src_i, inum_t inode_i) {
+    inode_t* src = get_inode(src_i);
+    inode_t* inode = get_inode(inode_i);
+    extent_t* extents = get_extents(src_i);
+    uint32_t count = (src->flags & INODE_INLINE) ? 0 : src->extent_count;
+    bnum_t e_block = 0;
+    int rv = 0;
+
+    // the inode becomes an owner of every block and gets its own copy of the
+    // extent block, if any step fails the references taken are dropped
+    uint32_t refs = 0;
+    while (refs < count && (rv = block_ref(extents[refs].start, extents[refs].length)) == 0) {
+        refs++;
+    }
+    if (rv == 0 && count > INODE_EXTENT_COUNT && (rv = block_alloc(src->e_block, 1, &e_block)) > 0) {
+        void* data = get_block(e_block);
+        memcpy(data, extents, count * sizeof(extent_t));
+        journal_dirty(data, BLOCK_SIZE);
+        rv = 0;
+    }
+    if (rv < 0) {
+        while (refs > 0) {
+            refs--;
+            block_free(extents[refs].start, extents[refs].length);
+        }
+        return rv;
+    }
+
+    // the extents in the inode share their bytes with an inline file's data,
+    // which is the longer of the two
+    memcpy(inode->inline_data, src->inline_data, sizeof(inode->inline_data));
+    inode->extent_count = src->extent_count;
+    inode->e_block = e_block;
+    inode->block_count = src->block_count;
+    inode->block_used = src->block_used;
+    inode->flags = src->flags;
+    inode->size = src->size;
+
+    // a compressed file's cluster table is copied, its blocks are not shared
+    if ((inode->flags & INODE_COMPRESSED) && (rv = cluster_clone(src_i, inode_i)) < 0) {
+        extent_shrink(inode_i, 0);
+        inode->size = 0;
+    }
+    journal_dirty_inode(inode_i, 1);
+    return rv;
+}
+
+// makes the inode's data a clone of the source's, both keep the same blocks
+// until either writes them, so the time it takes does not depend on the size
+// note: the inode's own data is freed first and it is left empty on failure
+int storage_clone(inum_t src_i, inum_t inode_i) {
+    if (src_i >= g_Super->inode_count || src_i == inode_i) {
+        return -EINVAL;
+    }
+    if (storage_readonly(inode_i) < 0) {
+        return -EROFS;
+    }
+
+    journal_begin();
+    inode_write_lock_pair(src_i, inode_i);
+    int rv = storage_clone_check(src_i, inode_i);
+    if (rv == 0) {
+        cluster_free(inode_i);
+        extent_shrink(inode_i, 0);
+        rv = storage_clone_blocks(src_i, inode_i);
+    }
+    inode_unlock_pair(src_i, inode_i);
+    journal_end();
+    return rv;
+}
+
+// clones len bytes of the source from src_offset to the inode at the given
+// offset the way storage_clone does, the inode's blocks in the range are freed
+// and a len of 0 clones to the end of the source
+// note: the offsets and len are multiples of BLOCK_SIZE, except that a range
+//       ending at the end of the source may end at or past the end of the
+//       inode, the ranges of a clone within one inode may not overlap
+int storage_clone_range(inum_t src_i, off_t src_offset, uint64_t len, inum_t inode_i, off_t offset) {
+    if (src_i >= g_Super->inode_count || src_offset < 0 || offset < 0 ||
+            src_offset % BLOCK_SIZE != 0 || offset % BLOCK_SIZE != 0) {
+        return -EINVAL;
+    }
+    if (storage_readonly(inode_i) < 0) {
+        return -EROFS;
+    }
+    inode_t* src = get_inode(src_i);
+    inode_t* inode = get_inode(inode_i);
+
+    journal_begin();
+    inode_write_lock_pair(src_i, inode_i);
+    int rv = storage_clone_check(src_i, inode_i);
+
+    // a compressed cluster's blocks mean nothing without its table entry
+    if (rv == 0 && ((src->flags | inode->flags) & INODE_COMPRESSED)) {
+        rv = -EOPNOTSUPP;
+    }
+    if (rv == 0 && len == 0 && (uint64_t)src_offset < src->size) {
+        len = src->size - src_offset;
+    }
+    uint64_t src_end = (uint64_t)src_offset + len;
+    uint64_t end = (uint64_t)offset + len;
+    if (rv == 0 && (src_end > src->size || (len % BLOCK_SIZE != 0 && (src_end != src->size || end < inode->size)))) {
+        rv = -EINVAL;
+    }
+    else if (rv == 0 && src_i == inode_i && (uint64_t)src_offset < end && (uint64_t)offset < src_end) {
+        rv = -EINVAL;
+    }
+    else if (rv == 0 && BLOCKS_FOR(end) > UINT32_MAX) {
+        rv = -EFBIG;
+    }
+
+    // an inline source's data is in its inode, it moves to blocks to be shared
+    if (rv == 0 && len > 0 && (src->flags & INODE_INLINE)) {
+        rv = storage_uninline(src_i);
+    }
+    if (rv == 0 && len > 0 && (inode->flags & INODE_INLINE)) {
+        rv = storage_uninline(inode_i);
+    }
+
+    // the inode's range becomes a hole and then each run of the source's is
+    // shared into it, a hole in the source stays a hole
+    uint32_t from = (uint32_t)(src_offset / BLOCK_SIZE);
+    uint32_t to = (uint32_t)(offset / BLOCK_SIZE);
+    uint32_t count = (uint32_t)BLOCKS_FOR(len);
+    if (rv == 0 && len > 0) {
+        if (BLOCKS_FOR(end) > inode->block_count) {
+            extent_hole(inode_i, (bnum_t)BLOCKS_FOR(end));
+        }
+        rv = extent_punch(inode_i, to, count);
+    }
+    for (uint32_t i = 0; rv == 0 && i < count; ) {
+        uint32_t run;
+        bnum_t block = extent_map(src_i, from + i, &run);
+        if (run > count - i) {
+            run = count - i;
+        }
+        if (block != EXTENT_HOLE) {
+            rv = extent_share(inode_i, to + i, block, run);
+        }
+        i += run;
+    }
+    if (rv == 0 && end > inode->size) {
+        inode->size = end;
+        journal_dirty_inode(inode_i, 1);
+    }
+
+    inode_unlock_pair(src_i, inode_i);
+    journal_end();
+    return rv;
+}
+
+// gives the data waiting in memory for the given inode its blocks, called
+// when an open file is flushed or released and before it is synced
+int storage_flush(inum_t inode_i) {
+    if (storage_delayed(inode_i) == 0) {
+        return 0;
+    }
+
+    journal_begin();
+    inode_write_lock(inode_i);
+    int rv = storage_delayed_flush(inode_i);
+    inode_unlock(inode_i);
+    journal_end();
+    return rv;
+}
+
+// returns the number of bytes appended to the given inode that wait for
+// blocks, may be called without the inode's lock
+size_t storage_delayed(inum_t inode_i) {
+    if (inode_i >= g_Super->inode_count) {
+        return 0;
+    }
+    return __atomic_load_n(&g_Delayed[inode_i].len, __ATOMIC_RELAXED);
+}
+
+// unlinks the item of the given name from the parent directory's inode
+int storage_unlink_at(inum_t inode_parent, const char* item) {
+    inum_t inode_i;
+    if (storage_readonly(inode_parent) < 0) {
+        return -EROFS;
+    }
+
+    // remove the name from the directory
+    journal_begin();
+    inode_write_lock(inode_parent);
+    int rv = directory_remove(item, strlen(item), inode_parent, &inode_i);
+    inode_unlock(inode_parent);
+
+    // if there are no links left and nothing has the inode open or looked
+    // up, free the data, otherwise the last release or forget frees it
+    if (rv == 0 && handle_unlink(inode_i)) {
+        storage_free_inode(inode_i);
+    }
+    journal_end();
+
+    return rv;
+}
+
+// unlinks a path from its inode
+int storage_unlink(const char* path) {
+    inum_t inode_parent;
+    char* parent = parent_directory(path);
+    const char* item = path + strlen(parent) + 1;
+
+    // get access to the parent directory's inode
+    int rv = storage_access(parent, &inode_parent);
+    if (rv == 0) {
+        rv = storage_unlink_at(inode_parent, item);
+    }
+
+    // free the parent
+    free_parent_directory(parent);
+
+    return rv;
+}
+
+// releases an open handle, frees its inode if it was unlinked while open,
+// otherwise the data appended through it is given its blocks
+void storage_release(uint64_t fh) {
+    inum_t inode_i;
+    journal_begin();
+    if (handle_release(fh, &inode_i)) {
+        storage_free_inode(inode_i);
+    }
+    else {
+        storage_flush(inode_i);
+    }
+    journal_end();
+}
+
+// makes the changes to the given inode durable, with datasync set only its
+// data and the metadata needed to read it back
+// note: an inode whose metadata is already on disk only has its own data
+//       blocks written and flushed, otherwise the running transaction is
+//       committed with everything in it
+int storage_fsync(inum_t inode_i, int datasync) {
+    // data waiting in memory has no blocks to write yet
+    int rv = storage_flush(inode_i);
+    if (rv < 0) {
+        return rv;
+    }
+
+    // the lock keeps the inode's blocks its own while they are written, a
+    // snapshot's file is durable once the snapshot is committed
+    inode_read_lock(inode_i);
+    rv = (inode_i < g_Super->inode_count) ? journal_write_inode(inode_i, datasync) : 1;
+    inode_unlock(inode_i);
+
+    // the commit waits for other operations, no lock can be held
+    if (rv > 0) {
+        rv = journal_commit();
+    }
+
+    return rv;
+}
+
+// frees the data blocks of an inode with no links and the inode itself
+// note: the inode can no longer be reached by a path or a handle so no lock is
+//       needed
+void storage_free_inode(inum_t inode_i) {
+    // free every extent of the inode and its extent block if it has one
+    inode_t* inode = get_inode(inode_i);
+    journal_begin();
+    cluster_free(inode_i);
+    extent_shrink(inode_i, 0);
+
+    // and the data that was still waiting for blocks
+    free(g_Delayed[inode_i].data);
+    g_Delayed[inode_i].data = 0;
+    g_Delayed[inode_i].len = 0;
+
+    // a freed directory's items can no longer be looked up, drop them before
+    // the inode is reused
+    if ((mode_t)(inode->mode & S_IFDIR) == S_IFDIR) {
+        dcache_invalidate_dir(inode_i);
+    }
+
+    // free the inode from use
+    pthread_mutex_lock(&g_Alloc_Lock);
+    bitmap_set(&g_Inode_Bitmap, 0, inode_i);
+    pthread_mutex_unlock(&g_Alloc_Lock);
+    bitmap_dirty(&g_Inode_Bitmap, inode_i, 1);
+    journal_end();
+}
+
+// drops nlookup of the lookups the kernel holds on the given inode, frees it
+// if it was unlinked and nothing else refers to it
+void storage_forget(inum_t inode_i, uint64_t nlookup) {
+    journal_begin();
+    if (handle_forget(inode_i, nlookup)) {
+        storage_free_inode(inode_i);
+    }
+    journal_end();
+}
+
+// links the given inode into the parent directory under the given name
+int storage_link_at(inum_t inode_i, inum_t inode_parent, const char* item) {
+    // a snapshot's inode has no links to add and its directories no items
+    if (storage_readonly(inode_i) < 0 || storage_readonly(inode_parent) < 0) {
+        return -EROFS;
+    }
+
+    // increase the inode's link count unless it was unlinked since it was
+    // looked up
+    journal_begin();
+    int rv = handle_link(inode_i);
+    if (rv == 0) {
+        // add the item to the directory with the inode's offset
+        inode_write_lock(inode_parent);
+        rv = directory_add(item, strlen(item), inode_parent, inode_i);
+        inode_unlock(inode_parent);
+
+        // the link was not made, this may have been the last link
+        if (rv != 0 && handle_unlink(inode_i)) {
+            storage_free_inode(inode_i);
+        }
+    }
+    journal_end();
+
+    return rv;
+}
+
+// links a given path's inode to another
+// 'to's inode will be the same as that of 'from'
+int storage_link(const char* from, const char* to) {
+    inum_t inode_i;
+    
+    // get access to froms inode
+    int rv = storage_access(from, &inode_i);
+    if (rv == 0) {
+        inum_t inode_ip;
+
+        // get the parent directory of to
+        char* parent = parent_directory(to);
+        const char* item = to + strlen(parent) + 1;
+
+        // get access to to's parent directory and add the link to it
+        if ((rv = storage_access(parent, &inode_ip)) == 0) {
+            rv = storage_link_at(inode_i, inode_ip, item);
+        }
+
+        // free the parent
+        free_parent_directory(parent);
+    }
+
+    return rv;
+}
+
+// stops a dir_iterate at the first item, see storage_rename_check
+static int storage_any_item(const char* item, inum_t inode_i, uint8_t type, uint64_t next, void* arg) {
+    return 1;
+}
+
+// returns 0 if the inode may replace the existing item's inode in a rename,
+// -EISDIR or -ENOTDIR if one is a directory and the other is not, or
+// -ENOTEMPTY if the replaced directory has items
+// note: the replaced directory is read locked after its parents, which only
+//       a rename does, under the rename lock, see lock.h
+static int storage_rename_check(inum_t inode_i, inum_t inode_replaced, inum_t inode_from_parent) {
+    int is_dir = S_ISDIR(get_inode(inode_i)->mode);
+    if (is_dir != S_ISDIR(get_inode(inode_replaced)->mode)) {
+        return is_dir ? -ENOTDIR : -EISDIR;
+    }
+    if (!is_dir) {
+        return 0;
+    }
+
+    // a parent being replaced holds the item moving into its place
+    if (inode_replaced == inode_from_parent) {
+        return -ENOTEMPTY;
+    }
+    inode_read_lock(inode_replaced);
+    int rv = dir_iterate(inode_replaced, 0, storage_any_item, 0);
+    inode_unlock(inode_replaced);
+    return (rv != 0) ? -ENOTEMPTY : 0;
+}
+
+// moves the item of the given name in one directory to the item of the other
+// name in another, replacing that item if there is one
+// note: a directory only replaces an empty directory and a file only a file,
+//       the replaced item is only removed once the move can no longer fail
+int storage_rename_at(inum_t inode_from_parent, const char* from_item, inum_t inode_to_parent, const char* to_item) {
+    int from_len = strlen(from_item);
+    int to_len = strlen(to_item);
+    inum_t inode_i;
+    inum_t inode_replaced;
+    int replaced = 0;
+    if (storage_readonly(inode_from_parent) < 0 || storage_readonly(inode_to_parent) < 0) {
+        return -EROFS;
+    }
+
+    // only one rename locks two directories at a time
+    journal_begin();
+    rename_lock();
+    inode_write_lock_pair(inode_from_parent, inode_to_parent);
+
+    // find both items, an existing 'to' must be replaceable, a rename onto
+    // another link of the same inode does nothing
+    int rv = dir_find(inode_from_parent, from_item, from_len, &inode_i);
+    if (rv == 0 && dir_find(inode_to_parent, to_item, to_len, &inode_replaced) == 0) {
+        replaced = 1;
+        if (inode_replaced == inode_i) {
+            replaced = 0;
+            rv = 1;
+        }
+        else {
+            rv = storage_rename_check(inode_i, inode_replaced, inode_from_parent);
+        }
+    }
+
+    // move the item, an existing 'to' is removed first so the directory never
+    // has two items of the same name, and put back if the move fails
+    if (rv == 0) {
+        rv = directory_remove(from_item, from_len, inode_from_parent, &inode_i);
+    }
+    if (rv == 0 && replaced && (rv = directory_remove(to_item, to_len, inode_to_parent, &inode_replaced)) != 0) {
+        directory_add(from_item, from_len, inode_from_parent, inode_i);
+    }
+    else if (rv == 0 && (rv = directory_add(to_item, to_len, inode_to_parent, inode_i)) != 0) {
+        // the space the items used is free
+        directory_add(from_item, from_len, inode_from_parent, inode_i);
+        if (replaced) {
+            directory_add(to_item, to_len, inode_to_parent, inode_replaced);
+        }
+    }
+
+    inode_unlock_pair(inode_from_parent, inode_to_parent);
+
+    // the replaced item lost a link
+    if (rv == 0 && replaced && handle_unlink(inode_replaced)) {
+        storage_free_inode(inode_replaced);
+    }
+
+    rename_unlock();
+    journal_end();
+
+    return (rv == 1) ? 0 : rv;
+}
+
+// moves the item at 'from' to 'to', replacing the item at 'to' if there is one
+int storage_rename(const char* from, const char* to) {
+    inum_t inode_from_parent;
+    inum_t inode_to_parent;
+    char* from_parent = parent_directory(from);
+    char* to_parent = parent_directory(to);
+    const char* from_item = from + strlen(from_parent) + 1;
+    const char* to_item = to + strlen(to_parent) + 1;
+
+    // get access to both parent directories
+    int rv = storage_access(from_parent, &inode_from_parent);
+    if (rv == 0 && (rv = storage_access(to_parent, &inode_to_parent)) == 0) {
+        rv = storage_rename_at(inode_from_parent, from_item, inode_to_parent, to_item);
+    }
+
+    // free the parents
+    free_parent_directory(from_parent);
+    free_parent_directory(to_parent);
+
+    return rv;
+}
+
+// adds a new item of the given name to the parent directory
+int storage_mknod_at(inum_t inode_parent, const char* new_item, mode_t mode, inum_t* inode_ret) {
+    // ensure the inode is a directory and there are search/modification
+    // permissions
+    inode_t* inode = get_inode(inode_parent);
+    int rv;
+    if (storage_readonly(inode_parent) < 0) {
+        return -EROFS;
+    }
+
+    journal_begin();
+    inode_write_lock(inode_parent);
+    if ((mode_t)(inode->mode & S_IFDIR) != S_IFDIR) {
+        rv = -ENOTDIR;
+    }
+    else if ((mode_t)(inode->mode & S_IXUSR) != S_IXUSR) {
+        rv = -EACCES;
+    }
+    // allocate the new inode
+    else if ((rv = inode_alloc()) >= 0) {
+        inum_t new_inode = (inum_t)rv;
+
+        // initialize the inode's data before it can be found
+        inode = get_inode(new_inode);
+        inode->mode = mode;
+        inode->links = 1;
+        inode->extent_count = 0;
+        inode->e_block = 0;
+        inode->c_block = 0;
+
+        inode->flags = 0;
+        inode->block_count = 0;
+        inode->block_used = 0;
+        inode->size = 0;
+
+        // a file starts with its data in the inode
+        if (S_ISREG(mode)) {
+            memset(inode->inline_data, 0, INODE_INLINE_BYTES);
+            inode->flags = INODE_INLINE | (g_Compress ? INODE_COMPRESSED : 0);
+        }
+        journal_dirty_inode(new_inode, 1);
+
+        // if the item is a directory it gets its initial block, the item is
+        // a file otherwise and has no data associated with it
+        rv = 0;
+        if ((mode_t)(mode & S_IFDIR) == S_IFDIR) {
+            rv = dir_init(new_inode);
+        }
 
-    // get the data blocks for the directory
-    uint8_t* blocks = get_blocks(*inode_i);
-    void* block;
-
-    // loop over all data blocks
-    for (int i = 0; i < inode->block_count; i++) {
-        // get the current data block
-        block = get_block(blocks[i]);
-
-        // loop until last directory item is found
-        while (strlen(block)) {
-            // set the inode to the current item's inode
-            *inode_i = *(uint8_t*)(block + strlen(block) + 1);
-            
-            // if the current item if the item of interest
-            if (strcmp(block, path) == 0) {
-                // recursively search that inode's data for the next path item
-                return search(path + strlen(path) + 1, inode_i);
-            }
+        // add the new item to the parent's directory
+        if (rv == 0) {
+            rv = directory_add(new_item, strlen(new_item), inode_parent, new_inode);
+        }
 
-            // continue to the next item in the block
-            block += strlen(block) + 2;
+        // set the ret inode, on failure nothing refers to the new inode
+        if (rv == 0) {
+            *inode_ret = new_inode;
+        }
+        else {
+            inode->links = 0;
+            storage_free_inode(new_inode);
         }
     }
+    inode_unlock(inode_parent);
+    journal_end();
 
-    // if the full loops above successfully finish, there is no entry
-    return -ENOENT;
+    return rv;
 }
 
-// accesses the given path's inode
-// note: inode_i can be null if just checking the item exists
-int storage_access(const char* path, uint8_t* inode_i) {
-    // delimit the path and set the search to start in root (0)
-    uint8_t path_inode = 0;
-    char* path_d = delimit_path(path);
-
-    // launch the search algorithm
-    int rv = search(path_d, &path_inode);
-
-    // free the delimited path
-    free_delimited_path(path_d);
-
-    // set the inode pointer if not null
-    if (inode_i != 0) {
-        *inode_i = path_inode;
+// adds a new item to the file system
+int storage_mknod(const char* path, mode_t mode, inum_t* inode_ret) {
+    char* parent = parent_directory(path);
+    const char* new_item = path + strlen(parent) + 1;
+    inum_t inode_i;
+    
+    // get access to the parent directory's inode
+    int rv = storage_access(parent, &inode_i);
+    if (rv == 0) {
+        rv = storage_mknod_at(inode_i, new_item, mode, inode_ret);
     }
+    
+    // free the parent
+    free_parent_directory(parent);
 
     return rv;
 }
 
-// truncates the given inode's size
-int storage_truncate(off_t size, uint8_t inode_i) {
-    // get the inode and set the number of blocks needed for the new size
-    inode_t* inode = get_inode(inode_i);
-    int blocks_needed = (size / BLOCK_SIZE) + (size % BLOCK_SIZE == 0 ? 0 : 1);
-
-    // assume success
+// makes a snapshot of the whole tree with the given name and sets the inode
+// pointer to its root, see snapshot.h
+// note: no other operation runs while it is made, the data waiting in memory
+//       is given its blocks first so the snapshot has every write before it
+int storage_snapshot(const char* name, inum_t* inode_ret) {
     int rv = 0;
+    journal_begin_exclusive();
+    for (inum_t i = 0; g_Delalloc && rv == 0 && i < g_Super->inode_count; i++) {
+        rv = storage_flush(i);
+    }
+    if (rv == 0) {
+        rv = snapshot_create(name, strlen(name), inode_ret);
+    }
+    journal_end();
+    return rv;
+}
 
-    // only need to alloc/free blocks if the counts are different
-    if (blocks_needed != inode->block_count) {
-        // get the inodes data block offsets
-        uint8_t* blocks = get_blocks(inode_i);
-        
-        // free blocks for other file data
-        if (blocks_needed < inode->block_count) {
-            // loop over all unneeded blocks and update the bitmap
-            for (int i = blocks_needed; i < inode->block_count; i++) {
-                bitmap_set(g_Block_Bitmap, 0, blocks[i], BITMAP_SIZE);
-            }
+// removes the snapshot with the given name, see snapshot.h, then frees every
+// data block that neither the live tree nor a snapshot that remains holds
+// note: no other operation runs and no snapshot inode is locked while it is
+//       removed, so no reader is inside the blocks it frees
+int storage_snapshot_remove(const char* name) {
+    journal_begin_exclusive();
+    snapshots_write_lock();
+    inum_t root;
+    int rv = snapshot_remove(name, strlen(name), &root);
+    uint64_t freed = 0;
+    if (rv == 0) {
+        // its inode numbers may be another snapshot's next
+        dcache_invalidate_dirs(root, g_Super->inode_count);
 
-            // if the block was previously using an indirect offset, switch to
-            // direct block offfsets if possible
-            if (blocks_needed <= DIRECT_BLOCK_COUNT && inode->block_count > DIRECT_BLOCK_COUNT) {
-                // copy all block offsets to the direct array
-                for (int i = 0; i < blocks_needed; i++) {
-                    inode->d_blocks[i] = blocks[i];
-                }
+        uint64_t* used = calloc(BITMAP_BYTES((uint64_t)g_Super->block_count), 1);
+        assert(used != 0);
 
-                // the indirect block offset cannot be 0, 0 is always the root
-                assert(inode->i_block != 0);
-                
-                // update the indirect block as free
-                bitmap_set(g_Block_Bitmap, 0, inode->i_block, BITMAP_SIZE);
+        // block 0 is always in use, see block_free
+        block_mark(used, 0, 1);
+        for (inum_t i = 0; i < g_Super->inode_count; i++) {
+            if (bitmap_get(&g_Inode_Bitmap, i)) {
+                block_mark_inode(used, get_inode(i));
             }
         }
-        // allocate more blocks
-        else {
-            // get the number of new blocks needed and allocate array to hold
-            // the new offsets
-            int new_blocks_count = blocks_needed - inode->block_count;
-            uint8_t* new_blocks = malloc(new_blocks_count * sizeof(uint8_t));
-            uint8_t block_pointer_switch = 0;
-            
-            // allocate a block for every new block needed
-            for (int i = 0; i < new_blocks_count; i++) {
-                // alloc the block
-                rv = bitmap_next(g_Block_Bitmap, BITMAP_SIZE);
-                new_blocks[i] = (uint8_t)rv;
-                
-                // on success update bitmap so the next free block can be
-                // obtained
-                if (rv >= 0) {
-                    bitmap_set(g_Block_Bitmap, 1, new_blocks[i], BITMAP_SIZE);
-
-                    // set rv to succes for when loop ends
-                    rv = 0;
-                }
-                // on failure do not attempt to allocate more blocks
-                else {
-                    break;
-                }
+        snapshot_mark(used);
+
+        // the rest of the blocks in use were only the removed snapshot's
+        pthread_mutex_lock(&g_Alloc_Lock);
+        for (bnum_t b = 0; b < g_Super->block_count; b++) {
+            if (bitmap_get(&g_Block_Bitmap, b) && !((used[b / 64] >> (b % 64)) & 1)) {
+                dedup_remove(b);
+                bitmap_set(&g_Block_Bitmap, 0, b);
+                bitmap_dirty(&g_Block_Bitmap, b, 1);
+                journal_free((uint64_t)g_Super->data_start + b, 1);
+                freed++;
             }
+        }
+        pthread_mutex_unlock(&g_Alloc_Lock);
+        free(used);
+    }
+    snapshots_unlock();
+    journal_end();
+    TRACE(TRACE_INFO, TRACE_SNAPSHOT_REMOVE, rv, hash_item(HASH_ITEM_SEED, name, strlen(name)), freed, 0, 0);
+    return rv;
+}
 
-            // if successful in allocating all needed blocks
-            if (rv == 0) {
-                // if a direct offsets are being used and indirect blocks are
-                // needed, allocate another block to hold the indirect offsets
-                if (inode->block_count <= DIRECT_BLOCK_COUNT && blocks_needed > DIRECT_BLOCK_COUNT) {
-                    if ((rv = bitmap_next(g_Block_Bitmap, BITMAP_SIZE)) >= 0) {
-                        // on success set the indirect block and update the
-                        // bitmap
-                        inode->i_block = (uint8_t)rv;
-
-                        // copy the old blocks to the new indirect offset block
-                        uint8_t* i_blocks = get_block(inode->i_block);
-                        for (int i = 0; i < inode->block_count; i++) {
-                            i_blocks[i] = blocks[i];
-                        }
-
-                        // the block offsets pointer is now the newly allocated
-                        // block, set block pointer switch flag is true, update
-                        // bitmap
-                        bitmap_set(g_Block_Bitmap, 1, inode->i_block, BITMAP_SIZE);
-                        block_pointer_switch = 1;
-                        blocks = i_blocks;
-                        rv = 0;
-                    }
-                }
 
-                // on success of allocation of new blocks and/or switch to
-                // indirect block
-                if (rv == 0) {
-                    // set the new blocks in the inode's block array, blocks
-                    // variable has been updated to point to the indirect block
-                    // memory if a switch had occurred
-                    for (int i = 0; i < new_blocks_count; i++) {
-                        blocks[i + inode->block_count] = new_blocks[i];
-                    }
 
-                    // allocation success
-                    rv = 0;
-                }
-            }
+// -------------------------- DIRECTORY MANIPULATION FUNCTIONS ----------
 
-            // on failure free all the blocks
-            if (rv != 0) {
-                int i = 0;
+// returns 1 if the item of the given length in the parent directory is the
+// hidden snapshot directory, which is not one of the root's items
+static int storage_snapshot_dir(const char* item, int len, inum_t inode_parent) {
+    return (inode_parent == 0 && len == strlen(SNAPSHOT_DIR) && memcmp(item, SNAPSHOT_DIR, len) == 0);
+}
 
-                // free all allocated blocks
-                while (new_blocks[i] >= 0 && i < new_blocks_count) {
-                    bitmap_set(g_Block_Bitmap, 0, new_blocks[i++], BITMAP_SIZE);
-                }
+// looks up the item of the given length in the parent directory, sets the
+// inode pointer to the item's inode
+// note: item does not need to be null terminated
+//       the parent is read locked while it is searched, the caller must not
+//       hold its lock
+int directory_lookup(const char* item, int len, inum_t inode_parent, inum_t* inode_i) {
+    // the snapshots come and go without the dcache knowing
+    if (storage_snapshot_dir(item, len, inode_parent)) {
+        *inode_i = SNAPSHOT_DIR_INODE;
+        return 0;
+    }
+    if (inode_parent == SNAPSHOT_DIR_INODE) {
+        inode_read_lock(inode_parent);
+        int rv = snapshot_find(item, len, inode_i);
+        inode_unlock(inode_parent);
+        return rv;
+    }
 
-                // if the block pointer switch was a success, free indirect
-                // block
-                if (block_pointer_switch) {
-                    bitmap_set(g_Block_Bitmap, 0, inode->i_block, BITMAP_SIZE);
-                }
-            }
+    // answer from the cache if possible
+    int rv = dcache_lookup(inode_parent, item, len, inode_i);
+    if (rv != DCACHE_MISS) {
+        return rv;
+    }
 
-            // free the new blocks array
-            free(new_blocks);
-        }
+    // the parent must be a directory to search it
+    inode_read_lock(inode_parent);
+    inode_t* inode = get_inode(inode_parent);
+    if ((mode_t)(inode->mode & S_IFDIR) != S_IFDIR) {
+        rv = -ENOTDIR;
     }
-    
-    // on success update inode's size and block count
-    if (rv == 0) {
-        inode->block_count = blocks_needed;
-        inode->size = size;
+    // search the directory's data and cache the result, found or not
+    else if ((rv = dir_find(inode_parent, item, len, inode_i)) == 0) {
+        dcache_insert(inode_parent, item, len, *inode_i);
     }
+    else if (rv == -ENOENT) {
+        dcache_insert_negative(inode_parent, item, len);
+    }
+    inode_unlock(inode_parent);
 
     return rv;
 }
 
-// reads len bytes of data from the given path at the given offset
-int storage_read(const char* path, char* data, size_t len, off_t offset) {
-    uint8_t inode_i;
+// adds the item of the given length to the parent directory with the given
+// inode, the caller holds the parent's write lock
+int directory_add(const char* item, int len, inum_t inode_parent, inum_t inode_i) {
+    if (storage_snapshot_dir(item, len, inode_parent)) {
+        return -EEXIST;
+    }
+    int rv = dir_insert(inode_parent, item, len, inode_i, IFTODT(get_inode(inode_i)->mode));
 
-    // get access to the path's inode
-    int rv = storage_access(path, &inode_i);
+    // the item now exists, replacing any negative cache entry
     if (rv == 0) {
-        // get the inode, update read len if it will exceed the file size
-        inode_t* inode = get_inode(inode_i);
-        if (offset + len > inode->size) {
-            len = inode->size - offset;
-        }
+        dcache_insert(inode_parent, item, len, inode_i);
+        journal_dirty_inode(inode_parent, 1);
+    }
 
-        // get the data blocks for the inode
-        uint8_t* blocks = get_blocks(inode_i);
+    return rv;
+}
 
-        // set the inital block based on the offset
-        uint8_t current_block = (uint8_t)(offset / BLOCK_SIZE);
+// removes the item of the given length from the parent directory and sets the
+// inode pointer to the item's inode, the caller holds the parent's write lock
+int directory_remove(const char* item, int len, inum_t inode_parent, inum_t* inode_i) {
+    // if the mode is not directory there is a bug
+    inode_t* inode = get_inode(inode_parent);
+    assert((mode_t)(inode->mode & S_IFDIR) == S_IFDIR);
 
-        // update the offset, it only matters for the first block
-        offset %= BLOCK_SIZE;
+    // remove the item, it no longer exists in the parent
+    int rv = dir_find(inode_parent, item, len, inode_i);
+    if (rv == 0 && (rv = dir_delete(inode_parent, item, len)) == 0) {
+        dcache_invalidate(inode_parent, item, len);
+        journal_dirty_inode(inode_parent, 1);
+    }
 
-        // set the bytes to read, either up until the end of the current block
-        // or the total len to read
-        int bytes_to_read = ((BLOCK_SIZE - offset) < len) ? (BLOCK_SIZE - offset) : len;
+    return rv;
+}
 
-        // copy the block data to the data buffer
-        memcpy(data, get_block(blocks[current_block++]) + offset, bytes_to_read);
 
-        // update return value
-        rv = bytes_to_read;
-        
-        // while the total number of bytes to read is not the length, continue
-        // to read data
-        while (rv != len) {
-            // bytes to read is either a full block or the partial amount left
-            // of the length
-            bytes_to_read = (((len - rv) >= BLOCK_SIZE) ? BLOCK_SIZE : (len - rv));
 
-            // copy the data and update the return value
-            memcpy(data + rv, get_block(blocks[current_block++]), bytes_to_read);
-            rv += bytes_to_read;
-        }
-    }
+// -------------------------- BLOCK AND INODE FUNCTIONS -----------------
 
-    return rv;
+// marks the words of the bitmap holding count bits from offset as changed
+static void bitmap_dirty(bitmap_t* bitmap, uint64_t offset, uint64_t count) {
+    uint64_t first = offset / 64;
+    uint64_t last = (offset + count - 1) / 64;
+    journal_dirty(bitmap->words + first, (last - first + 1) * sizeof(uint64_t));
 }
 
-// writes len bytes of data to the data for the given path at the given offset
-int storage_write(const char* path, const char* data, size_t len, off_t offset, uint8_t* inode_ret) {
-    uint8_t inode_i;
+// returns the superblock of the mounted image
+superblock_t* get_superblock() {
+    return g_Super;
+}
 
-    // get access to the path's inode
-    int rv = storage_access(path, &inode_i);
-    if (rv == 0) {
-        *inode_ret = inode_i;
-        inode_t* inode = get_inode(inode_i);
-        
-        // truncate the inode so it can actually have all bytes written, if
-        // possible
-        if (offset + len > inode->size) {
-            printf("more space needed...\n");
-            rv = storage_truncate(offset + len, inode_i);
-        }
+// returns the image file for reading the runs of storage_read_runs, -1 if the
+// backend cannot share it, see bdev_fd
+int storage_image_fd() {
+    return bdev_fd();
+}
 
-        // on success of truncate (or by default), begin reading
-        if (rv == 0) {
-            // get the inodes blocks
-            uint8_t* blocks = get_blocks(inode_i);
-
-            // set the current block based on the offset
-            uint8_t current_block = (uint8_t)(offset / BLOCK_SIZE);
-
-            // update the offset for the first block, it doesnt matter elsewhere
-            offset %= BLOCK_SIZE;
-
-            // bytes to write is either the rest of the first block or the total
-            // length to write
-            int bytes_to_write = ((BLOCK_SIZE - offset) < len) ? (BLOCK_SIZE - offset) : len;
-
-            // copy the data from the buffer to the current block
-            memcpy(get_block(blocks[current_block++]) + offset, data, bytes_to_write);
-
-            // update the return value
-            rv = bytes_to_write;
-            
-            // continue writing until the total number of bytes written is the
-            // length
-            while (rv != len) {
-                // bytes to write is either the full block or the remaining
-                // length bytes
-                bytes_to_write = (((len - rv) >= BLOCK_SIZE) ? BLOCK_SIZE : (len - rv));
-
-                // copy the data and update total bytes written
-                memcpy(get_block(blocks[current_block++]), data + rv, bytes_to_write);
-                rv += bytes_to_write;
-            }
-        }
-    }
+// returns -EROFS if the given inode is a snapshot's or the snapshot directory,
+// which never change, 0 otherwise
+static int storage_readonly(inum_t inode_i) {
+    return (inode_i >= g_Super->inode_count) ? -EROFS : 0;
+}
 
-    return rv;
+// returns the inode at the given offset, an inode past the image's inodes is a
+// snapshot's, see snapshot_inode
+inode_t* get_inode(inum_t inode_i) {
+    if (inode_i >= g_Super->inode_count) {
+        return snapshot_inode(inode_i);
+    }
+    return g_Inode_Base + inode_i;
 }
 
-// unlinks a path from its inode
-int storage_unlink(const char* path) {
-    uint8_t inode_i;
+// truncates the given inode's size, the caller holds the inode's write lock
+// note: a file grows by a hole, a directory's new blocks are allocated as one
+//       contiguous run after its last block when the bitmap has one, see
+//       extent.c
+//       growing keeps blocks preallocated past the new size, only shrinking
+//       frees them
+int inode_truncate(off_t size, inum_t inode_i) {
+    // get the inode and set the number of blocks needed for the new size
+    inode_t* inode = get_inode(inode_i);
+    uint64_t blocks_needed = BLOCKS_FOR((uint64_t)size);
 
-    // get access to the path's inode
-    int rv = storage_access(path, &inode_i);
-    if (rv == 0) {
-        // remove the path name from the directory
-        if ((rv = directory_remove(path)) == 0) {
-            // update the inode's link count
-            inode_t* inode = get_inode(inode_i);
-
-            // if there are no links left, free the data
-            if (--inode->links == 0) {
-                // get the inode's blocks, loop over all blocks and update the
-                // block bitmap accordingly
-                uint8_t* blocks = get_blocks(inode_i);
-                for (int i = 0; i < inode->block_count; i++) {
-                    bitmap_set(g_Block_Bitmap, 0, blocks[i], BITMAP_SIZE);
-                }
+    // the file cannot have more blocks than a block offset can count
+    if (blocks_needed > UINT32_MAX) {
+        return -EFBIG;
+    }
 
-                // if using indirect block pointer, free that block as well
-                if (inode->block_count > DIRECT_BLOCK_COUNT) {
-                    // the indirect block cannot be the root
-                    assert(inode->i_block != 0);
-                    bitmap_set(g_Block_Bitmap, 0, inode->i_block, BITMAP_SIZE);
-                }
+    // assume success
+    int rv = 0;
 
-                // update the block count and free the inode from use
-                inode->block_count = 0;
-                bitmap_set(g_Inode_Bitmap, 0, inode_i, BITMAP_SIZE);
+    // an inline file that still fits only changes its size, the bytes past
+    // its size are zeros
+    if (inode->flags & INODE_INLINE) {
+        if ((uint64_t)size <= INODE_INLINE_BYTES) {
+            if ((uint64_t)size < inode->size) {
+                memset(inode->inline_data + size, 0, inode->size - size);
             }
+            inode->size = size;
+            journal_dirty_inode(inode_i, 1);
+            return 0;
+        }
+        if ((rv = storage_uninline(inode_i)) < 0) {
+            return rv;
         }
     }
 
-    return rv;
-}
+    // allocate more blocks or free blocks for other file data
+    if (blocks_needed > inode->block_count && S_ISDIR(inode->mode)) {
+        rv = extent_grow(inode_i, (bnum_t)blocks_needed);
+    }
+    else if (blocks_needed > inode->block_count) {
+        extent_hole(inode_i, (bnum_t)blocks_needed);
+    }
+    else if ((uint64_t)size < inode->size && (inode->flags & INODE_COMPRESSED)) {
+        rv = cluster_truncate(inode_i, size);
+    }
+    else if ((uint64_t)size < inode->size) {
+        // the new last block is zeroed past the size, a shared one is copied
+        // first so nothing has changed if that fails
+        if ((uint64_t)size % BLOCK_SIZE != 0 && (rv = extent_own(inode_i, (uint32_t)(size / BLOCK_SIZE), 1)) < 0) {
+            return rv;
+        }
+        if (blocks_needed < inode->block_count && (rv = extent_shrink(inode_i, (bnum_t)blocks_needed)) < 0) {
+            return rv;
+        }
 
-// links a given path's inode to another
-// 'to's inode will be the same as that of 'from'
-int storage_link(const char* from, const char* to) {
-    uint8_t inode_i;
+        // the rest of the new last block reads as zeros if the file grows
+        // again
+        uint64_t zero_end = blocks_needed * BLOCK_SIZE;
+        storage_zero(inode_i, size, (inode->size < zero_end) ? inode->size : zero_end);
+    }
     
-    // get access to froms inode
-    int rv = storage_access(from, &inode_i);
+    // on success update inode's size
     if (rv == 0) {
-        uint8_t inode_ip;
-
-        // get the parent directory of to
-        char* parent = parent_directory(to);
-
-        // get access to to's parent directory
-        if ((rv = storage_access(parent, &inode_ip)) == 0) {
-            // add 'to' to the directory with 'from's inode offset
-            rv = directory_add(to + strlen(parent) + 1, inode_ip, 0, inode_i);
-
-            // increase the inode's link count
-            inode_t* inode = get_inode(inode_i);
-            inode->links++;
-        }
-
-        // free the parent
-        free_parent_directory(parent);
+        inode->size = size;
+        journal_dirty_inode(inode_i, 1);
     }
 
     return rv;
 }
 
-// adds a new item to the file system
-int storage_mknod(const char* path, mode_t mode, uint8_t* inode_ret) {
-    char* parent = parent_directory(path);
-    char* new_item = strdup(path + strlen(parent) + 1);
-    uint8_t inode_i;
-    
-    // get access to the parent directory's inode
-    int rv = storage_access(parent, &inode_i);
-    if (rv == 0) {
-        // ensure the inode is a directory and there are search/modification
-        // permissions
-        inode_t* inode = get_inode(inode_i);
-        if ((mode_t)(inode->mode & S_IFDIR) != S_IFDIR) {
-            rv = -ENOTDIR;
-        }
-        else if ((mode_t)(inode->mode & S_IXUSR) != S_IXUSR) {
-            rv = -EACCES;
-        }
-        // add the new data
-        else {
-            uint8_t new_inode;
-
-            // add the new item to the parent's directory, inode is set in
-            // directory_add and bitmap updated
-            if ((rv = directory_add(new_item, inode_i, &new_inode, -1)) == 0) {
-                // initialize the inode's data and the ret inode
-                *inode_ret = new_inode;
-                inode = get_inode(new_inode);
-                inode->mode = mode;
-                inode->links = 1;
-                inode->i_block = 0;
-
-                // if the item is a directory
-                if ((mode_t)(mode & S_IFDIR) == S_IFDIR) {
-                    // all directorys have an initial size of BLOCK_SIZE and one
-                    // block associated with it
-                    inode->size = BLOCK_SIZE;
-
-                    // get the next block
-                    rv = bitmap_next(g_Block_Bitmap, BITMAP_SIZE);
-                    if ((rv = bitmap_next(g_Block_Bitmap, BITMAP_SIZE)) >= 0) {
-                        // update the inode stats
-                        inode->block_count = 1;
-                        inode->d_blocks[0] = (uint8_t)rv;
-
-                        // null terminate the inital block so it is empty
-                        *(char*)get_block((uint8_t)rv) = 0;
-
-                        // update the bitmap and set rv to success
-                        bitmap_set(g_Block_Bitmap, 1, (uint8_t)rv, BITMAP_SIZE);
-                        rv = 0;
-                    }
-                }
-                // the item is a file, it has no data associated with it
-                else {
-                    inode->block_count = 0;
-                    inode->size = 0;
-                }
-            }
-        }
+// allocates a free inode, returns its offset or -EDQUOT if every inode is used
+int inode_alloc() {
+    pthread_mutex_lock(&g_Alloc_Lock);
+    int rv = (int)bitmap_next(&g_Inode_Bitmap);
+    if (rv >= 0) {
+        bitmap_set(&g_Inode_Bitmap, 1, rv);
+    }
+    pthread_mutex_unlock(&g_Alloc_Lock);
+    if (rv >= 0) {
+        bitmap_dirty(&g_Inode_Bitmap, rv, 1);
     }
-    
-    // free the parent and the item
-    free_parent_directory(parent);
-    free(new_item);
-
     return rv;
 }
 
+// gets the data block at the given offset
+void* get_block(bnum_t offset) {
+    assert(offset < g_Super->block_count);
+    return bdev_get((uint64_t)g_Super->data_start + offset, 0);
+}
 
+// gets the data block at the given offset and the blocks after it that are
+// adjacent in memory, count is the number wanted and is set to the number
+// returned, which is at least 1
+// note: release them with put_blocks once they are no longer used
+void* get_blocks(bnum_t offset, uint32_t* count) {
+    assert(offset < g_Super->block_count && *count > 0);
+    return bdev_get((uint64_t)g_Super->data_start + offset, count);
+}
 
-// -------------------------- DIRECTORY MANIPULATION FUNCTIONS ----------
+// releases the blocks from get_blocks holding the given address
+void put_blocks(void* addr) {
+    bdev_put(addr);
+}
 
-// adds the given item to the parent directory
-// note: if inode_new is a null pointer, the inode associated with the item will
-//       be inode_to_add
-//       if inode_new is a valid pointer, a new inode will be allocated and its
-//       value stored in inode_new, inode_to_add is ignored in this case
-int directory_add(const char* item, uint8_t inode_parent, uint8_t* inode_new, uint8_t inode_to_add) {
-    // assume success and the item's inode is the inode_to_add
-    int rv = 0;
-    uint8_t item_inode = inode_to_add;
-    
-    // if non null pointer, allocate a new inode
-    if (inode_new != 0) {
-        rv = bitmap_next(g_Inode_Bitmap, BITMAP_SIZE);
-        item_inode = (uint8_t)rv;
+// allocates up to want contiguous data blocks, the search starts at the goal
+// block so a file can continue its last run, a goal of 0 has no preference
+// returns the number of blocks allocated and sets start, the run may be shorter
+// than want if the bitmap has no free run of want blocks near the goal
+int block_alloc(bnum_t goal, bnum_t want, bnum_t* start) {
+    uint64_t len;
+
+    // the count is returned as an int
+    if (want > INT32_MAX) {
+        want = INT32_MAX;
     }
 
-    // on success allocation of inode or by default, add item to directory
+    // find the run and mark it used, its blocks are born now, which only
+    // needs recording once a snapshot could hold an older block
+    uint32_t epoch = snapshot_count();
+    pthread_mutex_lock(&g_Alloc_Lock);
+    int64_t rv = bitmap_alloc(&g_Block_Bitmap, goal, want, &len);
+    for (uint64_t i = 0; rv >= 0 && epoch > 0 && i < len; i++) {
+        g_Birth[rv + i] = epoch;
+    }
+    pthread_mutex_unlock(&g_Alloc_Lock);
     if (rv >= 0) {
-        // get the inode pf the parent
-        inode_t* inode = get_inode(inode_parent);
-
-        // the length of the data to add is the length of the item + null char +
-        // inode uint8_t + null char
-        int len = strlen(item) + 3;
-
-        // allocate and initialize the data to add
-        void* data = malloc(len * sizeof(char));
-        memcpy(data, item, len - 2);
-        memcpy(data + len - 2, &item_inode, 1);
-        memcpy(data + len - 1, "\0", 1);
-
-        // get the inode blocks, set found flag to false
-        uint8_t* blocks = get_blocks(inode_parent);
-        uint8_t found = 0;
-        void* block;
-        int blocklen;
-
-        // assume unsuccessful, disk quota reached
-        rv = -EDQUOT;
-        for (int i = 0; i < inode->block_count; i++) {
-            // get the directory block and loop to the end
-            block = get_block(blocks[i]);
-            while ((blocklen = strlen(block))) {
-                block += blocklen + 2;
-            }
-            
-            // if space exists for the new item
-            if (block + len <= get_block(blocks[i]) + BLOCK_SIZE) {
-                // add the data to the directory
-                memcpy(block, data, len);
-
-                // if allocating a new inode, update the given pointer and the
-                // inode bitmap
-                if (inode_new) {
-                    bitmap_set(g_Inode_Bitmap, 1, item_inode, BITMAP_SIZE);
-                    *inode_new = item_inode;
-                }
+        bitmap_dirty(&g_Block_Bitmap, rv, len);
+        if (epoch > 0) {
+            journal_dirty(g_Birth + rv, len * sizeof(uint32_t));
+        }
+        *start = (bnum_t)rv;
+        rv = (int64_t)len;
+    }
+    TRACE(TRACE_DEBUG, TRACE_BLOCK_ALLOC, rv, goal, want, (rv >= 0) ? *start : 0, 0);
 
-                // set success and break loop
-                rv = 0;
-                break;
-            }
+    return (int)rv;
+}
+
+// frees count contiguous data blocks starting at start, a shared block only
+// loses a reference and a frozen one stays the snapshots'
+void block_free(bnum_t start, bnum_t count) {
+    uint32_t epoch = snapshot_count();
+    int shared = 0;
+
+    // block 0 is always the root directory's, or a snapshot's once the root
+    // directory was copied from it
+    assert(start != 0 || g_Birth[0] < epoch);
+    pthread_mutex_lock(&g_Alloc_Lock);
+    for (bnum_t i = 0; i < count; ) {
+        if (g_Refcount[start + i] > 0) {
+            g_Refcount[start + i]--;
+            shared = 1;
+            i++;
+            continue;
+        }
+        if (g_Birth[start + i] < epoch) {
+            i++;
+            continue;
         }
 
-        // free the directory data
-        free(data);
+        // clear the run of blocks no one else owns at once
+        bnum_t run = 1;
+        while (i + run < count && g_Refcount[start + i + run] == 0 && g_Birth[start + i + run] >= epoch) {
+            run++;
+        }
+        for (bnum_t j = i; j < i + run; j++) {
+            dedup_remove(start + j);
+        }
+        bitmap_set_range(&g_Block_Bitmap, 0, start + i, run);
+        journal_free((uint64_t)g_Super->data_start + start + i, run);
+        i += run;
     }
+    pthread_mutex_unlock(&g_Alloc_Lock);
+    bitmap_dirty(&g_Block_Bitmap, start, count);
+    if (shared) {
+        journal_dirty(g_Refcount + start, count * sizeof(uint16_t));
+    }
+    TRACE(TRACE_DEBUG, TRACE_BLOCK_FREE, 0, start, count, 0, 0);
+}
 
+// adds an owner to count contiguous data blocks starting at start, returns 0
+// or -EMLINK if one of them already has REFCOUNT_MAX owners past the first
+int block_ref(bnum_t start, bnum_t count) {
+    int rv = 0;
+    pthread_mutex_lock(&g_Alloc_Lock);
+    for (bnum_t i = 0; i < count; i++) {
+        if (g_Refcount[start + i] == REFCOUNT_MAX) {
+            rv = -EMLINK;
+            break;
+        }
+    }
+    if (rv == 0) {
+        for (bnum_t i = 0; i < count; i++) {
+            g_Refcount[start + i]++;
+        }
+    }
+    pthread_mutex_unlock(&g_Alloc_Lock);
+    if (rv == 0) {
+        journal_dirty(g_Refcount + start, count * sizeof(uint16_t));
+    }
     return rv;
 }
 
-// removes an item from its directory, path is the full path of the item
-int directory_remove(const char* path) {
-    uint8_t inode_parent;
-    char* parent = parent_directory(path);
-    char* item = strdup(path + strlen(parent) + 1);
+// returns how many of the count blocks from start, up to the first shared or
+// frozen one, can be written in place, they are no longer found by the dedup
+// index
+bnum_t block_claim(bnum_t start, bnum_t count) {
+    uint32_t epoch = snapshot_count();
+    bnum_t i = 0;
+    pthread_mutex_lock(&g_Alloc_Lock);
+    while (i < count && g_Refcount[start + i] == 0 && g_Birth[start + i] >= epoch) {
+        dedup_remove(start + i);
+        i++;
+    }
+    pthread_mutex_unlock(&g_Alloc_Lock);
+    return i;
+}
 
-    // get access to the parent directory's inode
-    int rv = storage_access(parent, &inode_parent);
+// looks up the bytes of a block its caller owns, whose hash is given, in the
+// dedup index, returns another block holding the same bytes with a reference
+// added for the caller, or 0 if there is none and the block is added instead
+// note: the reference keeps the other block from being freed or written in
+// place while its bytes are compared outside the allocator lock
+bnum_t block_share(bnum_t block, uint64_t hash) {
+    pthread_mutex_lock(&g_Alloc_Lock);
+    bnum_t rv = dedup_find(hash);
     if (rv == 0) {
-        // if the mode is not directory there is a bug
-        inode_t* inode = get_inode(inode_parent);
-        assert((mode_t)(inode->mode & S_IFDIR) == S_IFDIR);
-
-        // assume item cannot be found
-        rv = -ENOENT;
-
-        // get the blocks and the inode for the parent
-        uint8_t* blocks = get_blocks(inode_parent);
-        void* next_item;
-        void* block;
-        int len;
-
-        // loop over all the blocks for the inode
-        for (int i = 0; i < inode->block_count; i++) {
-            // get the current block and loop until the item is found
-            block = get_block(blocks[i]);
-            while ((len = strlen(block)) && strcmp(block, item)) {
-                block += len + 2;
-            }
-
-            // if the item was found, break outer loop
-            if (strcmp(block, item) == 0) {
-                break;
-            }
-        }
+        dedup_add(block, hash);
+    }
+    else if (rv == block || g_Refcount[rv] == REFCOUNT_MAX) {
+        rv = 0;
+    }
+    else {
+        g_Refcount[rv]++;
+    }
+    pthread_mutex_unlock(&g_Alloc_Lock);
+    if (rv == 0) {
+        return 0;
+    }
+    journal_dirty(g_Refcount + rv, sizeof(uint16_t));
 
-        // on success finding item
-        if (strcmp(block, item) == 0) {
-            // shift the rest of the data down to overwrite the item
-            // remove it
-            void* replace = block + strlen(block) + 2;
-            while ((len = strlen(replace))) {
-                // copy the next item to the current items slot
-                memcpy(block, replace, len + 2);
-                block += len + 2;
-                replace += len + 2;
-            }
+    // the hashes of different bytes may be the same
+    if (memcmp(get_block(rv), get_block(block), BLOCK_SIZE) != 0) {
+        block_free(rv, 1);
+        return 0;
+    }
+    return rv;
+}
 
-            // null terminate the block to indicate end of directory data
-            *((char*)block) = 0;
+// returns 1 if the given data block is frozen, a snapshot holds it, see
+// snapshot.h
+// note: a block's birth only changes when it is allocated, so its owner may
+//       read it without the allocator lock
+int block_frozen(bnum_t block) {
+    return g_Birth[block] < snapshot_count();
+}
 
-            // set success
-            rv = 0;
+// lowers the birth of every block born after the given epoch to it, once the
+// snapshots after it are removed, so the next snapshot freezes them
+void block_epoch(uint32_t epoch) {
+    for (bnum_t b = 0; b < g_Super->block_count; b++) {
+        if (g_Birth[b] > epoch) {
+            g_Birth[b] = epoch;
+            journal_dirty(g_Birth + b, sizeof(uint32_t));
         }
     }
-
-    // free the item and the parent
-    free(item);
-    free_parent_directory(parent);
-
-    return rv;
 }
 
+// sets the bits of count blocks from start in used, a bitmap of the data blocks
+void block_mark(uint64_t* used, bnum_t start, bnum_t count) {
+    for (bnum_t b = start; b < start + count; b++) {
+        used[b / 64] |= 1ULL << (b % 64);
+    }
+}
 
+// sets the bit in used of every data block the given inode holds, live or a
+// snapshot's, the blocks its extents map, its extent block and its cluster
+// table
+void block_mark_inode(uint64_t* used, inode_t* inode) {
+    if (inode->flags & INODE_INLINE) {
+        return;
+    }
 
-// -------------------------- BLOCK AND INODE FUNCTIONS -----------------
+    extent_t* extents = inode->extents;
+    if (inode->extent_count > INODE_EXTENT_COUNT) {
+        block_mark(used, inode->e_block, 1);
+        extents = get_block(inode->e_block);
+    }
+    for (uint32_t e = 0; e < inode->extent_count; e++) {
+        block_mark(used, extents[e].start, extents[e].length);
+    }
+    if (extents != inode->extents) {
+        put_blocks(extents);
+    }
 
-// returns the inode at the given offset
-inode_t* get_inode(uint8_t inode_i) {
-    assert(inode_i >= 0 && inode_i < BITMAP_SIZE);
-    return g_Inode_Base + inode_i;
+    if (inode->c_block != 0) {
+        bnum_t* index = get_block(inode->c_block);
+        block_mark(used, inode->c_block, 1);
+        for (uint32_t l = 0; l < CLUSTER_INDEX_COUNT; l++) {
+            if (index[l] != 0) {
+                block_mark(used, index[l], 1);
+            }
+        }
+        put_blocks(index);
+    }
 }
 
-// returns the pointer to the block offset array for the given inode
-uint8_t* get_blocks(uint8_t inode_i) {
-    inode_t* inode = get_inode(inode_i);
-
-    // if the block count exceeds the direct block count, an indirect block is
-    // in use so return that block instead of the direct block array
-    return ((inode->block_count > DIRECT_BLOCK_COUNT) ?
-        (uint8_t*)get_block(inode->i_block) : inode->d_blocks);
-}
+// copies a frozen metadata block of a live inode to a new block and sets block
+// to it, the old block stays the snapshots'
+// returns 1 if the block was copied, 0 if it was not frozen, or a negative
+// errno
+int block_thaw(bnum_t* block) {
+    if (!block_frozen(*block)) {
+        return 0;
+    }
 
-// gets the data block at the given offset
-void* get_block(uint8_t offset) {
-    assert(offset < BITMAP_SIZE && offset >= 0);
-    return g_Block_Base + (offset * BLOCK_SIZE);
+    bnum_t copy;
+    int rv = block_alloc(*block + 1, 1, &copy);
+    if (rv < 0) {
+        return rv;
+    }
+    void* dst = get_block(copy);
+    memcpy(dst, get_block(*block), BLOCK_SIZE);
+    journal_dirty(dst, BLOCK_SIZE);
+    block_free(*block, 1);
+    *block = copy;
+    return 1;
 }
 
 
 
 // -------------------------- INIT / DESTRUCTOR FUNCTIONS----------------
 
-// initializes the root directory when the program starts, if it has not alread
-// been initialized
+// initializes the root directory of a new image
 void root_init() {
-    uint8_t block_offset;
-    uint8_t inode_offset;
+    bnum_t block_offset;
+    inum_t inode_offset;
     inode_t* inode;
 
     // first block used must be 0 for root
-    int rv = bitmap_next(g_Block_Bitmap, BITMAP_SIZE);
+    int rv = bitmap_next(&g_Block_Bitmap);
     assert(rv == 0);
     block_offset = rv;
     
     // first inode used must be 0 for root
-    rv = bitmap_next(g_Inode_Bitmap, BITMAP_SIZE);
+    rv = bitmap_next(&g_Inode_Bitmap);
     assert(rv == 0);
     inode_offset = rv;
 
@@ -698,87 +1930,215 @@ void root_init() {
     inode->links = 1;
     inode->size = BLOCK_SIZE;
     inode->block_count = 1;
-    inode->d_blocks[0] = block_offset;
-    inode->i_block = 0;
+    inode->block_used = 1;
+    inode->extent_count = 1;
+    inode->extents[0].logical = 0;
+    inode->extents[0].start = block_offset;
+    inode->extents[0].length = 1;
+    inode->e_block = 0;
+    inode->flags = 0;
+    inode->c_block = 0;
     
     // update the bitmaps
-    bitmap_set(g_Block_Bitmap, 1, block_offset, BITMAP_SIZE);
-    bitmap_set(g_Inode_Bitmap, 1, inode_offset, BITMAP_SIZE);
-
-    // update the init flag
-    *(uint8_t*)g_Disk_Base = c_Init_Flag;
+    bitmap_set(&g_Block_Bitmap, 1, block_offset);
+    bitmap_set(&g_Inode_Bitmap, 1, inode_offset);
 }
 
-// opens the given path as the 'disk' for the file system
-void storage_init(const char* path) {
-    // open the file
-    g_Disk_FD = open(path, O_CREAT | O_RDWR, 0644);
-    assert(g_Disk_FD != -1);
-
-    // truncate to disk size
-    int rv = ftruncate(g_Disk_FD, DISK_SPACE);
+// maps the open image and sets the global variables from its superblock, the
+// regions before the journal stay resident, a mounted image is never shared
+// so only the journal writes to the image file
+void storage_map(const superblock_t* super, int shared) {
+    bdev_map(super->image_blocks, super->journal_start, shared);
+
+    // the superblock is the first block, every region starts at the block
+    // index it records
+    g_Super = bdev_get(0, 0);
+    g_Inode_Base = bdev_get(g_Super->inode_table_start, 0);
+    g_Refcount = bdev_get(g_Super->refcount_start, 0);
+    g_Birth = bdev_get(g_Super->birth_start, 0);
+
+    // open the bitmaps, this builds their summaries
+    int rv = bitmap_open(&g_Block_Bitmap, bdev_get(g_Super->block_bitmap_start, 0), g_Super->block_count);
+    assert(rv == 0);
+    rv = bitmap_open(&g_Inode_Bitmap, bdev_get(g_Super->inode_bitmap_start, 0), g_Super->inode_count);
     assert(rv == 0);
+}
 
-    // mmap the base
-    g_Disk_Base = mmap(0, DISK_SPACE, PROT_READ | PROT_WRITE, MAP_SHARED, g_Disk_FD, 0);
-    assert(g_Disk_Base != MAP_FAILED);
+// unmaps the image
+void storage_unmap() {
+    bitmap_close(&g_Block_Bitmap);
+    bitmap_close(&g_Inode_Bitmap);
 
-    // initialize the global variables...
-    // block bitmap starts after the init flag
-    g_Block_Bitmap = g_Disk_Base + sizeof(uint8_t);
+    bdev_unmap();
+    g_Super = 0;
+    g_Refcount = 0;
+    g_Birth = 0;
+}
 
-    // inode bitmap starts bitmap bytes after the block bitmap
-    g_Inode_Bitmap = g_Block_Bitmap + BITMAP_BYTES;
+// makes a new image at the given path with the given number of data blocks,
+// inodes and journal blocks, any existing data in the file is lost
+int storage_mkfs(const char* path, bnum_t block_count, inum_t inode_count, uint32_t journal_blocks) {
+    superblock_t super;
 
-    // inode base starts bitmap bytes after the inode bytmap
-    g_Inode_Base = (inode_t*)(g_Inode_Bitmap + BITMAP_BYTES);
+    // there must be room for the root directory and a transaction
+    if (block_count == 0 || inode_count == 0 || journal_blocks < JOURNAL_MIN_BLOCKS) {
+        return -EINVAL;
+    }
 
-    // block base starts at the first BLOCK_SIZE alligned address after the
-    // inode base
-    g_Block_Base = (void*)((uint64_t)&g_Inode_Base[BITMAP_SIZE] & c_Block_Mask) +
-        ((uint64_t)&g_Inode_Base[BITMAP_SIZE] % BLOCK_SIZE == 0 ? 0 : BLOCK_SIZE);
+    // lay out the regions after the superblock, each starting on a block
+    memset(&super, 0, sizeof(superblock_t));
+    super.magic = SUPERBLOCK_MAGIC;
+    super.version = SUPERBLOCK_VERSION;
+    super.block_size = BLOCK_SIZE;
+    super.block_count = block_count;
+    super.inode_count = inode_count;
+    // note: the regions a snapshot freezes, the bitmaps and the inode table, are
+    //       next to each other so a snapshot's map is one run of them
+    super.refcount_start = 1;
+    super.birth_start = super.refcount_start + BLOCKS_FOR((uint64_t)block_count * sizeof(uint16_t));
+    super.block_bitmap_start = super.birth_start + BLOCKS_FOR((uint64_t)block_count * sizeof(uint32_t));
+    super.inode_bitmap_start = super.block_bitmap_start + BLOCKS_FOR(BITMAP_BYTES((uint64_t)block_count));
+    super.inode_table_start = super.inode_bitmap_start + BLOCKS_FOR(BITMAP_BYTES((uint64_t)inode_count));
+    super.snapshot_start = super.inode_table_start + BLOCKS_FOR((uint64_t)inode_count * sizeof(inode_t));
+    super.journal_start = super.snapshot_start + BLOCKS_FOR(SNAPSHOT_MAX * sizeof(snapshot_t));
+    super.journal_blocks = journal_blocks;
+    super.journal_seq = 1;
+    super.data_start = super.journal_start + journal_blocks;
+    super.image_blocks = (uint64_t)super.data_start + block_count;
+
+    // open the file and clear it, the new size reads as zeros so every bitmap
+    // starts empty
+    int fd = open(path, O_CREAT | O_RDWR, 0644);
+    if (fd == -1) {
+        return -errno;
+    }
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, super.image_blocks * BLOCK_SIZE) != 0 ||
+            pwrite(fd, &super, sizeof(superblock_t), 0) != sizeof(superblock_t)) {
+        int rv = -errno;
+        close(fd);
+        return rv;
+    }
+    close(fd);
 
-    // display the map information
-    printf("bitmap size:\t%d\nbitmap bytes:\t%d\ndisk base:\t%p\ndata map:\t%p\ninode map:\t%p\ninode base:\t%p\tsize:%lu\nblock base:\t%p\ndisk end:\t%p\nblock end:\t%p\n",
-            BITMAP_SIZE,
-            BITMAP_BYTES,
-            g_Disk_Base,
-            g_Block_Bitmap,
-            g_Inode_Bitmap,
-            g_Inode_Base,
-            sizeof(inode_t),
-            g_Block_Base,
-            g_Disk_Base + DISK_SPACE,
-            g_Block_Base + (BITMAP_SIZE * BLOCK_SIZE));
-    
-    // ensure the values are initialized correctly
-    assert((void*)(&g_Inode_Base[BITMAP_SIZE]) <= (void*)g_Block_Base);
-    assert((void*)(g_Block_Base + (BITMAP_SIZE * BLOCK_SIZE)) <= g_Disk_Base + DISK_SPACE);
+    // make the root directory, nothing is journaled yet so the image is
+    // written through a shared mapping
+    int rv = bdev_open(path, BDEV_MMAP, 0);
+    if (rv != 0) {
+        return rv;
+    }
+    storage_map(&super, 1);
+    root_init();
+    storage_unmap();
+
+    rv = bdev_flush();
+    bdev_close();
+    return rv;
+}
 
-    // init debug print statements
-    bitmap_init_print(g_Inode_Bitmap, g_Block_Bitmap);
+// opens the given path as the 'disk' for the file system, an empty or new file
+// is made into an image with the default geometry
+void storage_init(const char* path) {
+    struct stat st;
 
-    // if the first byte is not the init flag, initalize the root
-    if (*(uint8_t*)g_Disk_Base != c_Init_Flag) {
-        root_init();
+    // make a new image if there is nothing in the file
+    if (stat(path, &st) != 0 || st.st_size == 0) {
+        int rv = storage_mkfs(path, DEFAULT_BLOCK_COUNT, DEFAULT_INODE_COUNT, DEFAULT_JOURNAL_BLOCKS);
+        assert(rv == 0);
     }
-}
 
-// unmaps the disk file and closes it
-void storage_free() {
-    int rv = munmap(g_Disk_Base, DISK_SPACE);
+    // open the file with the backend from the environment
+    const char* cache = getenv("NUFS_CACHE");
+    g_Disk_Backend = bdev_backend(getenv("NUFS_BACKEND"));
+    assert(g_Disk_Backend >= 0);
+    int rv = bdev_open(path, g_Disk_Backend, (cache != 0) ? strtoull(cache, 0, 10) : 0);
     assert(rv == 0);
-    rv = close(g_Disk_FD);
-    assert(rv == 0);
-}
 
+    // read the superblock, the whole block so the journal can write it back
+    superblock_t* super = bdev_alloc(BLOCK_SIZE);
+    assert(super != 0);
+    rv = bdev_read(super, BLOCK_SIZE, 0);
+    assert(rv == 0);
 
+    // the image must be of this format and block size
+    assert(super->magic == SUPERBLOCK_MAGIC);
+    assert(super->version == SUPERBLOCK_VERSION);
+    assert(super->block_size == BLOCK_SIZE);
+    rv = stat(path, &st);
+    assert(rv == 0 && (uint64_t)st.st_size >= super->image_blocks * BLOCK_SIZE);
+
+    // finish the transactions committed before the image was last closed
+    rv = journal_replay(super);
+    assert(rv >= 0);
+    if (rv > 0) {
+        printf("journal:\t%d transactions replayed\n", rv);
+    }
 
-// -------------------------- END OF FILE -------------------------------
+    // map the image and journal every change to it
+    storage_map(super, 0);
+    free(super);
+    rv = journal_open(g_Super);
+    assert(rv == 0);
 
+    // display the map information
+    printf("block count:\t%u\tfree:%lu\ninode count:\t%u\tfree:%lu\nbackend:\t%s\ndata map:\t%p\ninode map:\t%p\ninode base:\t%p\tsize:%lu\n",
+            g_Super->block_count,
+            g_Block_Bitmap.free,
+            g_Super->inode_count,
+            g_Inode_Bitmap.free,
+            bdev_backend_name(g_Disk_Backend),
+            g_Block_Bitmap.words,
+            g_Inode_Bitmap.words,
+            g_Inode_Base,
+            sizeof(inode_t));
+
+    // size the open file table, the inode locks, the snapshots, the read
+    // offsets and the appended data waiting for blocks
+    handle_init(g_Super->inode_count);
+    lock_init(g_Super->inode_count);
+    snapshot_init(g_Super->inode_count);
+    free(g_Read_Next);
+    g_Read_Next = calloc(g_Super->inode_count, sizeof(uint64_t));
+    assert(g_Read_Next != 0);
+    free(g_Delayed);
+    g_Delayed = calloc(g_Super->inode_count, sizeof(delayed_t));
+    assert(g_Delayed != 0);
+    g_Delalloc = (getenv("NUFS_DELALLOC") != 0);
+    g_Compress = (getenv("NUFS_COMPRESS") != 0);
+    g_Dedup = (getenv("NUFS_DEDUP") != 0);
+    if (g_Dedup) {
+        dedup_init(g_Super->block_count);
+        printf("dedup:\t%lu blocks indexed\n", storage_dedup_index());
+    }
+}
 
+// unmaps the disk file and closes it
+void storage_free() {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+
+    // display the dcache effectiveness
+    dcache_stats(&hits, &misses);
+    printf("dcache hits:\t%lu\ndcache misses:\t%lu\n", hits, misses);
+
+    // and the block cache's, if the backend has one
+    if (g_Disk_Backend != BDEV_MMAP) {
+        bdev_stats(&hits, &misses, &evictions);
+        printf("cache hits:\t%lu\ncache misses:\t%lu\ncache evictions:\t%lu\n", hits, misses, evictions);
+    }
 
+    // files still open at unmount never had their data given blocks
+    for (inum_t i = 0; i < g_Super->inode_count; i++) {
+        storage_flush(i);
+    }
 
+    // commit everything before the blocks are dropped
+    journal_close();
+    storage_unmap();
+    bdev_close();
+    dedup_free();
+}
 
 
 
+// -------------------------- END OF FILE -------------------------------
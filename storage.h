@@ -5,12 +5,39 @@
  *
  *  notes:
  *   - most of the functions loosely tanslate to the nufs functions
- *   - many functions accept a pointer to a uint8_t, this is used to set the
+ *   - many functions accept a pointer to an inum_t, this is used to set the
  *     inode value in the calling function
  *   - read the function headers in storage.c for clear information on how each
  *     function should be called
  *   - this file is large, it contains the more complex file system functions to
  *     keep nufs cleaner
+ *   - the storage_* functions begin and end their own journal transaction,
+ *     see journal.h
+ *   - the storage_* functions take the locks they need and may be called from
+ *     any thread, see lock.h for the lock order
+ *   - a file's blocks may be holes, they have no data block and read as
+ *     zeros, block_used counts the blocks that are not
+ *   - a new file keeps its data in its inode until it grows past
+ *     INODE_INLINE_BYTES, then the data moves to blocks for good
+ *   - an inode's blocks may reach past its size, fallocate keeps blocks after
+ *     the end of a file and they read as zeros once the file grows over them
+ *   - with NUFS_DELALLOC set in the environment, data appended to a file waits
+ *     in memory without blocks until the file is flushed, synced or released
+ *     or DELAYED_BYTES of it wait, then all of it is given one run of blocks,
+ *     the file's size is its inode's size plus storage_delayed
+ *   - with NUFS_COMPRESS set in the environment, new files are INODE_COMPRESSED
+ *     and keep their data in compressed clusters, see cluster.h, a file stays
+ *     compressed or not for its whole life whatever the later mounts set
+ *   - a data block may be shared by several files or several blocks of one
+ *     file, its reference count is the number of owners past the first, freeing
+ *     a shared block drops a reference and a shared block is copied before it
+ *     is written, see extent_own
+ *   - with NUFS_DEDUP set in the environment, every block a write fills is
+ *     looked up by its contents and shares the block already holding them,
+ *     see dedup.h
+ *   - a snapshot is a read-only copy of the whole tree, its blocks are frozen
+ *     and a live file copies a frozen block before it is written, like a
+ *     shared one, see snapshot.h
  */
 
 #ifndef STORAGE_H
@@ -20,56 +47,177 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 
-// the number of direct block offsets a single inode has
-// currently max size of file before using indirect block is 32768 bytes
-#define DIRECT_BLOCK_COUNT 8
+// the number of extents held in the inode itself, an inode with more extents
+// keeps them all in its extent block
+#define INODE_EXTENT_COUNT 4
 
-// the block size and number of blocks for the file system
+// the block size of the file system, every image must be made with this size
 #define BLOCK_SIZE 4096
-#define BLOCK_COUNT 256
 
-// the size of the 'disk'
-#define DISK_SPACE BLOCK_SIZE * BLOCK_COUNT
+// the superblock magic number and the current format version
+#define SUPERBLOCK_MAGIC 0x4E554653
+#define SUPERBLOCK_VERSION 12
 
-// the number of inodes and data blocks for the system
-// chosen such that the number of blocks does not exceed the size of the disk
-// after the metadata
-#define BITMAP_SIZE 253
+// the geometry used when storage_init is given an empty image
+#define DEFAULT_BLOCK_COUNT 16384
+#define DEFAULT_INODE_COUNT 4096
+#define DEFAULT_JOURNAL_BLOCKS 1024
 
-// the number of bytes associated with the bitmaps
-#define BITMAP_BYTES (BITMAP_SIZE / 8) + (BITMAP_SIZE % 8 == 0 ? 0 : 1)
+// the blocks a sequential read starts reading ahead of itself
+#define READAHEAD_BLOCKS 32
+
+// the most bytes appended to a file that wait for blocks at once
+#define DELAYED_BYTES (256 * BLOCK_SIZE)
+
+// the most owners past the first a block can have
+#define REFCOUNT_MAX UINT16_MAX
+
+// the number of bytes associated with a bitmap of the given size, bitmaps are
+// made of 64 bit words
+#define BITMAP_BYTES(size) ((((size) / 64) + ((size) % 64 == 0 ? 0 : 1)) * 8)
+
+// returns the number of blocks needed to hold the given number of bytes
+#define BLOCKS_FOR(bytes) (((bytes) / BLOCK_SIZE) + ((bytes) % BLOCK_SIZE == 0 ? 0 : 1))
+
+// inode and data block numbers
+typedef uint32_t inum_t;
+typedef uint32_t bnum_t;
+
+// the superblock, the first block of every image
+// note: every region start is a block index in the image, data block numbers
+//       are relative to data_start
+typedef struct superblock_t {
+    uint32_t magic;                         // SUPERBLOCK_MAGIC
+    uint32_t version;                       // SUPERBLOCK_VERSION
+    uint32_t block_size;                    // BLOCK_SIZE when made
+    bnum_t block_count;                     // the number of data blocks
+    inum_t inode_count;                     // the number of inodes
+    uint32_t block_bitmap_start;            // the first block bitmap block
+    uint32_t refcount_start;                // the first reference count block
+    uint32_t birth_start;                   // the first birth block
+    uint32_t inode_bitmap_start;            // the first inode bitmap block
+    uint32_t inode_table_start;             // the first inode table block
+    uint32_t snapshot_start;                // the first snapshot table block
+    uint32_t data_start;                    // the first data block
+    uint64_t image_blocks;                  // the size of the image in blocks
+    uint32_t journal_start;                 // the first journal block
+    uint32_t journal_blocks;                // the number of journal blocks
+    uint64_t journal_seq;                   // the first transaction in the journal
+} superblock_t;
+
+// inode flag set when a directory's data uses the hashed index format
+#define INODE_INDEXED 0x01
+
+// inode flag set when a file's data is kept in the inode instead of blocks
+#define INODE_INLINE 0x02
+
+// inode flag set when a file's data is kept in compressed clusters
+#define INODE_COMPRESSED 0x04
+
+// the most bytes of data an inode keeps itself, the space of its extents and
+// the rest of its 128 bytes
+#define INODE_INLINE_BYTES 72
+
+// a run of contiguous data blocks of an inode
+typedef struct extent_t {
+    uint32_t logical;                       // the first inode block of the run
+    bnum_t start;                           // the first data block of the run
+    uint32_t length;                        // the number of blocks in the run
+} extent_t;
 
 // the inode used for this file system
+// note: an INODE_INLINE inode has no blocks and its data is in inline_data,
+//       the bytes past its size are zeros
 typedef struct inode_t {
     mode_t mode;                            // permissions and node type
     uint32_t links;                         // the number of links
-    uint32_t size;                          // the size of its data
-    uint8_t block_count;                    // the number of blocks for the inode
-    uint8_t d_blocks[DIRECT_BLOCK_COUNT];   // the direct block offsets
-    uint8_t i_block;                        // the indirect block offset
+    uint64_t size;                          // the size of its data
+    bnum_t block_count;                     // the number of blocks for the inode
+    bnum_t block_used;                      // the blocks of those not in a hole
+    uint32_t extent_count;                  // the number of extents in use
+    bnum_t e_block;                         // the extent block offset
+    uint32_t flags;                         // INODE_* flags
+    bnum_t c_block;                         // the cluster table block, if compressed
     time_t a_time;                          // last access time
     time_t m_time;                          // last modify time
+    union {
+        extent_t extents[INODE_EXTENT_COUNT];   // the extents, if few enough
+        char inline_data[INODE_INLINE_BYTES];   // or the data, if INODE_INLINE
+    };
 } inode_t;
 
+// the number of extents held by an extent block
+#define EXTENT_BLOCK_COUNT (BLOCK_SIZE / sizeof(extent_t))
+
+// a run of a file's data in the image file
+typedef struct storage_run_t {
+    uint64_t pos;                           // its offset in the image file
+    size_t len;                             // its length in bytes
+} storage_run_t;
+
+// copies the next len bytes of a write's data to dst, returns the number of
+// bytes copied or a negative errno
+typedef ssize_t (*storage_copy_t)(void* dst, size_t len, void* arg);
+
+// reads the given runs of a file's data out of the image file, called with the
+// inode still locked, returns 0 or a negative errno
+typedef int (*storage_send_t)(const storage_run_t* runs, uint32_t count, void* arg);
+
 // functions closely correspond to nufs functions
-int storage_access(const char* path, uint8_t* inode_i);
-int storage_truncate(off_t size, uint8_t inode_i);
-int storage_read(const char* path, char* data, size_t len, off_t offset);
-int storage_write(const char* path, const char* data, size_t len, off_t offset, uint8_t* inode_ret);
+int storage_access(const char* path, inum_t* inode_i);
+int storage_truncate(off_t size, inum_t inode_i);
+int storage_read(inum_t inode_i, char* data, size_t len, off_t offset);
+int storage_read_runs(inum_t inode_i, size_t len, off_t offset, storage_run_t* runs, uint32_t count,
+        storage_send_t send, void* arg);
+int storage_write(inum_t inode_i, const char* data, size_t len, off_t offset);
+int storage_write_from(inum_t inode_i, size_t len, off_t offset, storage_copy_t copy, void* arg);
+int storage_fallocate(inum_t inode_i, off_t offset, off_t len, int keep_size);
+int storage_clone(inum_t src_i, inum_t inode_i);
+int storage_clone_range(inum_t src_i, off_t src_offset, uint64_t len, inum_t inode_i, off_t offset);
+int storage_flush(inum_t inode_i);
+size_t storage_delayed(inum_t inode_i);
 int storage_unlink(const char* path);
+int storage_unlink_at(inum_t inode_parent, const char* item);
+void storage_release(uint64_t fh);
+void storage_forget(inum_t inode_i, uint64_t nlookup);
+int storage_fsync(inum_t inode_i, int datasync);
+void storage_free_inode(inum_t inode_i);
 int storage_link(const char* from, const char* to);
-int storage_mknod(const char* path, mode_t mode, uint8_t* inode_ret);
+int storage_link_at(inum_t inode_i, inum_t inode_parent, const char* item);
+int storage_rename(const char* from, const char* to);
+int storage_rename_at(inum_t inode_from_parent, const char* from_item, inum_t inode_to_parent, const char* to_item);
+int storage_mknod(const char* path, mode_t mode, inum_t* inode_ret);
+int storage_mknod_at(inum_t inode_parent, const char* new_item, mode_t mode, inum_t* inode_ret);
+int storage_snapshot(const char* name, inum_t* inode_ret);
+int storage_snapshot_remove(const char* name);
 
 // directory manipulation functions
-int directory_add(const char* item, uint8_t inode_parent, uint8_t* inode_new, uint8_t inode_to_add);
-int directory_remove(const char* path);
+int directory_lookup(const char* item, int len, inum_t inode_parent, inum_t* inode_i);
+int directory_add(const char* item, int len, inum_t inode_parent, inum_t inode_i);
+int directory_remove(const char* item, int len, inum_t inode_parent, inum_t* inode_i);
 
 // get data associated with inodes and blocks
-inode_t* get_inode(uint8_t inode_i);
-uint8_t* get_blocks(uint8_t inode_i);
-void* get_block(uint8_t offset);
+superblock_t* get_superblock();
+int storage_image_fd();
+inode_t* get_inode(inum_t inode_i);
+int inode_truncate(off_t size, inum_t inode_i);
+int inode_alloc();
+void* get_block(bnum_t offset);
+void* get_blocks(bnum_t offset, uint32_t* count);
+void put_blocks(void* addr);
+int block_alloc(bnum_t goal, bnum_t want, bnum_t* start);
+void block_free(bnum_t start, bnum_t count);
+int block_ref(bnum_t start, bnum_t count);
+bnum_t block_claim(bnum_t start, bnum_t count);
+bnum_t block_share(bnum_t block, uint64_t hash);
+int block_frozen(bnum_t block);
+int block_thaw(bnum_t* block);
+void block_epoch(uint32_t epoch);
+void block_mark(uint64_t* used, bnum_t start, bnum_t count);
+void block_mark_inode(uint64_t* used, inode_t* inode);
 
 // initialization and destructor functions
+int storage_mkfs(const char* path, bnum_t block_count, inum_t inode_count, uint32_t journal_blocks);
 void storage_init(const char* path);
 void storage_free();
 
@@ -0,0 +1,185 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - any number of threads can record at once, each takes the next ring index
+ *     with an atomic add and marks its record complete by setting seq last
+ *   - the ring keeps the latest TRACE_RING_SIZE records, older records are
+ *     overwritten and counted as dropped in the dump
+ */
+
+#define _GNU_SOURCE
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// the name and argument names of each event, each argument name is followed
+// by its format, h for a path hash, o for octal and d for decimal
+static const char* c_Trace_Events[TRACE_EVENT_COUNT][2] = {
+    [TRACE_ACCESS]      = { "access",       "inode:d mask:o" },
+    [TRACE_GETATTR]     = { "getattr",      "inode:d" },
+    [TRACE_READDIR]     = { "readdir",      "fh:d offset:d count:d" },
+    [TRACE_MKNOD]       = { "mknod",        "parent:d name:h mode:o inode:d" },
+    [TRACE_MKDIR]       = { "mkdir",        "parent:d name:h mode:o inode:d" },
+    [TRACE_UNLINK]      = { "unlink",       "parent:d name:h" },
+    [TRACE_LINK]        = { "link",         "inode:d parent:d name:h" },
+    [TRACE_RMDIR]       = { "rmdir",        "parent:d name:h" },
+    [TRACE_RENAME]      = { "rename",       "parent:d name:h to_parent:d to_name:h" },
+    [TRACE_CHMOD]       = { "chmod",        "inode:d mode:o" },
+    [TRACE_TRUNCATE]    = { "truncate",     "inode:d size:d" },
+    [TRACE_FTRUNCATE]   = { "ftruncate",    "fh:d size:d" },
+    [TRACE_FGETATTR]    = { "fgetattr",     "fh:d mode:o size:d" },
+    [TRACE_OPEN]        = { "open",         "inode:d flags:o" },
+    [TRACE_CREATE]      = { "create",       "parent:d name:h mode:o inode:d" },
+    [TRACE_RELEASE]     = { "release",      "fh:d" },
+    [TRACE_READ]        = { "read",         "fh:d size:d offset:d image:d" },
+    [TRACE_WRITE]       = { "write",        "fh:d size:d offset:d" },
+    [TRACE_UTIMENS]     = { "utimens",      "path:h atime:d mtime:d" },
+    [TRACE_IOCTL]       = { "ioctl",        "inode:d cmd:h src:d" },
+    [TRACE_ATIME]       = { "atime",        "inode:d time:d" },
+    [TRACE_MTIME]       = { "mtime",        "inode:d time:d" },
+    [TRACE_GROW]        = { "grow",         "inode:d size:d" },
+    [TRACE_BLOCK_ALLOC] = { "block_alloc",  "goal:d want:d start:d" },
+    [TRACE_BLOCK_FREE]  = { "block_free",   "start:d count:d" },
+    [TRACE_COMMIT]      = { "commit",       "seq:d blocks:d data:d" },
+    [TRACE_FSYNC]       = { "fsync",        "fh:d datasync:d" },
+    [TRACE_FSYNCDIR]    = { "fsyncdir",     "fh:d datasync:d" },
+    [TRACE_FLUSH]       = { "flush",        "fh:d" },
+    [TRACE_OPENDIR]     = { "opendir",      "inode:d" },
+    [TRACE_FALLOCATE]   = { "fallocate",    "fh:d offset:d len:d mode:o" },
+    [TRACE_DELALLOC]    = { "delalloc",     "inode:d offset:d size:d" },
+    [TRACE_RELEASEDIR]  = { "releasedir",   "fh:d" },
+    [TRACE_LOOKUP]      = { "lookup",       "parent:d name:h inode:d" },
+    [TRACE_FORGET]      = { "forget",       "inode:d nlookup:d" },
+    [TRACE_SETATTR]     = { "setattr",      "inode:d to_set:h mode:o size:d" },
+    [TRACE_COW]         = { "cow",          "inode:d logical:d block:d copy:d" },
+    [TRACE_DEDUP]       = { "dedup",        "inode:d logical:d block:d shared:d" },
+    [TRACE_SNAPSHOT]    = { "snapshot",     "name:h inode:d copied:d" },
+    [TRACE_SNAPSHOT_REMOVE] = { "snapshot_remove", "name:h freed:d" },
+};
+
+// the runtime level
+int g_Trace_Level = TRACE_OFF;
+
+// the ring of records and the number of records ever taken from it
+static trace_record_t g_Trace_Ring[TRACE_RING_SIZE];
+static uint64_t g_Trace_Head = 0;
+
+// the time trace_init was called
+static struct timespec g_Trace_Start;
+
+// the file the ring is dumped to
+static const char* g_Trace_File = "nufs.trace";
+
+// the recording thread's id, looked up once per thread
+static __thread uint32_t t_Trace_Tid = 0;
+
+// reads the runtime level and the dump file from the environment
+void trace_init() {
+    const char* level = getenv("NUFS_TRACE");
+    const char* file = getenv("NUFS_TRACE_FILE");
+
+    clock_gettime(CLOCK_MONOTONIC, &g_Trace_Start);
+    g_Trace_Level = (level != 0) ? atoi(level) : TRACE_OFF;
+    if (file != 0) {
+        g_Trace_File = file;
+    }
+}
+
+// records an event in the ring, use the TRACE macro instead
+void trace_record(int level, int event, int64_t rv, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (t_Trace_Tid == 0) {
+        t_Trace_Tid = (uint32_t)syscall(SYS_gettid);
+    }
+
+    // take the next record, it is incomplete until seq is set
+    uint64_t index = __atomic_fetch_add(&g_Trace_Head, 1, __ATOMIC_RELAXED);
+    trace_record_t* record = &g_Trace_Ring[index & (TRACE_RING_SIZE - 1)];
+    __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    record->time = (uint64_t)(now.tv_sec - g_Trace_Start.tv_sec) * 1000000000 + now.tv_nsec - g_Trace_Start.tv_nsec;
+    record->tid = t_Trace_Tid;
+    record->event = (uint16_t)event;
+    record->level = (uint16_t)level;
+    record->rv = rv;
+    record->args[0] = a0;
+    record->args[1] = a1;
+    record->args[2] = a2;
+    record->args[3] = a3;
+
+    __atomic_store_n(&record->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+// writes the complete records of the ring to the trace file, oldest first
+// note: records written during the dump may be skipped
+int trace_dump() {
+    trace_header_t header;
+
+    // nothing was recorded
+    if (g_Trace_Level == TRACE_OFF) {
+        return 0;
+    }
+
+    FILE* file = fopen(g_Trace_File, "w");
+    if (file == 0) {
+        return -errno;
+    }
+
+    // the ring holds at most the last TRACE_RING_SIZE records
+    uint64_t head = __atomic_load_n(&g_Trace_Head, __ATOMIC_ACQUIRE);
+    uint64_t first = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+
+    // the header is rewritten once the count is known
+    memset(&header, 0, sizeof(trace_header_t));
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(trace_record_t);
+    header.dropped = first;
+    fwrite(&header, sizeof(trace_header_t), 1, file);
+
+    // copy each record and keep it only if it was complete and not reused
+    for (uint64_t i = first; i < head; i++) {
+        trace_record_t* slot = &g_Trace_Ring[i & (TRACE_RING_SIZE - 1)];
+        trace_record_t record;
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != i + 1) {
+            continue;
+        }
+        memcpy(&record, slot, sizeof(trace_record_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != i + 1) {
+            continue;
+        }
+
+        fwrite(&record, sizeof(trace_record_t), 1, file);
+        header.count++;
+    }
+
+    // write the final header
+    rewind(file);
+    fwrite(&header, sizeof(trace_header_t), 1, file);
+    return (fclose(file) == 0) ? 0 : -errno;
+}
+
+// returns the name of the given event
+const char* trace_event_name(int event) {
+    return (event >= 0 && event < TRACE_EVENT_COUNT) ? c_Trace_Events[event][0] : "unknown";
+}
+
+// returns the argument names and formats of the given event
+const char* trace_event_args(int event) {
+    return (event >= 0 && event < TRACE_EVENT_COUNT) ? c_Trace_Events[event][1] : "";
+}
@@ -0,0 +1,134 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - tracing records fixed size binary records of file system events in an
+ *     in memory ring, nothing is formatted or written while tracing
+ *   - TRACE_LEVEL sets the most detailed level compiled in, build with
+ *     -DTRACE_LEVEL=0 to remove every trace call
+ *   - the level recorded at runtime is read from the NUFS_TRACE environment
+ *     variable by trace_init, tracing is off if it is not set
+ *   - trace_dump writes the ring to NUFS_TRACE_FILE (nufs.trace by default),
+ *     read it with tracedump
+ *   - item name arguments are recorded as their hash_item hash, inodes as
+ *     their offset
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "path.h"
+
+// the trace levels, a higher level records more events
+#define TRACE_OFF 0
+#define TRACE_INFO 1
+#define TRACE_DEBUG 2
+
+// the most detailed level compiled in
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_DEBUG
+#endif
+
+// the number of records in the ring, must be a power of two
+#define TRACE_RING_SIZE 65536
+
+// the trace file magic number and format version
+#define TRACE_MAGIC 0x4E555452
+#define TRACE_VERSION 2
+
+// the number of arguments of a record
+#define TRACE_ARG_COUNT 4
+
+// the events that can be traced
+typedef enum trace_event_t {
+    TRACE_ACCESS,
+    TRACE_GETATTR,
+    TRACE_READDIR,
+    TRACE_MKNOD,
+    TRACE_MKDIR,
+    TRACE_UNLINK,
+    TRACE_LINK,
+    TRACE_RMDIR,
+    TRACE_RENAME,
+    TRACE_CHMOD,
+    TRACE_TRUNCATE,
+    TRACE_FTRUNCATE,
+    TRACE_FGETATTR,
+    TRACE_OPEN,
+    TRACE_CREATE,
+    TRACE_RELEASE,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_UTIMENS,
+    TRACE_IOCTL,
+    TRACE_ATIME,
+    TRACE_MTIME,
+    TRACE_GROW,
+    TRACE_BLOCK_ALLOC,
+    TRACE_BLOCK_FREE,
+    TRACE_COMMIT,
+    TRACE_FSYNC,
+    TRACE_FSYNCDIR,
+    TRACE_FLUSH,
+    TRACE_OPENDIR,
+    TRACE_FALLOCATE,
+    TRACE_DELALLOC,
+    TRACE_RELEASEDIR,
+    TRACE_LOOKUP,
+    TRACE_FORGET,
+    TRACE_SETATTR,
+    TRACE_COW,
+    TRACE_DEDUP,
+    TRACE_SNAPSHOT,
+    TRACE_SNAPSHOT_REMOVE,
+    TRACE_EVENT_COUNT
+} trace_event_t;
+
+// a single traced event
+typedef struct trace_record_t {
+    uint64_t seq;                       // the record's index + 1, 0 if unused
+    uint64_t time;                      // nanoseconds since trace_init
+    uint32_t tid;                       // the recording thread
+    uint16_t event;                     // the trace_event_t
+    uint16_t level;                     // the TRACE_* level
+    int64_t rv;                         // the event's return value
+    uint64_t args[TRACE_ARG_COUNT];     // the event's arguments
+} trace_record_t;
+
+// the header of a trace file, the records follow oldest first
+typedef struct trace_header_t {
+    uint32_t magic;                     // TRACE_MAGIC
+    uint32_t version;                   // TRACE_VERSION
+    uint32_t record_size;               // sizeof(trace_record_t)
+    uint32_t count;                     // the number of records
+    uint64_t dropped;                   // records overwritten before the dump
+} trace_header_t;
+
+// the runtime level, only events at or below it are recorded
+extern int g_Trace_Level;
+
+// records an event if its level is compiled in and enabled, the arguments are
+// not evaluated otherwise
+#define TRACE(level, event, rv, a0, a1, a2, a3)                                 \
+    do {                                                                        \
+        if ((level) <= TRACE_LEVEL && (level) <= g_Trace_Level) {               \
+            trace_record((level), (event), (int64_t)(rv), (uint64_t)(a0),       \
+                    (uint64_t)(a1), (uint64_t)(a2), (uint64_t)(a3));            \
+        }                                                                       \
+    } while (0)
+
+// the argument recorded for a path
+#define TRACE_PATH(path) hash_item(HASH_ITEM_SEED, (path), strlen(path))
+
+void trace_init();
+void trace_record(int level, int event, int64_t rv, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3);
+int trace_dump();
+const char* trace_event_name(int event);
+const char* trace_event_args(int event);
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - decodes a trace file written by trace_dump, usage:
+ *       tracedump [trace file]
+ *   - each record is printed on one line as
+ *       time(s) tid event(args) -> rv
+ */
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// prints the arguments of a record using the names and formats of its event
+void print_args(const trace_record_t* record) {
+    const char* args = trace_event_args(record->event);
+
+    for (int i = 0; i < TRACE_ARG_COUNT && *args != 0; i++) {
+        // each argument is "name:format" separated by spaces
+        int len = strcspn(args, ":");
+        char format = args[len + 1];
+        printf("%s%.*s: ", (i == 0) ? "" : ", ", len, args);
+
+        // print the value in its format
+        switch (format) {
+            case 'h':
+                printf("#%08lx", record->args[i]);
+                break;
+            case 'o':
+                printf("%04lo", record->args[i]);
+                break;
+            default:
+                printf("%ld", (int64_t)record->args[i]);
+                break;
+        }
+
+        // move to the next argument
+        args += len + 2;
+        while (*args == ' ') {
+            args++;
+        }
+    }
+}
+
+// main entry point
+int main(int argc, char *argv[]) {
+    trace_header_t header;
+    trace_record_t record;
+
+    // read the header of the given file or the default trace file
+    const char* path = (argc > 1) ? argv[1] : "nufs.trace";
+    FILE* file = fopen(path, "r");
+    if (file == 0) {
+        perror(path);
+        return 1;
+    }
+    if (fread(&header, sizeof(trace_header_t), 1, file) != 1 || header.magic != TRACE_MAGIC ||
+            header.version != TRACE_VERSION || header.record_size != sizeof(trace_record_t)) {
+        fprintf(stderr, "%s: not a trace file of this version\n", path);
+        fclose(file);
+        return 1;
+    }
+
+    // print every record
+    printf("%u records, %lu dropped\n", header.count, header.dropped);
+    for (uint32_t i = 0; i < header.count && fread(&record, sizeof(trace_record_t), 1, file) == 1; i++) {
+        printf("%lu.%09lu %u %s(", record.time / 1000000000, record.time % 1000000000,
+                record.tid, trace_event_name(record.event));
+        print_args(&record);
+        printf(") -> %ld\n", record.rv);
+    }
+
+    fclose(file);
+    return 0;
+}
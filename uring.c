@@ -0,0 +1,169 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - the rings are shared with the kernel, a tail written by this side is
+ *     stored with release order after its entries and a head written by the
+ *     kernel is loaded with acquire order before the entries it covers
+ */
+
+#include "uring.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+// the io_uring system calls, which libc does not wrap
+static int uring_setup(uint32_t entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, 0, 0);
+}
+
+static int uring_register(int fd, uint32_t opcode, const void* arg, uint32_t count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+// makes a ring of the given number of submission entries
+int uring_open(uring_t* ring, uint32_t entries) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(uring_t));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = uring_setup(entries, &params);
+    if (ring->fd < 0) {
+        return -errno;
+    }
+
+    // completions must never be dropped
+    if ((params.features & IORING_FEAT_NODROP) == 0) {
+        close(ring->fd);
+        return -ENOSYS;
+    }
+
+    // map the submission ring, the completion ring and the submission entries
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        int rv = -errno;
+        uring_close(ring);
+        return rv;
+    }
+
+    ring->sq_head = (uint32_t*)((char*)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (uint32_t*)((char*)ring->sq_ring + params.sq_off.tail);
+    ring->sq_array = (uint32_t*)((char*)ring->sq_ring + params.sq_off.array);
+    ring->sq_mask = *(uint32_t*)((char*)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (uint32_t*)((char*)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (uint32_t*)((char*)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t*)((char*)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring + params.cq_off.cqes);
+    return 0;
+}
+
+// unmaps and closes the ring, nothing may be in flight
+void uring_close(uring_t* ring) {
+    if (ring->sqes != 0 && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != 0 && ring->cq_ring != MAP_FAILED) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != 0 && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+    memset(ring, 0, sizeof(uring_t));
+    ring->fd = -1;
+}
+
+// registers the given file as fixed file 0
+int uring_register_file(uring_t* ring, int fd) {
+    return (uring_register(ring->fd, IORING_REGISTER_FILES, &fd, 1) == 0) ? 0 : -errno;
+}
+
+// registers the given memory as fixed buffer 0, its pages stay pinned until
+// it is unregistered or the ring is closed
+int uring_register_buffer(uring_t* ring, void* base, size_t len) {
+    struct iovec iov = { base, len };
+    return (uring_register(ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0) ? 0 : -errno;
+}
+
+// unregisters every fixed buffer
+void uring_unregister_buffers(uring_t* ring) {
+    uring_register(ring->fd, IORING_UNREGISTER_BUFFERS, 0, 0);
+}
+
+// returns the next free submission entry, cleared, or null if every entry
+// is queued or not yet taken by the kernel
+struct io_uring_sqe* uring_sqe(uring_t* ring) {
+    uint32_t head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    uint32_t tail = *ring->sq_tail + ring->queued;
+    if (tail - head >= ring->sq_entries) {
+        return 0;
+    }
+
+    uint32_t index = tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    ring->queued++;
+    return sqe;
+}
+
+// gives every queued entry to the kernel, returns the number submitted or a
+// negative errno
+int uring_submit(uring_t* ring) {
+    uint32_t count = ring->queued;
+    if (count == 0) {
+        return 0;
+    }
+
+    // the entries are visible before the tail that covers them
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + count, __ATOMIC_RELEASE);
+    ring->queued = 0;
+
+    // the kernel takes every entry unless it fails outright
+    uint32_t done = 0;
+    while (done < count) {
+        int rv = uring_enter(ring->fd, count - done, 0, 0);
+        if (rv < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return -errno;
+        }
+        if (rv > 0) {
+            done += rv;
+        }
+    }
+    return (int)done;
+}
+
+// waits for the next completion and copies it to cqe
+int uring_wait(uring_t* ring, struct io_uring_cqe* cqe) {
+    for (;;) {
+        uint32_t head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            *cqe = ring->cqes[head & ring->cq_mask];
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+
+        if (uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            return -errno;
+        }
+    }
+}
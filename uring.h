@@ -0,0 +1,60 @@
+/*
+ *  Michael Curley
+ *  cs3650
+ *  ch03
+ *
+ *  notes:
+ *   - a minimal io_uring made directly with the system calls, only what the
+ *     block device needs
+ *   - one thread at a time may queue and submit entries and one (possibly
+ *     other) thread at a time may wait for completions, the caller serializes
+ *     each side
+ *   - a queued entry is not seen by the kernel until uring_submit
+ *   - completions the kernel cannot fit in the completion ring are kept by it
+ *     and delivered later, so entries in flight are not limited by its size
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// the kernel header brings linux/fs.h, whose BLOCK_SIZE is not the image's
+#pragma push_macro("BLOCK_SIZE")
+#undef BLOCK_SIZE
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE
+#pragma pop_macro("BLOCK_SIZE")
+
+// a ring and its mappings
+typedef struct uring_t {
+    int fd;                             // the ring's file descriptor
+    uint32_t* sq_head;                  // the submission ring's fields
+    uint32_t* sq_tail;
+    uint32_t* sq_array;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    struct io_uring_sqe* sqes;          // the submission entries
+    uint32_t* cq_head;                  // the completion ring's fields
+    uint32_t* cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe* cqes;          // the completion entries
+    uint32_t queued;                    // entries queued but not submitted
+    void* sq_ring;                      // the mappings and their sizes
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+int uring_open(uring_t* ring, uint32_t entries);
+void uring_close(uring_t* ring);
+int uring_register_file(uring_t* ring, int fd);
+int uring_register_buffer(uring_t* ring, void* base, size_t len);
+void uring_unregister_buffers(uring_t* ring);
+struct io_uring_sqe* uring_sqe(uring_t* ring);
+int uring_submit(uring_t* ring);
+int uring_wait(uring_t* ring, struct io_uring_cqe* cqe);
+
+#endif